@@ -0,0 +1,331 @@
+#include <benchmark/benchmark.h>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <jamspell/bloom_filter.hpp>
+#include <jamspell/lang_model.hpp>
+#include <jamspell/spell_corrector.hpp>
+#include <jamspell/utils.hpp>
+
+// Microbenchmarks of the hot paths, on test_data/input.txt and a model
+// trained from test_data/output.txt unless --model, --alphabet and --text
+// point somewhere else. Besides the Google Benchmark flags (use
+// --benchmark_format=json or --benchmark_out=file.json to keep results) every
+// benchmark reports the heap allocations it makes per iteration.
+
+using namespace NJamSpell;
+
+namespace {
+
+std::atomic<bool> Recording(false);
+std::atomic<int64_t> Allocations(0);
+std::atomic<int64_t> AllocatedBytes(0);
+
+class TAllocationCounter: public benchmark::MemoryManager {
+public:
+    void Start() override {
+        Allocations = 0;
+        AllocatedBytes = 0;
+        Recording = true;
+    }
+    // the library has used both signatures, see benchmarks/CMakeLists.txt
+#ifdef JAMSPELL_BENCHMARK_STOP_BY_POINTER
+    void Stop(Result* result) override {
+        Finish(*result);
+    }
+#endif
+#ifdef JAMSPELL_BENCHMARK_STOP_BY_REFERENCE
+    void Stop(Result& result) override {
+        Finish(result);
+    }
+#endif
+private:
+    void Finish(Result& result) {
+        Recording = false;
+        result.num_allocs = Allocations;
+        result.total_allocated_bytes = AllocatedBytes;
+    }
+};
+
+} // namespace
+
+void* operator new(size_t size) {
+    if (Recording.load(std::memory_order_relaxed)) {
+        Allocations.fetch_add(1, std::memory_order_relaxed);
+        AllocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+    void* ptr = malloc(size ? size : 1);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+namespace {
+
+std::string ModelFile;
+std::string AlphabetFile = std::string(TEST_DATA_DIR) + "/alphabet_en.txt";
+std::string TextFile = std::string(TEST_DATA_DIR) + "/input.txt";
+bool TemporaryModel = false;
+
+std::string ReadFile(const std::string& fileName) {
+    std::ifstream in(fileName, std::ios::binary);
+    std::stringstream buf;
+    buf << in.rdbuf();
+    return buf.str();
+}
+
+struct TBenchData {
+    TSpellCorrector Corrector;
+    std::unique_ptr<TSpellCorrector> IndexCorrector;
+    TTokenizer Tokenizer;
+    std::string Text;
+    std::wstring WideText;
+    TSentences Sentences;
+    std::unique_ptr<TBloomFilter> Vocabulary;
+
+    TBenchData() {
+        if (ModelFile.empty()) {
+            ModelFile = "jamspell_bench_model.bin";
+            TemporaryModel = true;
+            if (!Corrector.TrainLangModel(std::string(TEST_DATA_DIR) + "/output.txt", AlphabetFile, ModelFile)) {
+                std::cerr << "[error] failed to train the sample model" << std::endl;
+                exit(42);
+            }
+        }
+        if (!Corrector.LoadLangModel(ModelFile) || !Tokenizer.LoadAlphabet(AlphabetFile)) {
+            std::cerr << "[error] failed to load " << ModelFile << std::endl;
+            exit(42);
+        }
+        Text = ReadFile(TextFile);
+        UTF8ToWide(Text.data(), Text.size(), WideText);
+        Sentences = Corrector.GetLangModel().Tokenize(WideText);
+
+        const TLangModel& model = Corrector.GetLangModel();
+        Vocabulary.reset(new TBloomFilter(model.GetWordsCount(), 0.01));
+        for (TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+            TWord word = model.GetWordById(wid);
+            Vocabulary->Insert(word.Ptr, word.Len);
+        }
+    }
+
+    const TSpellCorrector& GetCorrector(bool index) {
+        if (!index) {
+            return Corrector;
+        }
+        if (!IndexCorrector) {
+            IndexCorrector.reset(new TSpellCorrector());
+            IndexCorrector->SetCandidateEngine(TSpellCorrector::ECandidateEngine::DeletionIndex);
+            if (!IndexCorrector->LoadLangModel(ModelFile)) {
+                std::cerr << "[error] failed to load " << ModelFile << std::endl;
+                exit(42);
+            }
+        }
+        return *IndexCorrector;
+    }
+};
+
+TBenchData& Data() {
+    static TBenchData data;
+    return data;
+}
+
+size_t WordsCount(const TSentences& sentences) {
+    size_t count = 0;
+    for (auto&& s: sentences) {
+        count += s.size();
+    }
+    return count;
+}
+
+void BM_UTF8ToWide(benchmark::State& state) {
+    const std::string& text = Data().Text;
+    std::wstring result;
+    for (auto _: state) {
+        UTF8ToWide(text.data(), text.size(), result);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetBytesProcessed(state.iterations() * text.size());
+}
+BENCHMARK(BM_UTF8ToWide);
+
+void BM_AppendUTF8(benchmark::State& state) {
+    const std::wstring& text = Data().WideText;
+    std::string result;
+    for (auto _: state) {
+        result.clear();
+        AppendUTF8(text.data(), text.size(), result);
+        benchmark::DoNotOptimize(result.data());
+    }
+    state.SetBytesProcessed(state.iterations() * text.size() * sizeof(wchar_t));
+}
+BENCHMARK(BM_AppendUTF8);
+
+void BM_Tokenize(benchmark::State& state) {
+    TBenchData& data = Data();
+    for (auto _: state) {
+        TSentences sentences = data.Tokenizer.Process(data.WideText);
+        benchmark::DoNotOptimize(sentences.data());
+    }
+    state.SetBytesProcessed(state.iterations() * data.WideText.size() * sizeof(wchar_t));
+}
+BENCHMARK(BM_Tokenize);
+
+// One n-gram lookup per word: GetWordCount() is a single 1-gram probe.
+void BM_GramLookup(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TLangModel& model = data.Corrector.GetLangModel();
+    std::vector<TWordId> ids;
+    for (auto&& s: data.Sentences) {
+        for (auto&& w: s) {
+            ids.push_back(model.GetWordIdNoCreate(w));
+        }
+    }
+    for (auto _: state) {
+        for (TWordId wid: ids) {
+            benchmark::DoNotOptimize(model.GetWordCount(wid));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * ids.size());
+}
+BENCHMARK(BM_GramLookup);
+
+void BM_Score(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TLangModel& model = data.Corrector.GetLangModel();
+    for (auto _: state) {
+        for (auto&& s: data.Sentences) {
+            benchmark::DoNotOptimize(model.Score(s));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * data.Sentences.size());
+}
+BENCHMARK(BM_Score);
+
+// Scores state.range(0) candidates in the middle of the first sentence.
+void BM_ScoreCandidates(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TLangModel& model = data.Corrector.GetLangModel();
+    const TWords& sentence = data.Sentences.at(0);
+    TScoreContext context = model.PrepareScoreContext(sentence, sentence.size() / 2);
+    std::vector<TWordId> candidates;
+    for (TWordId wid = 0; candidates.size() < size_t(state.range(0)); ++wid) {
+        candidates.push_back(wid % model.GetWordsCount());
+    }
+    std::vector<double> scores(candidates.size());
+    for (auto _: state) {
+        model.Score(context, candidates.data(), candidates.size(), scores.data());
+        benchmark::DoNotOptimize(scores.data());
+    }
+    state.SetItemsProcessed(state.iterations() * candidates.size());
+}
+BENCHMARK(BM_ScoreCandidates)->Arg(8)->Arg(64);
+
+void BM_BloomContains(benchmark::State& state) {
+    TBenchData& data = Data();
+    size_t words = WordsCount(data.Sentences);
+    for (auto _: state) {
+        for (auto&& s: data.Sentences) {
+            for (auto&& w: s) {
+                benchmark::DoNotOptimize(data.Vocabulary->Contains(w.Ptr, w.Len));
+            }
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * words);
+}
+BENCHMARK(BM_BloomContains);
+
+// Candidates of every known (known = 1) or unknown word of the text. Known
+// words are mostly served by Edits(), unknown ones also go through Edits2().
+void BM_Candidates(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TSpellCorrector& corrector = data.GetCorrector(state.range(0) != 0);
+    const bool known = state.range(1) != 0;
+    const TLangModel& model = corrector.GetLangModel();
+    std::vector<std::pair<const TWords*, size_t>> positions;
+    for (auto&& s: data.Sentences) {
+        for (size_t i = 0; i < s.size(); ++i) {
+            if ((model.GetWord(s[i].Ptr, s[i].Len).Ptr != nullptr) == known) {
+                positions.push_back(std::make_pair(&s, i));
+            }
+        }
+    }
+    for (auto _: state) {
+        for (auto&& p: positions) {
+            TScoredWords candidates = corrector.GetCandidatesScoredRaw(*p.first, p.second);
+            benchmark::DoNotOptimize(candidates.data());
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * positions.size());
+}
+BENCHMARK(BM_Candidates)->ArgNames({"index", "known"})->Args({0, 1})->Args({0, 0})->Args({1, 1})->Args({1, 0});
+
+void BM_FixFragment(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TSpellCorrector& corrector = data.GetCorrector(state.range(0) != 0);
+    for (auto _: state) {
+        std::wstring fixed = corrector.FixFragment(data.WideText);
+        benchmark::DoNotOptimize(fixed.data());
+    }
+    state.SetBytesProcessed(state.iterations() * data.Text.size());
+}
+BENCHMARK(BM_FixFragment)->ArgName("index")->Arg(0)->Arg(1);
+
+void BM_CandidatesJSON(benchmark::State& state) {
+    TBenchData& data = Data();
+    const TSpellCorrector& corrector = data.GetCorrector(state.range(0) != 0);
+    for (auto _: state) {
+        std::string json = corrector.GetALLCandidatesScoredJSON(data.Text, false);
+        benchmark::DoNotOptimize(json.data());
+    }
+    state.SetBytesProcessed(state.iterations() * data.Text.size());
+}
+BENCHMARK(BM_CandidatesJSON)->ArgName("index")->Arg(0)->Arg(1);
+
+bool ParseOption(const std::string& arg, const std::string& name, std::string& value) {
+    if (arg.compare(0, name.size(), name) != 0) {
+        return false;
+    }
+    value = arg.substr(name.size());
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    benchmark::Initialize(&argc, argv);
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (!ParseOption(arg, "--model=", ModelFile) &&
+            !ParseOption(arg, "--alphabet=", AlphabetFile) &&
+            !ParseOption(arg, "--text=", TextFile))
+        {
+            std::cerr << "Usage: " << argv[0] << " [benchmark flags] [--model=model.bin]"
+                      << " [--alphabet=alphabet.txt] [--text=input.txt]" << std::endl;
+            return 42;
+        }
+    }
+    TAllocationCounter allocationCounter;
+    benchmark::RegisterMemoryManager(&allocationCounter);
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::RegisterMemoryManager(nullptr);
+    if (TemporaryModel) {
+        for (auto&& suffix: {"", ".spell", ".deletes"}) {
+            std::remove((ModelFile + suffix).c_str());
+        }
+    }
+    return 0;
+}
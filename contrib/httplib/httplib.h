@@ -59,7 +59,10 @@ typedef int socket_t;
 #define INVALID_SOCKET (-1)
 #endif //_WIN32
 
+#include <algorithm>
 #include <assert.h>
+#include <condition_variable>
+#include <deque>
 #include <fcntl.h>
 #include <fstream>
 #include <functional>
@@ -94,11 +97,15 @@ inline const unsigned char *ASN1_STRING_get0_data(const ASN1_STRING *asn1) {
 #define CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND 5
 #define CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND 0
 #define CPPHTTPLIB_KEEPALIVE_MAX_COUNT 5
+#define CPPHTTPLIB_KEEPALIVE_IDLE_TIMEOUT_MSECOND 100
 #define CPPHTTPLIB_READ_TIMEOUT_SECOND 5
 #define CPPHTTPLIB_READ_TIMEOUT_USECOND 0
 #define CPPHTTPLIB_REQUEST_URI_MAX_LENGTH 8192
 #define CPPHTTPLIB_PAYLOAD_MAX_LENGTH (std::numeric_limits<size_t>::max)()
 #define CPPHTTPLIB_RECV_BUFSIZ 4096
+#define CPPHTTPLIB_THREAD_POOL_COUNT                                           \
+  ((std::max)(8u, std::thread::hardware_concurrency()))
+#define CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD 4
 
 namespace httplib {
 
@@ -195,6 +202,36 @@ public:
   void write_format(const char *fmt, const Args &... args);
 };
 
+// Reads a request body as it arrives, for handlers that do not want it
+// buffered: Content-Length, chunked and read-until-close bodies are
+// supported, neither compressed nor form bodies are decoded.
+class ContentReader {
+public:
+  ContentReader(Stream &strm, const Headers &headers);
+
+  // Appends the next part of the body, at most CPPHTTPLIB_RECV_BUFSIZ
+  // bytes, to out. Returns false once the body is over or on an error.
+  bool read(std::string &out);
+  // Skips what is left of the body; false if it could not be read whole.
+  bool skip();
+  bool failed() const { return failed_; }
+  uint64_t bytes_read() const { return bytes_read_; }
+
+private:
+  enum class Framing { Length, Chunked, UntilClose };
+
+  bool read_chunk_header();
+  bool fail();
+
+  Stream &strm_;
+  Framing framing_;
+  uint64_t remaining_; // of the body, or of the current chunk
+  bool first_chunk_;
+  bool done_;
+  bool failed_;
+  uint64_t bytes_read_;
+};
+
 class SocketStream : public Stream {
 public:
   SocketStream(socket_t sock);
@@ -225,9 +262,38 @@ private:
   std::string buffer;
 };
 
+// Fixed set of threads serving accepted connections. A non-zero
+// max_queued bounds the connections waiting for a free thread.
+class ThreadPool {
+public:
+  ThreadPool(size_t thread_count, size_t max_queued);
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  // Serves the queued connections, then joins the threads.
+  ~ThreadPool();
+
+  bool enqueue(std::function<void()> fn);
+
+private:
+  void worker();
+
+  std::vector<std::thread> threads_;
+  std::deque<std::function<void()>> jobs_;
+  size_t max_queued_;
+  bool shutdown_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+};
+
 class Server {
 public:
   typedef std::function<void(const Request &, Response &)> Handler;
+  // The reader stays valid while the response is written, so a streamcb
+  // can read the body as it writes the response. payload_max_length does
+  // not apply; whatever the handler leaves unread is skipped.
+  typedef std::function<void(const Request &, Response &, ContentReader &)>
+      HandlerWithContentReader;
   typedef std::function<void(const Request &, const Response &)> Logger;
 
   Server();
@@ -238,6 +304,7 @@ public:
 
   Server &Get(const char *pattern, Handler handler);
   Server &Post(const char *pattern, Handler handler);
+  Server &Post(const char *pattern, HandlerWithContentReader handler);
 
   Server &Put(const char *pattern, Handler handler);
   Server &Patch(const char *pattern, Handler handler);
@@ -250,8 +317,18 @@ public:
   void set_logger(Logger logger);
 
   void set_keep_alive_max_count(size_t count);
+  // How long a worker waits for the next request of a keep-alive
+  // connection before closing it, so that idle clients do not hold the
+  // workers; the first request still gets the full keep-alive timeout.
+  void set_keep_alive_idle_timeout(time_t msec);
   void set_payload_max_length(uint64_t length);
 
+  // Connections that arrive while max_queued connections are already
+  // waiting are answered with 503, by default
+  // CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD per thread. 0 means no limit.
+  void set_thread_pool(size_t thread_count);
+  void set_thread_pool(size_t thread_count, size_t max_queued);
+
   int bind_to_any_port(const char *host, int socket_flags = 0);
   bool listen_after_bind();
 
@@ -266,10 +343,13 @@ protected:
                        std::function<void(Request &)> setup_request = nullptr);
 
   size_t keep_alive_max_count_;
+  time_t keep_alive_idle_timeout_msec_;
   size_t payload_max_length_;
 
 private:
   typedef std::vector<std::pair<std::regex, Handler>> Handlers;
+  typedef std::vector<std::pair<std::regex, HandlerWithContentReader>>
+      HandlersForContentReader;
 
   socket_t create_server_socket(const char *host, int port,
                                 int socket_flags) const;
@@ -285,22 +365,22 @@ private:
                       Response &res);
 
   virtual bool read_and_close_socket(socket_t sock);
+  virtual void reject_and_close_socket(socket_t sock);
 
   std::atomic<bool> is_running_;
   std::atomic<socket_t> svr_sock_;
   std::string base_dir_;
   Handlers get_handlers_;
   Handlers post_handlers_;
+  HandlersForContentReader post_handlers_for_content_reader_;
   Handlers put_handlers_;
   Handlers patch_handlers_;
   Handlers delete_handlers_;
   Handlers options_handlers_;
   Handler error_handler_;
   Logger logger_;
-
-  // TODO: Use thread pool...
-  std::mutex running_threads_mutex_;
-  int running_threads_;
+  size_t thread_pool_count_;
+  size_t max_queued_connections_;
 };
 
 class Client {
@@ -399,6 +479,7 @@ public:
 
 private:
   virtual bool read_and_close_socket(socket_t sock);
+  virtual void reject_and_close_socket(socket_t sock);
 
   SSL_CTX *ctx_;
   std::mutex ctx_mutex_;
@@ -579,16 +660,28 @@ inline bool wait_until_socket_is_ready(socket_t sock, time_t sec, time_t usec) {
   return true;
 }
 
+// Waits for the next request of a keep-alive connection: the first one
+// gets the full keep-alive timeout, the next ones idle_timeout_msec.
+inline bool wait_keep_alive_request(socket_t sock, bool first,
+                                    time_t idle_timeout_msec) {
+  if (first) {
+    return select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
+                       CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0;
+  }
+  return select_read(sock, idle_timeout_msec / 1000,
+                     (idle_timeout_msec % 1000) * 1000) > 0;
+}
+
 template <typename T>
 inline bool read_and_close_socket(socket_t sock, size_t keep_alive_max_count,
-                                  T callback) {
+                                  time_t idle_timeout_msec, T callback) {
   bool ret = false;
 
   if (keep_alive_max_count > 0) {
     auto count = keep_alive_max_count;
     while (count > 0 &&
-           detail::select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                               CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0) {
+           wait_keep_alive_request(sock, count == keep_alive_max_count,
+                                   idle_timeout_msec)) {
       SocketStream strm(sock);
       auto last_connection = count == 1;
       auto connection_close = false;
@@ -821,6 +914,7 @@ inline const char *status_message(int status) {
   case 413: return "Payload Too Large";
   case 414: return "Request-URI Too Long";
   case 415: return "Unsupported Media Type";
+  case 503: return "Service Unavailable";
   default:
   case 500: return "Internal Server Error";
   }
@@ -1508,11 +1602,59 @@ inline std::string BufferStream::get_remote_addr() const { return ""; }
 
 inline const std::string &BufferStream::get_buffer() const { return buffer; }
 
+// Thread pool implementation
+inline ThreadPool::ThreadPool(size_t thread_count, size_t max_queued)
+    : max_queued_(max_queued), shutdown_(false) {
+  if (thread_count == 0) { thread_count = 1; }
+  for (size_t i = 0; i < thread_count; i++) {
+    threads_.emplace_back([this]() { worker(); });
+  }
+}
+
+inline ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    shutdown_ = true;
+  }
+  cond_.notify_all();
+  for (auto &t : threads_) {
+    t.join();
+  }
+}
+
+inline bool ThreadPool::enqueue(std::function<void()> fn) {
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    if (max_queued_ > 0 && jobs_.size() >= max_queued_) { return false; }
+    jobs_.push_back(std::move(fn));
+  }
+  cond_.notify_one();
+  return true;
+}
+
+inline void ThreadPool::worker() {
+  for (;;) {
+    std::function<void()> fn;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cond_.wait(lock, [&] { return !jobs_.empty() || shutdown_; });
+      if (jobs_.empty()) { break; }
+      fn = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    fn();
+  }
+}
+
 // HTTP server implementation
 inline Server::Server()
     : keep_alive_max_count_(CPPHTTPLIB_KEEPALIVE_MAX_COUNT),
+      keep_alive_idle_timeout_msec_(CPPHTTPLIB_KEEPALIVE_IDLE_TIMEOUT_MSECOND),
       payload_max_length_(CPPHTTPLIB_PAYLOAD_MAX_LENGTH), is_running_(false),
-      svr_sock_(INVALID_SOCKET), running_threads_(0) {
+      svr_sock_(INVALID_SOCKET),
+      thread_pool_count_(CPPHTTPLIB_THREAD_POOL_COUNT),
+      max_queued_connections_(CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD *
+                              thread_pool_count_) {
 #ifndef _WIN32
   signal(SIGPIPE, SIG_IGN);
 #endif
@@ -1530,6 +1672,13 @@ inline Server &Server::Post(const char *pattern, Handler handler) {
   return *this;
 }
 
+inline Server &Server::Post(const char *pattern,
+                            HandlerWithContentReader handler) {
+  post_handlers_for_content_reader_.push_back(
+      std::make_pair(std::regex(pattern), handler));
+  return *this;
+}
+
 inline Server &Server::Put(const char *pattern, Handler handler) {
   put_handlers_.push_back(std::make_pair(std::regex(pattern), handler));
   return *this;
@@ -1572,6 +1721,20 @@ inline void Server::set_payload_max_length(uint64_t length) {
   payload_max_length_ = length;
 }
 
+inline void Server::set_keep_alive_idle_timeout(time_t msec) {
+  keep_alive_idle_timeout_msec_ = msec;
+}
+
+inline void Server::set_thread_pool(size_t thread_count) {
+  set_thread_pool(thread_count,
+                  CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD * thread_count);
+}
+
+inline void Server::set_thread_pool(size_t thread_count, size_t max_queued) {
+  thread_pool_count_ = thread_count;
+  max_queued_connections_ = max_queued;
+}
+
 inline int Server::bind_to_any_port(const char *host, int socket_flags) {
   return bind_internal(host, 0, socket_flags);
 }
@@ -1753,6 +1916,9 @@ inline bool Server::listen_internal() {
 
   is_running_ = true;
 
+  std::unique_ptr<ThreadPool> task_queue(
+      new ThreadPool(thread_pool_count_, max_queued_connections_));
+
   for (;;) {
     if (svr_sock_ == INVALID_SOCKET) {
       // The server socket was closed by 'stop' method.
@@ -1777,28 +1943,13 @@ inline bool Server::listen_internal() {
       break;
     }
 
-    // TODO: Use thread pool...
-    std::thread([=]() {
-      {
-        std::lock_guard<std::mutex> guard(running_threads_mutex_);
-        running_threads_++;
-      }
-
-      read_and_close_socket(sock);
-
-      {
-        std::lock_guard<std::mutex> guard(running_threads_mutex_);
-        running_threads_--;
-      }
-    }).detach();
+    if (!task_queue->enqueue([=]() { read_and_close_socket(sock); })) {
+      reject_and_close_socket(sock);
+    }
   }
 
-  // TODO: Use thread pool...
-  for (;;) {
-    std::this_thread::sleep_for(std::chrono::milliseconds(10));
-    std::lock_guard<std::mutex> guard(running_threads_mutex_);
-    if (!running_threads_) { break; }
-  }
+  // Serves the connections already accepted, then joins the threads.
+  task_queue.reset();
 
   is_running_ = false;
 
@@ -1874,8 +2025,27 @@ Server::process_request(Stream &strm, bool last_connection,
     connection_close = true;
   }
 
+  // a client sending its own REMOTE_ADDR must not pass for another peer
+  req.headers.erase("REMOTE_ADDR");
   req.set_header("REMOTE_ADDR", strm.get_remote_addr().c_str());
 
+  // Handlers reading the body themselves
+  if (req.method == "POST") {
+    for (const auto &x : post_handlers_for_content_reader_) {
+      if (std::regex_match(req.path, req.matches, x.first)) {
+        if (req.get_header_value("Expect") == "100-continue") {
+          strm.write("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+        ContentReader content(strm, req.headers);
+        if (setup_request) { setup_request(req); }
+        x.second(req, res, content);
+        if (res.status == -1) { res.status = 200; }
+        write_response(strm, last_connection, req, res);
+        return content.skip();
+      }
+    }
+  }
+
   // Body
   if (req.method == "POST" || req.method == "PUT" || req.method == "PATCH") {
     bool exceed_payload_max_length = false;
@@ -1924,16 +2094,105 @@ Server::process_request(Stream &strm, bool last_connection,
   return true;
 }
 
+// ContentReader implementation
+inline ContentReader::ContentReader(Stream &strm, const Headers &headers)
+    : strm_(strm), framing_(Framing::UntilClose), remaining_(0),
+      first_chunk_(true), done_(false), failed_(false), bytes_read_(0) {
+  // as detail::read_content() tells them apart
+  const auto &encoding =
+      detail::get_header_value(headers, "Transfer-Encoding", 0, "");
+  if (detail::has_header(headers, "Content-Length")) {
+    remaining_ = detail::get_header_value_uint64(headers, "Content-Length", 0);
+    framing_ = remaining_ == 0 && !strcasecmp(encoding, "chunked")
+                   ? Framing::Chunked
+                   : Framing::Length;
+  } else if (!strcasecmp(encoding, "chunked")) {
+    framing_ = Framing::Chunked;
+  }
+}
+
+inline bool ContentReader::fail() {
+  failed_ = true;
+  done_ = true;
+  return false;
+}
+
+// Reads the line ending the previous chunk, if any, and the size line of
+// the next one; at the last chunk also the empty line after the trailers.
+inline bool ContentReader::read_chunk_header() {
+  char buf[64];
+  detail::stream_line_reader reader(strm_, buf, sizeof(buf));
+  if (!first_chunk_ && (!reader.getline() || strcmp(reader.ptr(), "\r\n"))) {
+    return fail();
+  }
+  first_chunk_ = false;
+  if (!reader.getline()) { return fail(); }
+  char *end = nullptr;
+  remaining_ = std::strtoull(reader.ptr(), &end, 16);
+  if (end == reader.ptr()) { return fail(); }
+  if (remaining_ == 0) {
+    do {
+      if (!reader.getline()) { return fail(); }
+    } while (strcmp(reader.ptr(), "\r\n"));
+    done_ = true;
+    return false;
+  }
+  return true;
+}
+
+inline bool ContentReader::read(std::string &out) {
+  if (done_) { return false; }
+  if (framing_ == Framing::Chunked && remaining_ == 0 &&
+      !read_chunk_header()) {
+    return false;
+  }
+  if (framing_ == Framing::Length && remaining_ == 0) {
+    done_ = true;
+    return false;
+  }
+  char buf[CPPHTTPLIB_RECV_BUFSIZ];
+  size_t size = sizeof(buf);
+  if (framing_ != Framing::UntilClose && remaining_ < size) {
+    size = static_cast<size_t>(remaining_);
+  }
+  auto n = strm_.read(buf, size);
+  if (n == 0 && framing_ == Framing::UntilClose) {
+    done_ = true;
+    return false;
+  }
+  if (n <= 0) { return fail(); }
+  out.append(buf, n);
+  bytes_read_ += n;
+  if (framing_ != Framing::UntilClose) { remaining_ -= n; }
+  return true;
+}
+
+inline bool ContentReader::skip() {
+  std::string discarded;
+  while (read(discarded)) {
+    discarded.clear();
+  }
+  return !failed_;
+}
+
 inline bool Server::is_valid() const { return true; }
 
 inline bool Server::read_and_close_socket(socket_t sock) {
   return detail::read_and_close_socket(
-      sock, keep_alive_max_count_,
+      sock, keep_alive_max_count_, keep_alive_idle_timeout_msec_,
       [this](Stream &strm, bool last_connection, bool &connection_close) {
         return process_request(strm, last_connection, connection_close);
       });
 }
 
+inline void Server::reject_and_close_socket(socket_t sock) {
+  SocketStream strm(sock);
+  strm.write_format("HTTP/1.1 %d %s\r\n"
+                    "Connection: close\r\nContent-Length: 0\r\n\r\n",
+                    503, detail::status_message(503));
+  detail::close_socket(sock);
+}
+
 // HTTP client implementation
 inline Client::Client(const char *host, int port, time_t timeout_sec)
     : host_(host), port_(port), timeout_sec_(timeout_sec),
@@ -2090,7 +2349,7 @@ inline bool Client::process_request(Stream &strm, Request &req, Response &res,
 inline bool Client::read_and_close_socket(socket_t sock, Request &req,
                                           Response &res) {
   return detail::read_and_close_socket(
-      sock, 0,
+      sock, 0, 0,
       [&](Stream &strm, bool /*last_connection*/, bool &connection_close) {
         return process_request(strm, req, res, connection_close);
       });
@@ -2267,6 +2526,7 @@ namespace detail {
 template <typename U, typename V, typename T>
 inline bool
 read_and_close_socket_ssl(socket_t sock, size_t keep_alive_max_count,
+                          time_t idle_timeout_msec,
                           // TODO: OpenSSL 1.0.2 occasionally crashes...
                           // The upcoming 1.1.0 is going to be thread safe.
                           SSL_CTX *ctx, std::mutex &ctx_mutex,
@@ -2302,8 +2562,8 @@ read_and_close_socket_ssl(socket_t sock, size_t keep_alive_max_count,
     if (keep_alive_max_count > 0) {
       auto count = keep_alive_max_count;
       while (count > 0 &&
-             detail::select_read(sock, CPPHTTPLIB_KEEPALIVE_TIMEOUT_SECOND,
-                                 CPPHTTPLIB_KEEPALIVE_TIMEOUT_USECOND) > 0) {
+             wait_keep_alive_request(sock, count == keep_alive_max_count,
+                                     idle_timeout_msec)) {
         SSLSocketStream strm(sock, ssl);
         auto last_connection = count == 1;
         auto connection_close = false;
@@ -2419,7 +2679,8 @@ inline bool SSLServer::is_valid() const { return ctx_; }
 
 inline bool SSLServer::read_and_close_socket(socket_t sock) {
   return detail::read_and_close_socket_ssl(
-      sock, keep_alive_max_count_, ctx_, ctx_mutex_, SSL_accept,
+      sock, keep_alive_max_count_, keep_alive_idle_timeout_msec_, ctx_,
+      ctx_mutex_, SSL_accept,
       [](SSL * /*ssl*/) { return true; },
       [this](SSL *ssl, Stream &strm, bool last_connection,
              bool &connection_close) {
@@ -2428,6 +2689,12 @@ inline bool SSLServer::read_and_close_socket(socket_t sock) {
       });
 }
 
+// Answering 503 would need a TLS handshake on the accept thread, so the
+// connection is just dropped.
+inline void SSLServer::reject_and_close_socket(socket_t sock) {
+  detail::close_socket(sock);
+}
+
 // SSL HTTP client implementation
 inline SSLClient::SSLClient(const char *host, int port, time_t timeout_sec,
                             const char *client_cert_path,
@@ -2475,7 +2742,7 @@ inline bool SSLClient::read_and_close_socket(socket_t sock, Request &req,
 
   return is_valid() &&
          detail::read_and_close_socket_ssl(
-             sock, 0, ctx_, ctx_mutex_,
+             sock, 0, 0, ctx_, ctx_mutex_,
              [&](SSL *ssl) {
                if (ca_cert_file_path_.empty()) {
                  SSL_CTX_set_verify(ctx_, SSL_VERIFY_NONE, nullptr);
@@ -758,6 +758,59 @@ template phf_hash_t PHF::hash<phf_string_t>(struct phf *, phf_string_t);
 template phf_hash_t PHF::hash<std::string>(struct phf *, std::string);
 #endif
 
+template<typename T>
+PHF_PUBLIC phf_hash_t PHF::slot(struct phf *phf, T k) {
+	return (phf->nodiv)? phf_g_mod_r<true>(k, phf->seed, phf->r) : phf_g_mod_r<false>(k, phf->seed, phf->r);
+} /* PHF::slot() */
+
+PHF_PUBLIC const void *PHF::slot_addr(const struct phf *phf, phf_hash_t slot) {
+	switch (phf->g_op) {
+	case phf::PHF_G_UINT8_MOD_R:
+	case phf::PHF_G_UINT8_BAND_R:
+		return reinterpret_cast<const uint8_t *>(phf->g) + slot;
+	case phf::PHF_G_UINT16_MOD_R:
+	case phf::PHF_G_UINT16_BAND_R:
+		return reinterpret_cast<const uint16_t *>(phf->g) + slot;
+	default:
+		return phf->g + slot;
+	}
+} /* PHF::slot_addr() */
+
+template<typename T>
+PHF_PUBLIC phf_hash_t PHF::hash_slot(struct phf *phf, T k, phf_hash_t slot) {
+	uint32_t d;
+
+	switch (phf->g_op) {
+	case phf::PHF_G_UINT8_MOD_R:
+	case phf::PHF_G_UINT8_BAND_R:
+		d = reinterpret_cast<const uint8_t *>(phf->g)[slot];
+		break;
+	case phf::PHF_G_UINT16_MOD_R:
+	case phf::PHF_G_UINT16_BAND_R:
+		d = reinterpret_cast<const uint16_t *>(phf->g)[slot];
+		break;
+	default:
+		d = phf->g[slot];
+		break;
+	}
+
+	return (phf->nodiv)? phf_f_mod_m<true>(d, k, phf->seed, phf->m) : phf_f_mod_m<false>(d, k, phf->seed, phf->m);
+} /* PHF::hash_slot() */
+
+template phf_hash_t PHF::slot<uint32_t>(struct phf *, uint32_t);
+template phf_hash_t PHF::slot<uint64_t>(struct phf *, uint64_t);
+template phf_hash_t PHF::slot<phf_string_t>(struct phf *, phf_string_t);
+#if !PHF_NO_LIBCXX
+template phf_hash_t PHF::slot<std::string>(struct phf *, std::string);
+#endif
+
+template phf_hash_t PHF::hash_slot<uint32_t>(struct phf *, uint32_t, phf_hash_t);
+template phf_hash_t PHF::hash_slot<uint64_t>(struct phf *, uint64_t, phf_hash_t);
+template phf_hash_t PHF::hash_slot<phf_string_t>(struct phf *, phf_string_t, phf_hash_t);
+#if !PHF_NO_LIBCXX
+template phf_hash_t PHF::hash_slot<std::string>(struct phf *, std::string, phf_hash_t);
+#endif
+
 PHF_PUBLIC void PHF::destroy(struct phf *phf) {
 	free(phf->g);
 	phf->g = NULL;
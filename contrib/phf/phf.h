@@ -176,6 +176,16 @@ namespace PHF {
 	template<typename key_t>
 	PHF_PUBLIC phf_hash_t hash(struct phf *, key_t);
 
+	/* hash() split in two steps, so that g can be prefetched in between:
+	 * hash_slot(f, k, slot(f, k)) == hash(f, k) */
+	template<typename key_t>
+	PHF_PUBLIC phf_hash_t slot(struct phf *, key_t);
+
+	PHF_PUBLIC const void *slot_addr(const struct phf *, phf_hash_t);
+
+	template<typename key_t>
+	PHF_PUBLIC phf_hash_t hash_slot(struct phf *, key_t, phf_hash_t);
+
 	PHF_PUBLIC void destroy(struct phf *);
 }
 
@@ -207,6 +217,20 @@ extern template phf_hash_t PHF::hash<phf_string_t>(struct phf *, phf_string_t);
 extern template phf_hash_t PHF::hash<std::string>(struct phf *, std::string);
 #endif
 
+extern template phf_hash_t PHF::slot<uint32_t>(struct phf *, uint32_t);
+extern template phf_hash_t PHF::slot<uint64_t>(struct phf *, uint64_t);
+extern template phf_hash_t PHF::slot<phf_string_t>(struct phf *, phf_string_t);
+#if !PHF_NO_LIBCXX
+extern template phf_hash_t PHF::slot<std::string>(struct phf *, std::string);
+#endif
+
+extern template phf_hash_t PHF::hash_slot<uint32_t>(struct phf *, uint32_t, phf_hash_t);
+extern template phf_hash_t PHF::hash_slot<uint64_t>(struct phf *, uint64_t, phf_hash_t);
+extern template phf_hash_t PHF::hash_slot<phf_string_t>(struct phf *, phf_string_t, phf_hash_t);
+#if !PHF_NO_LIBCXX
+extern template phf_hash_t PHF::hash_slot<std::string>(struct phf *, std::string, phf_hash_t);
+#endif
+
 #endif /* __cplusplus */
 
 
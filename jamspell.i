@@ -1,4 +1,4 @@
-%module jamspell
+%module(threads="1") jamspell
 %include "std_vector.i"
 %include "pyabc.i"
 %include <std_list.i>
@@ -6,6 +6,7 @@
 %include <std_wstring.i>
 %{
 #include "jamspell/spell_corrector.hpp"
+#include "jamspell/thread_pool.hpp"
 #include "jamspell/utils.hpp"
 %}
 
@@ -14,7 +15,29 @@
 // Instantiate templates used by example
 namespace std {
    %template(StringVector) vector<wstring>;
+   %template(Utf8StringVector) vector<string>;
 }
 
+// Calls keep the GIL by default. The correction methods only read the
+// corrector and release it once their arguments are converted, so other
+// Python threads run meanwhile; the batch ones also spread the texts over
+// the threads of a TThreadPool. Loading or training a model while another
+// thread corrects is not safe, with or without the GIL.
+%nothread;
+%thread NJamSpell::TSpellCorrector::FixFragment;
+%thread NJamSpell::TSpellCorrector::FixFragmentNormalized;
+%thread NJamSpell::TSpellCorrector::FixFragments;
+%thread NJamSpell::TSpellCorrector::GetCandidates;
+%thread NJamSpell::TSpellCorrector::GetALLCandidatesScoredJSON;
+
+// Only the constructor and the sizes make sense from Python.
+%ignore NJamSpell::TThreadPool::Add;
+%ignore NJamSpell::TThreadPool::TryAdd;
+%ignore NJamSpell::ParallelFor;
+// Python has whole strings at hand; the stream would also have to keep its
+// corrector alive.
+%ignore NJamSpell::TCorrectionStream;
+
+%include "jamspell/thread_pool.hpp"
 %include "jamspell/spell_corrector.hpp"
-#include "jamspell/utils.hpp"
\ No newline at end of file
+#include "jamspell/utils.hpp"
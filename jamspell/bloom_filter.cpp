@@ -1,27 +1,85 @@
 #include <cassert>
+#include <vector>
 
 #include "bloom_filter.hpp"
 
 #include <contrib/bloom/bloom_filter.hpp>
+#include <contrib/cityhash/city.h>
 #include <contrib/handypack/handypack.hpp>
 
 namespace NJamSpell {
 
-struct TBloomFilter::Impl: public bloom_filter {
-    Impl(): bloom_filter() {}
-    Impl(const bloom_parameters& params): bloom_filter(params) {}
-    Impl(const TBloomFilter::Impl& bloomFilter): bloom_filter(bloomFilter) {}
-    ~Impl() {}
+struct TBloomFilter::Impl {
+    Impl() = default;
+    Impl(const bloom_parameters& params)
+        : HashCount(params.optimal_parameters.number_of_hashes)
+        , TableBits(params.optimal_parameters.table_size)
+        , ProjectedCount(params.projected_element_count)
+        , FalsePositiveRate(params.false_positive_probability)
+        , Owned(TableBits / 8 + 1, 0)
+        , Table(Owned.data())
+    {
+    }
+    // Kirsch-Mitzenmacher: probe i is h1 + i * h2
+    void Insert(uint64_t hash) {
+        assert(Table == Owned.data() && "mapped filter is read-only");
+        uint64_t h2 = ((hash >> 33) | (hash << 31)) | 1;
+        for (uint32_t i = 0; i < HashCount; ++i) {
+            uint64_t bit = (hash + i * h2) % TableBits;
+            Owned[bit / 8] |= uint8_t(1) << (bit % 8);
+        }
+        ++InsertedCount;
+    }
+    bool Contains(uint64_t hash) const {
+        if (TableBits == 0) {
+            return false;
+        }
+        uint64_t h2 = ((hash >> 33) | (hash << 31)) | 1;
+        for (uint32_t i = 0; i < HashCount; ++i) {
+            uint64_t bit = (hash + i * h2) % TableBits;
+            if (!(Table[bit / 8] & (uint8_t(1) << (bit % 8)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+    bool Merge(const Impl& other) {
+        assert(Table == Owned.data() && "mapped filter is read-only");
+        if (HashCount != other.HashCount || TableBits != other.TableBits) {
+            return false;
+        }
+        const size_t size = Owned.size();
+        for (size_t i = 0; i < size; ++i) {
+            Owned[i] |= other.Table[i];
+        }
+        InsertedCount += other.InsertedCount;
+        return true;
+    }
     void Dump(std::ostream& out) const {
-        NHandyPack::Dump(out, salt_, bit_table_, salt_count_, table_size_,
-                        projected_element_count_, inserted_element_count_,
-                        random_seed_, desired_false_positive_probability_);
+        NHandyPack::Dump(out, HashCount, TableBits, ProjectedCount,
+                        InsertedCount, FalsePositiveRate);
+        DumpSection(out, Table, TableBits / 8 + 1);
     }
-    void Load(std::istream& in) {
-        NHandyPack::Load(in, salt_, bit_table_, salt_count_, table_size_,
-                        projected_element_count_, inserted_element_count_,
-                        random_seed_, desired_false_positive_probability_);
+    bool Load(TMemoryStream& in) {
+        NHandyPack::Load(in, HashCount, TableBits, ProjectedCount,
+                        InsertedCount, FalsePositiveRate);
+        uint64_t size = 0;
+        const char* table = MapSection(in, size);
+        if (!table || TableBits == 0 || size != TableBits / 8 + 1) {
+            return false;
+        }
+        std::vector<uint8_t>().swap(Owned);
+        Table = (const uint8_t*)table;
+        return true;
     }
+
+    uint32_t HashCount = 0;
+    uint64_t TableBits = 0;
+    uint64_t ProjectedCount = 0;
+    uint64_t InsertedCount = 0;
+    double FalsePositiveRate = 0.0;
+    std::vector<uint8_t> Owned;
+    const uint8_t* Table = nullptr;
 };
 
 TBloomFilter::TBloomFilter() {
@@ -41,20 +99,48 @@ TBloomFilter::TBloomFilter(uint64_t elements, double falsePositiveRate) {
 TBloomFilter::~TBloomFilter() {
 }
 
+uint64_t TBloomFilter::Hash(const char* data, size_t size) {
+    return CityHash64(data, size);
+}
+
+uint64_t TBloomFilter::Hash(const wchar_t* ptr, size_t len) {
+    return CityHash64((const char*)ptr, len * sizeof(wchar_t));
+}
+
 void TBloomFilter::Insert(const std::string& element) {
-    BloomFilter->insert(element);
+    InsertHash(Hash(element.data(), element.size()));
+}
+
+void TBloomFilter::Insert(const wchar_t* ptr, size_t len) {
+    InsertHash(Hash(ptr, len));
+}
+
+void TBloomFilter::InsertHash(uint64_t hash) {
+    BloomFilter->Insert(hash);
 }
 
 bool TBloomFilter::Contains(const std::string& element) const {
-    return BloomFilter->contains(element);
+    return ContainsHash(Hash(element.data(), element.size()));
+}
+
+bool TBloomFilter::Contains(const wchar_t* ptr, size_t len) const {
+    return ContainsHash(Hash(ptr, len));
+}
+
+bool TBloomFilter::ContainsHash(uint64_t hash) const {
+    return BloomFilter->Contains(hash);
+}
+
+bool TBloomFilter::Merge(const TBloomFilter& other) {
+    return BloomFilter->Merge(*other.BloomFilter);
 }
 
 void TBloomFilter::Dump(std::ostream& out) const {
     BloomFilter->Dump(out);
 }
 
-void TBloomFilter::Load(std::istream& in) {
-    BloomFilter->Load(in);
+bool TBloomFilter::Load(TMemoryStream& in) {
+    return BloomFilter->Load(in);
 }
 
 } // NJamSpell
@@ -2,17 +2,33 @@
 #include <memory>
 #include <string>
 
+#include "memory_map.hpp"
+
 namespace NJamSpell {
 
+// All overloads share one hashing scheme: a single 64-bit hash of the key
+// bytes, expanded into the probe positions by double hashing. Callers that
+// probe several filters with the same key can compute Hash() once.
 class TBloomFilter {
 public:
     TBloomFilter();
     TBloomFilter(uint64_t elements, double falsePositiveRate);
     ~TBloomFilter();
+    static uint64_t Hash(const char* data, size_t size);
+    static uint64_t Hash(const wchar_t* ptr, size_t len);
     void Insert(const std::string& element);
+    void Insert(const wchar_t* ptr, size_t len);
+    void InsertHash(uint64_t hash);
     bool Contains(const std::string& element) const;
+    bool Contains(const wchar_t* ptr, size_t len) const;
+    bool ContainsHash(uint64_t hash) const;
+    // Adds every element of other, which must have been constructed with
+    // the same elements and falsePositiveRate; returns false otherwise.
+    bool Merge(const TBloomFilter& other);
     void Dump(std::ostream& out) const;
-    void Load(std::istream& in);
+    // The bit table is used in place and must outlive the filter;
+    // mapped filters are read-only.
+    bool Load(TMemoryStream& in);
 private:
     struct Impl;
     std::unique_ptr<Impl> BloomFilter;
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace NJamSpell {
+
+// Counts that do not fit in memory are spilled to disk as runs, sorted by
+// TLess with equal keys collapsed, and merged back in the same order at the
+// end. Records are written as raw bytes and only read back by the process
+// that wrote them; the run files are removed with the object.
+template<typename TKey, typename TCount, typename TLess>
+class TCountRuns {
+public:
+    using TRecord = std::pair<TKey, TCount>;
+    using TConsumer = std::function<void(const TKey&, TCount)>;
+
+    explicit TCountRuns(const std::string& prefix)
+        : Prefix(prefix)
+    {
+    }
+    TCountRuns(const TCountRuns& other) = delete;
+    TCountRuns& operator=(const TCountRuns& other) = delete;
+    ~TCountRuns() {
+        for (auto&& f: Files) {
+            std::remove(f.c_str());
+        }
+    }
+
+    static void Collapse(std::vector<TRecord>& records) {
+        TLess less;
+        std::sort(records.begin(), records.end(), [&less](const TRecord& a, const TRecord& b) {
+            return less(a.first, b.first);
+        });
+        size_t last = 0;
+        for (size_t i = 1; i < records.size(); ++i) {
+            if (!less(records[last].first, records[i].first)) {
+                records[last].second += records[i].second;
+            } else {
+                records[++last] = records[i];
+            }
+        }
+        if (!records.empty()) {
+            records.resize(last + 1);
+        }
+    }
+
+    // Collapses the records into a new run and empties them.
+    bool Spill(std::vector<TRecord>& records) {
+        Collapse(records);
+        std::string fileName = NewFileName();
+        std::ofstream out(fileName, std::ios::binary);
+        out.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(TRecord));
+        records.clear();
+        return out.good();
+    }
+
+    size_t RunsCount() const {
+        return Files.size();
+    }
+
+    // Passes every key once, in order, with its total count.
+    bool Merge(const TConsumer& consumer) {
+        while (Files.size() > MAX_FAN_IN) {
+            std::vector<std::string> group(Files.begin(), Files.begin() + MAX_FAN_IN);
+            std::string fileName = NewFileName();
+            std::ofstream out(fileName, std::ios::binary);
+            bool ok = MergeFiles(group, [&out](const TKey& key, TCount count) {
+                TRecord record(key, count);
+                out.write(reinterpret_cast<const char*>(&record), sizeof(TRecord));
+            });
+            if (!ok || !out.good()) {
+                return false;
+            }
+            out.close();
+            for (auto&& f: group) {
+                std::remove(f.c_str());
+            }
+            Files.erase(Files.begin(), Files.begin() + MAX_FAN_IN);
+        }
+        return MergeFiles(Files, consumer);
+    }
+
+private:
+    static constexpr size_t MAX_FAN_IN = 64;
+    static constexpr size_t READ_BUFFER_RECORDS = 4096;
+
+    class TReader {
+    public:
+        explicit TReader(const std::string& fileName)
+            : In(fileName, std::ios::binary)
+        {
+        }
+        bool Good() const {
+            return In.is_open();
+        }
+        bool Next() {
+            if (++Position < Buffer.size()) {
+                return true;
+            }
+            Buffer.resize(READ_BUFFER_RECORDS);
+            In.read(reinterpret_cast<char*>(Buffer.data()), Buffer.size() * sizeof(TRecord));
+            Buffer.resize(In.gcount() / sizeof(TRecord));
+            Position = 0;
+            return !Buffer.empty();
+        }
+        const TRecord& Current() const {
+            return Buffer[Position];
+        }
+    private:
+        std::ifstream In;
+        std::vector<TRecord> Buffer;
+        size_t Position = 0;
+    };
+
+    std::string NewFileName() {
+        Files.push_back(Prefix + "." + std::to_string(NextRun++) + ".run");
+        return Files.back();
+    }
+
+    static bool MergeFiles(const std::vector<std::string>& files, const TConsumer& consumer) {
+        std::vector<std::unique_ptr<TReader>> readers;
+        for (auto&& f: files) {
+            readers.emplace_back(new TReader(f));
+            if (!readers.back()->Good()) {
+                return false;
+            }
+        }
+        TLess less;
+        auto greater = [&readers, &less](size_t a, size_t b) {
+            return less(readers[b]->Current().first, readers[a]->Current().first);
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heap(greater);
+        for (size_t i = 0; i < readers.size(); ++i) {
+            if (readers[i]->Next()) {
+                heap.push(i);
+            }
+        }
+        bool hasCurrent = false;
+        TRecord current;
+        while (!heap.empty()) {
+            size_t i = heap.top();
+            heap.pop();
+            const TRecord& record = readers[i]->Current();
+            if (hasCurrent && !less(current.first, record.first)) {
+                current.second += record.second;
+            } else {
+                if (hasCurrent) {
+                    consumer(current.first, current.second);
+                }
+                current = record;
+                hasCurrent = true;
+            }
+            if (readers[i]->Next()) {
+                heap.push(i);
+            }
+        }
+        if (hasCurrent) {
+            consumer(current.first, current.second);
+        }
+        return true;
+    }
+
+private:
+    std::string Prefix;
+    std::vector<std::string> Files;
+    size_t NextRun = 0;
+};
+
+} // NJamSpell
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <contrib/handypack/handypack.hpp>
+
+#include "dawg_index.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t DAWG_INDEX_MAGIC_BYTE = 5139624237061042343L;
+constexpr uint16_t DAWG_INDEX_VERSION = 1;
+
+namespace {
+
+struct TBuildState {
+    std::vector<std::pair<wchar_t, uint32_t>> Edges; // ascending labels
+    bool Final = false;
+};
+
+// Incremental construction from words in ascending order (Daciuk et al.):
+// once a word is added, the states of the previous one past the common
+// prefix can no longer change, so each is replaced by an equal state seen
+// before, if any.
+class TDawgBuilder {
+public:
+    TDawgBuilder()
+        : States(1)
+        , Path(1, 0)
+    {
+    }
+
+    void Add(const TWord& word) {
+        size_t common = 0;
+        while (common < word.Len && common < LastWord.size() && word.Ptr[common] == LastWord[common]) {
+            ++common;
+        }
+        Minimize(common);
+        for (size_t i = common; i < word.Len; ++i) {
+            uint32_t state = NewState();
+            States[Path.back()].Edges.emplace_back(word.Ptr[i], state);
+            Path.push_back(state);
+        }
+        States[Path.back()].Final = true;
+        LastWord.assign(word.Ptr, word.Ptr + word.Len);
+    }
+
+    // The root is state 0; states not reachable from it are unused.
+    std::vector<TBuildState>& Finish() {
+        Minimize(0);
+        return States;
+    }
+
+private:
+    uint32_t NewState() {
+        if (!Free.empty()) {
+            uint32_t state = Free.back();
+            Free.pop_back();
+            return state;
+        }
+        States.emplace_back();
+        return States.size() - 1;
+    }
+
+    static std::string Signature(const TBuildState& state) {
+        std::string signature(1, state.Final ? 1 : 0);
+        for (auto&& edge: state.Edges) {
+            signature.append((const char*)&edge.first, sizeof(edge.first));
+            signature.append((const char*)&edge.second, sizeof(edge.second));
+        }
+        return signature;
+    }
+
+    void Minimize(size_t depth) {
+        while (Path.size() > depth + 1) {
+            uint32_t child = Path.back();
+            Path.pop_back();
+            std::string signature = Signature(States[child]);
+            auto it = Register.find(signature);
+            if (it == Register.end()) {
+                Register.emplace(std::move(signature), child);
+                continue;
+            }
+            States[Path.back()].Edges.back().second = it->second;
+            States[child] = TBuildState();
+            Free.push_back(child);
+        }
+    }
+
+private:
+    std::vector<TBuildState> States;
+    std::vector<uint32_t> Path; // states along LastWord, from the root
+    std::vector<wchar_t> LastWord;
+    std::vector<uint32_t> Free;
+    std::unordered_map<std::string, uint32_t> Register;
+};
+
+static uint32_t CountWords(const std::vector<TBuildState>& states, uint32_t state, std::vector<uint32_t>& counts) {
+    const uint32_t UNKNOWN = uint32_t(-1);
+    if (counts[state] != UNKNOWN) {
+        return counts[state];
+    }
+    uint32_t count = states[state].Final ? 1 : 0;
+    for (auto&& edge: states[state].Edges) {
+        count += CountWords(states, edge.second, counts);
+    }
+    counts[state] = count;
+    return count;
+}
+
+// Depth-first walk keeping a row of distances to the query per prefix.
+struct TDawgWalk {
+    const TMappedArray<uint32_t>& Edges;
+    const TMappedArray<uint8_t>& Final;
+    const TMappedArray<wchar_t>& Labels;
+    const TMappedArray<uint32_t>& Targets;
+    const TMappedArray<uint32_t>& Ranks;
+    const TMappedArray<TWordId>& WordIds;
+    const TLangModel& Model;
+    const wchar_t* Query;
+    size_t Len;
+    uint8_t MaxDistance;
+    std::vector<uint8_t> Rows;  // (Len + 1) per depth, MaxDistance + 1 outside the band
+    std::vector<wchar_t> Path;  // labels of the current prefix
+    TWords& Result;
+
+    uint8_t* Row(size_t depth) {
+        return &Rows[depth * (Len + 1)];
+    }
+
+    void Walk(uint32_t state, size_t depth, uint32_t rank) {
+        const uint8_t limit = MaxDistance + 1;
+        const uint8_t* prev = Row(depth);
+        for (uint32_t e = Edges[state]; e < Edges[state + 1]; ++e) {
+            if (depth + 1 > Len + MaxDistance) {
+                return;
+            }
+            const wchar_t c = Labels[e];
+            uint8_t* row = Row(depth + 1);
+            row[0] = uint8_t(std::min<size_t>(depth + 1, limit));
+            uint8_t best = row[0];
+            // cells further than MaxDistance from the diagonal can only be
+            // above it, so they are left at the limit
+            const size_t first = depth + 1 > MaxDistance ? depth + 1 - MaxDistance : 1;
+            const size_t last = std::min<size_t>(Len, depth + 1 + MaxDistance);
+            for (size_t j = first; j <= last; ++j) {
+                uint8_t d = std::min<uint8_t>(prev[j], row[j - 1]) + 1;
+                d = std::min<uint8_t>(d, prev[j - 1] + (c != Query[j - 1]));
+                if (depth >= 1 && j >= 2 && c == Query[j - 2] && Path[depth - 1] == Query[j - 1]) {
+                    d = std::min<uint8_t>(d, Row(depth - 1)[j - 2] + 1);
+                }
+                row[j] = std::min(d, limit);
+                best = std::min(best, row[j]);
+            }
+            if (best > MaxDistance) {
+                continue;
+            }
+            const uint32_t target = Targets[e];
+            const uint32_t targetRank = rank + Ranks[e];
+            if (Final[target] && row[Len] <= MaxDistance) {
+                Result.push_back(Model.GetWordById(WordIds[targetRank]));
+            }
+            Path[depth] = c;
+            Walk(target, depth + 1, targetRank);
+        }
+    }
+};
+
+} // namespace
+
+bool TDawgIndex::Build(const TLangModel& model) {
+    std::cerr << "[info] building dawg index" << std::endl;
+    const size_t wordsCount = model.GetWordsCount();
+    std::vector<TWordId> ids(wordsCount);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::sort(ids.begin(), ids.end(), [&model](TWordId a, TWordId b) {
+        TWord wa = model.GetWordById(a);
+        TWord wb = model.GetWordById(b);
+        return std::lexicographical_compare(wa.Ptr, wa.Ptr + wa.Len, wb.Ptr, wb.Ptr + wb.Len);
+    });
+    TDawgBuilder builder;
+    for (TWordId wid: ids) {
+        builder.Add(model.GetWordById(wid));
+    }
+    std::vector<TBuildState>& states = builder.Finish();
+
+    // states are numbered breadth first, skipping the unused ones
+    const uint32_t UNKNOWN = uint32_t(-1);
+    std::vector<uint32_t> numbers(states.size(), UNKNOWN);
+    std::vector<uint32_t> order(1, 0);
+    numbers[0] = 0;
+    for (size_t i = 0; i < order.size(); ++i) {
+        for (auto&& edge: states[order[i]].Edges) {
+            if (numbers[edge.second] == UNKNOWN) {
+                numbers[edge.second] = order.size();
+                order.push_back(edge.second);
+            }
+        }
+    }
+    std::vector<uint32_t> counts(states.size(), UNKNOWN);
+    if (CountWords(states, 0, counts) != wordsCount) {
+        std::cerr << "[error] failed to build dawg index" << std::endl;
+        return false;
+    }
+
+    std::vector<uint32_t> edges;
+    std::vector<uint8_t> finals;
+    std::vector<wchar_t> labels;
+    std::vector<uint32_t> targets;
+    std::vector<uint32_t> ranks;
+    edges.reserve(order.size() + 1);
+    finals.reserve(order.size());
+    for (uint32_t old: order) {
+        const TBuildState& state = states[old];
+        edges.push_back(labels.size());
+        finals.push_back(state.Final ? 1 : 0);
+        uint32_t rank = state.Final ? 1 : 0;
+        for (auto&& edge: state.Edges) {
+            labels.push_back(edge.first);
+            targets.push_back(numbers[edge.second]);
+            ranks.push_back(rank);
+            rank += counts[edge.second];
+        }
+    }
+    edges.push_back(labels.size());
+    std::cerr << "[info] dawg index: " << order.size() << " states, " << labels.size() << " edges" << std::endl;
+
+    Edges.Assign(std::move(edges));
+    Final.Assign(std::move(finals));
+    Labels.Assign(std::move(labels));
+    Targets.Assign(std::move(targets));
+    Ranks.Assign(std::move(ranks));
+    WordIds.Assign(std::move(ids));
+    MappedFile.reset();
+    CheckSum = model.GetCheckSum();
+    Model = &model;
+    return true;
+}
+
+bool TDawgIndex::Dump(const std::string& fileName) const {
+    if (!Model) {
+        return false;
+    }
+    std::string tempFileName = TemporaryFileName(fileName);
+    std::ofstream out(tempFileName, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    NHandyPack::Dump(out, DAWG_INDEX_MAGIC_BYTE);
+    NHandyPack::Dump(out, DAWG_INDEX_VERSION);
+    NHandyPack::Dump(out, uint16_t(sizeof(wchar_t)));
+    NHandyPack::Dump(out, CheckSum);
+    DumpSection(out, Edges);
+    DumpSection(out, Final);
+    DumpSection(out, Labels);
+    DumpSection(out, Targets);
+    DumpSection(out, Ranks);
+    DumpSection(out, WordIds);
+    NHandyPack::Dump(out, DAWG_INDEX_MAGIC_BYTE);
+    out.close();
+    if (!out) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return CommitFile(tempFileName, fileName);
+}
+
+bool TDawgIndex::Load(const std::string& fileName, const TLangModel& model) {
+    std::cerr << "[info] loading dawg index (" << fileName << ")\n";
+    Model = nullptr;
+    std::unique_ptr<TMemoryMappedFile> file(new TMemoryMappedFile());
+    if (!file->Open(fileName)) {
+        return false;
+    }
+    TMemoryStream in(file->Data(), file->Size());
+    uint64_t magicByte = 0;
+    uint16_t version = 0;
+    uint16_t wcharSize = 0;
+    NHandyPack::Load(in, magicByte);
+    if (magicByte != DAWG_INDEX_MAGIC_BYTE) {
+        return false;
+    }
+    NHandyPack::Load(in, version, wcharSize);
+    if (version != DAWG_INDEX_VERSION || wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
+    NHandyPack::Load(in, CheckSum);
+    if (!in.good() || CheckSum != model.GetCheckSum()) {
+        return false;
+    }
+    if (!MapSection(in, Edges) ||
+        !MapSection(in, Final) ||
+        !MapSection(in, Labels) ||
+        !MapSection(in, Targets) ||
+        !MapSection(in, Ranks) ||
+        !MapSection(in, WordIds))
+    {
+        return false;
+    }
+    magicByte = 0;
+    NHandyPack::Load(in, magicByte);
+    if (magicByte != DAWG_INDEX_MAGIC_BYTE ||
+        Final.empty() ||
+        Edges.size() != Final.size() + 1 ||
+        Edges[Final.size()] != Labels.size() ||
+        Targets.size() != Labels.size() ||
+        Ranks.size() != Labels.size() ||
+        WordIds.size() != model.GetWordsCount())
+    {
+        return false;
+    }
+    MappedFile = std::move(file);
+    Model = &model;
+    return true;
+}
+
+void TDawgIndex::Find(const wchar_t* ptr, size_t len, size_t maxDistance, TWords& result) const {
+    assert(maxDistance <= MAX_DISTANCE);
+    if (!Model) {
+        return;
+    }
+    TDawgWalk walk{Edges, Final, Labels, Targets, Ranks, WordIds, *Model, ptr, len, uint8_t(maxDistance),
+                   std::vector<uint8_t>((len + maxDistance + 1) * (len + 1), uint8_t(maxDistance + 1)),
+                   std::vector<wchar_t>(len + maxDistance), result};
+    uint8_t* row = walk.Row(0);
+    for (size_t j = 0; j <= len; ++j) {
+        row[j] = uint8_t(std::min(j, maxDistance + 1));
+    }
+    if (Final[0] && len <= maxDistance) {
+        result.push_back(Model->GetWordById(WordIds[0]));
+    }
+    walk.Walk(0, 0, 0);
+}
+
+TWordId TDawgIndex::FindWord(const wchar_t* ptr, size_t len) const {
+    if (!Model) {
+        return UNKNOWN_WORD_ID;
+    }
+    uint32_t state = 0;
+    uint32_t rank = 0;
+    for (size_t i = 0; i < len; ++i) {
+        const wchar_t* begin = Labels.data() + Edges[state];
+        const wchar_t* end = Labels.data() + Edges[state + 1];
+        const wchar_t* it = std::lower_bound(begin, end, ptr[i]);
+        if (it == end || *it != ptr[i]) {
+            return UNKNOWN_WORD_ID;
+        }
+        const uint32_t e = it - Labels.data();
+        rank += Ranks[e];
+        state = Targets[e];
+    }
+    return Final[state] ? WordIds[rank] : UNKNOWN_WORD_ID;
+}
+
+size_t TDawgIndex::StatesCount() const {
+    return Final.size();
+}
+
+} // NJamSpell
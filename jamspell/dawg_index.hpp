@@ -0,0 +1,50 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "lang_model.hpp"
+#include "memory_map.hpp"
+
+namespace NJamSpell {
+
+// The vocabulary of a model as a minimal acyclic automaton (DAWG): words
+// sharing a prefix share the path to it, and words sharing a suffix share
+// the states after it. Each edge holds the number of words reached before
+// it, so the path of a word also yields its rank in lexicographic order,
+// which a table maps to the word id of the model.
+//
+// Find() walks the automaton with a bounded Damerau-Levenshtein (optimal
+// string alignment) automaton: a row of distances is kept per prefix, and
+// prefixes already more than maxDistance edits away are not followed. The
+// cost depends on the states visited, not on the size of the alphabet.
+// Load() uses the file in place from a mmap'ed file.
+class TDawgIndex {
+public:
+    static constexpr size_t MAX_DISTANCE = 2;
+
+    // The model must outlive the index.
+    bool Build(const TLangModel& model);
+    bool Dump(const std::string& fileName) const;
+    // Fails if the file was not built for this model. The index refers to
+    // the model, which must outlive it and not be reloaded.
+    bool Load(const std::string& fileName, const TLangModel& model);
+    // Appends the words at most maxDistance deletions, insertions,
+    // replacements or adjacent transpositions away from ptr, including ptr
+    // itself when it is a word. maxDistance is at most MAX_DISTANCE.
+    void Find(const wchar_t* ptr, size_t len, size_t maxDistance, TWords& result) const;
+    TWordId FindWord(const wchar_t* ptr, size_t len) const;
+    size_t StatesCount() const;
+private:
+    const TLangModel* Model = nullptr;
+    uint64_t CheckSum = 0;
+    std::unique_ptr<TMemoryMappedFile> MappedFile;
+    TMappedArray<uint32_t> Edges;   // first edge by state, plus the end
+    TMappedArray<uint8_t> Final;    // by state
+    TMappedArray<wchar_t> Labels;   // by edge, ascending within a state
+    TMappedArray<uint32_t> Targets; // by edge
+    TMappedArray<uint32_t> Ranks;   // by edge, words reached before it from its state
+    TMappedArray<TWordId> WordIds;  // by rank
+};
+
+} // NJamSpell
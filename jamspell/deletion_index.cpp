@@ -0,0 +1,203 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <contrib/cityhash/city.h>
+#include <contrib/handypack/handypack.hpp>
+
+#include "deletion_index.hpp"
+#include "edits.hpp"
+#include "thread_pool.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t DELETION_INDEX_MAGIC_BYTE = 6904296092706066741L;
+constexpr uint16_t DELETION_INDEX_VERSION = 2;
+// fixed, so that the file does not depend on the number of threads
+constexpr uint32_t DELETION_INDEX_HASH_PARTITIONS = 16;
+
+static uint64_t VariantHash(const wchar_t* ptr, size_t len) {
+    return CityHash64((const char*)ptr, len * sizeof(wchar_t));
+}
+
+static uint32_t Fingerprint(uint64_t hash) {
+    return static_cast<uint32_t>(hash >> 32);
+}
+
+bool TDeletionIndex::Build(const TLangModel& model, size_t threadsCount) {
+    std::cerr << "[info] building deletion index" << std::endl;
+    const size_t wordsCount = model.GetWordsCount();
+    if (threadsCount == 0) {
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadsCount = std::max(size_t(1), std::min(threadsCount, wordsCount));
+
+    // (variant hash, word id) for every word and each of its deletions
+    using TEntry = std::pair<uint64_t, TWordId>;
+    std::vector<std::vector<TEntry>> parts(threadsCount);
+    TThreadPool pool(threadsCount);
+    ParallelFor(pool, threadsCount, [&](size_t worker) {
+        std::vector<TEntry>& entries = parts[worker];
+        for (TWordId wid = worker; wid < wordsCount; wid += threadsCount) {
+            TWord word = model.GetWordById(wid);
+            entries.push_back(TEntry(VariantHash(word.Ptr, word.Len), wid));
+            ForEachDeletion(word.Ptr, word.Len, [&](const wchar_t* ptr, size_t size) {
+                entries.push_back(TEntry(VariantHash(ptr, size), wid));
+            });
+        }
+        std::sort(entries.begin(), entries.end());
+        entries.erase(std::unique(entries.begin(), entries.end()), entries.end());
+    });
+    std::vector<TEntry> entries;
+    for (auto&& part: parts) {
+        entries.insert(entries.end(), part.begin(), part.end());
+        std::vector<TEntry>().swap(part);
+    }
+    std::sort(entries.begin(), entries.end());
+
+    std::vector<uint64_t> keys;
+    for (auto&& e: entries) {
+        if (keys.empty() || keys.back() != e.first) {
+            keys.push_back(e.first);
+        }
+    }
+    std::cerr << "[info] deletion index: " << keys.size() << " variants, "
+              << entries.size() << " entries" << std::endl;
+
+    std::vector<TPerfectHash::TKeyRef> refs;
+    refs.reserve(keys.size());
+    for (auto&& k: keys) {
+        refs.push_back(TPerfectHash::TKeyRef((const char*)&k, sizeof(k)));
+    }
+    MappedFile.reset();
+    TPerfectHashParams params;
+    params.Partitions = DELETION_INDEX_HASH_PARTITIONS;
+    if (keys.empty() || !PerfectHash.Init(refs, params, &pool)) {
+        return false;
+    }
+    std::vector<TPerfectHash::TKeyRef>().swap(refs);
+
+    const size_t bucketsCount = PerfectHash.BucketsNumber();
+    std::vector<uint32_t> buckets(keys.size());
+    std::vector<uint32_t> fingerprints(bucketsCount, 0);
+    std::vector<uint32_t> offsets(bucketsCount + 1, 0);
+    for (size_t i = 0, k = 0; i < entries.size(); ++k) {
+        uint32_t bucket = PerfectHash.Hash((const char*)&keys[k], sizeof(uint64_t));
+        size_t end = i;
+        while (end < entries.size() && entries[end].first == keys[k]) {
+            ++end;
+        }
+        buckets[k] = bucket;
+        fingerprints[bucket] = Fingerprint(keys[k]);
+        offsets[bucket + 1] = end - i;
+        i = end;
+    }
+    for (size_t b = 0; b < bucketsCount; ++b) {
+        offsets[b + 1] += offsets[b];
+    }
+    std::vector<TWordId> wordIds(entries.size());
+    for (size_t i = 0, k = 0; i < entries.size(); ++k) {
+        uint32_t pos = offsets[buckets[k]];
+        for (; i < entries.size() && entries[i].first == keys[k]; ++i) {
+            wordIds[pos++] = entries[i].second;
+        }
+    }
+
+    Model = &model;
+    CheckSum = model.GetCheckSum();
+    Fingerprints.Assign(std::move(fingerprints));
+    Offsets.Assign(std::move(offsets));
+    WordIds.Assign(std::move(wordIds));
+    return true;
+}
+
+bool TDeletionIndex::Dump(const std::string& fileName) const {
+    if (!Model) {
+        return false;
+    }
+    std::string tempFileName = TemporaryFileName(fileName);
+    std::ofstream out(tempFileName, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    NHandyPack::Dump(out, DELETION_INDEX_MAGIC_BYTE);
+    NHandyPack::Dump(out, DELETION_INDEX_VERSION);
+    NHandyPack::Dump(out, uint16_t(sizeof(wchar_t)));
+    NHandyPack::Dump(out, CheckSum, uint16_t(MAX_DELETES));
+    PerfectHash.DumpMapped(out);
+    DumpSection(out, Fingerprints);
+    DumpSection(out, Offsets);
+    DumpSection(out, WordIds);
+    NHandyPack::Dump(out, DELETION_INDEX_MAGIC_BYTE);
+    out.close();
+    if (!out) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return CommitFile(tempFileName, fileName);
+}
+
+bool TDeletionIndex::Load(const std::string& fileName, const TLangModel& model) {
+    std::cerr << "[info] loading deletion index (" << fileName << ")\n";
+    Model = nullptr;
+    std::unique_ptr<TMemoryMappedFile> file(new TMemoryMappedFile());
+    if (!file->Open(fileName)) {
+        return false;
+    }
+    TMemoryStream in(file->Data(), file->Size());
+    uint64_t magicByte = 0;
+    uint16_t version = 0;
+    uint16_t wcharSize = 0;
+    uint16_t maxDeletes = 0;
+    NHandyPack::Load(in, magicByte);
+    if (magicByte != DELETION_INDEX_MAGIC_BYTE) {
+        return false;
+    }
+    NHandyPack::Load(in, version, wcharSize);
+    if (version != DELETION_INDEX_VERSION || wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
+    NHandyPack::Load(in, CheckSum, maxDeletes);
+    if (!in.good() || CheckSum != model.GetCheckSum() || maxDeletes != MAX_DELETES) {
+        return false;
+    }
+    if (!PerfectHash.LoadMapped(in) ||
+        !MapSection(in, Fingerprints) ||
+        !MapSection(in, Offsets) ||
+        !MapSection(in, WordIds))
+    {
+        return false;
+    }
+    magicByte = 0;
+    NHandyPack::Load(in, magicByte);
+    if (magicByte != DELETION_INDEX_MAGIC_BYTE ||
+        Fingerprints.size() != PerfectHash.BucketsNumber() ||
+        Offsets.size() != Fingerprints.size() + 1 ||
+        Offsets[Fingerprints.size()] != WordIds.size())
+    {
+        return false;
+    }
+    MappedFile = std::move(file);
+    Model = &model;
+    return true;
+}
+
+void TDeletionIndex::Find(const wchar_t* ptr, size_t len, size_t maxDeletes, TWords& result) const {
+    uint64_t hash = VariantHash(ptr, len);
+    uint32_t bucket = PerfectHash.Hash((const char*)&hash, sizeof(hash));
+    if (Fingerprints[bucket] != Fingerprint(hash)) {
+        return;
+    }
+    for (uint32_t i = Offsets[bucket]; i < Offsets[bucket + 1]; ++i) {
+        TWord word = Model->GetWordById(WordIds[i]);
+        if (IsSupersequence(word, ptr, len, maxDeletes)) {
+            result.push_back(word);
+        }
+    }
+}
+
+} // NJamSpell
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "lang_model.hpp"
+#include "memory_map.hpp"
+#include "perfect_hash.hpp"
+
+namespace NJamSpell {
+
+// Exact deletion index over the vocabulary of a model (the SymSpell
+// scheme): every word is stored under itself and under each variant with up
+// to MAX_DELETES characters removed, so all words that a string can be
+// reached from by deleting characters take a single probe to find.
+//
+// Variants are keyed by a perfect hash of their 64-bit hash with a 32-bit
+// fingerprint per bucket. Find() checks every word it returns against the
+// string, so hash collisions cost time but never change results. Load()
+// uses the file in place from a mmap'ed file.
+class TDeletionIndex {
+public:
+    static constexpr size_t MAX_DELETES = 2;
+
+    // Words are indexed on threadsCount threads, 0 means one per core.
+    // The model must outlive the index.
+    bool Build(const TLangModel& model, size_t threadsCount = 0);
+    bool Dump(const std::string& fileName) const;
+    // Fails if the file was not built for this model. The index refers to
+    // the model, which must outlive it and not be reloaded.
+    bool Load(const std::string& fileName, const TLangModel& model);
+    // Appends the words that are ptr with 0 to maxDeletes characters
+    // inserted, maxDeletes being at most MAX_DELETES.
+    void Find(const wchar_t* ptr, size_t len, size_t maxDeletes, TWords& result) const;
+private:
+    const TLangModel* Model = nullptr;
+    uint64_t CheckSum = 0;
+    std::unique_ptr<TMemoryMappedFile> MappedFile;
+    TPerfectHash PerfectHash;
+    TMappedArray<uint32_t> Fingerprints; // by bucket
+    TMappedArray<uint32_t> Offsets;      // by bucket, plus the end offset
+    TMappedArray<TWordId> WordIds;       // per bucket, in ascending order
+};
+
+} // NJamSpell
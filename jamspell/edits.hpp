@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+#include "utils.hpp"
+
+namespace NJamSpell {
+
+// Scratch space for building edit variants in place. Ordinary words fit on
+// the stack, so generating candidates does not allocate per edit.
+class TEditBuffer {
+public:
+    explicit TEditBuffer(size_t size)
+        : Ptr(Stack)
+    {
+        if (size > STACK_SIZE) {
+            Heap.resize(size);
+            Ptr = &Heap[0];
+        }
+    }
+    wchar_t* Data() {
+        return Ptr;
+    }
+    wchar_t& operator[](size_t i) {
+        return Ptr[i];
+    }
+private:
+    static constexpr size_t STACK_SIZE = 64;
+    wchar_t Stack[STACK_SIZE];
+    std::vector<wchar_t> Heap;
+    wchar_t* Ptr;
+};
+
+// Calls func(ptr, size) for every way of removing one character of the word
+// and, before each of them, the ways of removing one more. Variants repeat
+// when the word has repeated letters; ptr is only valid during the call.
+template<typename TFunc>
+void ForEachDeletion(const wchar_t* w, size_t len, TFunc&& func) {
+    if (len < 2) {
+        return;
+    }
+    TEditBuffer del1(len - 1);
+    TEditBuffer del2(len - 1);
+    std::copy(w + 1, w + len, del1.Data());
+    for (size_t i = 0; i < len; ++i) {
+        if (len > 2) {
+            std::copy(del1.Data() + 1, del1.Data() + len - 1, del2.Data());
+            for (size_t j = 0; j + 1 < len; ++j) {
+                func(static_cast<const wchar_t*>(del2.Data()), len - 2);
+                if (j + 2 < len) {
+                    del2[j] = del1[j];
+                }
+            }
+        }
+        func(static_cast<const wchar_t*>(del1.Data()), len - 1);
+        if (i + 1 < len) {
+            del1[i] = w[i];
+        }
+    }
+}
+
+// Whether word is ptr with up to maxInserted characters inserted.
+inline bool IsSupersequence(const TWord& word, const wchar_t* ptr, size_t len, size_t maxInserted) {
+    if (word.Len < len || word.Len - len > maxInserted) {
+        return false;
+    }
+    size_t j = 0;
+    for (size_t i = 0; i < word.Len && j < len; ++i) {
+        if (word.Ptr[i] == ptr[j]) {
+            ++j;
+        }
+    }
+    return j == len;
+}
+
+} // NJamSpell
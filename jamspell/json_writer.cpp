@@ -0,0 +1,191 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "json_writer.hpp"
+
+namespace NJamSpell {
+
+static const size_t INDENT = 4;
+
+TJsonWriter::TJsonWriter(std::string& out, bool pretty)
+    : Out(out)
+    , Pretty(pretty)
+{
+}
+
+void TJsonWriter::NewLine(size_t depth) {
+    if (Pretty) {
+        Out.push_back('\n');
+        Out.append(depth * INDENT, ' ');
+    }
+}
+
+void TJsonWriter::BeforeValue() {
+    if (AfterKey) {
+        AfterKey = false;
+        return;
+    }
+    if (Empty.empty()) {
+        return;
+    }
+    if (!Empty.back()) {
+        Out.push_back(',');
+    }
+    Empty.back() = false;
+    NewLine(Empty.size());
+}
+
+void TJsonWriter::Begin(char bracket) {
+    BeforeValue();
+    Out.push_back(bracket);
+    Empty.push_back(true);
+}
+
+void TJsonWriter::End(char bracket) {
+    bool empty = Empty.back();
+    Empty.pop_back();
+    if (!empty) {
+        NewLine(Empty.size());
+    }
+    Out.push_back(bracket);
+}
+
+TJsonWriter& TJsonWriter::BeginObject() {
+    Begin('{');
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::EndObject() {
+    End('}');
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::BeginArray() {
+    Begin('[');
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::EndArray() {
+    End(']');
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::Key(const char* key) {
+    BeforeValue();
+    AppendEscaped(key, strlen(key));
+    Out.push_back(':');
+    if (Pretty) {
+        Out.push_back(' ');
+    }
+    AfterKey = true;
+    return *this;
+}
+
+static void AppendEscapedChar(std::string& out, unsigned char c) {
+    switch (c) {
+    case '"': out += "\\\""; break;
+    case '\\': out += "\\\\"; break;
+    case '\b': out += "\\b"; break;
+    case '\f': out += "\\f"; break;
+    case '\n': out += "\\n"; break;
+    case '\r': out += "\\r"; break;
+    case '\t': out += "\\t"; break;
+    default:
+        if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out.push_back(c);
+        }
+    }
+}
+
+void TJsonWriter::AppendEscaped(const char* ptr, size_t len) {
+    Out.push_back('"');
+    for (size_t i = 0; i < len; ++i) {
+        AppendEscapedChar(Out, ptr[i]);
+    }
+    Out.push_back('"');
+}
+
+TJsonWriter& TJsonWriter::String(const std::string& value) {
+    BeforeValue();
+    AppendEscaped(value.data(), value.size());
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::String(const wchar_t* ptr, size_t len) {
+    BeforeValue();
+    Out.push_back('"');
+    for (size_t i = 0; i < len; ++i) {
+        uint32_t cp = static_cast<uint32_t>(ptr[i]);
+        if (sizeof(wchar_t) == 2 && cp >= 0xD800 && cp < 0xDC00 && i + 1 < len) {
+            uint32_t low = static_cast<uint32_t>(ptr[i + 1]);
+            if (low >= 0xDC00 && low < 0xE000) {
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                i += 1;
+            }
+        }
+        if (cp < 0x80) {
+            AppendEscapedChar(Out, static_cast<unsigned char>(cp));
+        } else if (cp < 0x800) {
+            Out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+            Out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else if (cp < 0x10000) {
+            Out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+            Out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            Out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        } else {
+            Out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+            Out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+            Out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+            Out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+        }
+    }
+    Out.push_back('"');
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::Int(int64_t value) {
+    BeforeValue();
+    char buf[32];
+    int size = snprintf(buf, sizeof(buf), "%lld", static_cast<long long>(value));
+    Out.append(buf, size);
+    return *this;
+}
+
+TJsonWriter& TJsonWriter::UInt(uint64_t value) {
+    BeforeValue();
+    char buf[32];
+    int size = snprintf(buf, sizeof(buf), "%llu", static_cast<unsigned long long>(value));
+    Out.append(buf, size);
+    return *this;
+}
+
+// Shortest representation that parses back to the same double, with ".0"
+// appended to integral values, as nlohmann::json prints them.
+TJsonWriter& TJsonWriter::Double(double value) {
+    BeforeValue();
+    if (!std::isfinite(value)) {
+        Out += "null";
+        return *this;
+    }
+    char buf[32];
+    int size = 0;
+    for (int precision = 15; precision <= 17; ++precision) {
+        size = snprintf(buf, sizeof(buf), "%.*g", precision, value);
+        if (strtod(buf, nullptr) == value) {
+            break;
+        }
+    }
+    Out.append(buf, size);
+    if (strpbrk(buf, ".eEn") == nullptr) {
+        Out += ".0";
+    }
+    return *this;
+}
+
+} // NJamSpell
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace NJamSpell {
+
+// Writes JSON straight into a caller-owned buffer, without building a DOM.
+// Output is appended, so one buffer can be cleared and reused between
+// documents. Pretty output uses the same layout as nlohmann::json::dump(4);
+// keys are written in the order given.
+class TJsonWriter {
+public:
+    explicit TJsonWriter(std::string& out, bool pretty = false);
+    TJsonWriter& BeginObject();
+    TJsonWriter& EndObject();
+    TJsonWriter& BeginArray();
+    TJsonWriter& EndArray();
+    TJsonWriter& Key(const char* key);
+    TJsonWriter& String(const std::string& value);
+    TJsonWriter& String(const wchar_t* ptr, size_t len);
+    TJsonWriter& Int(int64_t value);
+    TJsonWriter& UInt(uint64_t value);
+    TJsonWriter& Double(double value);
+private:
+    void BeforeValue();
+    void NewLine(size_t depth);
+    void Begin(char bracket);
+    void End(char bracket);
+    void AppendEscaped(const char* ptr, size_t len);
+private:
+    std::string& Out;
+    bool Pretty;
+    bool AfterKey = false;
+    std::vector<bool> Empty; // per open container
+};
+
+} // NJamSpell
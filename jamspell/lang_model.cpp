@@ -3,10 +3,15 @@
 #include <cmath>
 #include <fstream>
 #include <sstream>
-#include <ostream>
 #include <cstring>
 #include <algorithm>
+#include <cstdio>
+#include <random>
 #include "lang_model.hpp"
+#include "lang_model_delta.hpp"
+#include "thread_pool.hpp"
+#include "count_runs.hpp"
+#include "metrics.hpp"
 
 #include <contrib/cityhash/city.h>
 
@@ -16,51 +21,69 @@
 
 namespace NJamSpell {
 
-class MemStream: public std::basic_streambuf<char> {
-public:
-    MemStream(char* buff, long maxSize)
-        : Buff(buff)
-        , MaxSize(maxSize)
-        , Pos(0)
-    {
-    }
+// N-gram keys are hashed as the raw bytes of their word ids, laid out
+// exactly as HANDYPACK would serialize them. Building them on the stack keeps
+// lookups free of shared state, so a loaded model can be queried concurrently.
+constexpr size_t MAX_GRAM_KEY_SIZE = 3 * sizeof(TWordId);
 
-	std::streamsize xsputn(const char* s, std::streamsize n) override {
-        if (n <= 0) {
-            return n;
-        }
-        long toCopy = std::min<long>(n, MaxSize - Pos);
-        memcpy(Buff + Pos, s, toCopy);
-        Pos += toCopy;
-        return n;
-    }
-    void Reset() {
-        Pos = 0;
-    }
-    long Size() const {
-        return Pos;
-    }
-private:
-    char* Buff;
-    long MaxSize;
-    long Pos;
-};
+inline size_t PackGramKey(TGram1Key key, char* buff) {
+    memcpy(buff, &key, sizeof(TWordId));
+    return sizeof(TWordId);
+}
+
+inline size_t PackGramKey(const TGram2Key& key, char* buff) {
+    memcpy(buff, &key.first, sizeof(TWordId));
+    memcpy(buff + sizeof(TWordId), &key.second, sizeof(TWordId));
+    return 2 * sizeof(TWordId);
+}
 
-template<typename T>
-std::string DumpKey(const T& key) {
-    std::stringbuf buf;
-    std::ostream out(&buf);
-    NHandyPack::Dump(out, key);
-    return buf.str();
+// HANDYPACK writes tuple elements last to first.
+inline size_t PackGramKey(const TGram3Key& key, char* buff) {
+    memcpy(buff, &std::get<2>(key), sizeof(TWordId));
+    memcpy(buff + sizeof(TWordId), &std::get<1>(key), sizeof(TWordId));
+    memcpy(buff + 2 * sizeof(TWordId), &std::get<0>(key), sizeof(TWordId));
+    return 3 * sizeof(TWordId);
 }
 
-template<typename T>
-void PrepareNgramKeys(const T& grams, std::vector<std::string>& keys) {
-    for (auto&& it: grams) {
-        keys.push_back(DumpKey(it.first));
+// Models whose word ids fit in PACKED_GRAM_ID_BITS (after adding one) key
+// n-grams by a single integer instead: id + 1 of each word in its own bit
+// field, zero for missing words, so that 1-, 2- and 3-grams never collide.
+// Those keys take the integer perfect hash and a multiplicative fingerprint
+// rather than two hashes over the bytes.
+constexpr size_t PACKED_GRAM_ID_BITS = 21;
+constexpr size_t MAX_PACKED_GRAM_WORDS = (size_t(1) << PACKED_GRAM_ID_BITS) - 1;
+
+inline uint64_t PackedGramKey(TGram1Key key) {
+    return uint64_t(key) + 1;
+}
+
+inline uint64_t PackedGramKey(const TGram2Key& key) {
+    return (PackedGramKey(key.first) << PACKED_GRAM_ID_BITS) | PackedGramKey(key.second);
+}
+
+inline uint64_t PackedGramKey(const TGram3Key& key) {
+    return (PackedGramKey(TGram2Key(std::get<0>(key), std::get<1>(key))) << PACKED_GRAM_ID_BITS) |
+           PackedGramKey(std::get<2>(key));
+}
+
+// The same for a key written by PackGramKey().
+static uint64_t PackedGramKey(const char* key, size_t size) {
+    TWordId ids[3];
+    memcpy(ids, key, size);
+    switch (size / sizeof(TWordId)) {
+        case 1:
+            return PackedGramKey(ids[0]);
+        case 2:
+            return PackedGramKey(TGram2Key(ids[0], ids[1]));
+        default:
+            return PackedGramKey(TGram3Key(ids[2], ids[1], ids[0]));
     }
 }
 
+inline uint16_t PackedGramFingerprint(uint64_t key) {
+    return uint16_t((key * 0x9E3779B97F4A7C15ULL) >> 48);
+}
+
 static const uint32_t MAX_REAL_NUM = 268435456;
 static const uint32_t MAX_AVAILABLE_NUM = 65536;
 
@@ -79,26 +102,314 @@ uint32_t UnpackInt32(uint16_t num) {
     return uint32_t(ceil(r));
 }
 
-template<typename T>
-void InitializeBuckets(const T& grams, TPerfectHash& ph, std::vector<std::pair<uint16_t, uint16_t>>& buckets) {
-    for (auto&& it: grams) {
-        std::string key = DumpKey(it.first);
-        uint32_t bucket = ph.Hash(key);
-        if (bucket >= buckets.size()) {
-            std::cerr << bucket << " " << buckets.size() << "\n";
+// UnpackInt32() of every packed count. Lookups only ever decode through it.
+static std::vector<TCount> BuildUnpackTable() {
+    std::vector<TCount> table(MAX_AVAILABLE_NUM);
+    for (uint32_t i = 0; i < MAX_AVAILABLE_NUM; ++i) {
+        table[i] = UnpackInt32(uint16_t(i));
+    }
+    return table;
+}
+
+static const std::vector<TCount> UNPACKED_COUNTS = BuildUnpackTable();
+
+// Counts of the 8-bit codes: up to EXACT_COUNT_CODES they are the codes
+// themselves, above they grow geometrically up to MAX_REAL_NUM, about 8%
+// apart.
+static const uint32_t EXACT_COUNT_CODES = 64;
+static const uint32_t COUNT_CODES = 256;
+
+static std::vector<TCount> BuildCodeCounts() {
+    std::vector<TCount> counts(COUNT_CODES);
+    const uint32_t steps = COUNT_CODES - 1 - EXACT_COUNT_CODES;
+    const double ratio = pow(double(MAX_REAL_NUM) / EXACT_COUNT_CODES, 1.0 / steps);
+    for (uint32_t code = 0; code < COUNT_CODES; ++code) {
+        counts[code] = code <= EXACT_COUNT_CODES ? code
+                           : TCount(round(EXACT_COUNT_CODES * pow(ratio, code - EXACT_COUNT_CODES)));
+    }
+    return counts;
+}
+
+static const std::vector<TCount> CODE_COUNTS = BuildCodeCounts();
+
+// The code of the nearest count in log scale; monotonic, so 8-bit counts
+// keep the order of the counts the collision checks of Gram2LogProb() and
+// Gram3LogProb() rely on.
+uint8_t QuantizeCount(TCount count) {
+    auto it = std::lower_bound(CODE_COUNTS.begin(), CODE_COUNTS.end(), count);
+    if (it == CODE_COUNTS.end()) {
+        return uint8_t(COUNT_CODES - 1);
+    }
+    size_t code = it - CODE_COUNTS.begin();
+    if (code > 0 && *it != count && double(count) * count < double(*it) * *(it - 1)) {
+        code -= 1;
+    }
+    return uint8_t(code);
+}
+
+// PackInt32() of the count of every code, what lookups return for them.
+static std::vector<TPackedCount> BuildPackedCodes() {
+    std::vector<TPackedCount> table(COUNT_CODES);
+    for (uint32_t code = 0; code < COUNT_CODES; ++code) {
+        table[code] = PackInt32(CODE_COUNTS[code]);
+    }
+    return table;
+}
+
+static const std::vector<TPackedCount> PACKED_CODES = BuildPackedCodes();
+
+// Keys are handed to the perfect hash ordered by shard, then by key. Both
+// training modes produce that order, so they build identical models, and
+// neither depends on the number of threads.
+constexpr size_t TRAIN_SHARDS_BITS = 6;
+constexpr size_t TRAIN_SHARDS = size_t(1) << TRAIN_SHARDS_BITS;
+
+template<typename TKey, typename THash>
+size_t GramShard(const TKey& key) {
+    // hash maps use the low bits of the same hash, so take the high ones
+    uint64_t hash = uint64_t(THash()(key)) * 0x9E3779B97F4A7C15ULL;
+    return hash >> (64 - TRAIN_SHARDS_BITS);
+}
+
+template<typename TKey, typename THash>
+struct TGramLess {
+    bool operator()(const TKey& a, const TKey& b) const {
+        size_t shardA = GramShard<TKey, THash>(a);
+        size_t shardB = GramShard<TKey, THash>(b);
+        if (shardA != shardB) {
+            return shardA < shardB;
+        }
+        return a < b;
+    }
+};
+
+template<typename TKey>
+using TGramCounts = std::vector<std::pair<TKey, TCount>>;
+
+// Serialized keys of one n-gram order and their counts, in hashing order.
+class TGramTable {
+public:
+    template<typename TKey>
+    void Add(const TKey& key, TCount count) {
+        char buff[MAX_GRAM_KEY_SIZE];
+        KeySize = PackGramKey(key, buff);
+        Keys.insert(Keys.end(), buff, buff + KeySize);
+        Counts.push_back(count);
+    }
+    size_t Size() const {
+        return Counts.size();
+    }
+    const char* Key(size_t i) const {
+        return &Keys[i * KeySize];
+    }
+    // Drops the n-grams seen fewer than minCount times, keeping the order.
+    void Prune(TCount minCount) {
+        size_t kept = 0;
+        for (size_t i = 0; i < Size(); ++i) {
+            if (Counts[i] >= minCount) {
+                std::copy(Key(i), Key(i) + KeySize, &Keys[kept * KeySize]);
+                Counts[kept] = Counts[i];
+                kept += 1;
+            }
         }
-        assert(bucket < buckets.size());
-        std::pair<uint16_t, uint16_t> data;
-        data.first = CityHash16(key);
-        data.second = PackInt32(it.second);
-        buckets[bucket] = data;
+        Keys.resize(kept * KeySize);
+        Counts.resize(kept);
+    }
+    size_t KeySize = 0;
+    std::vector<char> Keys;
+    std::vector<TCount> Counts;
+};
+
+static void WriteBucket(uint8_t* data, const TBucketFormat& format, uint16_t fingerprint, TCount count) {
+    if (format.FingerprintBits == 16) {
+        memcpy(data, &fingerprint, sizeof(fingerprint));
+        data += sizeof(fingerprint);
+    } else {
+        *data++ = uint8_t(fingerprint >> 8);
+    }
+    if (format.CountBits == 16) {
+        TPackedCount packed = PackInt32(count);
+        memcpy(data, &packed, sizeof(packed));
+    } else {
+        *data = QuantizeCount(count);
     }
 }
 
-bool TLangModel::Train(const std::string& fileName, const std::string& alphabetFile) {
+inline TPackedCount TLangModel::ReadBucket(uint32_t bucket, uint16_t fingerprint) const {
+    assert(bucket < PerfectHash.BucketsNumber());
+    const uint8_t* data = Buckets.data() + size_t(bucket) * BucketFormat.Width();
+    uint16_t stored;
+    if (BucketFormat.FingerprintBits == 16) {
+        memcpy(&stored, data, sizeof(stored));
+        data += sizeof(stored);
+    } else {
+        stored = *data++;
+        fingerprint >>= 8;
+    }
+    if (stored != fingerprint) {
+        return TPackedCount();
+    }
+    if (BucketFormat.CountBits == 16) {
+        TPackedCount count;
+        memcpy(&count, data, sizeof(count));
+        return count;
+    }
+    return PACKED_CODES[*data];
+}
+
+// Prunes the tables (unigrams first) and hashes what is left into buckets
+// of TrainBucketFormat.
+bool TLangModel::BuildGramBuckets(std::vector<TGramTable*> tables, TThreadPool& pool) {
+    const TCount minCounts[] = {1, PruneParams.MinGram2Count, PruneParams.MinGram3Count};
+    for (size_t order = 1; order < tables.size() && order < 3; ++order) {
+        if (minCounts[order] > 1) {
+            const size_t before = tables[order]->Size();
+            tables[order]->Prune(minCounts[order]);
+            std::cerr << "[info] ngrams" << order + 1 << " seen less than " << minCounts[order] << " times pruned: "
+                      << before << " -> " << tables[order]->Size() << "\n";
+        }
+    }
+    const TPerfectHashParams& params = PerfectHashParams;
+    const bool packedKeys = PackedGramKeys;
+    TPerfectHash& perfectHash = PerfectHash;
+    size_t total = 0;
+    for (auto table: tables) {
+        total += table->Size();
+    }
+    std::cerr << "[info] total: " << total << "\n";
+    std::cerr << "[info] generating perf hash (lambda " << params.Lambda << ", alpha " << params.Alpha
+              << ", seed " << params.Seed << ", partitions " << params.Partitions
+              << (packedKeys ? ", integer keys" : ", byte keys") << ")" << std::endl;
+    bool hashBuilt = false;
+    if (packedKeys) {
+        std::vector<uint64_t> keys;
+        keys.reserve(total);
+        for (auto table: tables) {
+            for (size_t i = 0; i < table->Size(); ++i) {
+                keys.push_back(PackedGramKey(table->Key(i), table->KeySize));
+            }
+        }
+        hashBuilt = perfectHash.Init(keys, params, &pool);
+    } else {
+        std::vector<TPerfectHash::TKeyRef> keys;
+        keys.reserve(total);
+        for (auto table: tables) {
+            for (size_t i = 0; i < table->Size(); ++i) {
+                keys.push_back(TPerfectHash::TKeyRef(table->Key(i), table->KeySize));
+            }
+        }
+        hashBuilt = perfectHash.Init(keys, params, &pool);
+    }
+    if (!hashBuilt) {
+        std::cerr << "[error] failed to build perfect hash" << std::endl;
+        return false;
+    }
+    std::cerr << "[info] finished, buckets: " << perfectHash.BucketsNumber() << "\n";
+
+    // every key owns a distinct bucket, so ranges are filled in parallel
+    const TBucketFormat format = TrainBucketFormat;
+    const size_t width = format.Width();
+    std::vector<uint8_t> buckets(size_t(perfectHash.BucketsNumber()) * width);
+    for (auto table: tables) {
+        const size_t size = table->Size();
+        ParallelFor(pool, TRAIN_SHARDS, [&](size_t part) {
+            const size_t end = size * (part + 1) / TRAIN_SHARDS;
+            for (size_t i = size * part / TRAIN_SHARDS; i < end; ++i) {
+                const char* key = table->Key(i);
+                uint32_t bucket;
+                uint16_t fingerprint;
+                if (packedKeys) {
+                    uint64_t packedKey = PackedGramKey(key, table->KeySize);
+                    bucket = perfectHash.Hash(packedKey);
+                    fingerprint = PackedGramFingerprint(packedKey);
+                } else {
+                    bucket = perfectHash.Hash(key, table->KeySize);
+                    fingerprint = CityHash16(key, table->KeySize);
+                }
+                assert(size_t(bucket) * width < buckets.size());
+                WriteBucket(&buckets[size_t(bucket) * width], format, fingerprint, table->Counts[i]);
+            }
+        });
+    }
+    Buckets.Assign(std::move(buckets));
+    BucketFormat = format;
+    std::cerr << "[info] buckets filled, " << int(format.FingerprintBits) << "-bit fingerprints, "
+              << int(format.CountBits) << "-bit counts, " << GetBucketsMemory() << " bytes" << std::endl;
+    std::cerr << "[info] random trigrams matching a bucket: " << 100.0 * EstimateFalsePositiveRate() << "%" << std::endl;
+    return true;
+}
+
+static uint64_t MakeTrainCheckSum(uint64_t trainStartTime, size_t grams1, size_t grams2, size_t grams3,
+                                  size_t buckets, size_t textSize, size_t sentences)
+{
+    std::stringbuf checkSumBuf;
+    std::ostream checkSumOut(&checkSumBuf);
+    NHandyPack::Dump(checkSumOut, trainStartTime, grams1, grams2, grams3, buckets, textSize, sentences);
+    std::string checkSumStr = checkSumBuf.str();
+    return CityHash64(&checkSumStr[0], checkSumStr.size());
+}
+
+static size_t TrainThreadsCount(size_t threadsCount) {
+    if (threadsCount == 0) {
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return threadsCount;
+}
+
+// Each worker counts its share of the sentences into maps sharded like
+// GramShard(); shard i of every worker is then merged by one task.
+template<typename TKey, typename THash>
+class TShardedGramCounter {
+public:
+    TShardedGramCounter()
+        : Shards(TRAIN_SHARDS)
+    {
+    }
+    void Add(const TKey& key) {
+        Shards[GramShard<TKey, THash>(key)][key] += 1;
+    }
+    std::unordered_map<TKey, TCount, THash>& GetShard(size_t shard) {
+        return Shards[shard];
+    }
+private:
+    std::vector<std::unordered_map<TKey, TCount, THash>> Shards;
+};
+
+template<typename TKey, typename THash>
+TGramTable MergeGramCounters(std::vector<TShardedGramCounter<TKey, THash>>& counters, TThreadPool& pool) {
+    std::vector<TGramCounts<TKey>> shards(TRAIN_SHARDS);
+    ParallelFor(pool, TRAIN_SHARDS, [&](size_t shard) {
+        std::unordered_map<TKey, TCount, THash> merged;
+        merged.swap(counters[0].GetShard(shard));
+        for (size_t i = 1; i < counters.size(); ++i) {
+            std::unordered_map<TKey, TCount, THash> counts;
+            counts.swap(counters[i].GetShard(shard));
+            for (auto&& it: counts) {
+                merged[it.first] += it.second;
+            }
+        }
+        shards[shard].assign(merged.begin(), merged.end());
+        std::sort(shards[shard].begin(), shards[shard].end());
+    });
+    TGramTable table;
+    for (auto&& shard: shards) {
+        for (auto&& it: shard) {
+            table.Add(it.first, it.second);
+        }
+        TGramCounts<TKey>().swap(shard);
+    }
+    return table;
+}
+
+TLangModel::TLangModel() = default;
+
+TLangModel::~TLangModel() = default;
+
+bool TLangModel::Train(const std::string& fileName, const std::string& alphabetFile, size_t threadsCount) {
 
     std::cerr << "[info] loading text" << std::endl;
     uint64_t trainStarTime = GetCurrentTimeMs();
+    Clear();
     if (!Tokenizer.LoadAlphabet(alphabetFile)) {
         std::cerr << "[error] failed to load alphabet" << std::endl;
         return false;
@@ -118,8 +429,12 @@ bool TLangModel::Train(const std::string& fileName, const std::string& alphabetF
     std::cerr << "[info] converting to ids" << std::endl;
 
     TIdSentences sentenceIds = ConvertToIds(sentences);
+    BuildVocabulary();
+    PackedGramKeys = GetWordsCount() <= MAX_PACKED_GRAM_WORDS;
 
     assert(sentences.size() == sentenceIds.size());
+    const size_t textSize = trainText.size();
+    const size_t sentencesCount = sentences.size();
     {
         std::wstring tmp;
         trainText.swap(tmp);
@@ -129,74 +444,285 @@ bool TLangModel::Train(const std::string& fileName, const std::string& alphabetF
         sentences.swap(tmp);
     }
 
-    std::unordered_map<TGram1Key, TCount> grams1;
-    std::unordered_map<TGram2Key, TCount, TGram2KeyHash> grams2;
-    std::unordered_map<TGram3Key, TCount, TGram3KeyHash> grams3;
+    threadsCount = TrainThreadsCount(threadsCount);
+    TThreadPool pool(threadsCount);
+
+    using TGrams1Counter = TShardedGramCounter<TGram1Key, std::hash<TGram1Key>>;
+    using TGrams2Counter = TShardedGramCounter<TGram2Key, TGram2KeyHash>;
+    using TGrams3Counter = TShardedGramCounter<TGram3Key, TGram3KeyHash>;
+    std::vector<TGrams1Counter> counters1(threadsCount);
+    std::vector<TGrams2Counter> counters2(threadsCount);
+    std::vector<TGrams3Counter> counters3(threadsCount);
+    std::vector<uint64_t> totalWords(threadsCount, 0);
+
+    std::cerr << "[info] generating N-grams " << sentenceIds.size() << " on " << threadsCount << " threads" << std::endl;
+    const size_t total = sentenceIds.size();
+    ParallelFor(pool, threadsCount, [&](size_t worker) {
+        const size_t begin = total * worker / threadsCount;
+        const size_t end = total * (worker + 1) / threadsCount;
+        TGrams1Counter& grams1 = counters1[worker];
+        TGrams2Counter& grams2 = counters2[worker];
+        TGrams3Counter& grams3 = counters3[worker];
+        uint64_t lastTime = GetCurrentTimeMs();
+        for (size_t i = begin; i < end; ++i) {
+            const TWordIds& words = sentenceIds[i];
+
+            for (auto w: words) {
+                grams1.Add(w);
+                totalWords[worker] += 1;
+            }
+
+            for (ssize_t j = 0; j < (ssize_t)words.size() - 1; ++j) {
+                grams2.Add(TGram2Key(words[j], words[j+1]));
+            }
+            for (ssize_t j = 0; j < (ssize_t)words.size() - 2; ++j) {
+                grams3.Add(TGram3Key(words[j], words[j+1], words[j+2]));
+            }
+            uint64_t currTime = GetCurrentTimeMs();
+            if (currTime - lastTime > 4000) {
+                std::ostringstream progress;
+                progress << "[info] worker " << worker << ": processed "
+                         << (100.0 * float(i - begin) / float(end - begin)) << "%\n";
+                std::cerr << progress.str();
+                lastTime = currTime;
+            }
+        }
+    });
+    {
+        TIdSentences tmp;
+        sentenceIds.swap(tmp);
+    }
+    for (auto w: totalWords) {
+        TotalWords += w;
+    }
 
-    std::cerr << "[info] generating N-grams " << sentenceIds.size() << std::endl;
-    uint64_t lastTime = GetCurrentTimeMs();
-    size_t total = sentenceIds.size();
-    for (size_t i = 0; i < total; ++i) {
-        const TWordIds& words = sentenceIds[i];
+    std::cerr << "[info] merging N-gram counts" << std::endl;
+    TGramTable grams1 = MergeGramCounters(counters1, pool);
+    TGramTable grams2 = MergeGramCounters(counters2, pool);
+    TGramTable grams3 = MergeGramCounters(counters3, pool);
+
+    VocabSize = grams1.Size();
+
+    std::cerr << "[info] ngrams1: " << grams1.Size() << "\n";
+    std::cerr << "[info] ngrams2: " << grams2.Size() << "\n";
+    std::cerr << "[info] ngrams3: " << grams3.Size() << "\n";
+
+    if (!BuildGramBuckets({&grams1, &grams2, &grams3}, pool)) {
+        return false;
+    }
 
-        for (auto w: words) {
-            grams1[w] += 1;
-            TotalWords += 1;
+    CheckSum = MakeTrainCheckSum(trainStarTime, grams1.Size(), grams2.Size(), grams3.Size(),
+                                 Buckets.size(), textSize, sentencesCount);
+    BuildScoreTables();
+    return true;
+}
+
+// Text is cut after the last sentence end in the buffer, where the
+// tokenizer would start a new sentence anyway. Input without any is cut
+// after whitespace instead.
+static size_t FindChunkEnd(const std::string& text) {
+    size_t pos = text.find_last_of(".?!");
+    if (pos == std::string::npos) {
+        pos = text.find_last_of(" \t\r\n");
+    }
+    return pos == std::string::npos ? 0 : pos + 1;
+}
+
+template<typename TKey, typename THash>
+class TStreamingGramCounter {
+public:
+    using TRuns = TCountRuns<TKey, TCount, TGramLess<TKey, THash>>;
+
+    TStreamingGramCounter(const std::string& runsPrefix, size_t maxBytes)
+        : Runs(runsPrefix)
+        , Capacity(std::max(size_t(1024), maxBytes / sizeof(typename TRuns::TRecord)))
+    {
+        Buffer.reserve(Capacity);
+    }
+    bool Add(const TKey& key) {
+        Buffer.push_back(typename TRuns::TRecord(key, 1));
+        if (Buffer.size() < Capacity) {
+            return true;
+        }
+        // keep collapsing in memory while that frees at least half the buffer
+        TRuns::Collapse(Buffer);
+        if (Buffer.size() > Capacity / 2) {
+            return Runs.Spill(Buffer);
         }
+        return true;
+    }
+    size_t RunsCount() const {
+        return Runs.RunsCount();
+    }
+    bool Finish(TGramTable& table) {
+        if (Runs.RunsCount() == 0) {
+            TRuns::Collapse(Buffer);
+            for (auto&& it: Buffer) {
+                table.Add(it.first, it.second);
+            }
+        } else if (!Buffer.empty() && !Runs.Spill(Buffer)) {
+            return false;
+        }
+        std::vector<typename TRuns::TRecord>().swap(Buffer);
+        return Runs.Merge([&table](const TKey& key, TCount count) {
+            table.Add(key, count);
+        });
+    }
+private:
+    TRuns Runs;
+    size_t Capacity;
+    std::vector<typename TRuns::TRecord> Buffer;
+};
 
-        for (ssize_t j = 0; j < (ssize_t)words.size() - 1; ++j) {
-            TGram2Key key(words[j], words[j+1]);
-            grams2[key] += 1;
+bool TLangModel::TrainStreaming(const std::string& fileName, const std::string& alphabetFile,
+                                const std::string& tempPrefix, size_t maxMemoryMb, size_t threadsCount)
+{
+    std::cerr << "[info] streaming text" << std::endl;
+    uint64_t trainStarTime = GetCurrentTimeMs();
+    Clear();
+    if (!Tokenizer.LoadAlphabet(alphabetFile)) {
+        std::cerr << "[error] failed to load alphabet" << std::endl;
+        return false;
+    }
+    std::ifstream in(fileName, std::ios::binary);
+    if (!in.is_open()) {
+        std::cerr << "[error] failed to open " << fileName << std::endl;
+        return false;
+    }
+    in.seekg(0, std::ios::end);
+    const uint64_t fileSize = in.tellg();
+    in.seekg(0, std::ios::beg);
+
+    // 2-grams and 3-grams share the memory budget, 3-grams being the larger
+    const size_t maxBytes = maxMemoryMb << 20;
+    TStreamingGramCounter<TGram2Key, TGram2KeyHash> grams2Counter(tempPrefix + ".grams2", maxBytes / 3);
+    TStreamingGramCounter<TGram3Key, TGram3KeyHash> grams3Counter(tempPrefix + ".grams3", maxBytes * 2 / 3);
+    std::vector<TCount> grams1Counts;
+
+    const size_t READ_CHUNK_SIZE = 16 << 20;
+    std::vector<char> readBuffer(READ_CHUNK_SIZE);
+    std::string pending;
+    uint64_t bytesRead = 0;
+    size_t textSize = 0;
+    size_t sentencesCount = 0;
+    uint64_t lastTime = GetCurrentTimeMs();
+    bool ok = true;
+    for (bool last = false; !last && ok;) {
+        in.read(readBuffer.data(), readBuffer.size());
+        size_t got = in.gcount();
+        last = got < readBuffer.size();
+        bytesRead += got;
+        pending.append(readBuffer.data(), got);
+        size_t chunkEnd = last ? pending.size() : FindChunkEnd(pending);
+        if (chunkEnd == 0) {
+            continue;
         }
-        for (ssize_t j = 0; j < (ssize_t)words.size() - 2; ++j) {
-            TGram3Key key(words[j], words[j+1], words[j+2]);
-            grams3[key] += 1;
+
+        std::wstring text = UTF8ToWide(pending.substr(0, chunkEnd));
+        pending.erase(0, chunkEnd);
+        ToLower(text);
+        TSentences sentences = Tokenizer.Process(text);
+        textSize += text.size();
+        sentencesCount += sentences.size();
+
+        for (auto&& sentence: sentences) {
+            TWordIds words;
+            words.reserve(sentence.size());
+            for (auto&& w: sentence) {
+                words.push_back(GetWordId(w));
+            }
+            grams1Counts.resize(LastWordID, 0);
+            for (auto w: words) {
+                grams1Counts[w] += 1;
+                TotalWords += 1;
+            }
+            for (ssize_t j = 0; j < (ssize_t)words.size() - 1 && ok; ++j) {
+                ok = grams2Counter.Add(TGram2Key(words[j], words[j+1]));
+            }
+            for (ssize_t j = 0; j < (ssize_t)words.size() - 2 && ok; ++j) {
+                ok = grams3Counter.Add(TGram3Key(words[j], words[j+1], words[j+2]));
+            }
         }
+
         uint64_t currTime = GetCurrentTimeMs();
-        if (currTime - lastTime > 4000) {
-            std::cerr << "[info] processed " << (100.0 * float(i) / float(total)) << "%" << std::endl;
+        if (currTime - lastTime > 4000 || last) {
+            std::cerr << "[info] processed " << (fileSize ? 100.0 * double(bytesRead) / double(fileSize) : 100.0)
+                      << "%, " << LastWordID << " words, "
+                      << grams2Counter.RunsCount() + grams3Counter.RunsCount() << " runs on disk" << std::endl;
             lastTime = currTime;
         }
     }
+    if (!ok) {
+        std::cerr << "[error] failed to write n-gram runs at " << tempPrefix << std::endl;
+        return false;
+    }
+    if (sentencesCount == 0) {
+        std::cerr << "[error] no sentences" << std::endl;
+        return false;
+    }
+    std::cerr << "[info] " << sentencesCount << " sentences loaded" << std::endl;
 
-    VocabSize = grams1.size();
-
-    std::cerr << "[info] generating keys" << std::endl;
+    BuildVocabulary();
+    PackedGramKeys = GetWordsCount() <= MAX_PACKED_GRAM_WORDS;
 
+    std::cerr << "[info] merging N-gram counts" << std::endl;
+    TGramTable grams1;
     {
-        std::vector<std::string> keys;
-        keys.reserve(grams1.size() + grams2.size() + grams3.size());
-
-        std::cerr << "[info] ngrams1: " << grams1.size() << "\n";
-        std::cerr << "[info] ngrams2: " << grams2.size() << "\n";
-        std::cerr << "[info] ngrams3: " << grams3.size() << "\n";
-        std::cerr << "[info] total: " << grams3.size() + grams2.size() + grams1.size() << "\n";
+        std::vector<TGram1Key> ids(grams1Counts.size());
+        for (size_t i = 0; i < ids.size(); ++i) {
+            ids[i] = i;
+        }
+        std::sort(ids.begin(), ids.end(), TGramLess<TGram1Key, std::hash<TGram1Key>>());
+        for (auto id: ids) {
+            grams1.Add(id, grams1Counts[id]);
+        }
+        std::vector<TCount>().swap(grams1Counts);
+    }
+    TGramTable grams2;
+    TGramTable grams3;
+    if (!grams2Counter.Finish(grams2) || !grams3Counter.Finish(grams3)) {
+        std::cerr << "[error] failed to merge n-gram runs at " << tempPrefix << std::endl;
+        return false;
+    }
 
-        PrepareNgramKeys(grams1, keys);
-        PrepareNgramKeys(grams2, keys);
-        PrepareNgramKeys(grams3, keys);
+    VocabSize = grams1.Size();
 
-        std::cerr << "[info] generating perf hash" << std::endl;
+    std::cerr << "[info] ngrams1: " << grams1.Size() << "\n";
+    std::cerr << "[info] ngrams2: " << grams2.Size() << "\n";
+    std::cerr << "[info] ngrams3: " << grams3.Size() << "\n";
 
-        PerfectHash.Init(keys);
+    TThreadPool pool(TrainThreadsCount(threadsCount));
+    if (!BuildGramBuckets({&grams1, &grams2, &grams3}, pool)) {
+        return false;
     }
 
-    std::cerr << "[info] finished, buckets: " << PerfectHash.BucketsNumber() << "\n";
+    CheckSum = MakeTrainCheckSum(trainStarTime, grams1.Size(), grams2.Size(), grams3.Size(),
+                                 Buckets.size(), textSize, sentencesCount);
+    BuildScoreTables();
+    return true;
+}
+
+// Whether all words of the key are words of the model itself, the only
+// ones its tables may hold; unknown ids never are.
+inline bool IsBaseGram(TGram1Key key, TWordId baseWords) {
+    return key < baseWords;
+}
 
-    Buckets.resize(PerfectHash.BucketsNumber());
-    InitializeBuckets(grams1, PerfectHash, Buckets);
-    InitializeBuckets(grams2, PerfectHash, Buckets);
-    InitializeBuckets(grams3, PerfectHash, Buckets);
+inline bool IsBaseGram(const TGram2Key& key, TWordId baseWords) {
+    return key.first < baseWords && key.second < baseWords;
+}
 
-    std::cerr << "[info] buckets filled" << std::endl;
+inline bool IsBaseGram(const TGram3Key& key, TWordId baseWords) {
+    return std::get<0>(key) < baseWords && std::get<1>(key) < baseWords && std::get<2>(key) < baseWords;
+}
 
-    std::stringbuf checkSumBuf;
-    std::ostream checkSumOut(&checkSumBuf);
-    NHandyPack::Dump(checkSumOut, trainStarTime, grams1.size(), grams2.size(),
-                    grams3.size(), Buckets.size(), trainText.size(), sentences.size());
-    std::string checkSumStr = checkSumBuf.str();
-    CheckSum = CityHash64(&checkSumStr[0], checkSumStr.size());
-    return true;
+// A packed count of the model plus a count of the delta, packed again.
+static TPackedCount AddDeltaCount(TPackedCount packed, TCount count) {
+    if (count == 0) {
+        return packed;
+    }
+    uint64_t sum = uint64_t(UNPACKED_COUNTS[packed]) + count;
+    return PackInt32(uint32_t(std::min<uint64_t>(sum, MAX_REAL_NUM)));
 }
 
 double TLangModel::Score(const TWords& words) const {
@@ -213,13 +739,245 @@ double TLangModel::Score(const TWords& words) const {
 
     double result = 0;
     for (size_t i = 0; i < sentence.size() - 2; ++i) {
-        result += log(GetGram1Prob(sentence[i]));
-        result += log(GetGram2Prob(sentence[i], sentence[i + 1]));
-        result += log(GetGram3Prob(sentence[i], sentence[i + 1], sentence[i + 2]));
+        result += GetGram1LogProb(sentence[i]);
+        result += GetGram2LogProb(sentence[i], sentence[i + 1]);
+        result += GetGram3LogProb(sentence[i], sentence[i + 1], sentence[i + 2]);
     }
+    AddMetric(ECounter::GramProbes, 5 * (sentence.size() - 2));
+    return result;
+}
+
+TScoreContext TLangModel::PrepareScoreContext(const TWords& words, size_t position) const {
+    assert(position < words.size());
+    TScoreContext context;
+    TWordIds& sentence = context.Sentence;
+    for (auto&& w: words) {
+        sentence.push_back(GetWordIdNoCreate(w));
+    }
+    sentence.push_back(UnknownWordId);
+    sentence.push_back(UnknownWordId);
+
+    const size_t p = position;
+    context.Position = p;
+    uint64_t probes = 0;
+    for (size_t i = 0; i < sentence.size() - 2; ++i) {
+        if (i != p) {
+            context.FixedScore += GetGram1LogProb(sentence[i]);
+            probes += 1;
+        }
+        if (i != p && i + 1 != p) {
+            context.FixedScore += GetGram2LogProb(sentence[i], sentence[i + 1]);
+            probes += 2;
+        }
+        if (i > p || i + 2 < p) {
+            context.FixedScore += GetGram3LogProb(sentence[i], sentence[i + 1], sentence[i + 2]);
+            probes += 2;
+        }
+    }
+    if (p >= 1) {
+        context.PrevGram1Count = GetGram1HashCount(sentence[p - 1]);
+        probes += 1;
+    }
+    if (p >= 2) {
+        context.PrevGram2Count = GetGram2HashCount(sentence[p - 2], sentence[p - 1]);
+        probes += 1;
+    }
+    AddMetric(ECounter::GramProbes, probes);
+    return context;
+}
+
+double TLangModel::Score(const TScoreContext& context, TWordId candidate) const {
+    double result = 0;
+    Score(context, &candidate, 1, &result);
     return result;
 }
 
+// Keys probed for every candidate c at position p, in this order:
+// (c), (c, p+1), (c, p+1, p+2), (p-1, c), (p-1, c, p+1), (p-2, p-1, c).
+constexpr size_t SCORE_PROBES = 6;
+constexpr size_t SCORE_BLOCK = 16; // candidates prefetched together
+
+struct TGramProbe {
+    char Key[MAX_GRAM_KEY_SIZE]; // with byte keys
+    uint64_t PackedKey;          // with packed keys
+    uint32_t Size; // 0 if the key has an unknown word
+    uint32_t Bucket;
+    TPerfectHash::TSlot Slot;
+};
+
+template<typename TKey>
+inline void SetProbe(TGramProbe& probe, const TKey& key, bool known, bool packed) {
+    if (!known) {
+        probe.Size = 0;
+    } else if (packed) {
+        probe.PackedKey = PackedGramKey(key);
+        probe.Size = sizeof(uint64_t);
+    } else {
+        probe.Size = PackGramKey(key, probe.Key);
+    }
+}
+
+void TLangModel::Score(const TScoreContext& context, const TWordId* candidates, size_t count, double* scores) const {
+    const TWordIds& s = context.Sentence;
+    const size_t p = context.Position;
+    const TWordId unknown = UnknownWordId;
+    const TWordId next = s[p + 1];
+    const TWordId next2 = s[p + 2];
+    const TWordId prev = p >= 1 ? s[p - 1] : unknown;
+    const TWordId prev2 = p >= 2 ? s[p - 2] : unknown;
+    // ids from here on, unknown included, are not in the tables
+    const TWordId words = TWordId(Vocabulary.Size());
+
+    const bool packed = PackedGramKeys;
+    const size_t width = BucketFormat.Width();
+    TGramProbe probes[SCORE_BLOCK * SCORE_PROBES];
+    TPackedCount counts[SCORE_BLOCK * SCORE_PROBES];
+    uint64_t probesMade = 0;
+    for (size_t start = 0; start < count; start += SCORE_BLOCK) {
+        const size_t blockSize = std::min(SCORE_BLOCK, count - start);
+        const size_t probesCount = blockSize * SCORE_PROBES;
+
+        for (size_t i = 0; i < blockSize; ++i) {
+            const TWordId c = candidates[start + i];
+            const bool known = c < words;
+            TGramProbe* probe = probes + i * SCORE_PROBES;
+            SetProbe(probe[0], TGram1Key(c), known, packed);
+            SetProbe(probe[1], TGram2Key(c, next), known && next < words, packed);
+            SetProbe(probe[2], TGram3Key(c, next, next2), known && next < words && next2 < words, packed);
+            SetProbe(probe[3], TGram2Key(prev, c), known && prev < words, packed);
+            SetProbe(probe[4], TGram3Key(prev, c, next), known && prev < words && next < words, packed);
+            SetProbe(probe[5], TGram3Key(prev2, prev, c), known && prev2 < words && prev < words, packed);
+        }
+        for (size_t j = 0; j < probesCount; ++j) {
+            TGramProbe& probe = probes[j];
+            if (probe.Size) {
+                probe.Slot = packed ? PerfectHash.Slot(probe.PackedKey) : PerfectHash.Slot(probe.Key, probe.Size);
+                Prefetch(PerfectHash.SlotAddress(probe.Slot));
+                probesMade += 1;
+            }
+        }
+        for (size_t j = 0; j < probesCount; ++j) {
+            TGramProbe& probe = probes[j];
+            if (probe.Size) {
+                probe.Bucket = packed ? PerfectHash.HashSlot(probe.PackedKey, probe.Slot)
+                                      : PerfectHash.HashSlot(probe.Key, probe.Size, probe.Slot);
+                Prefetch(Buckets.data() + size_t(probe.Bucket) * width);
+            }
+        }
+        for (size_t j = 0; j < probesCount; ++j) {
+            const TGramProbe& probe = probes[j];
+            counts[j] = TPackedCount();
+            if (probe.Size) {
+                uint16_t fingerprint = packed ? PackedGramFingerprint(probe.PackedKey)
+                                              : CityHash16(probe.Key, probe.Size);
+                counts[j] = ReadBucket(probe.Bucket, fingerprint);
+            }
+        }
+        if (Delta) {
+            for (size_t i = 0; i < blockSize; ++i) {
+                const TWordId c = candidates[start + i];
+                TPackedCount* count = counts + i * SCORE_PROBES;
+                count[0] = AddDeltaCount(count[0], Delta->GetCount(TGram1Key(c)));
+                count[1] = AddDeltaCount(count[1], Delta->GetCount(TGram2Key(c, next)));
+                count[2] = AddDeltaCount(count[2], Delta->GetCount(TGram3Key(c, next, next2)));
+                count[3] = AddDeltaCount(count[3], Delta->GetCount(TGram2Key(prev, c)));
+                count[4] = AddDeltaCount(count[4], Delta->GetCount(TGram3Key(prev, c, next)));
+                count[5] = AddDeltaCount(count[5], Delta->GetCount(TGram3Key(prev2, prev, c)));
+            }
+        }
+
+        for (size_t i = 0; i < blockSize; ++i) {
+            const TPackedCount* c = counts + i * SCORE_PROBES;
+            double result = context.FixedScore;
+            result += Gram1LogProb(c[0]);
+            result += Gram2LogProb(c[0], c[1]);
+            result += Gram3LogProb(c[1], c[2]);
+            if (p >= 1) {
+                result += Gram2LogProb(context.PrevGram1Count, c[3]);
+                result += Gram3LogProb(c[3], c[4]);
+            }
+            if (p >= 2) {
+                result += Gram3LogProb(context.PrevGram2Count, c[5]);
+            }
+            scores[start + i] = result;
+        }
+    }
+    AddMetric(ECounter::GramProbes, probesMade);
+}
+
+void TLangModel::GetGram3HashCounts(const TGram3Key* keys, size_t count, TPackedCount* counts) const {
+    const TWordId words = TWordId(Vocabulary.Size());
+    const bool packed = PackedGramKeys;
+    const size_t width = BucketFormat.Width();
+    constexpr size_t BLOCK = SCORE_BLOCK * SCORE_PROBES;
+    TGramProbe probes[BLOCK];
+    uint64_t probesMade = 0;
+    for (size_t start = 0; start < count; start += BLOCK) {
+        const size_t blockSize = std::min(BLOCK, count - start);
+        for (size_t j = 0; j < blockSize; ++j) {
+            const TGram3Key& key = keys[start + j];
+            TGramProbe& probe = probes[j];
+            SetProbe(probe, key, IsBaseGram(key, words), packed);
+            if (probe.Size) {
+                probe.Slot = packed ? PerfectHash.Slot(probe.PackedKey) : PerfectHash.Slot(probe.Key, probe.Size);
+                Prefetch(PerfectHash.SlotAddress(probe.Slot));
+                probesMade += 1;
+            }
+        }
+        for (size_t j = 0; j < blockSize; ++j) {
+            TGramProbe& probe = probes[j];
+            if (probe.Size) {
+                probe.Bucket = packed ? PerfectHash.HashSlot(probe.PackedKey, probe.Slot)
+                                      : PerfectHash.HashSlot(probe.Key, probe.Size, probe.Slot);
+                Prefetch(Buckets.data() + size_t(probe.Bucket) * width);
+            }
+        }
+        for (size_t j = 0; j < blockSize; ++j) {
+            const TGramProbe& probe = probes[j];
+            counts[start + j] = TPackedCount();
+            if (probe.Size) {
+                uint16_t fingerprint = packed ? PackedGramFingerprint(probe.PackedKey)
+                                              : CityHash16(probe.Key, probe.Size);
+                counts[start + j] = ReadBucket(probe.Bucket, fingerprint);
+            }
+            if (Delta) {
+                counts[start + j] = AddDeltaCount(counts[start + j], Delta->GetCount(keys[start + j]));
+            }
+        }
+    }
+    AddMetric(ECounter::GramProbes, probesMade);
+}
+
+double TLangModel::WordContextLogProb(const TWords& words, size_t position) const {
+    assert(position < words.size());
+    auto idAt = [&](size_t i) {
+        return i < words.size() ? GetWordIdNoCreate(words[i]) : UnknownWordId;
+    };
+    const size_t p = position;
+    const TWordId word = idAt(p);
+    const TWordId next = idAt(p + 1);
+    const TWordId next2 = idAt(p + 2);
+    double result = GetGram1LogProb(word);
+    result += GetGram2LogProb(word, next);
+    result += GetGram3LogProb(word, next, next2);
+    uint64_t probes = 5;
+    size_t terms = 3;
+    if (p >= 1) {
+        const TWordId prev = idAt(p - 1);
+        result += GetGram2LogProb(prev, word);
+        result += GetGram3LogProb(prev, word, next);
+        probes += 4;
+        terms += 2;
+        if (p >= 2) {
+            result += GetGram3LogProb(idAt(p - 2), prev, word);
+            probes += 2;
+            terms += 1;
+        }
+    }
+    AddMetric(ECounter::GramProbes, probes);
+    return result / terms;
+}
+
 double TLangModel::Score(const std::wstring& str) const {
     TSentences sentences = Tokenizer.Process(str);
     TWords words;
@@ -232,36 +990,52 @@ double TLangModel::Score(const std::wstring& str) const {
 }
 
 bool TLangModel::Dump(const std::string& modelFileName) const {
-    std::ofstream out(modelFileName, std::ios::binary);
+    std::string tempFileName = TemporaryFileName(modelFileName);
+    std::ofstream out(tempFileName, std::ios::binary);
     if (!out.is_open()) {
         return false;
     }
     NHandyPack::Dump(out, LANG_MODEL_MAGIC_BYTE);
     NHandyPack::Dump(out, LANG_MODEL_VERSION);
-    Dump(out);
+    NHandyPack::Dump(out, uint16_t(sizeof(wchar_t)));
+    NHandyPack::Dump(out, LastWordID, TotalWords, VocabSize, Tokenizer, CheckSum, PackedGramKeys);
+    NHandyPack::Dump(out, BucketFormat.FingerprintBits, BucketFormat.CountBits);
+    PerfectHash.DumpMapped(out);
+    DumpSection(out, Buckets);
+    Vocabulary.Dump(out);
     NHandyPack::Dump(out, LANG_MODEL_MAGIC_BYTE);
-    return true;
+    out.close();
+    if (!out) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return CommitFile(tempFileName, modelFileName);
 }
 
 bool TLangModel::Load(const std::string& modelFileName) {
     std::cerr << "[info] loading model (" << modelFileName << ")\n";
 
-    std::ifstream in(modelFileName, std::ios::binary);
-    if (!in.is_open()) {
+    Clear();
+    if (!MappedFile.Open(modelFileName)) {
         return false;
     }
+    TMemoryStream in(MappedFile.Data(), MappedFile.Size());
+
     uint16_t version = 0;
     uint64_t magicByte = 0;
     NHandyPack::Load(in, magicByte);
     if (magicByte != LANG_MODEL_MAGIC_BYTE) {
+        Clear();
         return false;
     }
     NHandyPack::Load(in, version);
-    if (version != LANG_MODEL_VERSION) {
-        return false;
-    }
+    bool loaded = false;
     try {
-        Load(in);
+        if (version == LANG_MODEL_VERSION) {
+            loaded = LoadMapped(in);
+        } else if (version == LANG_MODEL_LEGACY_VERSION) {
+            loaded = LoadLegacy(in);
+        }
     }
     catch(const std::bad_alloc& e) {
         std::cerr << "Failed to load file" << "\n";
@@ -270,28 +1044,171 @@ bool TLangModel::Load(const std::string& modelFileName) {
 
     magicByte = 0;
     NHandyPack::Load(in, magicByte);
-    if (magicByte != LANG_MODEL_MAGIC_BYTE) {
+    if (!loaded || magicByte != LANG_MODEL_MAGIC_BYTE) {
         Clear();
         return false;
     }
-    IdToWord.clear();
-    IdToWord.resize(WordToId.size() + 1, nullptr);
-    for (auto&& it: WordToId) {
-        IdToWord[it.second] = &it.first;
+    if (version == LANG_MODEL_LEGACY_VERSION) {
+        MappedFile.Close(); // everything was copied out
+    }
+    BuildScoreTables();
+    if (HugePages) {
+        if (PerfectHash.CopyToHugePages() && Buckets.CopyToHugePages()) {
+            std::cerr << "[info] model tables moved to huge pages\n";
+        } else {
+            std::cerr << "[info] huge pages are not available, using regular pages\n";
+        }
     }
     return true;
 }
 
+bool TLangModel::LoadDelta(const std::string& deltaFileName) {
+    std::unique_ptr<TLangModelDelta> delta(new TLangModelDelta());
+    if (!delta->Load(deltaFileName, *this)) {
+        return false;
+    }
+    Delta = std::move(delta);
+    BuildScoreTables();
+    return true;
+}
+
+void TLangModel::ClearDelta() {
+    Delta.reset();
+    BuildScoreTables();
+}
+
+const TLangModelDelta* TLangModel::GetDelta() const {
+    return Delta.get();
+}
+
+void TLangModel::SetHugePages(bool hugePages) {
+    HugePages = hugePages;
+}
+
+void TLangModel::SetPerfectHashParams(const TPerfectHashParams& params) {
+    PerfectHashParams = params;
+}
+
+void TLangModel::SetPruneParams(const TPruneParams& params) {
+    PruneParams = params;
+}
+
+bool TLangModel::SetBucketFormat(const TBucketFormat& format) {
+    if (!format.IsValid()) {
+        return false;
+    }
+    TrainBucketFormat = format;
+    return true;
+}
+
+TBucketFormat TLangModel::GetBucketFormat() const {
+    return BucketFormat;
+}
+
+double TLangModel::EstimateFalsePositiveRate(size_t samples, uint32_t seed) const {
+    const size_t words = GetWordsCount();
+    if (words == 0 || samples == 0) {
+        return 0;
+    }
+    std::mt19937 random(seed);
+    std::uniform_int_distribution<TWordId> word(0, TWordId(words - 1));
+    size_t matched = 0;
+    for (size_t i = 0; i < samples; ++i) {
+        TWordId word1 = word(random);
+        TWordId word2 = word(random);
+        TWordId word3 = word(random);
+        matched += GetGram3HashCount(word1, word2, word3) != TPackedCount();
+    }
+    return double(matched) / samples;
+}
+
+size_t TLangModel::GetBucketsMemory() const {
+    return Buckets.size();
+}
+
+bool TLangModel::LoadMapped(TMemoryStream& in) {
+    uint16_t wcharSize = 0;
+    NHandyPack::Load(in, wcharSize);
+    if (wcharSize != sizeof(wchar_t)) {
+        std::cerr << "[error] model was built for " << wcharSize << "-byte wchar_t\n";
+        return false;
+    }
+    NHandyPack::Load(in, LastWordID, TotalWords, VocabSize, Tokenizer, CheckSum, PackedGramKeys);
+    NHandyPack::Load(in, BucketFormat.FingerprintBits, BucketFormat.CountBits);
+    if (!in.good() || !BucketFormat.IsValid()) {
+        return false;
+    }
+    if (!PerfectHash.LoadMapped(in) || !MapSection(in, Buckets) || !Vocabulary.LoadMapped(in)) {
+        return false;
+    }
+    return Buckets.size() == size_t(PerfectHash.BucketsNumber()) * BucketFormat.Width();
+}
+
+bool TLangModel::LoadLegacy(TMemoryStream& in) {
+    using TBucket = std::pair<uint16_t, TPackedCount>; // key check, count
+    // the word to id hash map of version 9 has the layout of a vector of pairs
+    std::vector<std::pair<std::wstring, TWordId>> words;
+    std::vector<TBucket> buckets;
+    NHandyPack::Load(in, words, LastWordID, TotalWords, VocabSize,
+                     PerfectHash, buckets, Tokenizer, CheckSum);
+    if (!in.good()) {
+        return false;
+    }
+    // the default format has the layout of the pairs
+    std::vector<uint8_t> bytes(buckets.size() * BucketFormat.Width());
+    for (size_t i = 0; i < buckets.size(); ++i) {
+        memcpy(&bytes[i * 4], &buckets[i].first, sizeof(uint16_t));
+        memcpy(&bytes[i * 4 + 2], &buckets[i].second, sizeof(TPackedCount));
+    }
+    Buckets.Assign(std::move(bytes));
+
+    std::vector<const std::wstring*> idToWord(words.size(), nullptr);
+    size_t totalLen = 0;
+    for (auto&& w: words) {
+        if (w.second >= idToWord.size()) {
+            return false;
+        }
+        idToWord[w.second] = &w.first;
+        totalLen += w.first.size();
+    }
+    std::vector<wchar_t> chars;
+    std::vector<uint32_t> offsets;
+    chars.reserve(totalLen);
+    offsets.reserve(idToWord.size() + 1);
+    for (const std::wstring* w: idToWord) {
+        if (!w) {
+            return false;
+        }
+        offsets.push_back(chars.size());
+        chars.insert(chars.end(), w->begin(), w->end());
+    }
+    offsets.push_back(chars.size());
+    Vocabulary.Assign(std::move(chars), std::move(offsets));
+    return true;
+}
+
 void TLangModel::Clear() {
     K = LANG_MODEL_DEFAULT_K;
-    WordToId.clear();
+    NewWords.Clear();
+    PackedGramKeys = false;
+    BucketFormat = TBucketFormat();
     LastWordID = 0;
     TotalWords = 0;
+    VocabSize = 0;
     Tokenizer.Clear();
+    Buckets.Clear();
+    PerfectHash.Clear();
+    Delta.reset();
+    Vocabulary.Clear();
+    CheckSum = 0;
+    LogCountsK.clear();
+    LogCountsTotal.clear();
+    LogGram1Total = 0;
+    MappedFile.Close();
 }
 
-const TRobinHash& TLangModel::GetWordToId() {
-    return WordToId;
+size_t TLangModel::GetWordsCount() const {
+    return Vocabulary.Size();
 }
 
 TIdSentences TLangModel::ConvertToIds(const TSentences& sentences) {
@@ -311,36 +1228,36 @@ TIdSentences TLangModel::ConvertToIds(const TSentences& sentences) {
 TWordId TLangModel::GetWordId(const TWord& word) {
     assert(word.Ptr && word.Len);
     assert(word.Len < 10000);
-    std::wstring w(word.Ptr, word.Len);
-    auto it = WordToId.find(w);
-    if (it != WordToId.end()) {
-        return it->second;
-    }
-    TWordId wordId = LastWordID;
-    ++LastWordID;
-    it = WordToId.insert(std::make_pair(w, wordId)).first;
-    IdToWord.push_back(&(it->first));
+    TWordId wordId = NewWords.Add(word.Ptr, word.Len);
+    LastWordID = NewWords.Size();
     return wordId;
 }
 
+void TLangModel::BuildVocabulary() {
+    NewWords.Finish(Vocabulary);
+}
+
 TWordId TLangModel::GetWordIdNoCreate(const TWord& word) const {
-    std::wstring w(word.Ptr, word.Len);
-    auto it = WordToId.find(w);
-    if (it != WordToId.end()) {
-        return it->second;
+    if (!Delta) {
+        return Vocabulary.Find(word.Ptr, word.Len);
+    }
+    const uint64_t hash = TVocabulary::Hash(word.Ptr, word.Len);
+    TWordId wid = Vocabulary.Find(word.Ptr, word.Len, hash);
+    if (wid == UnknownWordId) {
+        wid = Delta->FindWord(word.Ptr, word.Len, hash);
     }
-    return UnknownWordId;
+    return wid;
 }
 
 TWord TLangModel::GetWordById(TWordId wid) const {
-    if (wid >= IdToWord.size()) {
-        return TWord();
+    if (Delta && wid >= Vocabulary.Size()) {
+        return Delta->GetWord(wid);
     }
-    return TWord(*IdToWord[wid]);
+    return Vocabulary.Get(wid);
 }
 
 TCount TLangModel::GetWordCount(TWordId wid) const {
-    return GetGram1HashCount(wid);
+    return UNPACKED_COUNTS[GetGram1HashCount(wid)];
 }
 
 uint64_t TLangModel::GetCheckSum() const {
@@ -348,11 +1265,11 @@ uint64_t TLangModel::GetCheckSum() const {
 }
 
 TWord TLangModel::GetWord(const std::wstring& word) const {
-    auto it = WordToId.find(word);
-    if (it != WordToId.end()) {
-        return TWord(&it->first[0], it->first.size());
-    }
-    return TWord();
+    return GetWord(word.data(), word.size());
+}
+
+TWord TLangModel::GetWord(const wchar_t* ptr, size_t len) const {
+    return GetWordById(GetWordIdNoCreate(TWord(ptr, len)));
 }
 
 const std::unordered_set<wchar_t>& TLangModel::GetAlphabet() const {
@@ -360,85 +1277,107 @@ const std::unordered_set<wchar_t>& TLangModel::GetAlphabet() const {
 }
 
 TSentences TLangModel::Tokenize(const std::wstring& text) const {
+    TStageTimer timer(EStage::Tokenize);
     return Tokenizer.Process(text);
 }
 
-double TLangModel::GetGram1Prob(TWordId word) const {
-    double countsGram1 = GetGram1HashCount(word);
-    countsGram1 += K;
-    return countsGram1 / (TotalWords + VocabSize);
+bool TLangModel::IsLetter(wchar_t chr) const {
+    return Tokenizer.IsLetter(chr);
 }
 
-double TLangModel::GetGram2Prob(TWordId word1, TWordId word2) const {
-    double countsGram1 = GetGram1HashCount(word1);
-    double countsGram2 = GetGram2HashCount(word1, word2);
-    if (countsGram2 > countsGram1) { // (hash collision)
+// log((count + K) / (TotalWords + VocabSize)) and friends are split into
+// log(count + K) - log(count + TotalWords), both looked up by packed count.
+// The words of a delta add to both totals.
+void TLangModel::BuildScoreTables() {
+    const double totalWords = double(TotalWords) + (Delta ? Delta->TotalWords() : 0);
+    const double vocabSize = double(VocabSize) + (Delta ? Delta->WordsCount() : 0);
+    LogCountsK.resize(MAX_AVAILABLE_NUM);
+    LogCountsTotal.resize(MAX_AVAILABLE_NUM);
+    for (size_t i = 0; i < MAX_AVAILABLE_NUM; ++i) {
+        LogCountsK[i] = log(UNPACKED_COUNTS[i] + K);
+        LogCountsTotal[i] = log(double(UNPACKED_COUNTS[i]) + totalWords);
+    }
+    LogGram1Total = log(totalWords + vocabSize);
+}
+
+double TLangModel::Gram1LogProb(TPackedCount countsGram1) const {
+    return LogCountsK[countsGram1] - LogGram1Total;
+}
+
+double TLangModel::Gram2LogProb(TPackedCount countsGram1, TPackedCount countsGram2) const {
+    if (UNPACKED_COUNTS[countsGram2] > UNPACKED_COUNTS[countsGram1]) { // (hash collision)
         countsGram2 = 0;
     }
-    countsGram1 += TotalWords;
-    countsGram2 += K;
-    return countsGram2 / countsGram1;
+    return LogCountsK[countsGram2] - LogCountsTotal[countsGram1];
 }
 
-double TLangModel::GetGram3Prob(TWordId word1, TWordId word2, TWordId word3) const {
-    double countsGram2 = GetGram2HashCount(word1, word2);
-    double countsGram3 = GetGram3HashCount(word1, word2, word3);
-    if (countsGram3 > countsGram2) { // hash collision
+double TLangModel::Gram3LogProb(TPackedCount countsGram2, TPackedCount countsGram3) const {
+    if (UNPACKED_COUNTS[countsGram3] > UNPACKED_COUNTS[countsGram2]) { // hash collision
         countsGram3 = 0;
     }
-    countsGram2 += TotalWords;
-    countsGram3 += K;
-    return countsGram3 / countsGram2;
+    return LogCountsK[countsGram3] - LogCountsTotal[countsGram2];
 }
 
-template<typename T>
-TCount GetGramHashCount(T key,
-                        const TPerfectHash& ph,
-                        const std::vector<std::pair<uint16_t, uint16_t>>& buckets)
-{
-    constexpr int TMP_BUF_SIZE = 128;
-    static char tmpBuff[TMP_BUF_SIZE];
-    static MemStream tmpBuffStream(tmpBuff, TMP_BUF_SIZE - 1);
-    static std::ostream out(&tmpBuffStream);
-
-    tmpBuffStream.Reset();
+double TLangModel::GetGram1LogProb(TWordId word) const {
+    return Gram1LogProb(GetGram1HashCount(word));
+}
 
-    NHandyPack::Dump(out, key);
+double TLangModel::GetGram2LogProb(TWordId word1, TWordId word2) const {
+    return Gram2LogProb(GetGram1HashCount(word1), GetGram2HashCount(word1, word2));
+}
 
-    uint32_t bucket = ph.Hash(tmpBuff, tmpBuffStream.Size());
+double TLangModel::GetGram3LogProb(TWordId word1, TWordId word2, TWordId word3) const {
+    return Gram3LogProb(GetGram2HashCount(word1, word2), GetGram3HashCount(word1, word2, word3));
+}
 
-    assert(bucket < ph.BucketsNumber());
-    const std::pair<uint16_t, uint16_t>& data = buckets[bucket];
+template<typename TKey>
+TPackedCount TLangModel::GetGramHashCount(const TKey& key) const {
+    if (!Delta) {
+        return GetBaseGramHashCount(key);
+    }
+    TPackedCount count = IsBaseGram(key, TWordId(Vocabulary.Size())) ? GetBaseGramHashCount(key) : TPackedCount();
+    return AddDeltaCount(count, Delta->GetCount(key));
+}
 
-    TCount res = TCount();
-    if (data.first == CityHash16(tmpBuff, tmpBuffStream.Size())) {
-        res = UnpackInt32(data.second);
+template<typename TKey>
+TPackedCount TLangModel::GetBaseGramHashCount(const TKey& key) const {
+    uint32_t bucket;
+    uint16_t fingerprint;
+    if (PackedGramKeys) {
+        uint64_t packedKey = PackedGramKey(key);
+        bucket = PerfectHash.Hash(packedKey);
+        fingerprint = PackedGramFingerprint(packedKey);
+    } else {
+        char buff[MAX_GRAM_KEY_SIZE];
+        size_t size = PackGramKey(key, buff);
+        bucket = PerfectHash.Hash(buff, size);
+        fingerprint = CityHash16(buff, size);
     }
-    return res;
+    return ReadBucket(bucket, fingerprint);
 }
 
-TCount TLangModel::GetGram1HashCount(TWordId word) const {
+TPackedCount TLangModel::GetGram1HashCount(TWordId word) const {
     if (word == UnknownWordId) {
-        return TCount();
+        return TPackedCount();
     }
     TGram1Key key = word;
-    return GetGramHashCount(key, PerfectHash, Buckets);
+    return GetGramHashCount(key);
 }
 
-TCount TLangModel::GetGram2HashCount(TWordId word1, TWordId word2) const {
+TPackedCount TLangModel::GetGram2HashCount(TWordId word1, TWordId word2) const {
     if (word1 == UnknownWordId || word2 == UnknownWordId) {
-        return TCount();
+        return TPackedCount();
     }
     TGram2Key key({word1, word2});
-    return GetGramHashCount(key, PerfectHash, Buckets);
+    return GetGramHashCount(key);
 }
 
-TCount TLangModel::GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const {
+TPackedCount TLangModel::GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const {
     if (word1 == UnknownWordId || word2 == UnknownWordId || word3 == UnknownWordId) {
-        return TCount();
+        return TPackedCount();
     }
     TGram3Key key(word1, word2, word3);
-    return GetGramHashCount(key, PerfectHash, Buckets);
+    return GetGramHashCount(key);
 }
 
 } // NJamSpell
@@ -1,25 +1,30 @@
 #pragma once
 
 #include <unordered_map>
+#include <memory>
 #include <vector>
 #include <utility>
 #include <string>
 #include <limits>
 
 #include <contrib/handypack/handypack.hpp>
-#include <contrib/tsl/robin_map.h>
 #include "utils.hpp"
 #include "perfect_hash.hpp"
+#include "memory_map.hpp"
+#include "vocabulary.hpp"
 
 
 namespace NJamSpell {
 
+class TGramTable;
+class TThreadPool;
+class TLangModelDelta;
 
 constexpr uint64_t LANG_MODEL_MAGIC_BYTE = 8559322735408079685L;
-constexpr uint16_t LANG_MODEL_VERSION = 9;
+constexpr uint16_t LANG_MODEL_VERSION = 14;
+constexpr uint16_t LANG_MODEL_LEGACY_VERSION = 9;
 constexpr double LANG_MODEL_DEFAULT_K = 0.05;
 
-using TWordId = uint32_t;
 using TCount = uint32_t;
 
 using TGram1Key = TWordId;
@@ -27,6 +32,32 @@ using TGram2Key = std::pair<TWordId, TWordId>;
 using TGram3Key = std::tuple<TWordId, TWordId, TWordId>;
 using TWordIds = std::vector<TWordId>;
 using TIdSentences = std::vector<TWordIds>;
+using TPackedCount = uint16_t; // see PackInt32()
+
+// How a bucket stores the fingerprint of its n-gram, which tells a probed
+// key from the one hashed to the bucket, and its count; buckets are
+// FingerprintBits + CountBits wide. With 8-bit fingerprints about 1/256 of
+// the unseen n-grams probed get the count of another one instead of 0. 8-bit
+// counts are exact up to 64 and within 4% above (see QuantizeCount()).
+struct TBucketFormat {
+    uint8_t FingerprintBits = 16; // 8 or 16
+    uint8_t CountBits = 16;       // 8 or 16
+
+    size_t Width() const {
+        return (FingerprintBits + CountBits) / 8;
+    }
+    bool IsValid() const {
+        return (FingerprintBits == 8 || FingerprintBits == 16) && (CountBits == 8 || CountBits == 16);
+    }
+};
+
+// N-grams seen fewer times are left out of the model when training, so they
+// score as unseen ones. Words are always kept. A trigram whose bigram is
+// pruned scores as unseen too.
+struct TPruneParams {
+    TCount MinGram2Count = 1;
+    TCount MinGram3Count = 1;
+};
 
 struct TGram2KeyHash {
 public:
@@ -44,31 +75,90 @@ public:
   }
 };
 
-class TRobinSerializer: public NHandyPack::TUnorderedMapSerializer<tsl::robin_map<std::wstring, TWordId>, std::wstring, TWordId> {};
-class TRobinHash: public tsl::robin_map<std::wstring, TWordId> {
-public:
-    inline virtual void Dump(std::ostream& out) const {
-        TRobinSerializer::Dump(out, *this);
-    }
-    inline virtual void Load(std::istream& in) {
-        TRobinSerializer::Load(in, *this);
-    }
+// Everything Score() needs for a sentence in which only the word at
+// Position varies: resolved ids (padded like Score() does) and the sum of
+// all terms that do not touch Position.
+struct TScoreContext {
+    TWordIds Sentence;
+    size_t Position = 0;
+    double FixedScore = 0;
+    TPackedCount PrevGram1Count = 0; // Position-1
+    TPackedCount PrevGram2Count = 0; // Position-2, Position-1
 };
 
+// Training and loading mutate the model and must not overlap with anything
+// else. Once loaded, all const methods are reentrant and may be called
+// concurrently, so one model can serve every worker thread.
+//
+// The buckets, the perfect hash table and the vocabulary are stored as
+// aligned raw sections which Load() uses in place from a mmap'ed file; TWord
+// values returned by the model point into that memory. Version 9 models,
+// from before that format, are loaded by copying.
+//
+// A TLangModelDelta loaded on top of the model adds its words and counts to
+// every lookup; Dump() and GetCheckSum() still describe the model alone.
 class TLangModel {
 public:
-    bool Train(const std::string& fileName, const std::string& alphabetFile);
+    TLangModel();
+    ~TLangModel();
+    // N-grams are counted on threadsCount threads, 0 means one per core.
+    bool Train(const std::string& fileName, const std::string& alphabetFile, size_t threadsCount = 0);
+    // Builds the same model as Train() without holding the corpus in memory.
+    // The text is read in chunks, and n-gram counts beyond maxMemoryMb are
+    // spilled to sorted runs named tempPrefix.* and merged at the end. The
+    // vocabulary and the finished model still have to fit in memory.
+    bool TrainStreaming(const std::string& fileName, const std::string& alphabetFile,
+                        const std::string& tempPrefix, size_t maxMemoryMb = 1024, size_t threadsCount = 0);
     double Score(const TWords& words) const;
     double Score(const std::wstring& str) const;
+    // Score(words) with words[position] replaced by candidate, probing only
+    // the n-grams that include the candidate.
+    TScoreContext PrepareScoreContext(const TWords& words, size_t position) const;
+    double Score(const TScoreContext& context, TWordId candidate) const;
+    // The same for many candidates at once. The n-gram keys of a block of
+    // candidates are hashed up front and both tables are prefetched for all
+    // of them before any bucket is read, so the cache misses overlap.
+    void Score(const TScoreContext& context, const TWordId* candidates, size_t count, double* scores) const;
+    // The mean of the terms of Score(words) that involve words[position],
+    // i.e. its log probability given up to two words on each side. There are
+    // fewer of them near the start of a sentence, the mean keeps the values
+    // comparable whatever the position. Cheaper than PrepareScoreContext()
+    // since the other terms are not computed.
+    double WordContextLogProb(const TWords& words, size_t position) const;
     TWord GetWord(const std::wstring& word) const;
+    TWord GetWord(const wchar_t* ptr, size_t len) const;
     const std::unordered_set<wchar_t>& GetAlphabet() const;
     TSentences Tokenize(const std::wstring& text) const;
+    // Whether Tokenize() takes the character as part of a word.
+    bool IsLetter(wchar_t chr) const;
 
     bool Dump(const std::string& modelFileName) const;
     bool Load(const std::string& modelFileName);
     void Clear();
-
-    const TRobinHash& GetWordToId();
+    // Loads a delta trained on this model (see TLangModelDelta), replacing
+    // the current one; on failure the current one is kept. Load() and
+    // Train() drop it.
+    bool LoadDelta(const std::string& deltaFileName);
+    void ClearDelta();
+    const TLangModelDelta* GetDelta() const;
+    // Makes Load() copy the perfect hash table and the buckets to huge pages
+    // (see THugePageBuffer). It costs the memory of a private copy instead of
+    // sharing the mapped file between processes.
+    void SetHugePages(bool hugePages);
+    // Used by the following Train() and TrainStreaming() calls.
+    void SetPerfectHashParams(const TPerfectHashParams& params);
+    void SetPruneParams(const TPruneParams& params);
+    // Returns false, keeping the format, for an invalid one.
+    bool SetBucketFormat(const TBucketFormat& format);
+    TBucketFormat GetBucketFormat() const;
+    // Share of random trigrams of the vocabulary for which a bucket matches,
+    // mostly false positives of the fingerprints; checks samples of them.
+    double EstimateFalsePositiveRate(size_t samples = 100000, uint32_t seed = 42) const;
+    size_t GetBucketsMemory() const; // in bytes
+
+    // Words of the model itself; those of a delta take the ids from there
+    // on, which GetWordById() and GetWordIdNoCreate() also know.
+    size_t GetWordsCount() const;
 
     TWordId GetWordId(const TWord& word);
     TWordId GetWordIdNoCreate(const TWord& word) const;
@@ -77,31 +167,60 @@ public:
 
     uint64_t GetCheckSum() const;
 
-    HANDYPACK(WordToId, LastWordID, TotalWords, VocabSize,
-              PerfectHash, Buckets, Tokenizer, CheckSum)
+    // The n-gram counts Score() looks up and the terms it derives from them,
+    // for decoders that share counts between the hypotheses of a sentence.
+    TPackedCount GetGram1HashCount(TWordId word) const;
+    TPackedCount GetGram2HashCount(TWordId word1, TWordId word2) const;
+    TPackedCount GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const;
+    // Many trigram counts at once, prefetched like Score() does.
+    void GetGram3HashCounts(const TGram3Key* keys, size_t count, TPackedCount* counts) const;
+    double Gram1LogProb(TPackedCount countsGram1) const;
+    double Gram2LogProb(TPackedCount countsGram1, TPackedCount countsGram2) const;
+    double Gram3LogProb(TPackedCount countsGram2, TPackedCount countsGram3) const;
+
 private:
     TIdSentences ConvertToIds(const TSentences& sentences);
-
-    double GetGram1Prob(TWordId word) const;
-    double GetGram2Prob(TWordId word1, TWordId word2) const;
-    double GetGram3Prob(TWordId word1, TWordId word2, TWordId word3) const;
-
-    TCount GetGram1HashCount(TWordId word) const;
-    TCount GetGram2HashCount(TWordId word1, TWordId word2) const;
-    TCount GetGram3HashCount(TWordId word1, TWordId word2, TWordId word3) const;
+    void BuildVocabulary();
+    bool LoadMapped(TMemoryStream& in);
+    bool LoadLegacy(TMemoryStream& in);
+
+    void BuildScoreTables();
+    bool BuildGramBuckets(std::vector<TGramTable*> tables, TThreadPool& pool);
+    // The count of the n-gram hashed to bucket if its fingerprint matches.
+    TPackedCount ReadBucket(uint32_t bucket, uint16_t fingerprint) const;
+    template<typename TKey>
+    TPackedCount GetGramHashCount(const TKey& key) const;
+    template<typename TKey>
+    TPackedCount GetBaseGramHashCount(const TKey& key) const;
+
+    double GetGram1LogProb(TWordId word) const;
+    double GetGram2LogProb(TWordId word1, TWordId word2) const;
+    double GetGram3LogProb(TWordId word1, TWordId word2, TWordId word3) const;
 
 private:
-    const TWordId UnknownWordId = std::numeric_limits<TWordId>::max();
+    const TWordId UnknownWordId = UNKNOWN_WORD_ID;
     double K = LANG_MODEL_DEFAULT_K;
-    TRobinHash WordToId;
-    std::vector<const std::wstring*> IdToWord;
+    bool HugePages = false;
+    TPerfectHashParams PerfectHashParams;
+    TPruneParams PruneParams;
+    TBucketFormat TrainBucketFormat; // for the models trained next
+    TBucketFormat BucketFormat;      // of the current model
+    TVocabularyBuilder NewWords; // only used while training
+    bool PackedGramKeys = false; // see PackedGramKey()
     TWordId LastWordID = 0;
     TWordId TotalWords = 0;
     TWordId VocabSize = 0;
     TTokenizer Tokenizer;
-    std::vector<std::pair<uint16_t, uint16_t>> Buckets;
+    TMemoryMappedFile MappedFile;
+    TMappedArray<uint8_t> Buckets; // BucketFormat.Width() bytes per bucket
     TPerfectHash PerfectHash;
-    uint64_t CheckSum;
+    TVocabulary Vocabulary;
+    std::unique_ptr<TLangModelDelta> Delta;
+    uint64_t CheckSum = 0;
+    // by packed count, filled once the counts are known
+    std::vector<double> LogCountsK;     // log(count + K)
+    std::vector<double> LogCountsTotal; // log(count + TotalWords)
+    double LogGram1Total = 0;           // log(TotalWords + VocabSize)
 };
 
 
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include <contrib/cityhash/city.h>
+#include <contrib/handypack/handypack.hpp>
+
+#include "lang_model_delta.hpp"
+#include "edits.hpp"
+
+namespace NJamSpell {
+
+constexpr uint64_t LANG_MODEL_DELTA_MAGIC_BYTE = 7208313513203361093L;
+constexpr uint16_t LANG_MODEL_DELTA_VERSION = 1;
+
+static uint64_t VariantHash(const wchar_t* ptr, size_t len) {
+    return CityHash64((const char*)ptr, len * sizeof(wchar_t));
+}
+
+template<typename TMap, typename TKey>
+inline TCount FindCount(const TMap& grams, const TKey& key) {
+    auto it = grams.find(key);
+    return it == grams.end() ? TCount() : it->second;
+}
+
+bool TLangModelDelta::Train(const std::string& fileName, const TLangModel& base) {
+    std::cerr << "[info] training delta (" << fileName << ")\n";
+    Clear();
+    if (base.GetDelta()) {
+        std::cerr << "[error] the model already has a delta" << std::endl;
+        return false;
+    }
+    if (base.GetWordsCount() == 0) {
+        std::cerr << "[error] no model to train the delta on" << std::endl;
+        return false;
+    }
+    std::wstring text = UTF8ToWide(LoadFile(fileName));
+    ToLower(text);
+    TSentences sentences = base.Tokenize(text);
+    if (sentences.empty()) {
+        std::cerr << "[error] no sentences" << std::endl;
+        return false;
+    }
+
+    BaseWords = TWordId(base.GetWordsCount());
+    TVocabularyBuilder newWords;
+    TWordIds ids;
+    for (auto&& words: sentences) {
+        ids.clear();
+        for (auto&& w: words) {
+            TWordId wid = base.GetWordIdNoCreate(w);
+            if (wid == UNKNOWN_WORD_ID) {
+                wid = BaseWords + newWords.Add(w.Ptr, w.Len);
+            }
+            ids.push_back(wid);
+        }
+        for (size_t i = 0; i < ids.size(); ++i) {
+            Grams1[ids[i]] += 1;
+            if (i + 1 < ids.size()) {
+                Grams2[TGram2Key(ids[i], ids[i + 1])] += 1;
+            }
+            if (i + 2 < ids.size()) {
+                Grams3[TGram3Key(ids[i], ids[i + 1], ids[i + 2])] += 1;
+            }
+        }
+        TotalWordsCount += ids.size();
+    }
+    newWords.Finish(Vocabulary);
+    BaseCheckSum = base.GetCheckSum();
+    BuildIndex();
+
+    std::cerr << "[info] new words: " << WordsCount() << "\n";
+    std::cerr << "[info] ngrams1: " << Grams1.size() << "\n";
+    std::cerr << "[info] ngrams2: " << Grams2.size() << "\n";
+    std::cerr << "[info] ngrams3: " << Grams3.size() << "\n";
+    return true;
+}
+
+bool TLangModelDelta::Dump(const std::string& fileName) const {
+    if (BaseWords == 0) {
+        return false;
+    }
+    std::string tempFileName = TemporaryFileName(fileName);
+    std::ofstream out(tempFileName, std::ios::binary);
+    if (!out.is_open()) {
+        return false;
+    }
+    NHandyPack::Dump(out, LANG_MODEL_DELTA_MAGIC_BYTE);
+    NHandyPack::Dump(out, LANG_MODEL_DELTA_VERSION);
+    NHandyPack::Dump(out, uint16_t(sizeof(wchar_t)));
+    NHandyPack::Dump(out, BaseCheckSum, BaseWords, TotalWordsCount);
+    Vocabulary.Dump(out);
+    NHandyPack::Dump(out, Grams1, Grams2, Grams3);
+    NHandyPack::Dump(out, LANG_MODEL_DELTA_MAGIC_BYTE);
+    out.close();
+    if (!out) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return CommitFile(tempFileName, fileName);
+}
+
+bool TLangModelDelta::Load(const std::string& fileName, const TLangModel& base) {
+    std::cerr << "[info] loading delta (" << fileName << ")\n";
+    Clear();
+    std::unique_ptr<TMemoryMappedFile> file(new TMemoryMappedFile());
+    if (!file->Open(fileName)) {
+        return false;
+    }
+    TMemoryStream in(file->Data(), file->Size());
+    uint64_t magicByte = 0;
+    uint16_t version = 0;
+    uint16_t wcharSize = 0;
+    NHandyPack::Load(in, magicByte);
+    if (magicByte != LANG_MODEL_DELTA_MAGIC_BYTE) {
+        return false;
+    }
+    NHandyPack::Load(in, version, wcharSize);
+    if (version != LANG_MODEL_DELTA_VERSION || wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
+    NHandyPack::Load(in, BaseCheckSum, BaseWords, TotalWordsCount);
+    if (!in.good() || BaseCheckSum != base.GetCheckSum() || BaseWords != base.GetWordsCount()) {
+        Clear();
+        return false;
+    }
+    if (!Vocabulary.LoadMapped(in)) {
+        Clear();
+        return false;
+    }
+    NHandyPack::Load(in, Grams1, Grams2, Grams3);
+    magicByte = 0;
+    NHandyPack::Load(in, magicByte);
+    if (!in.good() || magicByte != LANG_MODEL_DELTA_MAGIC_BYTE) {
+        Clear();
+        return false;
+    }
+    MappedFile = std::move(file);
+    BuildIndex();
+    return true;
+}
+
+TWordId TLangModelDelta::FindWord(const wchar_t* ptr, size_t len, uint64_t hash) const {
+    TWordId wid = Vocabulary.Find(ptr, len, hash);
+    return wid == UNKNOWN_WORD_ID ? wid : BaseWords + wid;
+}
+
+TWord TLangModelDelta::GetWord(TWordId wid) const {
+    if (wid < BaseWords) {
+        return TWord();
+    }
+    return Vocabulary.Get(wid - BaseWords);
+}
+
+size_t TLangModelDelta::BaseWordsCount() const {
+    return BaseWords;
+}
+
+size_t TLangModelDelta::WordsCount() const {
+    return Vocabulary.Size();
+}
+
+uint64_t TLangModelDelta::TotalWords() const {
+    return TotalWordsCount;
+}
+
+inline bool TLangModelDelta::InCorpus(TWordId wid) const {
+    return wid < Seen.size() && Seen[wid];
+}
+
+TCount TLangModelDelta::GetCount(TGram1Key key) const {
+    return InCorpus(key) ? FindCount(Grams1, key) : TCount();
+}
+
+TCount TLangModelDelta::GetCount(const TGram2Key& key) const {
+    if (!InCorpus(key.first) || !InCorpus(key.second)) {
+        return TCount();
+    }
+    return FindCount(Grams2, key);
+}
+
+TCount TLangModelDelta::GetCount(const TGram3Key& key) const {
+    if (!InCorpus(std::get<0>(key)) || !InCorpus(std::get<1>(key)) || !InCorpus(std::get<2>(key))) {
+        return TCount();
+    }
+    return FindCount(Grams3, key);
+}
+
+void TLangModelDelta::Find(const wchar_t* ptr, size_t len, size_t maxDeletes, TWords& result) const {
+    const uint64_t hash = VariantHash(ptr, len);
+    auto it = std::lower_bound(Deletes.begin(), Deletes.end(), std::make_pair(hash, TWordId(0)));
+    for (; it != Deletes.end() && it->first == hash; ++it) {
+        TWord word = GetWord(it->second);
+        if (IsSupersequence(word, ptr, len, maxDeletes)) {
+            result.push_back(word);
+        }
+    }
+}
+
+void TLangModelDelta::Clear() {
+    BaseCheckSum = 0;
+    BaseWords = 0;
+    TotalWordsCount = 0;
+    Vocabulary.Clear();
+    MappedFile.reset();
+    Grams1.clear();
+    Grams2.clear();
+    Grams3.clear();
+    std::vector<bool>().swap(Seen);
+    std::vector<std::pair<uint64_t, TWordId>>().swap(Deletes);
+}
+
+void TLangModelDelta::BuildIndex() {
+    Seen.assign(BaseWords + Vocabulary.Size(), false);
+    for (auto&& it: Grams1) {
+        if (it.first < Seen.size()) {
+            Seen[it.first] = true;
+        }
+    }
+    Deletes.clear();
+    for (TWordId i = 0; i < Vocabulary.Size(); ++i) {
+        const TWord word = Vocabulary.Get(i);
+        const TWordId wid = BaseWords + i;
+        Deletes.push_back(std::make_pair(VariantHash(word.Ptr, word.Len), wid));
+        ForEachDeletion(word.Ptr, word.Len, [&](const wchar_t* ptr, size_t size) {
+            Deletes.push_back(std::make_pair(VariantHash(ptr, size), wid));
+        });
+    }
+    std::sort(Deletes.begin(), Deletes.end());
+    Deletes.erase(std::unique(Deletes.begin(), Deletes.end()), Deletes.end());
+}
+
+} // NJamSpell
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lang_model.hpp"
+#include "memory_map.hpp"
+#include "vocabulary.hpp"
+
+namespace NJamSpell {
+
+// N-gram counts of a small corpus trained on top of a model, e.g. new drug
+// names, loaded next to it with TLangModel::LoadDelta() instead of
+// retraining the model on the whole corpus. Words the base model knows keep
+// their ids, new ones are numbered from the base GetWordsCount() on, and
+// every count the model looks up is its own plus the one of the delta, as
+// if the delta corpus had been appended to the base one (except for the
+// n-grams the base pruned). New words are also indexed by their deletions
+// like TDeletionIndex does, since the candidate engines of the base model
+// do not know them.
+//
+// Retraining the base model on both corpora folds the delta in; until then
+// n-grams with a word the delta corpus does not have cost a bit check, the
+// others a hash lookup. Load() uses the words in place from a mmap'ed file
+// and copies the counts.
+class TLangModelDelta {
+public:
+    static constexpr size_t MAX_DELETES = 2;
+
+    // The text is tokenized like the base model does. Fails if base already
+    // has a delta, whose words the new one would not know.
+    bool Train(const std::string& fileName, const TLangModel& base);
+    bool Dump(const std::string& fileName) const;
+    // Fails if the file was not trained on this model.
+    bool Load(const std::string& fileName, const TLangModel& base);
+
+    // Ids are those of the model, starting from BaseWordsCount(); hash is
+    // TVocabulary::Hash(ptr, len).
+    TWordId FindWord(const wchar_t* ptr, size_t len, uint64_t hash) const;
+    // An empty word for ids outside the delta.
+    TWord GetWord(TWordId wid) const;
+    size_t BaseWordsCount() const;
+    size_t WordsCount() const; // new words only
+    uint64_t TotalWords() const;
+
+    // Counts in the delta corpus, 0 for n-grams it does not have.
+    TCount GetCount(TGram1Key key) const;
+    TCount GetCount(const TGram2Key& key) const;
+    TCount GetCount(const TGram3Key& key) const;
+
+    // Appends the new words that are ptr with 0 to maxDeletes characters
+    // inserted, see TDeletionIndex::Find().
+    void Find(const wchar_t* ptr, size_t len, size_t maxDeletes, TWords& result) const;
+private:
+    bool InCorpus(TWordId wid) const;
+    void Clear();
+    void BuildIndex();
+private:
+    uint64_t BaseCheckSum = 0;
+    uint32_t BaseWords = 0;
+    uint64_t TotalWordsCount = 0;
+    std::unique_ptr<TMemoryMappedFile> MappedFile;
+    TVocabulary Vocabulary; // new words, by id - BaseWords
+    std::unordered_map<TGram1Key, TCount> Grams1;
+    std::unordered_map<TGram2Key, TCount, TGram2KeyHash> Grams2;
+    std::unordered_map<TGram3Key, TCount, TGram3KeyHash> Grams3;
+    // by id, whether the word is in the delta corpus; most n-grams probed
+    // have one that is not and skip the maps
+    std::vector<bool> Seen;
+    // (hash of a new word or one of its deletions, id), sorted
+    std::vector<std::pair<uint64_t, TWordId>> Deletes;
+};
+
+} // NJamSpell
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace NJamSpell {
+
+struct TCacheStats {
+    uint64_t Hits = 0;
+    uint64_t Misses = 0;
+    size_t Entries = 0;
+    size_t Bytes = 0;
+};
+
+// Thread-safe LRU cache split into independently locked shards. The memory
+// limit is shared evenly between shards and is checked against the cost the
+// caller passes to Put(), which should approximate the bytes an entry holds.
+template<typename TKey, typename TValue, typename THash = std::hash<TKey>>
+class TShardedLruCache {
+public:
+    TShardedLruCache(size_t maxBytes, size_t shardsCount = 16)
+        : Shards(shardsCount ? shardsCount : 1)
+        , MaxShardBytes(maxBytes / Shards.size())
+    {
+    }
+
+    bool Get(const TKey& key, TValue& value) {
+        TShard& shard = GetShard(key);
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto it = shard.Index.find(key);
+        if (it == shard.Index.end()) {
+            Misses.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        shard.Entries.splice(shard.Entries.begin(), shard.Entries, it->second);
+        value = it->second->Value;
+        Hits.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    void Put(const TKey& key, const TValue& value, size_t cost) {
+        cost += sizeof(TEntry) + sizeof(TKey);
+        TShard& shard = GetShard(key);
+        if (cost > MaxShardBytes) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(shard.Mutex);
+        auto it = shard.Index.find(key);
+        if (it != shard.Index.end()) {
+            shard.Bytes -= it->second->Cost;
+            shard.Entries.erase(it->second);
+            shard.Index.erase(it);
+        }
+        while (!shard.Entries.empty() && shard.Bytes + cost > MaxShardBytes) {
+            const TEntry& last = shard.Entries.back();
+            shard.Bytes -= last.Cost;
+            shard.Index.erase(last.Key);
+            shard.Entries.pop_back();
+        }
+        shard.Entries.push_front(TEntry{key, value, cost});
+        shard.Index[key] = shard.Entries.begin();
+        shard.Bytes += cost;
+    }
+
+    void Clear() {
+        for (auto&& shard: Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            shard.Index.clear();
+            shard.Entries.clear();
+            shard.Bytes = 0;
+        }
+        Hits = 0;
+        Misses = 0;
+    }
+
+    TCacheStats GetStats() const {
+        TCacheStats stats;
+        stats.Hits = Hits.load(std::memory_order_relaxed);
+        stats.Misses = Misses.load(std::memory_order_relaxed);
+        for (auto&& shard: Shards) {
+            std::lock_guard<std::mutex> lock(shard.Mutex);
+            stats.Entries += shard.Index.size();
+            stats.Bytes += shard.Bytes;
+        }
+        return stats;
+    }
+
+private:
+    struct TEntry {
+        TKey Key;
+        TValue Value;
+        size_t Cost;
+    };
+    using TEntries = std::list<TEntry>;
+    struct TShard {
+        mutable std::mutex Mutex;
+        TEntries Entries; // most recently used first
+        std::unordered_map<TKey, typename TEntries::iterator, THash> Index;
+        size_t Bytes = 0;
+    };
+
+    TShard& GetShard(const TKey& key) {
+        // the low bits also pick the bucket inside the shard's map, so mix
+        // in the high bits before choosing a shard
+        size_t hash = THash()(key);
+        hash ^= hash >> 29;
+        return Shards[hash % Shards.size()];
+    }
+
+private:
+    std::vector<TShard> Shards;
+    size_t MaxShardBytes;
+    std::atomic<uint64_t> Hits{0};
+    std::atomic<uint64_t> Misses{0};
+};
+
+} // NJamSpell
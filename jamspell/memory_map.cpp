@@ -0,0 +1,227 @@
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <utility>
+
+#ifndef _WIN32
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+#include <contrib/handypack/handypack.hpp>
+
+#include "memory_map.hpp"
+
+namespace NJamSpell {
+
+TMemoryMappedFile::~TMemoryMappedFile() {
+    Close();
+}
+
+bool TMemoryMappedFile::Open(const std::string& fileName) {
+    Close();
+#ifndef _WIN32
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+    void* ptr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    Ptr = (const char*)ptr;
+    Len = st.st_size;
+    Mapped = true;
+    return true;
+#else
+    std::ifstream in(fileName, std::ios::binary | std::ios::ate);
+    if (!in.is_open()) {
+        return false;
+    }
+    std::streamoff size = in.tellg();
+    if (size <= 0) {
+        return false;
+    }
+    char* buff = new char[size];
+    in.seekg(0);
+    if (!in.read(buff, size)) {
+        delete[] buff;
+        return false;
+    }
+    Ptr = buff;
+    Len = size;
+    Mapped = false;
+    return true;
+#endif
+}
+
+void TMemoryMappedFile::Close() {
+    if (!Ptr) {
+        return;
+    }
+#ifndef _WIN32
+    if (Mapped) {
+        munmap((void*)Ptr, Len);
+    }
+#endif
+    if (!Mapped) {
+        delete[] Ptr;
+    }
+    Ptr = nullptr;
+    Len = 0;
+    Mapped = false;
+}
+
+const char* TMemoryMappedFile::Data() const {
+    return Ptr;
+}
+
+size_t TMemoryMappedFile::Size() const {
+    return Len;
+}
+
+static const size_t HUGE_PAGE_SIZE = size_t(2) << 20;
+
+THugePageBuffer::~THugePageBuffer() {
+    Release();
+}
+
+bool THugePageBuffer::Allocate(size_t size) {
+    Release();
+#ifndef _WIN32
+    if (size == 0) {
+        return false;
+    }
+    size_t len = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+#ifdef MAP_HUGETLB
+    void* ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED) {
+        Ptr = (char*)ptr;
+        Len = len;
+        return true;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    // transparent huge pages need 2 MB aligned ranges, so over-allocate and
+    // trim both ends
+    void* raw = mmap(nullptr, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) {
+        return false;
+    }
+    char* begin = (char*)raw;
+    char* aligned = (char*)(((uintptr_t)begin + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE);
+    if (aligned != begin) {
+        munmap(begin, aligned - begin);
+    }
+    char* end = begin + len + HUGE_PAGE_SIZE;
+    if (aligned + len != end) {
+        munmap(aligned + len, end - (aligned + len));
+    }
+    if (madvise(aligned, len, MADV_HUGEPAGE) != 0) {
+        munmap(aligned, len);
+        return false;
+    }
+    Ptr = aligned;
+    Len = len;
+    return true;
+#endif
+#endif
+    return false;
+}
+
+void THugePageBuffer::Release() {
+#ifndef _WIN32
+    if (Ptr) {
+        munmap(Ptr, Len);
+    }
+#endif
+    Ptr = nullptr;
+    Len = 0;
+}
+
+void THugePageBuffer::Swap(THugePageBuffer& other) {
+    std::swap(Ptr, other.Ptr);
+    std::swap(Len, other.Len);
+}
+
+char* THugePageBuffer::Data() const {
+    return Ptr;
+}
+
+TMemoryStreamBuf::TMemoryStreamBuf(const char* data, size_t size) {
+    char* p = const_cast<char*>(data);
+    setg(p, p, p + size);
+}
+
+size_t TMemoryStreamBuf::Tell() const {
+    return gptr() - eback();
+}
+
+const char* TMemoryStreamBuf::Current() const {
+    return gptr();
+}
+
+bool TMemoryStreamBuf::Skip(size_t size) {
+    if (size > size_t(egptr() - gptr())) {
+        return false;
+    }
+    setg(eback(), gptr() + size, egptr());
+    return true;
+}
+
+TMemoryStream::TMemoryStream(const char* data, size_t size)
+    : TMemoryStreamBuf(data, size)
+    , std::istream(static_cast<std::streambuf*>(this))
+{
+}
+
+std::string TemporaryFileName(const std::string& fileName) {
+    return fileName + ".tmp";
+}
+
+bool CommitFile(const std::string& tempFileName, const std::string& fileName) {
+#ifdef _WIN32
+    std::remove(fileName.c_str());
+#endif
+    if (std::rename(tempFileName.c_str(), fileName.c_str()) != 0) {
+        std::remove(tempFileName.c_str());
+        return false;
+    }
+    return true;
+}
+
+static size_t SectionPadding(uint64_t pos) {
+    return (MAPPED_SECTION_ALIGNMENT - pos % MAPPED_SECTION_ALIGNMENT) % MAPPED_SECTION_ALIGNMENT;
+}
+
+void DumpSection(std::ostream& out, const void* data, uint64_t size) {
+    NHandyPack::Dump(out, size);
+    static const char zeros[MAPPED_SECTION_ALIGNMENT] = {};
+    out.write(zeros, SectionPadding(out.tellp()));
+    if (size) {
+        out.write((const char*)data, size);
+    }
+}
+
+const char* MapSection(TMemoryStream& in, uint64_t& size) {
+    size = 0;
+    NHandyPack::Load(in, size);
+    if (!in.good() || !in.Skip(SectionPadding(in.Tell()))) {
+        return nullptr;
+    }
+    const char* data = in.Current();
+    if (!in.Skip(size)) {
+        return nullptr;
+    }
+    return data;
+}
+
+} // NJamSpell
@@ -0,0 +1,174 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <streambuf>
+#include <istream>
+#include <ostream>
+
+namespace NJamSpell {
+
+// Raw sections inside model and cache files start at this alignment,
+// relative to the beginning of the file.
+constexpr size_t MAPPED_SECTION_ALIGNMENT = 64;
+
+// Read-only view of a whole file. The file is mmap'ed where available, so
+// its pages are loaded lazily and shared between processes; otherwise it is
+// read into memory.
+class TMemoryMappedFile {
+public:
+    TMemoryMappedFile() = default;
+    TMemoryMappedFile(const TMemoryMappedFile& other) = delete;
+    TMemoryMappedFile& operator=(const TMemoryMappedFile& other) = delete;
+    ~TMemoryMappedFile();
+    bool Open(const std::string& fileName);
+    void Close();
+    const char* Data() const;
+    size_t Size() const;
+private:
+    const char* Ptr = nullptr;
+    size_t Len = 0;
+    bool Mapped = false;
+};
+
+// Anonymous memory for large tables that are read at random. Allocate()
+// backs it with huge pages, explicit ones when the system has them reserved
+// and transparent ones otherwise, so that lookups spread over the table miss
+// the TLB less often. It fails where neither is available.
+class THugePageBuffer {
+public:
+    THugePageBuffer() = default;
+    THugePageBuffer(const THugePageBuffer& other) = delete;
+    THugePageBuffer& operator=(const THugePageBuffer& other) = delete;
+    ~THugePageBuffer();
+    bool Allocate(size_t size);
+    void Release();
+    void Swap(THugePageBuffer& other);
+    char* Data() const;
+private:
+    char* Ptr = nullptr;
+    size_t Len = 0;
+};
+
+// Hint that ptr will be read soon; lookups that go through several random
+// memory accesses issue it for a batch of keys before resolving any of them.
+inline void Prefetch(const void* ptr) {
+#if defined(__GNUC__) || defined(__clang__)
+    __builtin_prefetch(ptr);
+#endif
+}
+
+// Array that either owns its elements or points into a mapped file.
+template<typename T>
+class TMappedArray {
+public:
+    TMappedArray() = default;
+    TMappedArray(const TMappedArray& other) = delete;
+    TMappedArray& operator=(const TMappedArray& other) = delete;
+
+    void Assign(std::vector<T>&& data) {
+        HugePages.Release();
+        Owned = std::move(data);
+        Ptr = Owned.data();
+        Len = Owned.size();
+    }
+    void Map(const T* data, size_t size) {
+        std::vector<T>().swap(Owned);
+        HugePages.Release();
+        Ptr = data;
+        Len = size;
+    }
+    // Moves the elements to huge pages owned by the array. On failure they
+    // stay where they were.
+    bool CopyToHugePages() {
+        if (Len == 0 || (HugePages.Data() && Ptr == (const T*)HugePages.Data())) {
+            return Len != 0;
+        }
+        THugePageBuffer buffer;
+        if (!buffer.Allocate(Len * sizeof(T))) {
+            return false;
+        }
+        memcpy(buffer.Data(), Ptr, Len * sizeof(T));
+        size_t len = Len;
+        Map(nullptr, 0);
+        HugePages.Swap(buffer);
+        Ptr = (const T*)HugePages.Data();
+        Len = len;
+        return true;
+    }
+    void Clear() {
+        Map(nullptr, 0);
+    }
+    const T& operator[](size_t i) const {
+        return Ptr[i];
+    }
+    const T* data() const {
+        return Ptr;
+    }
+    const T* begin() const {
+        return Ptr;
+    }
+    const T* end() const {
+        return Ptr + Len;
+    }
+    size_t size() const {
+        return Len;
+    }
+    bool empty() const {
+        return Len == 0;
+    }
+private:
+    std::vector<T> Owned;
+    THugePageBuffer HugePages;
+    const T* Ptr = nullptr;
+    size_t Len = 0;
+};
+
+class TMemoryStreamBuf: public std::streambuf {
+public:
+    TMemoryStreamBuf(const char* data, size_t size);
+    size_t Tell() const;
+    const char* Current() const;
+    bool Skip(size_t size);
+};
+
+// Input stream over a memory range which can hand out pointers to its
+// contents, so HANDYPACK fields and mapped sections can share one file.
+class TMemoryStream: private TMemoryStreamBuf, public std::istream {
+public:
+    TMemoryStream(const char* data, size_t size);
+    using TMemoryStreamBuf::Tell;
+    using TMemoryStreamBuf::Current;
+    using TMemoryStreamBuf::Skip;
+};
+
+// Files that may be mapped by a running process must never be truncated in
+// place. Writers dump into TemporaryFileName() and then CommitFile() renames
+// the result over the target, so existing mappings keep the old contents.
+std::string TemporaryFileName(const std::string& fileName);
+bool CommitFile(const std::string& tempFileName, const std::string& fileName);
+
+// Section layout: uint64 byte size, zero padding up to
+// MAPPED_SECTION_ALIGNMENT, raw bytes.
+void DumpSection(std::ostream& out, const void* data, uint64_t size);
+const char* MapSection(TMemoryStream& in, uint64_t& size);
+
+template<typename T>
+void DumpSection(std::ostream& out, const TMappedArray<T>& data) {
+    DumpSection(out, data.data(), data.size() * sizeof(T));
+}
+
+template<typename T>
+bool MapSection(TMemoryStream& in, TMappedArray<T>& data) {
+    uint64_t size = 0;
+    const char* ptr = MapSection(in, size);
+    if (!ptr || size % sizeof(T) != 0) {
+        return false;
+    }
+    data.Map((const T*)ptr, size / sizeof(T));
+    return true;
+}
+
+} // NJamSpell
@@ -0,0 +1,134 @@
+#include <cstdio>
+
+#include "metrics.hpp"
+
+namespace NJamSpell {
+
+std::atomic<bool> MetricsEnabledFlag(false);
+
+void EnableMetrics(bool enabled) {
+    MetricsEnabledFlag.store(enabled, std::memory_order_relaxed);
+}
+
+// 1us to 10s in 1-2.5-5 steps.
+static std::vector<uint64_t> LatencyBoundsNs() {
+    std::vector<uint64_t> bounds;
+    for (uint64_t decade = 1000; decade <= 1000000000ull; decade *= 10) {
+        bounds.push_back(decade);
+        bounds.push_back(decade * 5 / 2);
+        bounds.push_back(decade * 5);
+    }
+    bounds.push_back(10000000000ull);
+    return bounds;
+}
+
+static std::vector<uint64_t> GeometricBounds(uint64_t from, uint64_t to, uint64_t factor) {
+    std::vector<uint64_t> bounds;
+    for (uint64_t b = from; b <= to; b *= factor) {
+        bounds.push_back(b);
+    }
+    return bounds;
+}
+
+THistogram::THistogram(std::vector<uint64_t> bounds)
+    : Bounds(std::move(bounds))
+    , Buckets(Bounds.size() + 1)
+{
+}
+
+void THistogram::Observe(uint64_t value) {
+    size_t bucket = 0;
+    while (bucket < Bounds.size() && value > Bounds[bucket]) {
+        ++bucket;
+    }
+    Buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    Sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+static std::string FormatNumber(double value) {
+    char buff[32];
+    snprintf(buff, sizeof(buff), "%.9g", value);
+    return buff;
+}
+
+static std::string JoinLabels(const std::string& labels, const std::string& label) {
+    if (labels.empty()) {
+        return "{" + label + "}";
+    }
+    return "{" + labels + "," + label + "}";
+}
+
+void THistogram::Write(std::string& out, const std::string& name, const std::string& labels, double scale) const {
+    uint64_t count = 0;
+    for (size_t i = 0; i <= Bounds.size(); ++i) {
+        count += Buckets[i].load(std::memory_order_relaxed);
+        std::string le = i < Bounds.size() ? FormatNumber(Bounds[i] * scale) : "+Inf";
+        out += name + "_bucket" + JoinLabels(labels, "le=\"" + le + "\"") + " " + std::to_string(count) + "\n";
+    }
+    std::string suffix = labels.empty() ? "" : "{" + labels + "}";
+    out += name + "_sum" + suffix + " " + FormatNumber(Sum.load(std::memory_order_relaxed) * scale) + "\n";
+    out += name + "_count" + suffix + " " + std::to_string(count) + "\n";
+}
+
+TMetrics::TMetrics()
+    : CandidatesPerToken(GeometricBounds(1, 1024, 2))
+    , RequestBytes(GeometricBounds(64, 16 << 20, 4))
+    , RequestNs(LatencyBoundsNs())
+{
+    for (auto&& stage: Stages) {
+        stage.reset(new THistogram(LatencyBoundsNs()));
+    }
+}
+
+TMetrics& GetMetrics() {
+    static TMetrics metrics;
+    return metrics;
+}
+
+static const char* StageName(EStage stage) {
+    switch (stage) {
+    case EStage::Tokenize: return "tokenize";
+    case EStage::Edits2: return "edits2";
+    case EStage::Edits: return "edits";
+    case EStage::Score: return "score";
+    case EStage::Json: return "json";
+    case EStage::Count: break;
+    }
+    return "unknown";
+}
+
+static void WriteHeader(std::string& out, const std::string& name, const std::string& type, const std::string& help) {
+    out += "# HELP " + name + " " + help + "\n";
+    out += "# TYPE " + name + " " + type + "\n";
+}
+
+static void WriteCounter(std::string& out, const std::string& name, const std::string& help, uint64_t value) {
+    WriteHeader(out, name, "counter", help);
+    out += name + " " + std::to_string(value) + "\n";
+}
+
+void WriteMetrics(std::string& out) {
+    TMetrics& metrics = GetMetrics();
+    WriteHeader(out, "jamspell_stage_seconds", "histogram",
+                "Time spent per call of each correction stage: tokenize, first (edits2) and "
+                "second (edits) level candidates, scoring of the candidates of a word, JSON output.");
+    for (size_t i = 0; i < size_t(EStage::Count); ++i) {
+        EStage stage = EStage(i);
+        metrics.StageNs(stage).Write(out, "jamspell_stage_seconds",
+                                     std::string("stage=\"") + StageName(stage) + "\"", 1e-9);
+    }
+    WriteCounter(out, "jamspell_bloom_probes_total", "Bloom filter probes made generating candidates.",
+                 metrics.Counter(ECounter::BloomProbes).Get());
+    WriteCounter(out, "jamspell_gram_probes_total", "N-gram table lookups made scoring.",
+                 metrics.Counter(ECounter::GramProbes).Get());
+    WriteCounter(out, "jamspell_degraded_words_total", "Words corrected with less effort to meet a latency budget.",
+                 metrics.Counter(ECounter::DegradedWords).Get());
+    WriteHeader(out, "jamspell_candidates_per_token", "histogram", "Scored candidates per word.");
+    metrics.CandidatesPerToken.Write(out, "jamspell_candidates_per_token", "", 1);
+    WriteHeader(out, "jamspell_request_bytes", "histogram", "Size of the request bodies or texts.");
+    metrics.RequestBytes.Write(out, "jamspell_request_bytes", "", 1);
+    WriteHeader(out, "jamspell_request_seconds", "histogram", "Time to answer a request.");
+    metrics.RequestNs.Write(out, "jamspell_request_seconds", "", 1e-9);
+}
+
+} // NJamSpell
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace NJamSpell {
+
+// Process-wide counters and histograms of the correction stages, written in
+// the Prometheus text format by WriteMetrics(). They are only updated while
+// metrics are enabled (off by default): a timer that is off never reads the
+// clock, and updates that are on are relaxed atomic adds.
+enum class EStage {
+    Tokenize,
+    Edits2,  // first level candidates, Edits2() or the deletion index
+    Edits,   // second level candidates when the first level found none
+    Score,
+    Json,
+    Count,
+};
+
+enum class ECounter {
+    BloomProbes,
+    GramProbes,
+    DegradedWords, // corrected with less effort to meet a TLatencyBudget
+    Count,
+};
+
+void EnableMetrics(bool enabled);
+
+class TMetricCounter {
+public:
+    void Add(uint64_t value) {
+        Value.fetch_add(value, std::memory_order_relaxed);
+    }
+    uint64_t Get() const {
+        return Value.load(std::memory_order_relaxed);
+    }
+private:
+    std::atomic<uint64_t> Value{0};
+};
+
+// Cumulative histogram over integer values; Bounds are the inclusive upper
+// bounds of the buckets, the last one catching everything above them.
+class THistogram {
+public:
+    explicit THistogram(std::vector<uint64_t> bounds);
+    THistogram(const THistogram& other) = delete;
+    THistogram& operator=(const THistogram& other) = delete;
+    void Observe(uint64_t value);
+    // Values are multiplied by scale, e.g. 1e-9 for nanoseconds in seconds.
+    void Write(std::string& out, const std::string& name, const std::string& labels, double scale) const;
+private:
+    std::vector<uint64_t> Bounds;
+    std::vector<std::atomic<uint64_t>> Buckets;
+    std::atomic<uint64_t> Sum{0};
+};
+
+struct TMetrics {
+    TMetrics();
+    THistogram& StageNs(EStage stage) {
+        return *Stages[size_t(stage)];
+    }
+    TMetricCounter& Counter(ECounter counter) {
+        return Counters[size_t(counter)];
+    }
+    THistogram CandidatesPerToken;
+    // requests are observed by the servers
+    THistogram RequestBytes;
+    THistogram RequestNs;
+private:
+    std::array<std::unique_ptr<THistogram>, size_t(EStage::Count)> Stages;
+    std::array<TMetricCounter, size_t(ECounter::Count)> Counters;
+};
+
+TMetrics& GetMetrics();
+
+// Appends every metric, each with its HELP and TYPE lines.
+void WriteMetrics(std::string& out);
+
+extern std::atomic<bool> MetricsEnabledFlag; // set by EnableMetrics()
+
+inline bool MetricsEnabled() {
+    return MetricsEnabledFlag.load(std::memory_order_relaxed);
+}
+
+inline void AddMetric(ECounter counter, uint64_t value) {
+    if (MetricsEnabled()) {
+        GetMetrics().Counter(counter).Add(value);
+    }
+}
+
+inline void ObserveMetric(THistogram& histogram, uint64_t value) {
+    if (MetricsEnabled()) {
+        histogram.Observe(value);
+    }
+}
+
+// Adds the time of its scope to the histogram of the stage.
+class TStageTimer {
+public:
+    explicit TStageTimer(EStage stage)
+        : Stage(stage)
+        , Enabled(MetricsEnabled())
+    {
+        if (Enabled) {
+            Start = std::chrono::steady_clock::now();
+        }
+    }
+    TStageTimer(const TStageTimer& other) = delete;
+    TStageTimer& operator=(const TStageTimer& other) = delete;
+    ~TStageTimer() {
+        if (Enabled) {
+            auto elapsed = std::chrono::steady_clock::now() - Start;
+            GetMetrics().StageNs(Stage).Observe(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+    }
+private:
+    EStage Stage;
+    bool Enabled;
+    std::chrono::steady_clock::time_point Start;
+};
+
+} // NJamSpell
@@ -1,82 +1,330 @@
 #include <contrib/handypack/handypack.hpp>
 #include <contrib/phf/phf.h>
+#include <contrib/cityhash/city.h>
 
 #include "perfect_hash.hpp"
+#include "thread_pool.hpp"
 
+#include <atomic>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
 
 namespace NJamSpell {
 
-void TPerfectHash::Dump(std::ostream& out) const {
-    const phf& perfHash = *(const phf*)Phf;
+static void DumpHeader(std::ostream& out, const phf& perfHash) {
     NHandyPack::Dump(out, perfHash.d_max,
                          perfHash.g_op,
                          perfHash.m,
                          perfHash.r,
                          perfHash.seed,
                          perfHash.nodiv);
-    out.write((const char*)perfHash.g, perfHash.r * sizeof(uint32_t));
 }
 
-void TPerfectHash::Load(std::istream& in) {
-    Clear();
-    Phf = new phf();
-    phf& perfHash = *(phf*)Phf;
+static void LoadHeader(std::istream& in, phf& perfHash) {
     NHandyPack::Load(in, perfHash.d_max,
                         perfHash.g_op,
                         perfHash.m,
                         perfHash.r,
                         perfHash.seed,
                         perfHash.nodiv);
+}
+
+static uint32_t PartitionOf(const char* value, size_t size, uint32_t seed, uint32_t partitions) {
+    uint64_t hash = CityHash64WithSeed(value, size, seed);
+    return uint32_t(((hash >> 32) * partitions) >> 32);
+}
+
+static uint32_t PartitionOf(uint64_t value, uint32_t seed, uint32_t partitions) {
+    // splitmix64 finalizer over the seeded key
+    uint64_t hash = value + seed * 0x9E3779B97F4A7C15ULL;
+    hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+    hash ^= hash >> 31;
+    return uint32_t(((hash >> 32) * partitions) >> 32);
+}
+
+// Builds a table per partition of keys, on pool when one is given. Returns
+// nullptr if any of them fails.
+template<typename TKey>
+static phf* BuildPartitions(std::vector<std::vector<TKey>>& keys, const TPerfectHashParams& params, TThreadPool* pool) {
+    const size_t partitions = keys.size();
+    phf* tempPhf = new phf[partitions]();
+    std::atomic<bool> failed(false);
+    auto build = [&](size_t i) {
+        std::vector<TKey>& part = keys[i];
+        phf_error_t res = PHF::init<TKey, false>(&tempPhf[i], part.data(), part.size(),
+                                                  params.Lambda, params.Alpha, params.Seed);
+        if (res != 0) {
+            failed = true;
+        }
+        std::vector<TKey>().swap(part);
+    };
+    if (pool && partitions > 1) {
+        ParallelFor(*pool, partitions, build);
+    } else {
+        for (size_t i = 0; i < partitions; ++i) {
+            build(i);
+        }
+    }
+    if (failed) {
+        for (size_t i = 0; i < partitions; ++i) {
+            PHF::destroy(&tempPhf[i]);
+        }
+        delete[] tempPhf;
+        return nullptr;
+    }
+    return tempPhf;
+}
+
+static size_t TableSize(const phf& perfHash) {
+    return (const char*)PHF::slot_addr(&perfHash, perfHash.r) - (const char*)perfHash.g;
+}
+
+void TPerfectHash::Dump(std::ostream& out) const {
+    assert(Partitions == 1 && "Only mapped hashes can be partitioned");
+    const phf& perfHash = *(const phf*)Phf;
+    DumpHeader(out, perfHash);
+    out.write((const char*)perfHash.g, perfHash.r * sizeof(uint32_t));
+}
+
+void TPerfectHash::Load(std::istream& in) {
+    Reset(1, 0);
+    phf& perfHash = *(phf*)Phf;
+    LoadHeader(in, perfHash);
     perfHash.g = (uint32_t*)calloc(perfHash.r, sizeof(uint32_t));
     in.read((char*)perfHash.g, perfHash.r * sizeof(uint32_t));
+    BucketOffsets = {0, uint32_t(perfHash.m)};
+}
+
+// Layout: uint32 partitions, uint32 partition seed, then for every
+// partition the PHF header followed by its displacements as a section.
+void TPerfectHash::DumpMapped(std::ostream& out) const {
+    NHandyPack::Dump(out, Partitions, PartitionSeed);
+    for (uint32_t i = 0; i < Partitions; ++i) {
+        const phf& perfHash = ((const phf*)Phf)[i];
+        DumpHeader(out, perfHash);
+        DumpSection(out, perfHash.g, perfHash.r * sizeof(uint32_t));
+    }
+}
+
+bool TPerfectHash::MapTable(TMemoryStream& in, uint32_t partition) {
+    phf& perfHash = ((phf*)Phf)[partition];
+    LoadHeader(in, perfHash);
+    uint64_t size = 0;
+    const char* g = MapSection(in, size);
+    if (!g || size != perfHash.r * sizeof(uint32_t)) {
+        return false;
+    }
+    // g stays inside the mapped file, PHF::hash() only reads it
+    perfHash.g = (uint32_t*)g;
+    BucketOffsets[partition + 1] = BucketOffsets[partition] + perfHash.m;
+    return true;
+}
+
+bool TPerfectHash::LoadMapped(TMemoryStream& in) {
+    uint32_t partitions = 0;
+    uint32_t partitionSeed = 0;
+    NHandyPack::Load(in, partitions, partitionSeed);
+    if (!in.good() || partitions == 0) {
+        Clear();
+        return false;
+    }
+    Reset(partitions, partitionSeed);
+    MappedTable = true;
+    for (uint32_t i = 0; i < partitions; ++i) {
+        if (!MapTable(in, i)) {
+            Clear();
+            return false;
+        }
+    }
+    return true;
 }
 
 bool TPerfectHash::Init(const std::vector<std::string>& keys) {
-    std::vector<phf_string_t> keysForPhf;
-    keysForPhf.reserve(keys.size());
+    std::vector<TKeyRef> refs;
+    refs.reserve(keys.size());
     for (const std::string& s: keys) {
-        keysForPhf.push_back({&s[0], s.size()});
+        refs.push_back(TKeyRef(s.data(), s.size()));
     }
+    return Init(refs);
+}
 
-    phf* tempPhf = new phf();
-    phf_error_t res = PHF::init<phf_string_t, false>(tempPhf, &keysForPhf[0], keysForPhf.size(), 4, 80, 42);
-    if (res != 0) {
-        PHF::destroy(tempPhf);
-        delete tempPhf;
+bool TPerfectHash::Init(const std::vector<TKeyRef>& keys, const TPerfectHashParams& params, TThreadPool* pool) {
+    const uint32_t partitions = params.Partitions ? params.Partitions : 1;
+    std::vector<std::vector<phf_string_t>> keysForPhf(partitions);
+    if (partitions == 1) {
+        keysForPhf[0].reserve(keys.size());
+    }
+    for (const TKeyRef& k: keys) {
+        uint32_t partition = partitions > 1 ? PartitionOf(k.first, k.second, params.Seed, partitions) : 0;
+        keysForPhf[partition].push_back({k.first, k.second});
+    }
+    phf* phfs = BuildPartitions(keysForPhf, params, pool);
+    if (!phfs) {
         return false;
     }
-    Clear();
-    Phf = tempPhf;
+    Assign(phfs, partitions, params.Seed);
     return true;
 }
 
+bool TPerfectHash::Init(const std::vector<uint64_t>& keys, const TPerfectHashParams& params, TThreadPool* pool) {
+    const uint32_t partitions = params.Partitions ? params.Partitions : 1;
+    std::vector<std::vector<uint64_t>> keysForPhf(partitions);
+    if (partitions == 1) {
+        keysForPhf[0] = keys;
+    } else {
+        for (uint64_t k: keys) {
+            keysForPhf[PartitionOf(k, params.Seed, partitions)].push_back(k);
+        }
+    }
+    phf* phfs = BuildPartitions(keysForPhf, params, pool);
+    if (!phfs) {
+        return false;
+    }
+    Assign(phfs, partitions, params.Seed);
+    return true;
+}
+
+void TPerfectHash::Assign(void* phfs, uint32_t partitions, uint32_t partitionSeed) {
+    Clear();
+    Phf = phfs;
+    Partitions = partitions;
+    PartitionSeed = partitionSeed;
+    BucketOffsets.assign(partitions + 1, 0);
+    for (uint32_t i = 0; i < partitions; ++i) {
+        BucketOffsets[i + 1] = BucketOffsets[i] + ((phf*)phfs)[i].m;
+    }
+}
+
+void TPerfectHash::Reset(uint32_t partitions, uint32_t partitionSeed) {
+    Clear();
+    Phf = new phf[partitions]();
+    Partitions = partitions;
+    PartitionSeed = partitionSeed;
+    BucketOffsets.assign(partitions + 1, 0);
+}
+
 void TPerfectHash::Clear() {
     if (!Phf) {
         return;
     }
-    PHF::destroy((phf*)Phf);
-    delete (phf*)Phf;
+    phf* phfs = (phf*)Phf;
+    for (uint32_t i = 0; i < Partitions; ++i) {
+        if (MappedTable) {
+            phfs[i].g = nullptr;
+        }
+        PHF::destroy(&phfs[i]);
+    }
+    MappedTable = false;
+    HugePages.Release();
+    delete[] phfs;
+    Phf = nullptr;
+    Partitions = 0;
+    PartitionSeed = 0;
+    BucketOffsets.clear();
+}
+
+uint32_t TPerfectHash::Partition(const char* value, size_t size) const {
+    if (Partitions == 1) {
+        return 0;
+    }
+    return PartitionOf(value, size, PartitionSeed, Partitions);
+}
+
+uint32_t TPerfectHash::Partition(uint64_t value) const {
+    if (Partitions == 1) {
+        return 0;
+    }
+    return PartitionOf(value, PartitionSeed, Partitions);
 }
 
 uint32_t TPerfectHash::Hash(const std::string& value) const {
-    assert(Phf && "Not initialized");
-    return PHF::hash<std::string>((phf*)Phf, value);
+    return Hash(value.data(), value.size());
 }
 
 uint32_t TPerfectHash::Hash(const char* value, size_t size) const {
     assert(Phf && "Not initialized");
+    uint32_t partition = Partition(value, size);
+    phf_string_t phfValue = {value, size};
+    return BucketOffsets[partition] + PHF::hash<phf_string_t>((phf*)Phf + partition, phfValue);
+}
+
+uint32_t TPerfectHash::Hash(uint64_t value) const {
+    assert(Phf && "Not initialized");
+    uint32_t partition = Partition(value);
+    return BucketOffsets[partition] + PHF::hash<uint64_t>((phf*)Phf + partition, value);
+}
+
+TPerfectHash::TSlot TPerfectHash::Slot(const char* value, size_t size) const {
+    assert(Phf && "Not initialized");
+    uint32_t partition = Partition(value, size);
+    phf_string_t phfValue = {value, size};
+    return (TSlot(partition) << 32) | PHF::slot<phf_string_t>((phf*)Phf + partition, phfValue);
+}
+
+TPerfectHash::TSlot TPerfectHash::Slot(uint64_t value) const {
+    assert(Phf && "Not initialized");
+    uint32_t partition = Partition(value);
+    return (TSlot(partition) << 32) | PHF::slot<uint64_t>((phf*)Phf + partition, value);
+}
+
+const void* TPerfectHash::SlotAddress(TSlot slot) const {
+    return PHF::slot_addr((const phf*)Phf + (slot >> 32), uint32_t(slot));
+}
+
+uint32_t TPerfectHash::HashSlot(const char* value, size_t size, TSlot slot) const {
+    uint32_t partition = uint32_t(slot >> 32);
     phf_string_t phfValue = {value, size};
-    return PHF::hash<phf_string_t>((phf*)Phf, phfValue);
+    return BucketOffsets[partition] + PHF::hash_slot<phf_string_t>((phf*)Phf + partition, phfValue, uint32_t(slot));
+}
+
+uint32_t TPerfectHash::HashSlot(uint64_t value, TSlot slot) const {
+    uint32_t partition = uint32_t(slot >> 32);
+    return BucketOffsets[partition] + PHF::hash_slot<uint64_t>((phf*)Phf + partition, value, uint32_t(slot));
 }
 
 uint32_t TPerfectHash::BucketsNumber() const {
-    const phf* p = (phf*)Phf;
-    return p->m;
+    return Phf ? BucketOffsets.back() : 0;
+}
+
+uint32_t TPerfectHash::PartitionsNumber() const {
+    return Partitions;
+}
+
+bool TPerfectHash::CopyToHugePages() {
+    if (!Phf) {
+        return false;
+    }
+    phf* phfs = (phf*)Phf;
+    size_t total = 0;
+    for (uint32_t i = 0; i < Partitions; ++i) {
+        total += TableSize(phfs[i]);
+    }
+    THugePageBuffer buffer;
+    if (!buffer.Allocate(total)) {
+        return false;
+    }
+    char* ptr = buffer.Data();
+    for (uint32_t i = 0; i < Partitions; ++i) {
+        size_t size = TableSize(phfs[i]);
+        memcpy(ptr, phfs[i].g, size);
+        if (!MappedTable) {
+            free(phfs[i].g);
+        }
+        phfs[i].g = (uint32_t*)ptr;
+        ptr += size;
+    }
+    HugePages.Swap(buffer);
+    MappedTable = true;
+    return true;
 }
 
 TPerfectHash::TPerfectHash()
     : Phf(nullptr)
+    , Partitions(0)
+    , PartitionSeed(0)
+    , MappedTable(false)
 {
 }
 
@@ -1,23 +1,84 @@
 #pragma once
 
 #include <ostream>
+#include <vector>
+#include <string>
+#include <utility>
+
+#include "memory_map.hpp"
 
 namespace NJamSpell {
 
+class TThreadPool;
+
+// PHF::init() parameters: keys per displacement (lambda), load factor in
+// percent (alpha) and seed. With Partitions > 1 the keys are split by a
+// seeded hash into independent tables, which are built in parallel and each
+// need a fraction of the temporary memory; lookups hash the key once more to
+// find its table.
+struct TPerfectHashParams {
+    size_t Lambda = 4;
+    size_t Alpha = 80;
+    uint32_t Seed = 42;
+    uint32_t Partitions = 1;
+};
+
+// Hash() is safe to call concurrently once Init() or one of the loads has
+// returned. LoadMapped() keeps pointing into the stream memory, which must
+// outlive the hash. Keys are either byte strings or 64-bit integers; a hash
+// must be queried with the kind of keys it was built from, which the file
+// does not record.
 class TPerfectHash {
 public:
+    // Key bytes and size; the bytes only have to live during Init().
+    using TKeyRef = std::pair<const char*, size_t>;
+    // Partition in the high half, slot of its displacement table in the low.
+    using TSlot = uint64_t;
+
     TPerfectHash();
     TPerfectHash(const TPerfectHash& other) = delete;
     ~TPerfectHash();
+    // Dump() and Load() keep the HANDYPACK layout of version 9 models and
+    // only support a single partition.
     void Dump(std::ostream& out) const;
     void Load(std::istream& in);
+    void DumpMapped(std::ostream& out) const;
+    bool LoadMapped(TMemoryStream& in);
     bool Init(const std::vector<std::string>& keys);
+    // Partitions are built on pool when one is given.
+    bool Init(const std::vector<TKeyRef>& keys, const TPerfectHashParams& params = TPerfectHashParams(),
+              TThreadPool* pool = nullptr);
+    bool Init(const std::vector<uint64_t>& keys, const TPerfectHashParams& params = TPerfectHashParams(),
+              TThreadPool* pool = nullptr);
     void Clear();
     uint32_t Hash(const std::string& value) const;
     uint32_t Hash(const char* value, size_t size) const;
+    uint32_t Hash(uint64_t value) const;
+    // Hash() in two steps for batched lookups: Slot() only hashes the key,
+    // so the displacement at SlotAddress() can be prefetched before
+    // HashSlot() reads it.
+    TSlot Slot(const char* value, size_t size) const;
+    TSlot Slot(uint64_t value) const;
+    const void* SlotAddress(TSlot slot) const;
+    uint32_t HashSlot(const char* value, size_t size, TSlot slot) const;
+    uint32_t HashSlot(uint64_t value, TSlot slot) const;
     uint32_t BucketsNumber() const;
+    uint32_t PartitionsNumber() const;
+    // Moves the displacement tables to huge pages, see THugePageBuffer.
+    bool CopyToHugePages();
+private:
+    uint32_t Partition(const char* value, size_t size) const;
+    uint32_t Partition(uint64_t value) const;
+    void Reset(uint32_t partitions, uint32_t partitionSeed);
+    void Assign(void* phfs, uint32_t partitions, uint32_t partitionSeed);
+    bool MapTable(TMemoryStream& in, uint32_t partition);
 private:
-    void* Phf; // sort of forward declaration
+    void* Phf; // sort of forward declaration, one phf per partition
+    uint32_t Partitions;
+    uint32_t PartitionSeed;
+    std::vector<uint32_t> BucketOffsets; // by partition, plus the total
+    bool MappedTable; // g is not owned by phf, either mapped or HugePages
+    THugePageBuffer HugePages;
 };
 
 } // NJamSpell
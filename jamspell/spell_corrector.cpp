@@ -1,120 +1,262 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
-#include "contrib/nlohmann/json.hpp"
 #include <cwctype>
 #include <exception>
+#include <limits>
+#include <cstdio>
+#include <mutex>
+#include <thread>
 
 #include "spell_corrector.hpp"
+#include "lang_model_delta.hpp"
+#include "json_writer.hpp"
+#include "edits.hpp"
+#include "metrics.hpp"
 
 namespace NJamSpell {
 
 const std::string VERSION = "1.1a";
 
-static std::vector<std::wstring> GetDeletes1(const std::wstring& w) {
-    std::vector<std::wstring> results;
-    for (size_t i = 0; i < w.size(); ++i) {
-        auto nw = w.substr(0, i) + w.substr(i+1);
-        if (!nw.empty()) {
-            results.push_back(nw);
-        }
-    }
-    return results;
-}
-
-static std::vector<std::vector<std::wstring>> GetDeletes2(const std::wstring& w) {
-    std::vector<std::vector<std::wstring>> results;
-    for (size_t i = 0; i < w.size(); ++i) {
-        auto nw = w.substr(0, i) + w.substr(i+1);
-        if (!nw.empty()) {
-            std::vector<std::wstring> currResults = GetDeletes1(nw);
-            currResults.push_back(nw);
-            results.push_back(currResults);
-        }
-    }
-    return results;
-}
-
 bool TSpellCorrector::LoadLangModel(const std::string& modelFile) {
     std::cerr << "[info] medSpellCheck v" << VERSION << ". Based on jamspell.\n";
+    ClearCaches();
+    DeletionIndex.reset();
+    Dawg.reset();
+    ModelFile.clear();
     if (!LangModel.Load(modelFile)) {
         return false;
     }
+    ModelFile = modelFile;
     std::string cacheFile = modelFile + ".spell";
     if (!LoadCache(cacheFile)) {
-        PrepareCache();
+        if (!PrepareCache()) {
+            return false;
+        }
         SaveCache(cacheFile);
     }
-    return true;
+    return PrepareCandidateIndex(false);
 }
 
 bool TSpellCorrector::TrainLangModel(const std::string& textFile, const std::string& alphabetFile, const std::string& modelFile) {
+    ClearCaches();
+    DeletionIndex.reset();
+    Dawg.reset();
+    ModelFile.clear();
     if (!LangModel.Train(textFile, alphabetFile)) {
         return false;
     }
-    PrepareCache();
-    if (!LangModel.Dump(modelFile)) {
+    if (!PrepareCache() || !LangModel.Dump(modelFile)) {
         return false;
     }
+    ModelFile = modelFile;
     std::string cacheFile = modelFile + ".spell";
     if (!SaveCache(cacheFile)) {
         return false;
     }
-    return true;
+    return PrepareCandidateIndex(true);
 }
 
-TScoredWords TSpellCorrector::GetCandidatesScoredRaw(const TWords& sentence, size_t position) const {
-   if (position >= sentence.size()) {
-        return TScoredWords();
+TLatencyBudget::TLatencyBudget(double milliseconds)
+    : Deadline(std::chrono::steady_clock::now())
+    , Total(std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double, std::milli>(std::max(milliseconds, 0.0))))
+{
+    Deadline += Total;
+}
+
+TLatencyBudget::ELevel TLatencyBudget::Check() {
+    auto left = Deadline - std::chrono::steady_clock::now();
+    ELevel level = left <= left.zero() ? ELevel::Exhausted
+                 : left < Total / 4 ? ELevel::FirstLevelOnly
+                 : left < Total / 2 ? ELevel::FewerCandidates
+                                    : ELevel::Full;
+    if (level != ELevel::Full) {
+        DegradedFlag = true;
+        AddMetric(ECounter::DegradedWords, 1);
     }
+    return level;
+}
 
-    TWord w = sentence[position];
+bool TLatencyBudget::Degraded() const {
+    return DegradedFlag;
+}
 
-    TWords candidates = Edits2(w);
+void TSpellCorrector::GetCandidateSet(const TWord& word, TCandidateSet& result, TLatencyBudget::ELevel level) const {
+    std::wstring key;
+    if (CandidatesCache) {
+        key.assign(word.Ptr, word.Len);
+        if (CandidatesCache->Get(key, result)) {
+            return;
+        }
+    }
 
-    bool firstLevel = true;
-    bool knownWord = false;
-    if (candidates.empty()) {
-        candidates = Edits(w);
-        firstLevel = false;
+    TWord w = word;
+    TWords candidates;
+    {
+        TStageTimer timer(EStage::Edits2);
+        candidates = DeletionIndex ? IndexEdits(w, true) : Dawg ? DawgEdits(w, true) : Edits2(w);
+        DeltaEdits(w, true, candidates);
     }
 
-    if (candidates.empty()) {
-        return TScoredWords();
+    result = TCandidateSet();
+    if (candidates.empty() && level < TLatencyBudget::ELevel::FirstLevelOnly) {
+        TStageTimer timer(EStage::Edits);
+        candidates = DeletionIndex ? IndexEdits(w, false) : Dawg ? DawgEdits(w, false) : Edits(w);
+        DeltaEdits(w, false, candidates);
+        result.FirstLevel = false;
     }
 
-    {
-        TWord c = LangModel.GetWord(std::wstring(w.Ptr, w.Len));
+    if (!candidates.empty()) {
+        result.Empty = false;
+        TWord c = LangModel.GetWord(w.Ptr, w.Len);
         if (c.Ptr && c.Len) {
             w = c;
             candidates.push_back(c);
-            knownWord = true;
+            result.KnownWord = true;
         } else {
             candidates.push_back(w);
         }
+
+        std::unordered_set<TWord, TWordHashPtr> uniqueCandidates(candidates.begin(), candidates.end());
+
+        const size_t maxCandidates = level == TLatencyBudget::ELevel::Full
+            ? MaxCandidatesToCheck : std::max<size_t>(MaxCandidatesToCheck / 2, 1);
+        FilterCandidatesByFrequency(uniqueCandidates, w, maxCandidates);
+
+        if (!result.KnownWord) {
+            uniqueCandidates.erase(w);
+        }
+        result.Words.assign(uniqueCandidates.begin(), uniqueCandidates.end());
     }
 
-    std::unordered_set<TWord, TWordHashPtr> uniqueCandidates(candidates.begin(), candidates.end());
+    if (CandidatesCache && level == TLatencyBudget::ELevel::Full) {
+        CandidatesCache->Put(key, result, key.size() * sizeof(wchar_t) + result.Words.size() * sizeof(TWord));
+    }
+}
+
+// Scores depend only on the word ids around the candidate, so the window is
+// keyed by ids, plus the text of the word itself for unknown words.
+static std::string MakeResultKey(const TWordIds& windowIds, size_t windowPosition, const TWord& word) {
+    std::string key;
+    key.reserve(2 + windowIds.size() * sizeof(TWordId) + word.Len * sizeof(wchar_t));
+    key.push_back(static_cast<char>(windowIds.size()));
+    key.push_back(static_cast<char>(windowPosition));
+    for (size_t i = 0; i < windowIds.size(); ++i) {
+        if (i != windowPosition) {
+            key.append(reinterpret_cast<const char*>(&windowIds[i]), sizeof(TWordId));
+        }
+    }
+    key.append(reinterpret_cast<const char*>(word.Ptr), word.Len * sizeof(wchar_t));
+    return key;
+}
 
-    FilterCandidatesByFrequency(uniqueCandidates, w);
+TScoredWords TSpellCorrector::GetCandidatesScoredRaw(const TWords& sentence, size_t position,
+                                                     TLatencyBudget* budget) const
+{
+   if (position >= sentence.size()) {
+        return TScoredWords();
+    }
 
-    TScoredWords scoredCandidates;
-    //scoredCandidates.reserve(uniqueCandidates.size());
-
-    for (TWord cand: uniqueCandidates) {
-        TWords candSentence;
-        for (size_t i = 0; i < sentence.size(); ++i) {
-            if (i == position) {
-                candSentence.push_back(cand);
-            } else if ((i < position && i + 2 >= position) ||
-                       (i > position && i <= position + 2))
-            {
-                candSentence.push_back(sentence[i]);
+    TScoredWord accepted;
+    if (KnownWordMinCount > 0 && IsConfidentKnownWord(sentence, position, accepted)) {
+        ObserveMetric(GetMetrics().CandidatesPerToken, 1);
+        return TScoredWords(1, accepted);
+    }
+
+    TWord w = sentence[position];
+
+    // the candidate is scored in a window of up to two words on each side
+    TWords window;
+    size_t windowPosition = 0;
+    for (size_t i = 0; i < sentence.size(); ++i) {
+        if (i == position) {
+            windowPosition = window.size();
+            window.push_back(w);
+        } else if ((i < position && i + 2 >= position) ||
+                   (i > position && i <= position + 2))
+        {
+            window.push_back(sentence[i]);
+        }
+    }
+
+    // cached results mark the word itself with an empty TWord, since it
+    // points into the caller's text
+    const TWord original = w;
+    std::string resultKey;
+    if (ResultsCache) {
+        TWordIds windowIds;
+        for (auto&& word: window) {
+            windowIds.push_back(LangModel.GetWordIdNoCreate(word));
+        }
+        resultKey = MakeResultKey(windowIds, windowPosition, w);
+        TScoredWords cached;
+        if (ResultsCache->Get(resultKey, cached)) {
+            for (auto&& c: cached) {
+                if (!c.Word.Ptr) {
+                    c.Word = original;
+                }
             }
+            ObserveMetric(GetMetrics().CandidatesPerToken, cached.size());
+            return cached;
         }
+    }
 
+    // cache hits cost little, so the budget only applies to the rest
+    const TLatencyBudget::ELevel level = budget ? budget->Check() : TLatencyBudget::ELevel::Full;
+    if (level == TLatencyBudget::ELevel::Exhausted) {
+        return TScoredWords();
+    }
+
+    auto cacheResult = [&](const TScoredWords& scoredCandidates) {
+        if (!ResultsCache || level != TLatencyBudget::ELevel::Full) {
+            return;
+        }
+        TScoredWords stored = scoredCandidates;
+        for (auto&& c: stored) {
+            if (c.Word == original) {
+                c.Word = TWord();
+            }
+        }
+        ResultsCache->Put(resultKey, stored, resultKey.size() + stored.size() * sizeof(TScoredWord));
+    };
+
+    TCandidateSet candidateSet;
+    GetCandidateSet(w, candidateSet, level);
+
+    if (candidateSet.Empty) {
+        ObserveMetric(GetMetrics().CandidatesPerToken, 0);
+        cacheResult(TScoredWords());
+        return TScoredWords();
+    }
+
+    const bool firstLevel = candidateSet.FirstLevel;
+    const bool knownWord = candidateSet.KnownWord;
+    TWords& candidates = candidateSet.Words;
+    if (knownWord) {
+        w = LangModel.GetWord(w.Ptr, w.Len);
+        window[windowPosition] = w;
+    } else {
+        candidates.push_back(w);
+    }
+
+    TStageTimer scoreTimer(EStage::Score);
+    TScoredWords scoredCandidates;
+    scoredCandidates.reserve(candidates.size());
+
+    TScoreContext context = LangModel.PrepareScoreContext(window, windowPosition);
+    TWordIds candidateIds(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        candidateIds[i] = LangModel.GetWordIdNoCreate(candidates[i]);
+    }
+    std::vector<double> scores(candidates.size());
+    LangModel.Score(context, candidateIds.data(), candidateIds.size(), scores.data());
+
+    for (size_t i = 0; i < candidates.size(); ++i) {
         TScoredWord scored;
-        scored.Word = cand;
-        scored.Score = LangModel.Score(candSentence);
+        scored.Word = candidates[i];
+        scored.Score = scores[i];
         if (!(scored.Word == w)) {
             if (knownWord) {
                 if (firstLevel) {
@@ -133,42 +275,71 @@ TScoredWords TSpellCorrector::GetCandidatesScoredRaw(const TWords& sentence, siz
         return w1.Score > w2.Score;
     });
 
+    ObserveMetric(GetMetrics().CandidatesPerToken, scoredCandidates.size());
+    cacheResult(scoredCandidates);
     return scoredCandidates;
 
 }
 
-TWords TSpellCorrector::GetCandidatesRaw(const TWords& sentence, size_t position) const {
+bool TSpellCorrector::IsConfidentKnownWord(const TWords& sentence, size_t position, TScoredWord& result) const {
+    KnownWordsChecked.fetch_add(1, std::memory_order_relaxed);
+    const TWord& w = sentence[position];
+    TWordId wid = LangModel.GetWordIdNoCreate(w);
+    if (wid == UNKNOWN_WORD_ID || LangModel.GetWordCount(wid) < KnownWordMinCount) {
+        return false;
+    }
+    double logProb = LangModel.WordContextLogProb(sentence, position);
+    if (logProb < KnownWordMinContextLogProb) {
+        return false;
+    }
+    KnownWordsAccepted.fetch_add(1, std::memory_order_relaxed);
+    result = TScoredWord(LangModel.GetWordById(wid), logProb);
+    return true;
+}
+
+TWords TSpellCorrector::GetCandidatesRaw(const TWords& sentence, size_t position, TLatencyBudget* budget) const {
     
-    TScoredWords scoredCandidates = GetCandidatesScoredRaw(sentence, position);
+    TScoredWords scoredCandidates = GetCandidatesScoredRaw(sentence, position, budget);
     
     TWords candidates;
     candidates.reserve(scoredCandidates.size());
 
+    const bool debug = LogEnabled(ELogLevel::Debug);
     for (auto s: scoredCandidates) { 
-        std::cerr << ">> cand " << WideToUTF8(std::wstring(s.Word.Ptr, s.Word.Len)) << " (score=" << s.Score << ")\n";
+        if (debug) {
+            std::cerr << ">> cand " << WideToUTF8(std::wstring(s.Word.Ptr, s.Word.Len)) << " (score=" << s.Score << ")\n";
+        }
         candidates.push_back(s.Word);
     }
     return candidates;
 }
 
-void TSpellCorrector::FilterCandidatesByFrequency(std::unordered_set<TWord, TWordHashPtr>& uniqueCandidates, TWord origWord) const {
-    if (uniqueCandidates.size() <= MaxCandidatesToCheck) {
+void TSpellCorrector::FilterCandidatesByFrequency(std::unordered_set<TWord, TWordHashPtr>& uniqueCandidates, TWord origWord,
+                                                  size_t maxCandidates) const
+{
+    if (uniqueCandidates.size() <= maxCandidates) {
         return;
     }
 
-    using TCountCand = std::pair<TCount, TWord>;
+    // equally frequent words are kept by id, so that the choice does not
+    // depend on the order the candidates were generated in
+    struct TCountCand {
+        TCount Count;
+        TWordId Id;
+        TWord Word;
+    };
     std::vector<TCountCand> candidateCounts;
     for (auto&& c: uniqueCandidates) {
-        TCount cnt = LangModel.GetWordCount(LangModel.GetWordIdNoCreate(c));
-        candidateCounts.push_back(std::make_pair(cnt, c));
+        TWordId wid = LangModel.GetWordIdNoCreate(c);
+        candidateCounts.push_back(TCountCand{LangModel.GetWordCount(wid), wid, c});
     }
     uniqueCandidates.clear();
-    std::stable_sort(candidateCounts.begin(), candidateCounts.end(), [](const TCountCand& a, const TCountCand& b) {
-        return a.first > b.first;
+    std::sort(candidateCounts.begin(), candidateCounts.end(), [](const TCountCand& a, const TCountCand& b) {
+        return a.Count > b.Count || (a.Count == b.Count && a.Id < b.Id);
     });
 
-    for (size_t i = 0; i < MaxCandidatesToCheck; ++ i) {
-        uniqueCandidates.insert(candidateCounts[i].second);
+    for (size_t i = 0; i < maxCandidates; ++ i) {
+        uniqueCandidates.insert(candidateCounts[i].Word);
     }
     uniqueCandidates.insert(origWord);
 }
@@ -191,49 +362,133 @@ TScoredWords TSpellCorrector::GetCandidatesScored(const std::vector<std::wstring
 
 // this takes a string as an input and returns json as string
 // returns ALL detected misspellings along with scores, locations, and candidates
-std::string TSpellCorrector::GetALLCandidatesScoredJSON(const std::string& text) const {
+std::vector<TSpellCorrector::TMisspelling> TSpellCorrector::GetMisspellings(const TWords& sentence,
+                                                                            TLatencyBudget* budget) const
+{
+    std::vector<TMisspelling> results;
+    for (size_t j = 0; j < sentence.size(); ++j) {
+        const TWord& currWord = sentence[j];
+        TScoredWords candidates = GetCandidatesScoredRaw(sentence, j, budget);
+        if (candidates.empty()) {
+            continue;
+        }
+        const TWord& firstCandidate = candidates[0].Word;
+        if (currWord.Len == firstCandidate.Len && std::equal(currWord.Ptr, currWord.Ptr + currWord.Len, firstCandidate.Ptr)) {
+            continue; //i.e. the input word was correctly spelled
+        }
+        TMisspelling misspelling;
+        misspelling.Word = currWord;
+        misspelling.Candidates = std::move(candidates);
+        results.push_back(std::move(misspelling));
+    }
+    return results;
+}
+
+static std::wstring PrepareCandidatesInput(const std::string& text) {
     std::wstring input = NJamSpell::UTF8ToWide(text);
     std::transform(input.begin(), input.end(), input.begin(), std::towlower);
-    NJamSpell::TSentences sentences = LangModel.Tokenize(input);
+    return input;
+}
 
-    nlohmann::json results;
-    results["results"] = nlohmann::json::array();
+// Keys are written in alphabetical order, as the original nlohmann-based
+// output had them. Positions are offset by the characters before input.
+static void WriteMisspellingJSON(TJsonWriter& writer, const std::wstring& input, size_t offset,
+                                 const TSpellCorrector::TMisspelling& misspelling)
+{
+    const TWord& currWord = misspelling.Word;
+    const TScoredWords& candidates = misspelling.Candidates;
+    writer.BeginObject().Key("candidates").BeginArray();
+    size_t candidatesSize = std::min(candidates.size(), size_t(7));
+    for (size_t k = 0; k < candidatesSize; ++k) {
+        const NJamSpell::TScoredWord& candidate = candidates[k];
+        writer.BeginObject()
+            .Key("candidate").String(candidate.Word.Ptr, candidate.Word.Len)
+            .Key("score").Double(candidate.Score)
+            .EndObject();
+    }
+    writer.EndArray()
+        .Key("len").UInt(currWord.Len)
+        .Key("original").String(currWord.Ptr, currWord.Len)
+        .Key("pos_from").Int(offset + (currWord.Ptr - input.data()))
+        .EndObject();
+}
 
-    for (size_t i = 0; i < sentences.size(); ++i) {
-        const NJamSpell::TWords& sentence = sentences[i];
-        for (size_t j = 0; j < sentence.size(); ++j) {
-            NJamSpell::TWord currWord = sentence[j];
-            std::wstring wCurrWord(currWord.Ptr, currWord.Len);
-            //std::cerr << "  word " << NJamSpell::WideToUTF8(wCurrWord) << std::endl;
-            NJamSpell::TScoredWords candidates = GetCandidatesScoredRaw(sentence, j);
-            if (candidates.empty()) {
-                continue;
-            }
-            std::wstring firstCandidate(candidates[0].Word.Ptr, candidates[0].Word.Len);
-            if (wCurrWord == firstCandidate) { //i.e. the input word was correctly spelled
-                continue;
-            }
-            nlohmann::json currentResult;
-            currentResult["pos_from"] = currWord.Ptr - &input[0];
-            currentResult["len"] = currWord.Len;
-            currentResult["candidates"] = nlohmann::json::array();
-            currentResult["original"] = NJamSpell::WideToUTF8(wCurrWord);
-
-            size_t candidatesSize = std::min(candidates.size(), size_t(7));
-            for (size_t k = 0; k < candidatesSize; ++k) {
-                nlohmann::json cand;
-                NJamSpell::TScoredWord candidate = candidates[k];
-                std::string candidateStr = NJamSpell::WideToUTF8(std::wstring(candidate.Word.Ptr, candidate.Word.Len));
-                cand["candidate"] = candidateStr;
-                cand["score"] = candidate.Score;
-                currentResult["candidates"].push_back(cand);
-            }
+static void WriteMisspellingsJSON(TJsonWriter& writer, const std::wstring& input,
+                                  const std::vector<std::vector<TSpellCorrector::TMisspelling>>& sentences)
+{
+    TStageTimer timer(EStage::Json);
+    writer.BeginObject().Key("results").BeginArray();
+    for (auto&& misspellings: sentences) {
+        for (auto&& misspelling: misspellings) {
+            WriteMisspellingJSON(writer, input, 0, misspelling);
+        }
+    }
+    writer.EndArray().EndObject();
+}
+
+std::string TSpellCorrector::GetALLCandidatesScoredJSON(const std::string& text, bool pretty,
+                                                        TLatencyBudget* budget) const
+{
+    std::string result;
+    AppendCandidatesScoredJSON(text, result, pretty, budget);
+    return result;
+}
+
+void TSpellCorrector::AppendCandidatesScoredJSON(const std::string& text, std::string& out, bool pretty,
+                                                 TLatencyBudget* budget) const
+{
+    std::wstring input = PrepareCandidatesInput(text);
+    NJamSpell::TSentences sentences = LangModel.Tokenize(input);
 
-            results["results"].push_back(currentResult);
+    std::vector<std::vector<TMisspelling>> misspellings;
+    for (auto&& sentence: sentences) {
+        misspellings.push_back(GetMisspellings(sentence, budget));
+    }
+    TJsonWriter writer(out, pretty);
+    WriteMisspellingsJSON(writer, input, misspellings);
+}
+
+// Flattens the sentences of several documents into one list of tasks, so a
+// single long document is spread over the pool as well as many short ones.
+struct TBatchTask {
+    size_t Document;
+    size_t Sentence;
+};
+
+static std::vector<TBatchTask> MakeBatchTasks(const std::vector<TSentences>& documents) {
+    std::vector<TBatchTask> tasks;
+    for (size_t i = 0; i < documents.size(); ++i) {
+        for (size_t j = 0; j < documents[i].size(); ++j) {
+            tasks.push_back({i, j});
         }
     }
+    return tasks;
+}
+
+std::vector<std::string> TSpellCorrector::GetALLCandidatesScoredJSON(const std::vector<std::string>& texts, TThreadPool& pool) const {
+    std::vector<std::wstring> inputs(texts.size());
+    std::vector<TSentences> sentences(texts.size());
+    ParallelFor(pool, texts.size(), [&](size_t i) {
+        inputs[i] = PrepareCandidatesInput(texts[i]);
+        sentences[i] = LangModel.Tokenize(inputs[i]);
+    });
+
+    std::vector<std::vector<std::vector<TMisspelling>>> misspellings(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        misspellings[i].resize(sentences[i].size());
+    }
+    std::vector<TBatchTask> tasks = MakeBatchTasks(sentences);
+    ParallelFor(pool, tasks.size(), [&](size_t t) {
+        const TBatchTask& task = tasks[t];
+        misspellings[task.Document][task.Sentence] = GetMisspellings(sentences[task.Document][task.Sentence]);
+    });
 
-    return results.dump(4);
+    std::vector<std::string> results(texts.size());
+    ParallelFor(pool, texts.size(), [&](size_t i) {
+        TJsonWriter writer(results[i]);
+        WriteMisspellingsJSON(writer, inputs[i], misspellings[i]);
+    });
+    return results;
 }
 
 std::vector<std::wstring> TSpellCorrector::GetCandidates(const std::vector<std::wstring>& sentence, size_t position) const {
@@ -249,23 +504,207 @@ std::vector<std::wstring> TSpellCorrector::GetCandidates(const std::vector<std::
     return results;
 }
 
-std::wstring TSpellCorrector::FixFragment(const std::wstring& text) const {
-    TSentences origSentences = LangModel.Tokenize(text);
-    std::wstring lowered = text;
-    ToLower(lowered);
-    TSentences sentences = LangModel.Tokenize(lowered);
+TWords TSpellCorrector::FixSentence(const TWords& sentence, TLatencyBudget* budget) const {
+    if (Decoding == EDecoding::Beam) {
+        return FixSentenceBeam(sentence, budget);
+    }
+    TWords words = sentence;
+    for (size_t j = 0; j < words.size(); ++j) {
+        TWords candidates = GetCandidatesRaw(words, j, budget);
+        if (candidates.size() > 0) {
+            words[j] = candidates[0];
+        }
+    }
+    return words;
+}
+
+// The word itself (its vocabulary entry when known) comes first and is never
+// penalized, the penalties of the others are those of GetCandidatesScoredRaw().
+std::vector<TSpellCorrector::TLatticeCandidate> TSpellCorrector::GetLatticeCandidates(const TWords& sentence,
+                                                                                      size_t position,
+                                                                                      TLatencyBudget* budget) const
+{
+    std::vector<TLatticeCandidate> result;
+    TScoredWord accepted;
+    if (KnownWordMinCount > 0 && IsConfidentKnownWord(sentence, position, accepted)) {
+        result.push_back({accepted.Word, LangModel.GetWordIdNoCreate(accepted.Word), 0.0});
+        return result;
+    }
+    const TLatencyBudget::ELevel level = budget ? budget->Check() : TLatencyBudget::ELevel::Full;
+    TCandidateSet candidateSet;
+    if (level != TLatencyBudget::ELevel::Exhausted) {
+        GetCandidateSet(sentence[position], candidateSet, level);
+    }
+    TWord w = sentence[position];
+    if (candidateSet.KnownWord) {
+        w = LangModel.GetWord(w.Ptr, w.Len);
+    }
+    result.push_back({w, LangModel.GetWordIdNoCreate(w), 0.0});
+    if (candidateSet.Empty || (candidateSet.KnownWord && !candidateSet.FirstLevel)) {
+        return result;
+    }
+    const double penalty = candidateSet.KnownWord ? KnownWordsPenalty : UnknownWordsPenalty;
+    for (auto&& c: candidateSet.Words) {
+        if (!(c == w)) {
+            result.push_back({c, LangModel.GetWordIdNoCreate(c), penalty});
+        }
+    }
+    return result;
+}
+
+// Viterbi search over the lattice with a beam. The terms of
+// TLangModel::Score() are added as soon as their last word is chosen, so a
+// hypothesis only depends on its last two words: hypotheses ending in the
+// same two candidates are merged before the beam is cut. After merging, the
+// trigrams of the expansions of a position are all distinct; unigram and
+// bigram counts are kept per position and looked up once.
+TWords TSpellCorrector::FixSentenceBeam(const TWords& sentence, TLatencyBudget* budget) const {
+    if (sentence.empty()) {
+        return sentence;
+    }
+    const size_t n = sentence.size();
+    std::vector<std::vector<TLatticeCandidate>> lattice;
+    for (size_t i = 0; i < n; ++i) {
+        lattice.push_back(GetLatticeCandidates(sentence, i, budget));
+    }
+
+    TStageTimer timer(EStage::Score);
+    uint64_t probes = 0;
+    std::vector<std::vector<TPackedCount>> counts1(n);
+    for (size_t i = 0; i < n; ++i) {
+        for (auto&& cand: lattice[i]) {
+            counts1[i].push_back(LangModel.GetGram1HashCount(cand.Id));
+        }
+        probes += lattice[i].size();
+    }
+    // bigrams[i][p * lattice[i].size() + c] is candidate p of position
+    // i - 1 followed by candidate c: its count, and the terms of Score() it
+    // completes less the penalty of c; looked up on first use
+    struct TBigram {
+        TPackedCount Count;
+        double Score;
+    };
+    const TPackedCount NOT_LOOKED_UP = std::numeric_limits<TPackedCount>::max();
+    std::vector<std::vector<TBigram>> bigrams(n);
+    for (size_t i = 1; i < n; ++i) {
+        bigrams[i].assign(lattice[i - 1].size() * lattice[i].size(), TBigram{NOT_LOOKED_UP, 0.0});
+    }
+    auto bigram = [&](size_t i, size_t p, size_t c) -> const TBigram& {
+        TBigram& b = bigrams[i][p * lattice[i].size() + c];
+        if (b.Count == NOT_LOOKED_UP) {
+            b.Count = LangModel.GetGram2HashCount(lattice[i - 1][p].Id, lattice[i][c].Id);
+            b.Score = LangModel.Gram1LogProb(counts1[i][c]) + LangModel.Gram2LogProb(counts1[i - 1][p], b.Count) -
+                      lattice[i][c].Penalty;
+            ++probes;
+        }
+        return b;
+    };
+
+    struct THypothesis {
+        size_t Candidate; // in lattice[position]
+        size_t Back;      // in the beam of position - 1
+        double Score;
+    };
+    auto cutBeam = [this](std::vector<THypothesis>& beam) {
+        if (beam.size() > BeamWidth) {
+            std::nth_element(beam.begin(), beam.begin() + BeamWidth, beam.end(),
+                             [](const THypothesis& a, const THypothesis& b) { return a.Score > b.Score; });
+            beam.resize(BeamWidth);
+        }
+    };
+    std::vector<std::vector<THypothesis>> beams(n);
+    for (size_t c = 0; c < lattice[0].size(); ++c) {
+        beams[0].push_back({c, 0, LangModel.Gram1LogProb(counts1[0][c]) - lattice[0][c].Penalty});
+    }
+    cutBeam(beams[0]);
+
+    const size_t NO_HYPOTHESIS = std::numeric_limits<size_t>::max();
+    std::vector<size_t> merged; // hypothesis of beams[i] per (previous candidate, candidate)
+    std::vector<TGram3Key> keys3;
+    std::vector<TPackedCount> counts3;
+    for (size_t i = 1; i < n; ++i) {
+        const size_t candidates = lattice[i].size();
+        const std::vector<THypothesis>& prevBeam = beams[i - 1];
+        keys3.clear();
+        if (i >= 2) {
+            for (auto&& prev: prevBeam) {
+                const TWordId pp = lattice[i - 2][beams[i - 2][prev.Back].Candidate].Id;
+                const TWordId p = lattice[i - 1][prev.Candidate].Id;
+                for (auto&& cand: lattice[i]) {
+                    keys3.push_back(TGram3Key(pp, p, cand.Id));
+                }
+            }
+            counts3.resize(keys3.size());
+            LangModel.GetGram3HashCounts(keys3.data(), keys3.size(), counts3.data());
+        }
+
+        merged.assign(lattice[i - 1].size() * candidates, NO_HYPOTHESIS);
+        std::vector<THypothesis>& beam = beams[i];
+        for (size_t h = 0; h < prevBeam.size(); ++h) {
+            const THypothesis& prev = prevBeam[h];
+            const size_t p = prev.Candidate;
+            const size_t pp = i >= 2 ? beams[i - 2][prev.Back].Candidate : 0;
+            for (size_t c = 0; c < candidates; ++c) {
+                double score = prev.Score + bigram(i, p, c).Score;
+                if (i >= 2) {
+                    score += LangModel.Gram3LogProb(bigram(i - 1, pp, p).Count, counts3[h * candidates + c]);
+                }
+                size_t& slot = merged[p * candidates + c];
+                if (slot == NO_HYPOTHESIS) {
+                    slot = beam.size();
+                    beam.push_back({c, h, score});
+                } else if (score > beam[slot].Score) {
+                    beam[slot] = {c, h, score};
+                }
+            }
+        }
+        cutBeam(beam);
+    }
+    AddMetric(ECounter::GramProbes, probes);
+
+    // the two unknown words Score() pads the sentence with have no counts
+    const size_t last = n - 1;
+    size_t best = 0;
+    double bestScore = -std::numeric_limits<double>::infinity();
+    for (size_t h = 0; h < beams[last].size(); ++h) {
+        const THypothesis& hyp = beams[last][h];
+        double score = hyp.Score;
+        score += LangModel.Gram2LogProb(counts1[last][hyp.Candidate], TPackedCount());
+        score += LangModel.Gram3LogProb(TPackedCount(), TPackedCount());
+        if (last >= 1) {
+            const size_t p = beams[last - 1][hyp.Back].Candidate;
+            score += LangModel.Gram3LogProb(bigram(last, p, hyp.Candidate).Count, TPackedCount());
+        }
+        if (score > bestScore) {
+            bestScore = score;
+            best = h;
+        }
+    }
+
+    TWords words(n);
+    for (size_t i = n; i-- > 0;) {
+        const THypothesis& hyp = beams[i][best];
+        words[i] = lattice[i][hyp.Candidate].Word;
+        best = hyp.Back;
+    }
+    return words;
+}
+
+// Rebuilds the text with the fixed words, keeping the original separators
+// and the case of the original words. Lowering does not move word
+// boundaries, so each original word is at the offset of its lowered one.
+static std::wstring RestoreFragment(const std::wstring& text,
+                                    const std::wstring& loweredText,
+                                    const TSentences& loweredSentences,
+                                    const TSentences& fixedSentences)
+{
     std::wstring result;
     size_t origPos = 0;
-    for (size_t i = 0; i < sentences.size(); ++i) {
-        TWords words = sentences[i];
-        const TWords& origWords = origSentences[i];
+    for (size_t i = 0; i < fixedSentences.size(); ++i) {
+        const TWords& words = fixedSentences[i];
         for (size_t j = 0; j < words.size(); ++j) {
-            TWord orig = origWords[j];
-            TWord lowered = words[j];
-            TWords candidates = GetCandidatesRaw(words, j);
-            if (candidates.size() > 0) {
-                words[j] = candidates[0];
-            }
+            TWord lowered = loweredSentences[i][j];
+            TWord orig(text.data() + (lowered.Ptr - loweredText.data()), lowered.Len);
             size_t currOrigPos = orig.Ptr - &text[0];
             while (origPos < currOrigPos) {
                 result.push_back(text[origPos]);
@@ -294,19 +733,52 @@ std::wstring TSpellCorrector::FixFragment(const std::wstring& text) const {
     return result;
 }
 
+std::wstring TSpellCorrector::FixFragment(const std::wstring& text, TLatencyBudget* budget) const {
+    std::wstring lowered = text;
+    ToLower(lowered);
+    TSentences sentences = LangModel.Tokenize(lowered);
+    TSentences fixed;
+    for (auto&& sentence: sentences) {
+        fixed.push_back(FixSentence(sentence, budget));
+    }
+    return RestoreFragment(text, lowered, sentences, fixed);
+}
+
+std::vector<std::wstring> TSpellCorrector::FixFragments(const std::vector<std::wstring>& texts, TThreadPool& pool) const {
+    std::vector<std::wstring> lowered(texts.size());
+    std::vector<TSentences> sentences(texts.size());
+    ParallelFor(pool, texts.size(), [&](size_t i) {
+        lowered[i] = texts[i];
+        ToLower(lowered[i]);
+        sentences[i] = LangModel.Tokenize(lowered[i]);
+    });
+
+    std::vector<TSentences> fixed(texts.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        fixed[i].resize(sentences[i].size());
+    }
+    std::vector<TBatchTask> tasks = MakeBatchTasks(sentences);
+    ParallelFor(pool, tasks.size(), [&](size_t t) {
+        const TBatchTask& task = tasks[t];
+        fixed[task.Document][task.Sentence] = FixSentence(sentences[task.Document][task.Sentence]);
+    });
+
+    std::vector<std::wstring> results(texts.size());
+    ParallelFor(pool, texts.size(), [&](size_t i) {
+        results[i] = RestoreFragment(texts[i], lowered[i], sentences[i], fixed[i]);
+    });
+    return results;
+}
+
 std::wstring TSpellCorrector::FixFragmentNormalized(const std::wstring& text) const {
     std::wstring lowered = text;
     ToLower(lowered);
     TSentences sentences = LangModel.Tokenize(lowered);
     std::wstring result;
     for (size_t i = 0; i < sentences.size(); ++i) {
-        TWords words = sentences[i];
-        for (size_t i = 0; i < words.size(); ++i) {
-            TWords candidates = GetCandidatesRaw(words, i);
-            if (candidates.size() > 0) {
-                words[i] = candidates[0];
-            }
-            result += std::wstring(words[i].Ptr, words[i].Len) + L" ";
+        TWords words = FixSentence(sentences[i]);
+        for (auto&& w: words) {
+            result += std::wstring(w.Ptr, w.Len) + L" ";
         }
         if (words.size() > 0) {
             result.resize(result.size() - 1);
@@ -322,10 +794,83 @@ std::wstring TSpellCorrector::FixFragmentNormalized(const std::wstring& text) co
 void TSpellCorrector::SetPenalty(double knownWordsPenaly, double unknownWordsPenalty) {
     KnownWordsPenalty = knownWordsPenaly;
     UnknownWordsPenalty = unknownWordsPenalty;
+    ClearCaches();
 }
 
 void TSpellCorrector::SetMaxCandidatesToCheck(size_t maxCandidatesToCheck) {
     MaxCandidatesToCheck = maxCandidatesToCheck;
+    ClearCaches();
+}
+
+void TSpellCorrector::SetDecoding(EDecoding decoding, size_t beamWidth) {
+    Decoding = decoding;
+    BeamWidth = std::max<size_t>(beamWidth, 1);
+}
+
+TSpellCorrector::EDecoding TSpellCorrector::GetDecoding() const {
+    return Decoding;
+}
+
+void TSpellCorrector::SetKnownWordThreshold(TCount minCount, double minContextLogProb) {
+    KnownWordMinCount = minCount;
+    KnownWordMinContextLogProb = minContextLogProb;
+    KnownWordsChecked = 0;
+    KnownWordsAccepted = 0;
+}
+
+TSpellCorrector::TKnownWordStats TSpellCorrector::GetKnownWordStats() const {
+    TKnownWordStats stats;
+    stats.Checked = KnownWordsChecked.load(std::memory_order_relaxed);
+    stats.Accepted = KnownWordsAccepted.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool TSpellCorrector::SetCandidateEngine(ECandidateEngine engine) {
+    CandidateEngine = engine;
+    ClearCaches();
+    DeletionIndex.reset();
+    Dawg.reset();
+    if (ModelFile.empty() || PrepareCandidateIndex(false)) {
+        return true;
+    }
+    CandidateEngine = ECandidateEngine::Edits;
+    return false;
+}
+
+TSpellCorrector::ECandidateEngine TSpellCorrector::GetCandidateEngine() const {
+    return CandidateEngine;
+}
+
+void TSpellCorrector::SetHugePages(bool hugePages) {
+    LangModel.SetHugePages(hugePages);
+}
+
+void TSpellCorrector::SetCacheSize(size_t maxBytes) {
+    CacheSize = maxBytes;
+    ClearCaches();
+}
+
+// Entries point into the language model, so they are dropped whenever the
+// model or the scoring parameters change.
+void TSpellCorrector::ClearCaches() {
+    if (CacheSize == 0) {
+        CandidatesCache.reset();
+        ResultsCache.reset();
+        return;
+    }
+    CandidatesCache.reset(new TCandidatesCache(CacheSize / 2));
+    ResultsCache.reset(new TResultsCache(CacheSize / 2));
+}
+
+TSpellCorrector::TCachesStats TSpellCorrector::GetCacheStats() const {
+    TCachesStats stats;
+    if (CandidatesCache) {
+        stats.Candidates = CandidatesCache->GetStats();
+    }
+    if (ResultsCache) {
+        stats.Results = ResultsCache->GetStats();
+    }
+    return stats;
 }
 
 const TLangModel& TSpellCorrector::GetLangModel() const {
@@ -338,90 +883,95 @@ inline void AddVec(T& target, const T& source) {
 }
 
 TWords TSpellCorrector::Edits(const TWord& word) const {
-    std::wstring w(word.Ptr, word.Len);
+    const wchar_t* w = word.Ptr;
+    const size_t len = word.Len;
     TWords result;
+    uint64_t probes = 0;
 
-    std::vector<std::vector<std::wstring>> cands = GetDeletes2(w);
-    cands.push_back(std::vector<std::wstring>({w}));
-
-    for (auto&& w1: cands) {
-        for (auto&& w: w1) {
-            TWord c = LangModel.GetWord(w);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            std::string s = WideToUTF8(w);
-            if (Deletes1->Contains(s)) {
-                Inserts(w, result);
-            }
-            if (Deletes2->Contains(s)) {
-                Inserts2(w, result);
-            }
+    auto check = [&](const wchar_t* ptr, size_t size) {
+        TWord c = LangModel.GetWord(ptr, size);
+        if (c.Ptr && c.Len) {
+            result.push_back(c);
         }
-    }
+        probes += 2;
+        uint64_t hash = TBloomFilter::Hash(ptr, size);
+        if (Deletes1->ContainsHash(hash)) {
+            Inserts(TWord(ptr, size), result);
+        }
+        if (Deletes2->ContainsHash(hash)) {
+            Inserts2(TWord(ptr, size), result);
+        }
+    };
 
+    // every single and double deletion, then the word itself
+    ForEachDeletion(w, len, check);
+    check(w, len);
+
+    AddMetric(ECounter::BloomProbes, probes);
     return result;
 }
 
 TWords TSpellCorrector::Edits2(const TWord& word, bool lastLevel) const {
-    std::wstring w(word.Ptr, word.Len);
+    const wchar_t* w = word.Ptr;
+    const size_t len = word.Len;
     TWords result;
 
-    for (size_t i = 0; i < w.size() + 1; ++i) {
+    auto check = [&](const wchar_t* ptr, size_t size) {
+        TWord c = LangModel.GetWord(ptr, size);
+        if (c.Ptr && c.Len) {
+            result.push_back(c);
+        }
+        if (!lastLevel) {
+            AddVec(result, Edits2(TWord(ptr, size)));
+        }
+    };
+
+    // Each buffer holds the current variant; moving to the next position
+    // only touches one character.
+    TEditBuffer deleted(len);
+    TEditBuffer transposed(len);
+    TEditBuffer replaced(len);
+    TEditBuffer inserted(len + 1);
+    if (len > 0) {
+        std::copy(w + 1, w + len, deleted.Data());
+    }
+    std::copy(w, w + len, transposed.Data());
+    std::copy(w, w + len, replaced.Data());
+    std::copy(w, w + len, inserted.Data() + 1);
+
+    for (size_t i = 0; i < len + 1; ++i) {
         // delete
-        if (i < w.size()) {
-            std::wstring s = w.substr(0, i) + w.substr(i+1);
-            TWord c = LangModel.GetWord(s);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            if (!lastLevel) {
-                AddVec(result, Edits2(TWord(s)));
+        if (i < len) {
+            check(deleted.Data(), len - 1);
+            if (i + 1 < len) {
+                deleted[i] = w[i];
             }
         }
 
         // transpose
-        if (i + 1 < w.size()) {
-            std::wstring s = w.substr(0, i);
-            s += w.substr(i + 1, 1);
-            s += w.substr(i, 1);
-            if (i + 2 < w.size()) {
-                s += w.substr(i+2);
-            }
-            TWord c = LangModel.GetWord(s);
-            if (c.Ptr && c.Len) {
-                result.push_back(c);
-            }
-            if (!lastLevel) {
-                AddVec(result, Edits2(TWord(s)));
-            }
+        if (i + 1 < len) {
+            std::swap(transposed[i], transposed[i + 1]);
+            check(transposed.Data(), len);
+            std::swap(transposed[i], transposed[i + 1]);
         }
 
         // replace
-        if (i < w.size()) {
+        if (i < len) {
             for (auto&& ch: LangModel.GetAlphabet()) {
-                std::wstring s = w.substr(0, i) + ch + w.substr(i+1);
-                TWord c = LangModel.GetWord(s);
-                if (c.Ptr && c.Len) {
-                    result.push_back(c);
-                }
-                if (!lastLevel) {
-                    AddVec(result, Edits2(TWord(s)));
-                }
+                replaced[i] = ch;
+                check(replaced.Data(), len);
             }
+            replaced[i] = w[i];
         }
 
         // inserts
         {
             for (auto&& ch: LangModel.GetAlphabet()) {
-                std::wstring s = w.substr(0, i) + ch + w.substr(i);
-                TWord c = LangModel.GetWord(s);
-                if (c.Ptr && c.Len) {
-                    result.push_back(c);
-                }
-                if (!lastLevel) {
-                    AddVec(result, Edits2(TWord(s)));
-                }
+                inserted[i] = ch;
+                check(inserted.Data(), len + 1);
+            }
+            if (i < len) {
+                inserted[i] = w[i];
             }
         }
     }
@@ -429,38 +979,120 @@ TWords TSpellCorrector::Edits2(const TWord& word, bool lastLevel) const {
     return result;
 }
 
-void TSpellCorrector::Inserts(const std::wstring& w, TWords& result) const {
-    for (size_t i = 0; i < w.size() + 1; ++i) {
+void TSpellCorrector::Inserts(const TWord& word, TWords& result) const {
+    const wchar_t* w = word.Ptr;
+    const size_t len = word.Len;
+    TEditBuffer inserted(len + 1);
+    std::copy(w, w + len, inserted.Data() + 1);
+    for (size_t i = 0; i < len + 1; ++i) {
         for (auto&& ch: LangModel.GetAlphabet()) {
-            std::wstring s = w.substr(0, i) + ch + w.substr(i);
-            TWord c = LangModel.GetWord(s);
+            inserted[i] = ch;
+            TWord c = LangModel.GetWord(inserted.Data(), len + 1);
             if (c.Ptr && c.Len) {
                 result.push_back(c);
             }
         }
+        if (i < len) {
+            inserted[i] = w[i];
+        }
     }
 }
 
-void TSpellCorrector::Inserts2(const std::wstring& w, TWords& result) const {
-    for (size_t i = 0; i < w.size() + 1; ++i) {
+void TSpellCorrector::Inserts2(const TWord& word, TWords& result) const {
+    const wchar_t* w = word.Ptr;
+    const size_t len = word.Len;
+    TEditBuffer inserted(len + 1);
+    std::copy(w, w + len, inserted.Data() + 1);
+    for (size_t i = 0; i < len + 1; ++i) {
         for (auto&& ch: LangModel.GetAlphabet()) {
-            std::wstring s = w.substr(0, i) + ch + w.substr(i);
-            if (Deletes1->Contains(WideToUTF8(s))) {
-                Inserts(s, result);
+            inserted[i] = ch;
+            if (Deletes1->Contains(inserted.Data(), len + 1)) {
+                Inserts(TWord(inserted.Data(), len + 1), result);
             }
         }
+        if (i < len) {
+            inserted[i] = w[i];
+        }
+    }
+    AddMetric(ECounter::BloomProbes, (len + 1) * LangModel.GetAlphabet().size());
+}
+
+// Same-length words one replacement or one adjacent transposition apart,
+// or equal.
+static bool IsReplaceOrTranspose(const TWord& a, const TWord& b) {
+    size_t i = 0;
+    while (i < a.Len && a.Ptr[i] == b.Ptr[i]) {
+        ++i;
+    }
+    if (i + 1 >= a.Len) {
+        return true;
+    }
+    if (std::equal(a.Ptr + i + 1, a.Ptr + a.Len, b.Ptr + i + 1)) {
+        return true;
+    }
+    return a.Ptr[i] == b.Ptr[i + 1] && a.Ptr[i + 1] == b.Ptr[i] &&
+           std::equal(a.Ptr + i + 2, a.Ptr + a.Len, b.Ptr + i + 2);
+}
+
+// Words sharing a variant with up to one deletion on each side with the
+// word are its edits at distance 1, as found by Edits2(), except the
+// same-length ones further apart; with two deletions on each side they are
+// exactly what Edits() finds.
+template<typename TIndex>
+static void DeletionEdits(const TIndex& index, const TWord& word, bool firstLevel, TWords& result) {
+    const size_t maxDeletes = firstLevel ? 1 : TIndex::MAX_DELETES;
+    const size_t begin = result.size();
+    index.Find(word.Ptr, word.Len, maxDeletes, result);
+    ForEachDeletion(word.Ptr, word.Len, [&](const wchar_t* ptr, size_t size) {
+        if (word.Len - size <= maxDeletes) {
+            index.Find(ptr, size, maxDeletes, result);
+        }
+    });
+    if (firstLevel) {
+        result.erase(std::remove_if(result.begin() + begin, result.end(), [&word](const TWord& c) {
+            return c.Len == word.Len && !IsReplaceOrTranspose(c, word);
+        }), result.end());
+    }
+}
+
+TWords TSpellCorrector::IndexEdits(const TWord& word, bool firstLevel) const {
+    TWords result;
+    DeletionEdits(*DeletionIndex, word, firstLevel, result);
+    return result;
+}
+
+TWords TSpellCorrector::DawgEdits(const TWord& word, bool firstLevel) const {
+    TWords result;
+    Dawg->Find(word.Ptr, word.Len, firstLevel ? 1 : TDawgIndex::MAX_DISTANCE, result);
+    return result;
+}
+
+void TSpellCorrector::DeltaEdits(const TWord& word, bool firstLevel, TWords& result) const {
+    if (const TLangModelDelta* delta = LangModel.GetDelta()) {
+        DeletionEdits(*delta, word, firstLevel, result);
     }
 }
 
-void TSpellCorrector::PrepareCache() {
+// Single deletions of the word go to deletes1 and double ones to deletes2,
+// the filters Edits() probes.
+static void InsertDeletes(const TWord& word, TBloomFilter& deletes1, TBloomFilter& deletes2) {
+    ForEachDeletion(word.Ptr, word.Len, [&](const wchar_t* ptr, size_t size) {
+        if (size + 1 == word.Len) {
+            deletes1.Insert(ptr, size);
+        } else {
+            deletes2.Insert(ptr, size);
+        }
+    });
+}
+
+bool TSpellCorrector::PrepareCache(size_t threadsCount) {
     std::cerr << "[info] preparing cache" << std::endl;
-    auto&& wordToId = LangModel.GetWordToId();
+    size_t wordsCount = LangModel.GetWordsCount();
     size_t n = 0;
     size_t s = 0;
-    std::cerr << "  starting loop 1\n"; 
-    for (auto&& it: wordToId) {
+    for (TWordId wid = 0; wid < wordsCount; ++wid) {
         n += 1;
-        s += it.first.size();
+        s += LangModel.GetWordById(wid).Len;
         if (n > 3000) {
             break;
         }
@@ -470,60 +1102,144 @@ void TSpellCorrector::PrepareCache() {
 
     std::cerr << "  average word length " << avgWordLen << std::endl;
 
-    uint64_t deletes1size = wordToId.size() * avgWordLen;
-    uint64_t deletes2size = wordToId.size() * avgWordLen * avgWordLenMinusOne;
-    deletes1size = std::max(uint64_t(1000), deletes1size);
+    uint64_t deletes1size = wordsCount * avgWordLen;
+    uint64_t deletes2size = wordsCount * avgWordLen * avgWordLenMinusOne;
     deletes1size = std::max(uint64_t(1000), deletes1size);
+    deletes2size = std::max(uint64_t(1000), deletes2size);
 
     double falsePositiveProb = 0.001;
-    Deletes1.reset(new TBloomFilter(deletes1size, falsePositiveProb));
-    Deletes2.reset(new TBloomFilter(deletes2size, falsePositiveProb));
+    CacheFile.reset();
+    Deletes1.reset();
+    Deletes2.reset();
+
+    // Each worker fills its own pair of filters from every threadsCount-th
+    // word; the tables are OR-ed together at the end. Filters have the same
+    // size whatever the thread count, so the result is identical, at the
+    // price of one extra pair of tables per additional thread.
+    if (threadsCount == 0) {
+        threadsCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threadsCount = std::max(size_t(1), std::min(threadsCount, wordsCount));
+    std::vector<std::unique_ptr<TBloomFilter>> deletes1(threadsCount);
+    std::vector<std::unique_ptr<TBloomFilter>> deletes2(threadsCount);
+
+    std::cerr << "  filling filters on " << threadsCount << " threads" << std::endl;
+    const size_t REPORT_EVERY_WORDS = 10000;
+    const auto REPORT_INTERVAL = std::chrono::seconds(4);
+    std::atomic<size_t> processed{0};
+    std::mutex reportMutex;
+    auto nextReport = std::chrono::steady_clock::now() + REPORT_INTERVAL;
+
+    TThreadPool pool(threadsCount);
+    ParallelFor(pool, threadsCount, [&](size_t worker) {
+        deletes1[worker].reset(new TBloomFilter(deletes1size, falsePositiveProb));
+        deletes2[worker].reset(new TBloomFilter(deletes2size, falsePositiveProb));
+        size_t pending = 0;
+        for (TWordId wid = worker; wid < wordsCount; wid += threadsCount) {
+            InsertDeletes(LangModel.GetWordById(wid), *deletes1[worker], *deletes2[worker]);
+            if (++pending < REPORT_EVERY_WORDS) {
+                continue;
+            }
+            size_t done = processed.fetch_add(pending) + pending;
+            pending = 0;
+            std::lock_guard<std::mutex> lock(reportMutex);
+            auto now = std::chrono::steady_clock::now();
+            if (now >= nextReport) {
+                std::cerr << "    " << done << "/" << wordsCount << " complete" << std::endl;
+                nextReport = now + REPORT_INTERVAL;
+            }
+        }
+    });
 
-    uint64_t deletes1real = 0;
-    uint64_t deletes2real = 0;
+    for (size_t i = 1; i < threadsCount; ++i) {
+        if (!deletes1[0]->Merge(*deletes1[i]) || !deletes2[0]->Merge(*deletes2[i])) {
+            std::cerr << "[error] failed to merge the filters of the cache" << std::endl;
+            return false;
+        }
+        deletes1[i].reset();
+        deletes2[i].reset();
+    }
+    Deletes1 = std::move(deletes1[0]);
+    Deletes2 = std::move(deletes2[0]);
+    std::cerr << "[info] cache preparation complete\n";
+    return true;
+}
 
-    std::cerr << "  starting loop 2\n";
-    n = 0;
-    for (auto&& it: wordToId) {
-        n += 1;
-        try{
-            std::cerr << "    " << n << "/" << wordToId.size() << " complete\r";
-            auto deletes = GetDeletes2(it.first);
-            for (auto&& w1: deletes) {
-                try{
-                    Deletes1->Insert(WideToUTF8(w1.back()));
-                    deletes1real += 1;
-                    for (size_t i = 0; i < w1.size() - 1; ++i) {
-                        try{
-                            Deletes2->Insert(WideToUTF8(w1[i]));
-                            deletes2real += 1;
-                        }
-                        catch(const std::runtime_error& re) { std::cerr << "[error] [922] Runtime error caught: " << re.what() << "\n";}
-                        catch(const std::exception& ex){ std::cerr << "[error] [921] Error caught: " << ex.what() << "\n";}
-                        catch(...){ std::cerr << "[error] [920] Unknown exception caught in middle cache prep loop. Continuing" << "\n"; }
-                    }
-                }
-                catch(const std::runtime_error& re) { std::cerr << "[error] [912] Runtime error caught: " << re.what() << "\n"; }
-                catch(const std::exception& ex){ std::cerr << "[error] [911] Error caught: " << ex.what() << "\n"; }
-                catch(...){ std::cerr << "[error] [910] Unknown exception caught in middle cache prep loop. Continuing" << "\n"; }
+bool TSpellCorrector::BuildCache(const std::string& modelFile, size_t threadsCount) {
+    ClearCaches();
+    DeletionIndex.reset();
+    Dawg.reset();
+    ModelFile.clear();
+    if (!LangModel.Load(modelFile)) {
+        return false;
+    }
+    ModelFile = modelFile;
+    return PrepareCache(threadsCount) && SaveCache(modelFile + ".spell") && PrepareCandidateIndex(true, threadsCount);
+}
+
+bool TSpellCorrector::LoadDelta(const std::string& deltaFile) {
+    if (!LangModel.LoadDelta(deltaFile)) {
+        return false;
+    }
+    ClearCaches();
+    return true;
+}
+
+bool TSpellCorrector::TrainDelta(const std::string& textFile, const std::string& deltaFile) {
+    ClearCaches();
+    LangModel.ClearDelta();
+    TLangModelDelta delta;
+    return delta.Train(textFile, LangModel) && delta.Dump(deltaFile) && LoadDelta(deltaFile);
+}
+
+bool TSpellCorrector::PrepareCandidateIndex(bool rebuild, size_t threadsCount) {
+    DeletionIndex.reset();
+    Dawg.reset();
+    if (CandidateEngine == ECandidateEngine::Dawg) {
+        std::string dawgFile = ModelFile + ".dawg";
+        std::unique_ptr<TDawgIndex> dawg(new TDawgIndex());
+        if (rebuild || !dawg->Load(dawgFile, LangModel)) {
+            dawg.reset(new TDawgIndex());
+            if (!dawg->Build(LangModel)) {
+                return false;
+            }
+            if (!dawg->Dump(dawgFile)) {
+                std::cerr << "[error] failed to save dawg index (" << dawgFile << ")\n";
+                return false;
             }
         }
-        catch(const std::runtime_error& re) { std::cerr << "[error] [902] Runtime error caught: " << re.what() << "\n";}
-        catch(const std::exception& ex){ std::cerr << "[error] [901] Error caught: " << ex.what() << "\n";}
-        catch(...){std::cerr << "[error] [900] Unknown exception caught in outer cache prep loop. Continuing. n="<< n << "\n"; } 
+        Dawg = std::move(dawg);
+        return true;
     }
-    std::cerr << "[info] cache preparation complete\n";
+    if (CandidateEngine != ECandidateEngine::DeletionIndex) {
+        return true;
+    }
+    std::string indexFile = ModelFile + ".deletes";
+    std::unique_ptr<TDeletionIndex> index(new TDeletionIndex());
+    if (rebuild || !index->Load(indexFile, LangModel)) {
+        index.reset(new TDeletionIndex());
+        if (!index->Build(LangModel, threadsCount)) {
+            return false;
+        }
+        if (!index->Dump(indexFile)) {
+            std::cerr << "[error] failed to save deletion index (" << indexFile << ")\n";
+            return false;
+        }
+    }
+    DeletionIndex = std::move(index);
+    return true;
 }
 
 constexpr uint64_t SPELL_CHECKER_CACHE_MAGIC_BYTE = 3811558393781437494L;
-constexpr uint16_t SPELL_CHECKER_CACHE_VERSION = 1;
+constexpr uint16_t SPELL_CHECKER_CACHE_VERSION = 3;
 
 bool TSpellCorrector::LoadCache(const std::string& cacheFile) {
     std::cerr << "[info] loading cache (" << cacheFile << ")\n";
-    std::ifstream in(cacheFile, std::ios::binary);
-    if (!in.is_open()) {
+    std::unique_ptr<TMemoryMappedFile> file(new TMemoryMappedFile());
+    if (!file->Open(cacheFile)) {
         return false;
     }
+    TMemoryStream in(file->Data(), file->Size());
     uint16_t version = 0;
     uint64_t magicByte = 0;
     NHandyPack::Load(in, magicByte);
@@ -534,6 +1250,12 @@ bool TSpellCorrector::LoadCache(const std::string& cacheFile) {
     if (version != SPELL_CHECKER_CACHE_VERSION) {
         return false;
     }
+    // deletes are hashed as raw wchar_t spans
+    uint16_t wcharSize = 0;
+    NHandyPack::Load(in, wcharSize);
+    if (wcharSize != sizeof(wchar_t)) {
+        return false;
+    }
     uint64_t checkSum = 0;
     NHandyPack::Load(in, checkSum);
     if (checkSum != LangModel.GetCheckSum()) {
@@ -541,8 +1263,9 @@ bool TSpellCorrector::LoadCache(const std::string& cacheFile) {
     }
     std::unique_ptr<TBloomFilter> deletes1(new TBloomFilter());
     std::unique_ptr<TBloomFilter> deletes2(new TBloomFilter());
-    deletes1->Load(in);
-    deletes2->Load(in);
+    if (!deletes1->Load(in) || !deletes2->Load(in)) {
+        return false;
+    }
     magicByte = 0;
     NHandyPack::Load(in, magicByte);
     if (magicByte != SPELL_CHECKER_CACHE_MAGIC_BYTE) {
@@ -550,27 +1273,139 @@ bool TSpellCorrector::LoadCache(const std::string& cacheFile) {
     }
     Deletes1 = std::move(deletes1);
     Deletes2 = std::move(deletes2);
+    CacheFile = std::move(file);
     return true;
 }
 
 bool TSpellCorrector::SaveCache(const std::string& cacheFile) {
     std::cerr << "[info] saving cache (" << cacheFile << ")\n";
-    std::ofstream out(cacheFile, std::ios::binary);
-    if (!out.is_open()) {
+    if (!Deletes1 || !Deletes2) {
         return false;
     }
-    if (!Deletes1 || !Deletes2) {
+    std::string tempFile = TemporaryFileName(cacheFile);
+    std::ofstream out(tempFile, std::ios::binary);
+    if (!out.is_open()) {
         return false;
     }
     NHandyPack::Dump(out, SPELL_CHECKER_CACHE_MAGIC_BYTE);
     NHandyPack::Dump(out, SPELL_CHECKER_CACHE_VERSION);
+    NHandyPack::Dump(out, uint16_t(sizeof(wchar_t)));
     NHandyPack::Dump(out, LangModel.GetCheckSum());
     Deletes1->Dump(out);
     Deletes2->Dump(out);
     NHandyPack::Dump(out, SPELL_CHECKER_CACHE_MAGIC_BYTE);
+    out.close();
+    if (!out || !CommitFile(tempFile, cacheFile)) {
+        std::remove(tempFile.c_str());
+        return false;
+    }
     std::cerr << "[info] cache saved\n";
     return true;
 }
 
 
+// Bytes at the end of data that begin a UTF-8 sequence without ending it.
+// Malformed sequences are left for UTF8ToWide() to reject.
+static size_t IncompleteUTF8Suffix(const std::string& data) {
+    size_t continuations = 0;
+    while (continuations < 3 && continuations < data.size() &&
+           (static_cast<unsigned char>(data[data.size() - 1 - continuations]) & 0xC0) == 0x80)
+    {
+        ++continuations;
+    }
+    if (continuations == data.size()) {
+        return 0;
+    }
+    unsigned char lead = static_cast<unsigned char>(data[data.size() - 1 - continuations]);
+    size_t length = lead >= 0xF0 ? 4 : lead >= 0xE0 ? 3 : lead >= 0xC0 ? 2 : 1;
+    return length > continuations + 1 ? continuations + 1 : 0;
+}
+
+TCorrectionStream::TCorrectionStream(const TSpellCorrector& corrector, EOutput output, size_t maxPending)
+    : Corrector(corrector)
+    , Output(output)
+    , MaxPending(std::max<size_t>(maxPending, 1))
+{
+}
+
+// The tokenizer ends a sentence at these unless they are letters, in which
+// case the word around them goes on into the next sentence.
+bool TCorrectionStream::IsSentenceEnd(wchar_t chr) const {
+    return (chr == L'?' || chr == L'!' || chr == L'.') && !Corrector.GetLangModel().IsLetter(chr);
+}
+
+std::string TCorrectionStream::Put(const std::string& data) {
+    Incomplete += data;
+    size_t complete = Incomplete.size() - IncompleteUTF8Suffix(Incomplete);
+    UTF8ToWide(Incomplete.data(), complete, Converted);
+    Incomplete.erase(0, complete);
+    Pending += Converted;
+
+    size_t end = 0;
+    for (size_t i = Scanned; i < Pending.size(); ++i) {
+        if (IsSentenceEnd(Pending[i])) {
+            end = i + 1;
+        }
+    }
+    Scanned = Pending.size();
+    if (end == 0 && Pending.size() > MaxPending) {
+        // after the last separator, or anywhere in a word that long
+        end = Pending.size();
+        while (end > 0 && Corrector.GetLangModel().IsLetter(Pending[end - 1])) {
+            --end;
+        }
+        if (end == 0) {
+            end = Pending.size();
+        }
+    }
+    std::string out;
+    if (end > 0) {
+        Process(end, out);
+    }
+    return out;
+}
+
+std::string TCorrectionStream::Finish() {
+    if (!Incomplete.empty()) {
+        UTF8ToWide(Incomplete.data(), Incomplete.size(), Converted); // throws
+    }
+    std::string out;
+    Process(Pending.size(), out);
+    if (Output == EOutput::Candidates) {
+        out += "]}";
+    }
+    return out;
+}
+
+void TCorrectionStream::Process(size_t end, std::string& out) {
+    if (Output == EOutput::Candidates && !Started) {
+        out += "{\"results\":[";
+    }
+    Started = true;
+    if (end == 0) {
+        return;
+    }
+    std::wstring text(Pending, 0, end);
+    if (Output == EOutput::Fixed) {
+        std::wstring fixed = Corrector.FixFragment(text);
+        AppendUTF8(fixed.data(), fixed.size(), out);
+    } else {
+        std::transform(text.begin(), text.end(), text.begin(), std::towlower);
+        TSentences sentences = Corrector.GetLangModel().Tokenize(text);
+        TJsonWriter writer(out);
+        for (auto&& sentence: sentences) {
+            for (auto&& misspelling: Corrector.GetMisspellings(sentence)) {
+                if (!FirstResult) {
+                    out += ",";
+                }
+                FirstResult = false;
+                WriteMisspellingJSON(writer, text, Offset, misspelling);
+            }
+        }
+    }
+    Offset += end;
+    Pending.erase(0, end);
+    Scanned = Pending.size();
+}
+
 } // NJamSpell
@@ -1,43 +1,243 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <memory>
 
 #include "lang_model.hpp"
 #include "bloom_filter.hpp"
+#include "dawg_index.hpp"
+#include "deletion_index.hpp"
+#include "thread_pool.hpp"
+#include "lru_cache.hpp"
 
 namespace NJamSpell {
 
+// A deadline for one correction call, checked before each word. As the time
+// left shrinks each word gets less effort: under half of the budget left at
+// most half of MaxCandidatesToCheck candidates are scored, under a quarter
+// the second level (Edits) fallback is skipped too, and past the deadline
+// words get no candidates at all, so FixFragment() leaves them as they are.
+// Results computed with less effort are not cached. Not thread safe: one
+// budget per call.
+class TLatencyBudget {
+public:
+    enum class ELevel {
+        Full,
+        FewerCandidates,
+        FirstLevelOnly,
+        Exhausted,
+    };
+    explicit TLatencyBudget(double milliseconds);
+    // Reads the clock; any level but Full marks the call as degraded.
+    ELevel Check();
+    // Whether some word got less than the full effort.
+    bool Degraded() const;
+private:
+    std::chrono::steady_clock::time_point Deadline;
+    std::chrono::steady_clock::duration Total;
+    bool DegradedFlag = false;
+};
 
+// Const methods are safe to call concurrently once LoadLangModel() or
+// TrainLangModel() has returned.
 class TSpellCorrector {
 public:
+    struct TMisspelling {
+        NJamSpell::TWord Word;
+        NJamSpell::TScoredWords Candidates;
+    };
+
     bool LoadLangModel(const std::string& modelFile);
     bool TrainLangModel(const std::string& textFile, const std::string& alphabetFile, const std::string& modelFile);
-    NJamSpell::TScoredWords GetCandidatesScoredRaw(const NJamSpell::TWords& sentence, size_t position) const;
-    NJamSpell::TWords GetCandidatesRaw(const NJamSpell::TWords& sentence, size_t position) const;
-    std::string GetALLCandidatesScoredJSON(const std::string& text) const;
+    // Rebuilds modelFile.spell from scratch on threadsCount threads (0 means
+    // one per core), so that LoadLangModel() finds it up to date.
+    bool BuildCache(const std::string& modelFile, size_t threadsCount = 0);
+    // Loads a delta trained on the loaded model (see TLangModelDelta). Its
+    // words get candidates from its own deletion index whatever the engine.
+    // On failure the current delta, if any, is kept.
+    bool LoadDelta(const std::string& deltaFile);
+    // Trains a delta on the loaded model from textFile, saves it to
+    // deltaFile and loads it. It replaces the current delta rather than
+    // adding to it, so textFile holds all the text the model lacks.
+    bool TrainDelta(const std::string& textFile, const std::string& deltaFile);
+    // How candidates are generated. Edits probes the vocabulary for every
+    // edit of the word, backed by the Bloom filters of modelFile.spell.
+    // DeletionIndex looks the same candidates up in a TDeletionIndex stored
+    // in modelFile.deletes, which is built when missing or stale. Dawg walks
+    // a TDawgIndex stored in modelFile.dawg the same way, for words within
+    // one edit, then two; whatever the alphabet size, but unlike Edits it
+    // does not find words that take three or four edits which Edits()
+    // reaches by two deletions on each side.
+    enum class ECandidateEngine {
+        Edits,
+        DeletionIndex,
+        Dawg,
+    };
+    // Applies to the loaded model, if any, and to the ones loaded later. On
+    // failure to prepare the index the engine stays at Edits. BuildCache()
+    // also rebuilds the index of the selected engine.
+    bool SetCandidateEngine(ECandidateEngine engine);
+    ECandidateEngine GetCandidateEngine() const;
+    // Applies to models loaded afterwards, see TLangModel::SetHugePages().
+    void SetHugePages(bool hugePages);
+    // The calls taking a budget spend less effort per word as it runs out,
+    // see TLatencyBudget; without one they always spend the full effort.
+    NJamSpell::TScoredWords GetCandidatesScoredRaw(const NJamSpell::TWords& sentence, size_t position,
+                                                   TLatencyBudget* budget = nullptr) const;
+    NJamSpell::TWords GetCandidatesRaw(const NJamSpell::TWords& sentence, size_t position,
+                                       TLatencyBudget* budget = nullptr) const;
+    std::string GetALLCandidatesScoredJSON(const std::string& text, bool pretty = true,
+                                           TLatencyBudget* budget = nullptr) const;
+    // Same document, appended to out; lets callers reuse one buffer.
+    void AppendCandidatesScoredJSON(const std::string& text, std::string& out, bool pretty = false,
+                                    TLatencyBudget* budget = nullptr) const;
+    // Words of the sentence whose best candidate differs from the word itself.
+    std::vector<TMisspelling> GetMisspellings(const NJamSpell::TWords& sentence,
+                                              TLatencyBudget* budget = nullptr) const;
     NJamSpell::TScoredWords GetCandidatesScored(const std::vector<std::wstring>& sentence, size_t position) const;
     std::vector<std::wstring> GetCandidates(const std::vector<std::wstring>& sentence, size_t position) const;
-    std::wstring FixFragment(const std::wstring& text) const;
+    std::wstring FixFragment(const std::wstring& text, TLatencyBudget* budget = nullptr) const;
     std::wstring FixFragmentNormalized(const std::wstring& text) const;
+    // Batch versions of GetALLCandidatesScoredJSON() and FixFragment(). The
+    // sentences of all texts are processed in parallel on the pool; results
+    // come back in input order. The JSON documents are compact.
+    std::vector<std::string> GetALLCandidatesScoredJSON(const std::vector<std::string>& texts, TThreadPool& pool) const;
+    std::vector<std::wstring> FixFragments(const std::vector<std::wstring>& texts, TThreadPool& pool) const;
     void SetPenalty(double knownWordsPenaly, double unknownWordsPenalty);
     void SetMaxCandidatesToCheck(size_t maxCandidatesToCheck);
+    // Accepts words of the vocabulary seen at least minCount times whose
+    // TLangModel::WordContextLogProb(), a mean per n-gram, is at least
+    // minContextLogProb without generating candidates: they come back as
+    // their only candidate, scored by that log probability. A minCount of 0
+    // turns the gate off, the default.
+    void SetKnownWordThreshold(TCount minCount, double minContextLogProb);
+    // How FixFragment() and FixFragments() choose the words of a sentence.
+    // Greedy fixes one word at a time, left to right, scoring the candidates
+    // of each in the sentence fixed so far. Beam builds a lattice of the
+    // candidates of every word and searches it for the best whole sentence,
+    // keeping the beamWidth best hypotheses per word; each n-gram is looked
+    // up once per sentence (see TGramMemo). Known words with only second
+    // level candidates are kept as they are in the lattice, as Greedy keeps
+    // them in practice.
+    enum class EDecoding {
+        Greedy,
+        Beam,
+    };
+    void SetDecoding(EDecoding decoding, size_t beamWidth = 4);
+    EDecoding GetDecoding() const;
+    struct TKnownWordStats {
+        uint64_t Checked = 0;  // words looked at while the gate is on
+        uint64_t Accepted = 0; // of them, words that skipped candidates
+    };
+    TKnownWordStats GetKnownWordStats() const;
+    // Caches generated candidates per word and scored candidates per window
+    // of two words on each side, in up to maxBytes of memory (0 disables
+    // caching, the default). Not safe to call while the corrector is in use.
+    void SetCacheSize(size_t maxBytes);
+    struct TCachesStats {
+        TCacheStats Candidates;
+        TCacheStats Results;
+    };
+    TCachesStats GetCacheStats() const;
     const NJamSpell::TLangModel& GetLangModel() const;
 private:
-    void FilterCandidatesByFrequency(std::unordered_set<NJamSpell::TWord, NJamSpell::TWordHashPtr>& uniqueCandidates, NJamSpell::TWord origWord) const;
+    // Candidates for one word; Words never holds the word itself unless it
+    // is in the vocabulary, so entries do not point into caller's text.
+    struct TCandidateSet {
+        NJamSpell::TWords Words;
+        bool Empty = true;
+        bool FirstLevel = true;
+        bool KnownWord = false;
+    };
+    using TCandidatesCache = TShardedLruCache<std::wstring, TCandidateSet>;
+    using TResultsCache = TShardedLruCache<std::string, NJamSpell::TScoredWords>;
+
+    bool IsConfidentKnownWord(const NJamSpell::TWords& sentence, size_t position, NJamSpell::TScoredWord& result) const;
+    void GetCandidateSet(const NJamSpell::TWord& word, TCandidateSet& result,
+                         TLatencyBudget::ELevel level = TLatencyBudget::ELevel::Full) const;
+    void ClearCaches();
+    void FilterCandidatesByFrequency(std::unordered_set<NJamSpell::TWord, NJamSpell::TWordHashPtr>& uniqueCandidates, NJamSpell::TWord origWord,
+                                     size_t maxCandidates) const;
     NJamSpell::TWords Edits(const NJamSpell::TWord& word) const;
     NJamSpell::TWords Edits2(const NJamSpell::TWord& word, bool lastLevel = true) const;
-    void Inserts(const std::wstring& w, NJamSpell::TWords& result) const;
-    void Inserts2(const std::wstring& w, NJamSpell::TWords& result) const;
-    void PrepareCache();
+    NJamSpell::TWords IndexEdits(const NJamSpell::TWord& word, bool firstLevel) const;
+    NJamSpell::TWords DawgEdits(const NJamSpell::TWord& word, bool firstLevel) const;
+    // The words of the delta the engines above do not know.
+    void DeltaEdits(const NJamSpell::TWord& word, bool firstLevel, NJamSpell::TWords& result) const;
+    void Inserts(const NJamSpell::TWord& word, NJamSpell::TWords& result) const;
+    void Inserts2(const NJamSpell::TWord& word, NJamSpell::TWords& result) const;
+    struct TLatticeCandidate {
+        NJamSpell::TWord Word;
+        NJamSpell::TWordId Id;
+        double Penalty; // subtracted from the score of the sentence
+    };
+    std::vector<TLatticeCandidate> GetLatticeCandidates(const NJamSpell::TWords& sentence, size_t position,
+                                                        TLatencyBudget* budget) const;
+    NJamSpell::TWords FixSentence(const NJamSpell::TWords& sentence, TLatencyBudget* budget = nullptr) const;
+    NJamSpell::TWords FixSentenceBeam(const NJamSpell::TWords& sentence, TLatencyBudget* budget) const;
+    // Leaves no filters, so that SaveCache() fails, if those of the workers
+    // could not be merged.
+    bool PrepareCache(size_t threadsCount = 0);
     bool LoadCache(const std::string& cacheFile);
     bool SaveCache(const std::string& cacheFile);
+    bool PrepareCandidateIndex(bool rebuild, size_t threadsCount = 0);
 private:
     TLangModel LangModel;
+    std::string ModelFile; // of the loaded model
+    std::unique_ptr<TMemoryMappedFile> CacheFile; // backs Deletes1/Deletes2 once loaded
     std::unique_ptr<TBloomFilter> Deletes1;
     std::unique_ptr<TBloomFilter> Deletes2;
+    ECandidateEngine CandidateEngine = ECandidateEngine::Edits;
+    std::unique_ptr<TDeletionIndex> DeletionIndex; // set when CandidateEngine is DeletionIndex
+    std::unique_ptr<TDawgIndex> Dawg;              // set when CandidateEngine is Dawg
     double KnownWordsPenalty = 20.0;
     double UnknownWordsPenalty = 5.0;
     size_t MaxCandidatesToCheck = 14;
+    EDecoding Decoding = EDecoding::Greedy;
+    size_t BeamWidth = 4;
+    TCount KnownWordMinCount = 0;
+    double KnownWordMinContextLogProb = 0;
+    mutable std::atomic<uint64_t> KnownWordsChecked{0};
+    mutable std::atomic<uint64_t> KnownWordsAccepted{0};
+    size_t CacheSize = 0;
+    std::unique_ptr<TCandidatesCache> CandidatesCache;
+    std::unique_ptr<TResultsCache> ResultsCache;
+};
+
+// Corrects a UTF-8 text that arrives in pieces, e.g. a request body read as
+// it comes, one run of whole sentences at a time. Put() returns the output
+// for the sentences it completes and keeps the rest, at most maxPending
+// characters of it, for the next pieces or Finish(). Sentences end where
+// TLangModel::Tokenize() ends them, so the outputs add up to FixFragment()
+// or the compact GetALLCandidatesScoredJSON() of the whole text; only a
+// sentence longer than maxPending characters is cut at a word boundary.
+// Malformed UTF-8 throws std::range_error. The corrector must outlive it.
+class TCorrectionStream {
+public:
+    enum class EOutput {
+        Fixed,
+        Candidates,
+    };
+    static constexpr size_t DEFAULT_MAX_PENDING = 1 << 16;
+
+    TCorrectionStream(const TSpellCorrector& corrector, EOutput output, size_t maxPending = DEFAULT_MAX_PENDING);
+    std::string Put(const std::string& data);
+    std::string Finish();
+private:
+    bool IsSentenceEnd(wchar_t chr) const;
+    void Process(size_t end, std::string& out);
+private:
+    const TSpellCorrector& Corrector;
+    EOutput Output;
+    size_t MaxPending;
+    std::string Incomplete; // bytes of a UTF-8 sequence cut by the piece
+    std::wstring Converted;
+    std::wstring Pending;
+    size_t Scanned = 0; // characters of Pending without a sentence end
+    size_t Offset = 0;  // characters before Pending, for the positions
+    bool Started = false;
+    bool FirstResult = true;
 };
 
 
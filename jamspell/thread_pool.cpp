@@ -0,0 +1,157 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include "thread_pool.hpp"
+
+namespace NJamSpell {
+
+TThreadPool::TThreadPool(size_t threadsCount, size_t maxQueueSize)
+    : MaxQueueSize(maxQueueSize)
+{
+    if (threadsCount == 0) {
+        threadsCount = 1;
+    }
+    Workers.reserve(threadsCount);
+    for (size_t i = 0; i < threadsCount; ++i) {
+        Workers.emplace_back(&TThreadPool::WorkerLoop, this);
+    }
+}
+
+TThreadPool::~TThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        Stopping = true;
+    }
+    HasTask.notify_all();
+    HasSpace.notify_all();
+    for (auto&& worker: Workers) {
+        worker.join();
+    }
+}
+
+void TThreadPool::Add(TTask task) {
+    {
+        std::unique_lock<std::mutex> lock(Mutex);
+        HasSpace.wait(lock, [this] {
+            return MaxQueueSize == 0 || Queue.size() < MaxQueueSize;
+        });
+        Queue.push_back(std::move(task));
+    }
+    HasTask.notify_one();
+}
+
+bool TThreadPool::TryAdd(TTask task) {
+    {
+        std::lock_guard<std::mutex> lock(Mutex);
+        if (MaxQueueSize != 0 && Queue.size() >= MaxQueueSize) {
+            return false;
+        }
+        Queue.push_back(std::move(task));
+    }
+    HasTask.notify_one();
+    return true;
+}
+
+size_t TThreadPool::ThreadsCount() const {
+    return Workers.size();
+}
+
+size_t TThreadPool::QueueSize() const {
+    std::lock_guard<std::mutex> lock(Mutex);
+    return Queue.size();
+}
+
+void TThreadPool::WorkerLoop() {
+    for (;;) {
+        TTask task;
+        {
+            std::unique_lock<std::mutex> lock(Mutex);
+            HasTask.wait(lock, [this] {
+                return Stopping || !Queue.empty();
+            });
+            if (Queue.empty()) {
+                return;
+            }
+            task = std::move(Queue.front());
+            Queue.pop_front();
+        }
+        HasSpace.notify_one();
+        task();
+    }
+}
+
+namespace {
+
+struct TParallelForState {
+    std::function<void(size_t)> Func;
+    size_t Count = 0;
+    std::atomic<size_t> Next{0};
+    size_t Done = 0;
+    std::exception_ptr Error;
+    std::mutex Mutex;
+    std::condition_variable Finished;
+
+    // Executes indices until none are left. Helpers that start after the
+    // work has been taken return immediately.
+    void Run() {
+        size_t executed = 0;
+        for (;;) {
+            size_t i = Next.fetch_add(1);
+            if (i >= Count) {
+                break;
+            }
+            try {
+                Func(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(Mutex);
+                if (!Error) {
+                    Error = std::current_exception();
+                }
+            }
+            executed += 1;
+        }
+        if (executed == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(Mutex);
+        Done += executed;
+        if (Done == Count) {
+            Finished.notify_all();
+        }
+    }
+};
+
+} // namespace
+
+void ParallelFor(TThreadPool& pool, size_t count, const std::function<void(size_t)>& func) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        func(0);
+        return;
+    }
+    // Helpers may still be queued after ParallelFor returns, so the state
+    // (including a copy of func) is shared with them rather than borrowed.
+    auto state = std::make_shared<TParallelForState>();
+    state->Func = func;
+    state->Count = count;
+    size_t helpers = std::min(pool.ThreadsCount(), count - 1);
+    for (size_t i = 0; i < helpers; ++i) {
+        if (!pool.TryAdd([state] { state->Run(); })) {
+            break;
+        }
+    }
+    state->Run();
+    std::unique_lock<std::mutex> lock(state->Mutex);
+    state->Finished.wait(lock, [&state] {
+        return state->Done == state->Count;
+    });
+    if (state->Error) {
+        std::rethrow_exception(state->Error);
+    }
+}
+
+} // NJamSpell
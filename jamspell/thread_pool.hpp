@@ -0,0 +1,47 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace NJamSpell {
+
+// Fixed set of worker threads fed from one FIFO queue. A non-zero
+// maxQueueSize bounds the number of tasks waiting for a worker.
+class TThreadPool {
+public:
+    using TTask = std::function<void()>;
+
+    explicit TThreadPool(size_t threadsCount, size_t maxQueueSize = 0);
+    TThreadPool(const TThreadPool& other) = delete;
+    TThreadPool& operator=(const TThreadPool& other) = delete;
+    // Runs the tasks still queued, then joins the workers.
+    ~TThreadPool();
+    // Blocks while the queue is full.
+    void Add(TTask task);
+    // Returns false instead of blocking when the queue is full.
+    bool TryAdd(TTask task);
+    size_t ThreadsCount() const;
+    size_t QueueSize() const;
+private:
+    void WorkerLoop();
+private:
+    std::vector<std::thread> Workers;
+    std::deque<TTask> Queue;
+    size_t MaxQueueSize;
+    bool Stopping = false;
+    mutable std::mutex Mutex;
+    std::condition_variable HasTask;
+    std::condition_variable HasSpace;
+};
+
+// Calls func(0) .. func(count - 1) on the pool and returns once all calls
+// have finished. The calling thread takes part in the work, so ParallelFor
+// makes progress even when every worker is busy (or is itself inside a
+// ParallelFor). The first exception thrown by func is rethrown here.
+void ParallelFor(TThreadPool& pool, size_t count, const std::function<void(size_t)>& func);
+
+} // NJamSpell
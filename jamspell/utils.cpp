@@ -1,3 +1,4 @@
+#include <atomic>
 #include <fstream>
 #include <sstream>
 #include <chrono>
@@ -5,11 +6,15 @@
 #include <iostream>
 #include <cassert>
 #include <algorithm>
+#include <stdexcept>
+#include <cstring>
 
 #ifdef USE_BOOST_CONVERT
     #include <boost/locale/encoding_utf.hpp>
-#else
-    #include <codecvt>
+#endif
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
 #endif
 
 #include "utils.hpp"
@@ -19,6 +24,18 @@
 
 namespace NJamSpell {
 
+// en_US.UTF-8 is not generated on every system (e.g. slim containers), so
+// fall back to another UTF-8 locale rather than failing at startup.
+static std::locale MakeUtf8Locale() {
+    for (const char* name: {"en_US.UTF-8", "C.UTF-8"}) {
+        try {
+            return std::locale(name);
+        } catch (const std::runtime_error&) {
+        }
+    }
+    return std::locale::classic();
+}
+
 std::string LoadFile(const std::string& fileName) {
     std::ifstream in(fileName, std::ios::binary);
     std::ostringstream out;
@@ -32,10 +49,24 @@ void SaveFile(const std::string& fileName, const std::string& data) {
 }
 
 TTokenizer::TTokenizer()
-    : Locale("en_US.utf-8")
+    : Letters(LETTERS_SIZE / 64, 0)
+    , Locale(MakeUtf8Locale())
 {
 }
 
+void TTokenizer::BuildLetters() {
+    std::vector<uint64_t> letters(LETTERS_SIZE / 64, 0);
+    if (!Alphabet.empty()) {
+        const std::ctype<wchar_t>& ctype = std::use_facet<std::ctype<wchar_t>>(Locale);
+        for (uint32_t c = 0; c < LETTERS_SIZE; ++c) {
+            if (Alphabet.find(ctype.tolower(static_cast<wchar_t>(c))) != Alphabet.end()) {
+                letters[c / 64] |= uint64_t(1) << (c % 64);
+            }
+        }
+    }
+    Letters.swap(letters);
+}
+
 bool TTokenizer::LoadAlphabet(const std::string& alphabetFile) {
     std::string data = LoadFile(alphabetFile);
     if (data.empty()) {
@@ -57,6 +88,7 @@ bool TTokenizer::LoadAlphabet(const std::string& alphabetFile) {
         return false;
     }
     Alphabet = alphabet;
+    BuildLetters();
     return true;
 }
 
@@ -71,8 +103,8 @@ TSentences TTokenizer::Process(const std::wstring& originalText) const {
     TWord currWord;
 
     for (size_t i = 0; i < originalText.size(); ++i) {
-        wchar_t letter = std::tolower(originalText[i], Locale);
-        if (Alphabet.find(letter) != Alphabet.end()) {
+        wchar_t letter = originalText[i];
+        if (IsLetter(letter)) {
             if (currWord.Ptr == nullptr) {
                 currWord.Ptr = &originalText[i];
             }
@@ -102,31 +134,204 @@ TSentences TTokenizer::Process(const std::wstring& originalText) const {
 
 void TTokenizer::Clear() {
     Alphabet.clear();
+    BuildLetters();
 }
 
 const std::unordered_set<wchar_t>& TTokenizer::GetAlphabet() const {
     return Alphabet;
 }
 
-std::wstring UTF8ToWide(const std::string& text) {
-#ifdef USE_BOOST_CONVERT
-    using boost::locale::conv::utf_to_utf;
-    return utf_to_utf<wchar_t>(text.c_str(), text.c_str() + text.size());
+#ifndef USE_BOOST_CONVERT
+
+static void ThrowInvalidUTF8() {
+    throw std::range_error("invalid UTF-8 sequence");
+}
+
+// Number of leading bytes below 0x80.
+static size_t ASCIIPrefix(const unsigned char* data, size_t size) {
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        int mask = _mm_movemask_epi8(chunk);
+        if (mask != 0) {
+            return i + __builtin_ctz(mask);
+        }
+    }
 #else
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t, 0x10ffff, std::little_endian>> converter;
-    return converter.from_bytes(text);
+    for (; i + 8 <= size; i += 8) {
+        uint64_t chunk;
+        memcpy(&chunk, data + i, sizeof(chunk));
+        if (chunk & 0x8080808080808080ULL) {
+            break;
+        }
+    }
 #endif
+    while (i < size && data[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+static wchar_t* WidenASCII(const unsigned char* data, size_t size, wchar_t* out) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (sizeof(wchar_t) == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= size; i += 16) {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+            __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            __m128i* dst = reinterpret_cast<__m128i*>(out + i);
+            _mm_storeu_si128(dst + 0, _mm_unpacklo_epi16(lo, zero));
+            _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(lo, zero));
+            _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(hi, zero));
+            _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(hi, zero));
+        }
+    }
+#endif
+    for (; i < size; ++i) {
+        out[i] = data[i];
+    }
+    return out + size;
+}
+
+// Strict decoding: overlong forms, surrogates and code points above
+// U+10FFFF are rejected, as std::codecvt_utf8 rejected them.
+static uint32_t DecodeUTF8(const unsigned char*& p, const unsigned char* end) {
+    unsigned char lead = *p++;
+    size_t extra = 0;
+    uint32_t cp = 0;
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        extra = 1;
+        cp = lead & 0x1F;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        extra = 2;
+        cp = lead & 0x0F;
+        min = lead == 0xE0 ? 0xA0 : 0x80;
+        max = lead == 0xED ? 0x9F : 0xBF;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        extra = 3;
+        cp = lead & 0x07;
+        min = lead == 0xF0 ? 0x90 : 0x80;
+        max = lead == 0xF4 ? 0x8F : 0xBF;
+    } else {
+        ThrowInvalidUTF8();
+    }
+    if (size_t(end - p) < extra || *p < min || *p > max) {
+        ThrowInvalidUTF8();
+    }
+    for (size_t i = 0; i < extra; ++i) {
+        if ((p[i] & 0xC0) != 0x80) {
+            ThrowInvalidUTF8();
+        }
+        cp = (cp << 6) | (p[i] & 0x3F);
+    }
+    p += extra;
+    return cp;
+}
+
+void UTF8ToWide(const char* data, size_t size, std::wstring& out) {
+    out.resize(size);
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + size;
+    wchar_t* begin = &out[0];
+    wchar_t* dst = begin;
+    while (p < end) {
+        size_t ascii = ASCIIPrefix(p, end - p);
+        dst = WidenASCII(p, ascii, dst);
+        p += ascii;
+        if (p == end) {
+            break;
+        }
+        uint32_t cp = DecodeUTF8(p, end);
+        if (sizeof(wchar_t) == 2 && cp >= 0x10000) {
+            // a 4-byte sequence becomes two UTF-16 units, which still fit
+            cp -= 0x10000;
+            *dst++ = static_cast<wchar_t>(0xD800 + (cp >> 10));
+            *dst++ = static_cast<wchar_t>(0xDC00 + (cp & 0x3FF));
+        } else {
+            *dst++ = static_cast<wchar_t>(cp);
+        }
+    }
+    out.resize(dst - begin);
+}
+
+// Surrogate pairs are combined into one code point; lone surrogates and
+// values above U+10FFFF have no UTF-8 form and become U+FFFD.
+static uint32_t NextCodePoint(const wchar_t*& p, const wchar_t* end) {
+    uint32_t cp = static_cast<uint32_t>(*p++);
+    if (cp >= 0xD800 && cp < 0xDC00 && p < end) {
+        uint32_t low = static_cast<uint32_t>(*p);
+        if (low >= 0xDC00 && low < 0xE000) {
+            ++p;
+            return 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+        }
+    }
+    if ((cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF) {
+        return 0xFFFD;
+    }
+    return cp;
+}
+
+void AppendUTF8(const wchar_t* ptr, size_t len, std::string& out) {
+    // no code unit takes more than 4 bytes; the string is shrunk at the end
+    const size_t oldSize = out.size();
+    out.resize(oldSize + len * 4);
+    char* begin = &out[0] + oldSize;
+    char* dst = begin;
+    const wchar_t* end = ptr + len;
+    for (const wchar_t* p = ptr; p < end;) {
+        while (p < end && static_cast<uint32_t>(*p) < 0x80) {
+            *dst++ = static_cast<char>(*p++);
+        }
+        if (p == end) {
+            break;
+        }
+        uint32_t cp = NextCodePoint(p, end);
+        if (cp < 0x800) {
+            *dst++ = static_cast<char>(0xC0 | (cp >> 6));
+            *dst++ = static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            *dst++ = static_cast<char>(0xE0 | (cp >> 12));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            *dst++ = static_cast<char>(0xF0 | (cp >> 18));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            *dst++ = static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+    out.resize(oldSize + (dst - begin));
 }
 
-std::string WideToUTF8(const std::wstring& text) {
-#ifdef USE_BOOST_CONVERT
-    using boost::locale::conv::utf_to_utf;
-    return utf_to_utf<char>(text.c_str(), text.c_str() + text.size());
 #else
-    using convert_type = std::codecvt_utf8<wchar_t, 0x10ffff, std::little_endian>;
-    std::wstring_convert<convert_type, wchar_t> converter;
-    return converter.to_bytes(text);
+
+void UTF8ToWide(const char* data, size_t size, std::wstring& out) {
+    using boost::locale::conv::utf_to_utf;
+    out = utf_to_utf<wchar_t>(data, data + size);
+}
+
+void AppendUTF8(const wchar_t* ptr, size_t len, std::string& out) {
+    using boost::locale::conv::utf_to_utf;
+    out += utf_to_utf<char>(ptr, ptr + len);
+}
+
 #endif
+
+std::wstring UTF8ToWide(const std::string& text) {
+    std::wstring result;
+    UTF8ToWide(text.data(), text.size(), result);
+    return result;
+}
+
+std::string WideToUTF8(const std::wstring& text) {
+    std::string result;
+    AppendUTF8(text.data(), text.size(), result);
+    return result;
 }
 
 uint64_t GetCurrentTimeMs() {
@@ -135,11 +340,24 @@ uint64_t GetCurrentTimeMs() {
     return ms.count();
 }
 
-static const std::locale GLocale("en_US.UTF-8");
+static std::atomic<int> GLogLevel(static_cast<int>(ELogLevel::Info));
+
+void SetLogLevel(ELogLevel level) {
+    GLogLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+bool LogEnabled(ELogLevel level) {
+    return static_cast<int>(level) <= GLogLevel.load(std::memory_order_relaxed);
+}
+
+static const std::locale GLocale = MakeUtf8Locale();
 static const std::ctype<wchar_t>& GWctype = std::use_facet<std::ctype<wchar_t>>(GLocale);
 
 void ToLower(std::wstring& text) {
     std::transform(text.begin(), text.end(), text.begin(), [](wchar_t wch) {
+        if (static_cast<uint32_t>(wch) < 0x80) {
+            return wch >= L'A' && wch <= L'Z' ? wchar_t(wch + (L'a' - L'A')) : wch;
+        }
         return GWctype.tolower(wch);
     });
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <unordered_set>
@@ -50,6 +51,9 @@ using TWords = std::vector<TWord>;
 using TScoredWords = std::vector<TScoredWord>;
 using TSentences = std::vector<TWords>;
 
+// Words are runs of characters whose lowercase form is in the alphabet.
+// Membership of every BMP character is precomputed into a bitmap when the
+// alphabet is loaded, so Process() does one table lookup per character.
 class TTokenizer {
     public:
         TTokenizer();
@@ -59,17 +63,52 @@ class TTokenizer {
 
         const std::unordered_set<wchar_t>& GetAlphabet() const;
 
-        HANDYPACK(Alphabet);
+        inline virtual void Dump(std::ostream& out) const {
+            NHandyPack::Dump(out, Alphabet);
+        }
+        inline virtual void Load(std::istream& in) {
+            NHandyPack::Load(in, Alphabet);
+            BuildLetters();
+        }
+        // Characters of the alphabet make up words, all others separate them.
+        bool IsLetter(wchar_t chr) const {
+            uint32_t c = static_cast<uint32_t>(chr);
+            if (c < LETTERS_SIZE) {
+                return (Letters[c / 64] >> (c % 64)) & 1;
+            }
+            return Alphabet.find(std::tolower(chr, Locale)) != Alphabet.end();
+        }
+    private:
+        static constexpr uint32_t LETTERS_SIZE = 0x10000;
+
+        void BuildLetters();
     private:
         std::unordered_set<wchar_t> Alphabet;
+        std::vector<uint64_t> Letters; // bit per BMP character
         std::locale Locale;
 };
 
 std::string LoadFile(const std::string& fileName);
 void SaveFile(const std::string& fileName, const std::string& data);
+// Malformed UTF-8 throws std::range_error. wchar_t holds UTF-32 code
+// points, or UTF-16 units where it is 2 bytes wide.
 std::wstring UTF8ToWide(const std::string& text);
 std::string WideToUTF8(const std::wstring& text);
+// Same conversions into caller-owned buffers, so that repeated calls can
+// reuse their memory: UTF8ToWide() replaces the contents of out,
+// AppendUTF8() appends to it.
+void UTF8ToWide(const char* data, size_t size, std::wstring& out);
+void AppendUTF8(const wchar_t* ptr, size_t len, std::string& out);
 uint64_t GetCurrentTimeMs();
+// Messages less severe than the log level are not written; defaults to
+// Info. Debug adds per-word output to the correction paths, which is slow.
+enum class ELogLevel {
+    Error,
+    Info,
+    Debug,
+};
+void SetLogLevel(ELogLevel level);
+bool LogEnabled(ELogLevel level);
 void ToLower(std::wstring& text);
 wchar_t MakeUpperIfRequired(wchar_t orig, wchar_t sample);
 uint16_t CityHash16(const std::string& str);
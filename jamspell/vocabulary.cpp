@@ -0,0 +1,183 @@
+#include <algorithm>
+#include <cassert>
+
+#include <contrib/cityhash/city.h>
+
+#include "vocabulary.hpp"
+
+namespace NJamSpell {
+
+constexpr size_t MIN_TABLE_SIZE = 16;
+
+static uint64_t WordHash(const wchar_t* ptr, size_t len) {
+    return CityHash64((const char*)ptr, len * sizeof(wchar_t));
+}
+
+static size_t TableSizeFor(size_t wordsCount) {
+    size_t size = MIN_TABLE_SIZE;
+    while (size < 2 * wordsCount) {
+        size *= 2;
+    }
+    return size;
+}
+
+// Slot holding the word, or the free slot it would go to.
+static size_t FindSlot(const wchar_t* chars, const uint32_t* offsets, const TWordId* table, size_t tableSize,
+                       const wchar_t* ptr, size_t len, uint64_t hash)
+{
+    const size_t mask = tableSize - 1;
+    for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+        TWordId wid = table[slot];
+        if (wid == UNKNOWN_WORD_ID) {
+            return slot;
+        }
+        const uint32_t begin = offsets[wid];
+        if (offsets[wid + 1] - begin == len && std::equal(ptr, ptr + len, chars + begin)) {
+            return slot;
+        }
+    }
+}
+
+static std::vector<TWordId> BuildTable(const wchar_t* chars, const uint32_t* offsets, size_t wordsCount) {
+    std::vector<TWordId> table(TableSizeFor(wordsCount), UNKNOWN_WORD_ID);
+    for (TWordId wid = 0; wid < wordsCount; ++wid) {
+        const wchar_t* ptr = chars + offsets[wid];
+        size_t len = offsets[wid + 1] - offsets[wid];
+        table[FindSlot(chars, offsets, table.data(), table.size(), ptr, len, WordHash(ptr, len))] = wid;
+    }
+    return table;
+}
+
+void TVocabulary::Assign(std::vector<wchar_t>&& chars, std::vector<uint32_t>&& offsets) {
+    assert(!offsets.empty() && offsets.back() == chars.size());
+    std::vector<TWordId> table = BuildTable(chars.data(), offsets.data(), offsets.size() - 1);
+    Assign(std::move(chars), std::move(offsets), std::move(table));
+}
+
+void TVocabulary::Assign(std::vector<wchar_t>&& chars, std::vector<uint32_t>&& offsets, std::vector<TWordId>&& table) {
+    Chars.Assign(std::move(chars));
+    Offsets.Assign(std::move(offsets));
+    Table.Assign(std::move(table));
+}
+
+void TVocabulary::Dump(std::ostream& out) const {
+    DumpSection(out, Chars);
+    DumpSection(out, Offsets);
+    DumpSection(out, Table);
+}
+
+bool TVocabulary::LoadMapped(TMemoryStream& in) {
+    if (!MapSection(in, Chars) ||
+        !MapSection(in, Offsets) ||
+        !MapSection(in, Table))
+    {
+        Clear();
+        return false;
+    }
+    const size_t tableSize = Table.size();
+    if (Offsets.empty() || Offsets[0] != 0 || Offsets[Offsets.size() - 1] != Chars.size() ||
+        tableSize < 2 * Size() || (tableSize & (tableSize - 1)) != 0)
+    {
+        Clear();
+        return false;
+    }
+    for (size_t i = 1; i < Offsets.size(); ++i) {
+        if (Offsets[i] < Offsets[i - 1]) {
+            Clear();
+            return false;
+        }
+    }
+    // at most Size() used slots leave free ones for FindSlot() to stop at
+    size_t used = 0;
+    for (size_t i = 0; i < tableSize; ++i) {
+        if (Table[i] == UNKNOWN_WORD_ID) {
+            continue;
+        }
+        if (Table[i] >= Size() || ++used > Size()) {
+            Clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+void TVocabulary::Clear() {
+    Chars.Clear();
+    Offsets.Clear();
+    Table.Clear();
+}
+
+TWordId TVocabulary::Find(const wchar_t* ptr, size_t len) const {
+    return Find(ptr, len, WordHash(ptr, len));
+}
+
+TWordId TVocabulary::Find(const wchar_t* ptr, size_t len, uint64_t hash) const {
+    if (Table.empty()) {
+        return UNKNOWN_WORD_ID;
+    }
+    return Table[FindSlot(Chars.data(), Offsets.data(), Table.data(), Table.size(), ptr, len, hash)];
+}
+
+uint64_t TVocabulary::Hash(const wchar_t* ptr, size_t len) {
+    return WordHash(ptr, len);
+}
+
+TWord TVocabulary::Get(TWordId wid) const {
+    if (wid >= Size()) {
+        return TWord();
+    }
+    return TWord(Chars.data() + Offsets[wid], Offsets[wid + 1] - Offsets[wid]);
+}
+
+size_t TVocabulary::Size() const {
+    return Offsets.empty() ? 0 : Offsets.size() - 1;
+}
+
+TVocabularyBuilder::TVocabularyBuilder() {
+    Clear();
+}
+
+TWordId TVocabularyBuilder::Add(const wchar_t* ptr, size_t len) {
+    size_t slot = FindSlot(Chars.data(), Offsets.data(), Table.data(), Table.size(), ptr, len, WordHash(ptr, len));
+    if (Table[slot] != UNKNOWN_WORD_ID) {
+        return Table[slot];
+    }
+    TWordId wid = Size();
+    Chars.insert(Chars.end(), ptr, ptr + len);
+    Offsets.push_back(Chars.size());
+    Table[slot] = wid;
+    if (2 * Size() > Table.size()) {
+        Grow();
+    }
+    return wid;
+}
+
+size_t TVocabularyBuilder::Size() const {
+    return Offsets.size() - 1;
+}
+
+void TVocabularyBuilder::Finish(TVocabulary& vocabulary) {
+    vocabulary.Assign(std::move(Chars), std::move(Offsets), std::move(Table));
+    Clear();
+}
+
+void TVocabularyBuilder::Clear() {
+    std::vector<wchar_t>().swap(Chars);
+    Offsets.assign(1, 0);
+    Table.assign(MIN_TABLE_SIZE, UNKNOWN_WORD_ID);
+}
+
+void TVocabularyBuilder::Grow() {
+    std::vector<TWordId> table(Table.size() * 2, UNKNOWN_WORD_ID);
+    for (TWordId wid: Table) {
+        if (wid == UNKNOWN_WORD_ID) {
+            continue;
+        }
+        const wchar_t* ptr = Chars.data() + Offsets[wid];
+        size_t len = Offsets[wid + 1] - Offsets[wid];
+        table[FindSlot(Chars.data(), Offsets.data(), table.data(), table.size(), ptr, len, WordHash(ptr, len))] = wid;
+    }
+    Table.swap(table);
+}
+
+} // NJamSpell
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <ostream>
+#include <vector>
+
+#include "memory_map.hpp"
+#include "utils.hpp"
+
+namespace NJamSpell {
+
+using TWordId = uint32_t;
+
+constexpr TWordId UNKNOWN_WORD_ID = std::numeric_limits<TWordId>::max();
+
+// Words by id: the characters of all words in one arena, an offset per id
+// and an open-addressing table of ids (linear probing, at most half full)
+// keyed by a hash of the characters. Dump() writes the three arrays as raw
+// sections which LoadMapped() uses in place, so the words returned point
+// into the mapped file. Find() and Get() are safe to call concurrently.
+class TVocabulary {
+public:
+    TVocabulary() = default;
+    TVocabulary(const TVocabulary& other) = delete;
+    TVocabulary& operator=(const TVocabulary& other) = delete;
+
+    // offsets has an entry per word plus the end of chars.
+    void Assign(std::vector<wchar_t>&& chars, std::vector<uint32_t>&& offsets);
+    void Dump(std::ostream& out) const;
+    // Fails on sections that would make Find() or Get() read outside them.
+    bool LoadMapped(TMemoryStream& in);
+    void Clear();
+    TWordId Find(const wchar_t* ptr, size_t len) const;
+    // The same with Hash(ptr, len), which is that of every vocabulary, so
+    // that a word looked up in several is hashed once.
+    TWordId Find(const wchar_t* ptr, size_t len, uint64_t hash) const;
+    static uint64_t Hash(const wchar_t* ptr, size_t len);
+    // An empty word for unknown ids.
+    TWord Get(TWordId wid) const;
+    size_t Size() const;
+private:
+    friend class TVocabularyBuilder;
+    void Assign(std::vector<wchar_t>&& chars, std::vector<uint32_t>&& offsets, std::vector<TWordId>&& table);
+private:
+    TMappedArray<wchar_t> Chars;
+    TMappedArray<uint32_t> Offsets;
+    TMappedArray<TWordId> Table; // power of two slots, UNKNOWN_WORD_ID when free
+};
+
+// Collects words while training, numbering them in the order they are
+// first added.
+class TVocabularyBuilder {
+public:
+    TVocabularyBuilder();
+    TWordId Add(const wchar_t* ptr, size_t len);
+    size_t Size() const;
+    // Moves the words into vocabulary and starts over.
+    void Finish(TVocabulary& vocabulary);
+    void Clear();
+private:
+    void Grow();
+private:
+    std::vector<wchar_t> Chars;
+    std::vector<uint32_t> Offsets;
+    std::vector<TWordId> Table;
+};
+
+} // NJamSpell
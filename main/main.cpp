@@ -1,28 +1,177 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
 #include <iostream>
+#include <random>
+#include <thread>
 
 #include <jamspell/lang_model.hpp>
+#include <jamspell/lang_model_delta.hpp>
 #include <jamspell/spell_corrector.hpp>
-#include "contrib/nlohmann/json.hpp"
-#include <cwctype>
 
 using namespace NJamSpell;
 
 void PrintUsage(const char** argv) {
     std::cerr << "Usage: " << argv[0] << " mode args" << std::endl;
-    std::cerr << "    train alphabet.txt dataset.txt resultModel.bin  - train model" << std::endl;
+    std::cerr << "    train alphabet.txt dataset.txt resultModel.bin [--cache] [--index|--dawg] [--phf-*] [--prune*] [--*-bits]" << std::endl;
+    std::cerr << "        - train model" << std::endl;
+    std::cerr << "    trainstream alphabet.txt dataset.txt resultModel.bin [memoryMb] [--cache] [--index|--dawg] [--phf-*] [--prune*]" << std::endl;
+    std::cerr << "        [--*-bits] - train model without loading" << std::endl;
+    std::cerr << "        the whole dataset, spilling n-gram counts over memoryMb (default 1024) to disk" << std::endl;
+    std::cerr << "        --cache also builds resultModel.bin.spell, so that loading the model does not have to" << std::endl;
+    std::cerr << "        --index builds resultModel.bin.deletes as well, the deletion index used by --index below," << std::endl;
+    std::cerr << "        --dawg builds resultModel.bin.dawg, the automaton used by --dawg below" << std::endl;
+    std::cerr << "        --phf-lambda N, --phf-alpha N, --phf-seed N set the perfect hash parameters (default 4, 80, 42)" << std::endl;
+    std::cerr << "        --phf-partitions N builds N perfect hashes in parallel, each over a share of the n-grams (default 1)" << std::endl;
+    std::cerr << "        --prune2 N, --prune3 N leave out bigrams and trigrams seen less than N times (default 1)" << std::endl;
+    std::cerr << "        --fingerprint-bits 8|16, --count-bits 8|16 set the size of an n-gram bucket (default 16 and 16)" << std::endl;
+    std::cerr << "    traindelta model.bin dataset.txt resultDelta.bin - count the n-grams of dataset.txt on top of" << std::endl;
+    std::cerr << "        model.bin, for words and phrases it lacks, without retraining it (see TLangModelDelta)" << std::endl;
     std::cerr << "    score model.bin - input sentences and get score" << std::endl;
-    std::cerr << "    scoredcands model.bin - input sentences and get scored candidates" << std::endl;
-    std::cerr << "    correct model.bin - input sentences and get corrected one" << std::endl;
-    std::cerr << "    fix model.bin input.txt output.txt - automatically fix txt file" << std::endl;
+    std::cerr << "    scoredcands model.bin [--compact] [--index|--dawg] - input sentences and get scored candidates" << std::endl;
+    std::cerr << "    correct model.bin [--index|--dawg] - input sentences and get corrected one" << std::endl;
+    std::cerr << "    fix model.bin input.txt output.txt [--index|--dawg] - automatically fix txt file" << std::endl;
+    std::cerr << "    evaluate model.bin original.txt [--typos errored.txt] [--threads N] [--max-words N] [--repeat N]" << std::endl;
+    std::cerr << "        [--seed N] [--beam N] [--index|--dawg] [--budget-ms X] [--delta delta.bin] - fix the sentences" << std::endl;
+    std::cerr << "        of original.txt with typos in them over N threads (default 1), reporting accuracy, QPS and latency" << std::endl;
+    std::cerr << "        percentiles. Typos are generated like evaluate/typo_model.py does unless --typos gives the" << std::endl;
+    std::cerr << "        same text with errors; --repeat runs the requests N times for load testing, --beam N" << std::endl;
+    std::cerr << "        switches to beam decoding of width N" << std::endl;
+    std::cerr << "        --index looks candidates up in the deletion index instead of probing all edits, --dawg walks" << std::endl;
+    std::cerr << "        a DAWG of the vocabulary with a Levenshtein automaton, --budget-ms X gives each request" << std::endl;
+    std::cerr << "        X ms, after which its words get less effort (see TLatencyBudget), --delta loads a delta" << std::endl;
+    std::cerr << "        trained by traindelta on top of model.bin" << std::endl;
+}
+
+bool HasFlag(int argc, const char** argv, int first, const std::string& flag) {
+    for (int i = first; i < argc; ++i) {
+        if (argv[i] == flag) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t FlagValue(int argc, const char** argv, int first, const std::string& flag, size_t defaultValue) {
+    for (int i = first; i + 1 < argc; ++i) {
+        if (argv[i] == flag) {
+            return std::stoul(argv[i + 1]);
+        }
+    }
+    return defaultValue;
+}
+
+struct TTrainParams {
+    TPerfectHashParams PerfectHash;
+    TPruneParams Prune;
+    TBucketFormat Format;
+};
+
+TTrainParams TrainParams(int argc, const char** argv, int first) {
+    TTrainParams params;
+    TPerfectHashParams& phf = params.PerfectHash;
+    phf.Lambda = FlagValue(argc, argv, first, "--phf-lambda", phf.Lambda);
+    phf.Alpha = FlagValue(argc, argv, first, "--phf-alpha", phf.Alpha);
+    phf.Seed = FlagValue(argc, argv, first, "--phf-seed", phf.Seed);
+    phf.Partitions = FlagValue(argc, argv, first, "--phf-partitions", phf.Partitions);
+    params.Prune.MinGram2Count = FlagValue(argc, argv, first, "--prune2", params.Prune.MinGram2Count);
+    params.Prune.MinGram3Count = FlagValue(argc, argv, first, "--prune3", params.Prune.MinGram3Count);
+    params.Format.FingerprintBits = FlagValue(argc, argv, first, "--fingerprint-bits", params.Format.FingerprintBits);
+    params.Format.CountBits = FlagValue(argc, argv, first, "--count-bits", params.Format.CountBits);
+    return params;
+}
+
+bool SetTrainParams(TLangModel& model, const TTrainParams& params) {
+    model.SetPerfectHashParams(params.PerfectHash);
+    model.SetPruneParams(params.Prune);
+    if (!model.SetBucketFormat(params.Format)) {
+        std::cerr << "[error] fingerprints and counts take 8 or 16 bits" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+using TCandidateEngine = TSpellCorrector::ECandidateEngine;
+
+TCandidateEngine CandidateEngine(int argc, const char** argv, int first) {
+    if (HasFlag(argc, argv, first, "--dawg")) {
+        return TCandidateEngine::Dawg;
+    }
+    return HasFlag(argc, argv, first, "--index") ? TCandidateEngine::DeletionIndex : TCandidateEngine::Edits;
+}
+
+int BuildCache(const std::string& modelFile, TCandidateEngine engine) {
+    TSpellCorrector corrector;
+    corrector.SetCandidateEngine(engine);
+    if (!corrector.BuildCache(modelFile)) {
+        std::cerr << "[error] failed to build cache" << std::endl;
+        return 42;
+    }
+    return 0;
 }
 
 int Train(const std::string& alphabetFile,
           const std::string& datasetFile,
-          const std::string& resultModelFile)
+          const std::string& resultModelFile,
+          const TTrainParams& params,
+          bool buildCache,
+          TCandidateEngine engine)
 {
     TLangModel model;
+    if (!SetTrainParams(model, params)) {
+        return 42;
+    }
     model.Train(datasetFile, alphabetFile);
     model.Dump(resultModelFile);
+    if (buildCache || engine != TCandidateEngine::Edits) {
+        return BuildCache(resultModelFile, engine);
+    }
+    return 0;
+}
+
+int TrainStreaming(const std::string& alphabetFile,
+                   const std::string& datasetFile,
+                   const std::string& resultModelFile,
+                   size_t maxMemoryMb,
+                   const TTrainParams& params,
+                   bool buildCache,
+                   TCandidateEngine engine)
+{
+    TLangModel model;
+    if (!SetTrainParams(model, params)) {
+        return 42;
+    }
+    if (!model.TrainStreaming(datasetFile, alphabetFile, resultModelFile, maxMemoryMb)) {
+        std::cerr << "[error] failed to train model" << std::endl;
+        return 42;
+    }
+    if (!model.Dump(resultModelFile)) {
+        std::cerr << "[error] failed to save model" << std::endl;
+        return 42;
+    }
+    if (buildCache || engine != TCandidateEngine::Edits) {
+        return BuildCache(resultModelFile, engine);
+    }
+    return 0;
+}
+
+int TrainDelta(const std::string& modelFile, const std::string& datasetFile, const std::string& resultDeltaFile) {
+    TLangModel model;
+    if (!model.Load(modelFile)) {
+        std::cerr << "[error] failed to load model" << std::endl;
+        return 42;
+    }
+    TLangModelDelta delta;
+    if (!delta.Train(datasetFile, model)) {
+        std::cerr << "[error] failed to train delta" << std::endl;
+        return 42;
+    }
+    if (!delta.Dump(resultDeltaFile)) {
+        std::cerr << "[error] failed to save delta" << std::endl;
+        return 42;
+    }
     return 0;
 }
 
@@ -35,16 +184,18 @@ int Score(const std::string& modelFile) {
     }
     std::cerr << "[info] loaded" << std::endl;
     std::cerr << ">> ";
+    std::wstring wtext;
     for (std::string line; std::getline(std::cin, line);) {
-        std::wstring wtext = UTF8ToWide(line);
+        UTF8ToWide(line.data(), line.size(), wtext);
         std::cerr << model.Score(wtext) << "\n";
         std::cerr << ">> ";
     }
     return 0;
 }
 
-int ScoredCands(const std::string& modelFile) {
+int ScoredCands(const std::string& modelFile, bool pretty, TCandidateEngine engine) {
     TSpellCorrector corrector;
+    corrector.SetCandidateEngine(engine);
     //std::cerr << "[info] loading model" << std::endl;
     if (!corrector.LoadLangModel(modelFile)) {
         std::cerr << "[error] failed to load model" << std::endl;
@@ -53,49 +204,11 @@ int ScoredCands(const std::string& modelFile) {
     std::cerr << "[info] loaded" << std::endl;
     std::cerr << ">> ";
 
+    std::string json;
     for (std::string line; std::getline(std::cin, line);) {
-        std::wstring input = UTF8ToWide(line);
-        std::transform(input.begin(), input.end(), input.begin(), std::towlower);
-        NJamSpell::TSentences sentences = corrector.GetLangModel().Tokenize(input);
-        nlohmann::json results;
-        results["results"] = nlohmann::json::array();
-        //std::cerr << "sentence count = " << sentences.size() << std::endl;
-        for (size_t i = 0; i < sentences.size(); ++i) {
-            const NJamSpell::TWords& sentence = sentences[i];
-            //std::cerr << "sentence " << i << " length = " << sentence.size() << std::endl;
-            for (size_t j = 0; j < sentence.size(); ++j) {
-                NJamSpell::TWord currWord = sentence[j];
-                std::wstring wCurrWord(currWord.Ptr, currWord.Len);
-                //std::cerr << "  word " << NJamSpell::WideToUTF8(wCurrWord) << std::endl;
-                NJamSpell::TScoredWords candidates = corrector.GetCandidatesScoredRaw(sentence, j);
-                if (candidates.empty()) {
-                    continue;
-                }
-                std::wstring firstCandidate(candidates[0].Word.Ptr, candidates[0].Word.Len);
-                if (wCurrWord == firstCandidate) { //i.e. the input word was correctly spelled
-                    continue;
-                }
-                nlohmann::json currentResult;
-                currentResult["pos_from"] = currWord.Ptr - &input[0];
-                currentResult["len"] = currWord.Len;
-                currentResult["candidates"] = nlohmann::json::array();
-                currentResult["original"] = NJamSpell::WideToUTF8(wCurrWord);
-
-                size_t candidatesSize = std::min(candidates.size(), size_t(7));
-                for (size_t k = 0; k < candidatesSize; ++k) {
-                    nlohmann::json cand;
-                    NJamSpell::TScoredWord candidate = candidates[k];
-                    std::string candidateStr = NJamSpell::WideToUTF8(std::wstring(candidate.Word.Ptr, candidate.Word.Len));
-                    cand["candidate"] = candidateStr;
-                    cand["score"] = candidate.Score;
-                    currentResult["candidates"].push_back(cand);
-                }
-
-                results["results"].push_back(currentResult);
-            }
-        }
-
-        std::cerr << results.dump(4) << "\n";
+        json.clear();
+        corrector.AppendCandidatesScoredJSON(line, json, pretty);
+        std::cerr << json << "\n";
         std::cerr << ">> ";
     }
     return 0;
@@ -103,9 +216,11 @@ int ScoredCands(const std::string& modelFile) {
 
 int Fix(const std::string& modelFile,
         const std::string& inputFile,
-        const std::string& outFile)
+        const std::string& outFile,
+        TCandidateEngine engine)
 {
     TSpellCorrector corrector;
+    corrector.SetCandidateEngine(engine);
     std::cerr << "[info] loading model" << std::endl;
     if (!corrector.LoadLangModel(modelFile)) {
         std::cerr << "[error] failed to load model" << std::endl;
@@ -121,8 +236,9 @@ int Fix(const std::string& modelFile,
     return 0;
 }
 
-int Correct(const std::string& modelFile) {
+int Correct(const std::string& modelFile, TCandidateEngine engine) {
     TSpellCorrector corrector;
+    corrector.SetCandidateEngine(engine);
     std::cerr << "[info] loading model" << std::endl;
     if (!corrector.LoadLangModel(modelFile)) {
         std::cerr << "[error] failed to load model" << std::endl;
@@ -130,15 +246,294 @@ int Correct(const std::string& modelFile) {
     }
     std::cerr << "[info] loaded" << std::endl;
     std::cerr << ">> ";
+    std::wstring wtext;
+    std::string output;
     for (std::string line; std::getline(std::cin, line);) {
-        std::wstring wtext = UTF8ToWide(line);
+        UTF8ToWide(line.data(), line.size(), wtext);
         std::wstring result = corrector.FixFragment(wtext);
-        std::cerr << WideToUTF8(result) << "\n";
+        output.clear();
+        AppendUTF8(result.data(), result.size(), output);
+        std::cerr << output << "\n";
         std::cerr << ">> ";
     }
     return 0;
 }
 
+// Typos of evaluate/typo_model.py: every letter has TYPO_PROB chance of an
+// error, a fifth of the misspelled words get a second one.
+class TTypoGenerator {
+public:
+    TTypoGenerator(const std::unordered_set<wchar_t>& alphabet, uint32_t seed)
+        : Alphabet(alphabet.begin(), alphabet.end())
+        , Random(seed)
+    {
+        std::sort(Alphabet.begin(), Alphabet.end());
+    }
+
+    std::wstring Generate(std::wstring word) {
+        if (word.empty() || Alphabet.empty()) {
+            return word;
+        }
+        double required = 1.0 - std::pow(1.0 - TYPO_PROB, word.size());
+        double chance = Uniform(Random);
+        size_t typos = chance < required * SECOND_TYPO_CF ? 2 : chance < required ? 1 : 0;
+        for (size_t i = 0; i < typos; ++i) {
+            AddTypo(word);
+        }
+        return word;
+    }
+
+private:
+    void AddTypo(std::wstring& word) {
+        std::discrete_distribution<int> type({0.7, 0.1, 0.1, 0.1});
+        std::uniform_int_distribution<size_t> letter(0, Alphabet.size() - 1);
+        std::uniform_int_distribution<size_t> position(0, word.size() ? word.size() - 1 : 0);
+        switch (type(Random)) {
+        case 0: // replace
+            if (!word.empty()) {
+                word[position(Random)] = Alphabet[letter(Random)];
+            }
+            break;
+        case 1: // insert
+            word.insert(word.begin() + std::uniform_int_distribution<size_t>(0, word.size())(Random),
+                        Alphabet[letter(Random)]);
+            break;
+        case 2: // remove
+            if (!word.empty()) {
+                word.erase(position(Random), 1);
+            }
+            break;
+        default: { // transpose
+            if (word.empty()) {
+                break;
+            }
+            std::discrete_distribution<size_t> distance({0.8, 0.15, 0.04, 0.01});
+            size_t l = position(Random);
+            size_t d = distance(Random) + 1;
+            size_t l1 = l > d / 2 ? l - d / 2 : 0;
+            size_t l2 = std::min(word.size() - 1, l1 + d);
+            std::swap(word[l1], word[l2]);
+        }
+        }
+    }
+
+private:
+    static constexpr double TYPO_PROB = 0.03;
+    static constexpr double SECOND_TYPO_CF = 0.2;
+    std::vector<wchar_t> Alphabet;
+    std::mt19937 Random;
+    std::uniform_real_distribution<double> Uniform;
+};
+
+using TWideSentence = std::vector<std::wstring>;
+
+std::vector<TWideSentence> LoadSentences(const TLangModel& model, const std::string& fileName) {
+    std::wstring text = UTF8ToWide(LoadFile(fileName));
+    ToLower(text);
+    std::vector<TWideSentence> result;
+    for (const TWords& sentence: model.Tokenize(text)) {
+        TWideSentence words;
+        for (const TWord& word: sentence) {
+            words.emplace_back(word.Ptr, word.Len);
+        }
+        result.push_back(std::move(words));
+    }
+    return result;
+}
+
+std::wstring JoinWords(const TWideSentence& sentence) {
+    std::wstring text;
+    for (const std::wstring& word: sentence) {
+        if (!text.empty()) {
+            text += L' ';
+        }
+        text += word;
+    }
+    return text;
+}
+
+struct TEvaluationOptions {
+    std::string TyposFile; // generated when empty
+    size_t Threads = 1;
+    size_t MaxWords = 0;   // 0 means all
+    size_t Repeat = 1;
+    uint32_t Seed = 42;
+    size_t BeamWidth = 0;  // greedy when 0
+    TCandidateEngine Engine = TCandidateEngine::Edits;
+    double BudgetMs = 0;   // no latency budget when 0
+    std::string DeltaFile; // none when empty
+};
+
+// Counts of a word-by-word comparison of the fixed sentences against the
+// originals, as in evaluate/evaluate.py.
+struct TAccuracy {
+    size_t Words = 0;
+    size_t OrigErrors = 0;   // words with a typo
+    size_t Fixed = 0;        // of them, words restored
+    size_t NotTouched = 0;   // words without a typo
+    size_t Broken = 0;       // of them, words changed
+    size_t Errors = 0;       // words that differ from the original after fixing
+
+    void Add(const TWideSentence& original, const TWideSentence& errored, const TWideSentence& fixed) {
+        for (size_t i = 0; i < original.size(); ++i) {
+            // a fix that changed the number of words counts as wrong everywhere
+            const std::wstring& result = fixed.size() == original.size() ? fixed[i] : std::wstring();
+            Words += 1;
+            if (errored[i] != original[i]) {
+                OrigErrors += 1;
+                Fixed += result == original[i];
+            } else {
+                NotTouched += 1;
+                Broken += result != original[i];
+            }
+            Errors += result != original[i];
+        }
+    }
+};
+
+double Percent(size_t part, size_t total) {
+    return total ? 100.0 * part / total : 0.0;
+}
+
+double Percentile(const std::vector<uint64_t>& sortedNs, double p) {
+    if (sortedNs.empty()) {
+        return 0;
+    }
+    size_t idx = std::min(sortedNs.size() - 1, size_t(p * sortedNs.size()));
+    return sortedNs[idx] / 1e6;
+}
+
+int Evaluate(const std::string& modelFile, const std::string& originalFile, const TEvaluationOptions& options) {
+    TSpellCorrector corrector;
+    corrector.SetCandidateEngine(options.Engine);
+    if (options.BeamWidth) {
+        corrector.SetDecoding(TSpellCorrector::EDecoding::Beam, options.BeamWidth);
+    }
+    std::cerr << "[info] loading model" << std::endl;
+    if (!corrector.LoadLangModel(modelFile)) {
+        std::cerr << "[error] failed to load model" << std::endl;
+        return 42;
+    }
+    if (!options.DeltaFile.empty() && !corrector.LoadDelta(options.DeltaFile)) {
+        std::cerr << "[error] failed to load delta" << std::endl;
+        return 42;
+    }
+    std::cerr << "[info] loaded" << std::endl;
+    const TLangModel& model = corrector.GetLangModel();
+
+    std::vector<TWideSentence> original = LoadSentences(model, originalFile);
+    std::vector<TWideSentence> errored;
+    if (options.TyposFile.empty()) {
+        TTypoGenerator generator(model.GetAlphabet(), options.Seed);
+        for (const TWideSentence& sentence: original) {
+            TWideSentence words;
+            for (const std::wstring& word: sentence) {
+                words.push_back(generator.Generate(word));
+            }
+            errored.push_back(std::move(words));
+        }
+    } else {
+        errored = LoadSentences(model, options.TyposFile);
+        if (errored.size() != original.size()) {
+            std::cerr << "[error] " << options.TyposFile << " has " << errored.size() << " sentences, "
+                      << originalFile << " has " << original.size() << std::endl;
+            return 42;
+        }
+    }
+    size_t words = 0;
+    size_t sentences = 0;
+    while (sentences < original.size() && (!options.MaxWords || words < options.MaxWords)) {
+        if (original[sentences].size() != errored[sentences].size()) {
+            std::cerr << "[error] sentence " << sentences << " has a different number of words in "
+                      << options.TyposFile << std::endl;
+            return 42;
+        }
+        words += original[sentences].size();
+        sentences += 1;
+    }
+    original.resize(sentences);
+    errored.resize(sentences);
+
+    std::vector<std::wstring> requests;
+    for (const TWideSentence& sentence: errored) {
+        requests.push_back(JoinWords(sentence));
+    }
+    const size_t requestsCount = requests.size() * options.Repeat;
+    std::vector<std::wstring> results(requests.size());
+    std::vector<uint64_t> latenciesNs(requestsCount);
+
+    // Each thread is a client sending one request after another.
+    const size_t threads = std::max<size_t>(options.Threads, 1);
+    std::atomic<size_t> next(0);
+    std::atomic<size_t> degraded(0);
+    auto client = [&] {
+        for (size_t i = next++; i < requestsCount; i = next++) {
+            auto requestStart = std::chrono::steady_clock::now();
+            TLatencyBudget budget(options.BudgetMs);
+            std::wstring result = corrector.FixFragment(requests[i % requests.size()],
+                                                        options.BudgetMs > 0 ? &budget : nullptr);
+            if (budget.Degraded()) {
+                ++degraded;
+            }
+            auto elapsed = std::chrono::steady_clock::now() - requestStart;
+            latenciesNs[i] = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+            if (i < requests.size()) {
+                results[i] = std::move(result);
+            }
+        }
+    };
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> clients;
+    for (size_t i = 0; i < threads; ++i) {
+        clients.emplace_back(client);
+    }
+    for (auto&& thread: clients) {
+        thread.join();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    TAccuracy accuracy;
+    for (size_t i = 0; i < results.size(); ++i) {
+        ToLower(results[i]);
+        TWideSentence fixed;
+        for (const TWords& sentence: model.Tokenize(results[i])) {
+            for (const TWord& word: sentence) {
+                fixed.emplace_back(word.Ptr, word.Len);
+            }
+        }
+        accuracy.Add(original[i], errored[i], fixed);
+    }
+    std::sort(latenciesNs.begin(), latenciesNs.end());
+
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "words: " << accuracy.Words << ", with typos: " << accuracy.OrigErrors
+              << " (" << Percent(accuracy.OrigErrors, accuracy.Words) << "%)\n";
+    std::cout << "error rate: " << Percent(accuracy.Errors, accuracy.Words) << "%"
+              << ", fixed: " << Percent(accuracy.Fixed, accuracy.OrigErrors) << "%"
+              << ", broken: " << Percent(accuracy.Broken, accuracy.NotTouched) << "%\n";
+    std::cout << "requests: " << requestsCount << " on " << threads << " threads in " << seconds << "s"
+              << ", qps: " << (seconds > 0 ? requestsCount / seconds : 0.0)
+              << ", words/s: " << (seconds > 0 ? accuracy.Words * options.Repeat / seconds : 0.0) << "\n";
+    std::cout << std::setprecision(3) << "latency ms: p50 " << Percentile(latenciesNs, 0.5)
+              << ", p95 " << Percentile(latenciesNs, 0.95)
+              << ", p99 " << Percentile(latenciesNs, 0.99)
+              << ", max " << (latenciesNs.empty() ? 0.0 : latenciesNs.back() / 1e6) << std::endl;
+    if (options.BudgetMs > 0) {
+        std::cout << std::setprecision(2) << "degraded requests: " << degraded.load()
+                  << " (" << Percent(degraded.load(), requestsCount) << "%)" << std::endl;
+    }
+    return 0;
+}
+
+std::string FlagString(int argc, const char** argv, int first, const std::string& flag) {
+    for (int i = first; i + 1 < argc; ++i) {
+        if (argv[i] == flag) {
+            return argv[i + 1];
+        }
+    }
+    return std::string();
+}
+
 int main(int argc, const char** argv) {
     if (argc < 2) {
         PrintUsage(argv);
@@ -153,7 +548,30 @@ int main(int argc, const char** argv) {
         std::string alphabetFile = argv[2];
         std::string datasetFile = argv[3];
         std::string resultModelFile = argv[4];
-        return Train(alphabetFile, datasetFile, resultModelFile);
+        bool buildCache = HasFlag(argc, argv, 5, "--cache");
+        return Train(alphabetFile, datasetFile, resultModelFile, TrainParams(argc, argv, 5), buildCache,
+                     CandidateEngine(argc, argv, 5));
+    } else if (mode == "trainstream") {
+        if (argc < 5) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string alphabetFile = argv[2];
+        std::string datasetFile = argv[3];
+        std::string resultModelFile = argv[4];
+        bool buildCache = HasFlag(argc, argv, 5, "--cache");
+        size_t maxMemoryMb = argc > 5 && argv[5][0] != '-' ? std::stoul(argv[5]) : 1024;
+        return TrainStreaming(alphabetFile, datasetFile, resultModelFile, maxMemoryMb,
+                              TrainParams(argc, argv, 5), buildCache, CandidateEngine(argc, argv, 5));
+    } else if (mode == "traindelta") {
+        if (argc < 5) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string modelFile = argv[2];
+        std::string datasetFile = argv[3];
+        std::string resultDeltaFile = argv[4];
+        return TrainDelta(modelFile, datasetFile, resultDeltaFile);
     } else if (mode == "score") {
         if (argc < 3) {
             PrintUsage(argv);
@@ -167,14 +585,15 @@ int main(int argc, const char** argv) {
             return 42;
         }
         std::string modelFile = argv[2];
-        return ScoredCands(modelFile);
+        bool pretty = !HasFlag(argc, argv, 3, "--compact");
+        return ScoredCands(modelFile, pretty, CandidateEngine(argc, argv, 3));
     } else if (mode == "correct") {
         if (argc < 3) {
             PrintUsage(argv);
             return 42;
         }
         std::string modelFile = argv[2];
-        return Correct(modelFile);
+        return Correct(modelFile, CandidateEngine(argc, argv, 3));
     } else if (mode == "fix") {
         if (argc < 5) {
             PrintUsage(argv);
@@ -183,7 +602,26 @@ int main(int argc, const char** argv) {
         std::string modelFile = argv[2];
         std::string inFile = argv[3];
         std::string outFile = argv[4];
-        return Fix(modelFile, inFile, outFile);
+        return Fix(modelFile, inFile, outFile, CandidateEngine(argc, argv, 5));
+    } else if (mode == "evaluate") {
+        if (argc < 4) {
+            PrintUsage(argv);
+            return 42;
+        }
+        std::string modelFile = argv[2];
+        std::string originalFile = argv[3];
+        TEvaluationOptions options;
+        options.TyposFile = FlagString(argc, argv, 4, "--typos");
+        options.Threads = FlagValue(argc, argv, 4, "--threads", options.Threads);
+        options.MaxWords = FlagValue(argc, argv, 4, "--max-words", options.MaxWords);
+        options.Repeat = std::max<size_t>(1, FlagValue(argc, argv, 4, "--repeat", options.Repeat));
+        options.Seed = FlagValue(argc, argv, 4, "--seed", options.Seed);
+        options.BeamWidth = FlagValue(argc, argv, 4, "--beam", options.BeamWidth);
+        options.Engine = CandidateEngine(argc, argv, 4);
+        std::string budget = FlagString(argc, argv, 4, "--budget-ms");
+        options.BudgetMs = budget.empty() ? 0.0 : std::stod(budget);
+        options.DeltaFile = FlagString(argc, argv, 4, "--delta");
+        return Evaluate(modelFile, originalFile, options);
     }
 
     PrintUsage(argv);
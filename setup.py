@@ -11,6 +11,11 @@ import subprocess
 
 this_dir = os.path.dirname(os.path.abspath(__file__))
 
+compile_args = ['-std=c++11', '-O3', '-flto']
+link_args = ['-flto']
+if os.environ.get('JAMSPELL_NATIVE') == '1':
+    compile_args.append('-march=native')
+
 jamspell = Extension(
     name='_jamspell',
     include_dirs=['.', 'jamspell'],
@@ -20,11 +25,21 @@ jamspell = Extension(
         os.path.join('jamspell', 'utils.cpp'),
         os.path.join('jamspell', 'perfect_hash.cpp'),
         os.path.join('jamspell', 'bloom_filter.cpp'),
+        os.path.join('jamspell', 'memory_map.cpp'),
+        os.path.join('jamspell', 'thread_pool.cpp'),
+        os.path.join('jamspell', 'json_writer.cpp'),
+        os.path.join('jamspell', 'deletion_index.cpp'),
+        os.path.join('jamspell', 'dawg_index.cpp'),
+        os.path.join('jamspell', 'lang_model_delta.cpp'),
+        os.path.join('jamspell', 'vocabulary.cpp'),
+        os.path.join('jamspell', 'metrics.cpp'),
         os.path.join('contrib', 'cityhash', 'city.cc'),
         os.path.join('contrib', 'phf', 'phf.cc'),
         os.path.join('jamspell.i'),
     ],
-    extra_compile_args=['-std=c++11', '-O2'],
+    define_macros=[('PHF_NO_COMPUTED_GOTOS', '1')],
+    extra_compile_args=compile_args,
+    extra_link_args=link_args,
     swig_opts=['-c++'],
 )
 
@@ -46,6 +61,31 @@ class Swig3Ext(build_ext):
         assert subprocess.check_output([swigBinary, "-version"]).find(b'SWIG Version 3') != -1
         return swigBinary
 
+    def build_extensions(self):
+        # GCC 10+ parallelizes the link-time stage with -flto=auto; plain
+        # -flto makes lto-wrapper fall back to serial compilation
+        if self.compiler.compiler_type == 'unix' and self.has_flag('-flto=auto'):
+            for ext in self.extensions:
+                for args in (ext.extra_compile_args, ext.extra_link_args):
+                    args[:] = ['-flto=auto' if a == '-flto' else a for a in args]
+        build_ext.build_extensions(self)
+
+    def has_flag(self, flag):
+        import shutil
+        import tempfile
+        from distutils.errors import CompileError
+        tmpDir = tempfile.mkdtemp()
+        src = os.path.join(tmpDir, 'flag.cpp')
+        with open(src, 'w') as f:
+            f.write('int main() { return 0; }\n')
+        try:
+            self.compiler.compile([src], output_dir=tmpDir, extra_postargs=[flag])
+        except CompileError:
+            return False
+        finally:
+            shutil.rmtree(tmpDir)
+        return True
+
 VERSION = '1.0.0'
 
 ##
@@ -13,6 +13,8 @@ def removeFile(fname):
 
 TEMP_MODEL = 'temp_model.bin'
 TEMP_SPELL = 'temp_model.bin.spell'
+BATCH_MODEL = 'temp_batch_model.bin'
+BATCH_SPELL = 'temp_batch_model.bin.spell'
 TEMP = 'temp'
 TEMP_TEST = TEMP + '_test.txt'
 TEMP_TRAIN = TEMP + '_train.txt'
@@ -21,6 +23,8 @@ TEST_DATA = 'test_data/'
 def teardown_module(module):
     removeFile(TEMP_MODEL)
     removeFile(TEMP_SPELL)
+    removeFile(BATCH_MODEL)
+    removeFile(BATCH_SPELL)
     removeFile(TEMP_TEST)
     removeFile(TEMP_TRAIN)
 
@@ -40,3 +44,20 @@ def test_evaluation(sourceFile, alphabetFile, expected):
     trainLangModel(TEMP_TRAIN, alphabetFile, TEMP_MODEL)
     results = evaluateJamspell(TEMP_MODEL, TEMP_TEST, alphabetFile)
     assert results == expected
+
+@pytest.fixture(scope='module')
+def englishModel():
+    # a model of its own, not whichever test_evaluation trained last
+    corrector = jamspell.TSpellCorrector()
+    assert corrector.TrainLangModel(TEST_DATA + 'output.txt', TEST_DATA + 'alphabet_en.txt', BATCH_MODEL)
+    return BATCH_MODEL
+
+def test_batch(englishModel):
+    corrector = jamspell.TSpellCorrector()
+    assert corrector.LoadLangModel(englishModel)
+    texts = ['she has dibetes mellitus', 'they lik ice cream and piza', '', 'high blod pressure. coronary artery disase']
+    assert corrector.FixFragment(texts[0]) == 'she has diabetes mellitus'
+    pool = jamspell.TThreadPool(2)
+    assert list(corrector.FixFragments(texts, pool)) == [corrector.FixFragment(t) for t in texts]
+    assert list(corrector.GetALLCandidatesScoredJSON(texts, pool)) == \
+        [corrector.GetALLCandidatesScoredJSON(t, False) for t in texts]
@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+
+#include <sstream>
+
+#include <jamspell/bloom_filter.hpp>
+
+TEST(BloomFilterTest, spansAndHashes) {
+    NJamSpell::TBloomFilter filter(1000, 0.001);
+    std::vector<std::wstring> words;
+    for (size_t i = 0; i < 1000; ++i) {
+        words.push_back(L"word" + std::to_wstring(i));
+    }
+    for (auto&& w: words) {
+        filter.Insert(w.data(), w.size());
+    }
+    for (auto&& w: words) {
+        ASSERT_TRUE(filter.Contains(w.data(), w.size()));
+        ASSERT_TRUE(filter.ContainsHash(NJamSpell::TBloomFilter::Hash(w.data(), w.size())));
+    }
+    size_t falsePositives = 0;
+    for (size_t i = 0; i < 10000; ++i) {
+        std::wstring w = L"other" + std::to_wstring(i);
+        falsePositives += filter.Contains(w.data(), w.size());
+    }
+    ASSERT_LT(falsePositives, 50u);
+
+    std::string serialized;
+    {
+        std::stringbuf buf;
+        std::ostream out(&buf);
+        filter.Dump(out);
+        serialized = buf.str();
+    }
+    NJamSpell::TMemoryStream in(&serialized[0], serialized.size());
+    NJamSpell::TBloomFilter loaded;
+    ASSERT_TRUE(loaded.Load(in));
+    for (auto&& w: words) {
+        ASSERT_TRUE(loaded.Contains(w.data(), w.size()));
+    }
+}
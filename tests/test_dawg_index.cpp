@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+
+#include <jamspell/dawg_index.hpp>
+
+static const std::string ALPHABET_FILE = std::string(TEST_DATA_DIR) + "/alphabet_en.txt";
+static const std::string CORPUS_FILE = std::string(TEST_DATA_DIR) + "/output.txt";
+
+static size_t OsaDistance(const std::wstring& a, const std::wstring& b) {
+    std::vector<std::vector<size_t>> d(a.size() + 1, std::vector<size_t>(b.size() + 1));
+    for (size_t i = 0; i <= a.size(); ++i) {
+        for (size_t j = 0; j <= b.size(); ++j) {
+            if (i == 0 || j == 0) {
+                d[i][j] = i + j;
+                continue;
+            }
+            d[i][j] = std::min({d[i - 1][j] + 1, d[i][j - 1] + 1, d[i - 1][j - 1] + (a[i - 1] != b[j - 1])});
+            if (i > 1 && j > 1 && a[i - 1] == b[j - 2] && a[i - 2] == b[j - 1]) {
+                d[i][j] = std::min(d[i][j], d[i - 2][j - 2] + 1);
+            }
+        }
+    }
+    return d[a.size()][b.size()];
+}
+
+static std::vector<std::wstring> Sorted(const NJamSpell::TWords& words) {
+    std::vector<std::wstring> result;
+    for (auto&& w: words) {
+        result.push_back(std::wstring(w.Ptr, w.Len));
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+TEST(DawgIndexTest, findMatchesBruteForce) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    NJamSpell::TDawgIndex index;
+    ASSERT_TRUE(index.Build(model));
+    // suffixes are shared, so there are fewer states than letters
+    size_t letters = 0;
+    for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+        letters += model.GetWordById(wid).Len;
+    }
+    ASSERT_LT(index.StatesCount(), letters);
+
+    const std::string indexFile = "test_dawg_index.dawg";
+    ASSERT_TRUE(index.Dump(indexFile));
+    NJamSpell::TDawgIndex loaded;
+    ASSERT_TRUE(loaded.Load(indexFile, model));
+    std::remove(indexFile.c_str());
+
+    const std::vector<std::wstring> queries = {L"dibetes", L"melitus", L"hihg", L"blod", L"presure", L"a", L"xq", L""};
+    for (const NJamSpell::TDawgIndex* i: {&index, &loaded}) {
+        for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+            NJamSpell::TWord w = model.GetWordById(wid);
+            ASSERT_EQ(wid, i->FindWord(w.Ptr, w.Len));
+        }
+        ASSERT_EQ(NJamSpell::UNKNOWN_WORD_ID, i->FindWord(L"dibetes", 7));
+
+        for (auto&& q: queries) {
+            for (size_t distance = 0; distance <= NJamSpell::TDawgIndex::MAX_DISTANCE; ++distance) {
+                std::vector<std::wstring> expected;
+                for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+                    NJamSpell::TWord w = model.GetWordById(wid);
+                    std::wstring word(w.Ptr, w.Len);
+                    if (OsaDistance(q, word) <= distance) {
+                        expected.push_back(word);
+                    }
+                }
+                std::sort(expected.begin(), expected.end());
+                NJamSpell::TWords found;
+                i->Find(q.data(), q.size(), distance, found);
+                ASSERT_EQ(expected, Sorted(found));
+            }
+        }
+    }
+
+    // an index only loads against the model it was built for
+    ASSERT_TRUE(index.Dump(indexFile));
+    NJamSpell::TLangModel other;
+    ASSERT_TRUE(other.Train(ALPHABET_FILE, ALPHABET_FILE));
+    NJamSpell::TDawgIndex mismatched;
+    ASSERT_FALSE(mismatched.Load(indexFile, other));
+    std::remove(indexFile.c_str());
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include <jamspell/json_writer.hpp>
+#include <contrib/nlohmann/json.hpp>
+
+// Keys are sorted, as nlohmann::json orders them.
+static void WriteSample(NJamSpell::TJsonWriter& writer) {
+    std::wstring word = L"dïabétes \"x\"\n中";
+    writer.BeginObject()
+        .Key("empty").BeginArray().EndArray()
+        .Key("inner").BeginObject().EndObject()
+        .Key("items").BeginArray()
+            .BeginObject()
+                .Key("score").Double(-96.29586442794346)
+                .Key("word").String(word.data(), word.size())
+            .EndObject()
+            .BeginObject()
+                .Key("score").Double(-100.0)
+                .Key("word").String("plain\ttext")
+            .EndObject()
+        .EndArray()
+        .Key("len").UInt(7)
+        .Key("pos").Int(-3)
+        .Key("tiny").Double(1.5e-7)
+    .EndObject();
+}
+
+TEST(JsonWriterTest, compactRoundTrip) {
+    std::string out = "prefix";
+    NJamSpell::TJsonWriter writer(out);
+    WriteSample(writer);
+    ASSERT_EQ(0u, out.find("prefix"));
+    nlohmann::json parsed = nlohmann::json::parse(out.substr(6));
+    ASSERT_EQ(std::string("dïabétes \"x\"\n中"), parsed["items"][0]["word"].get<std::string>());
+    ASSERT_EQ(-96.29586442794346, parsed["items"][0]["score"].get<double>());
+    ASSERT_EQ(7u, parsed["len"].get<size_t>());
+    ASSERT_EQ(-3, parsed["pos"].get<int>());
+    ASSERT_EQ(std::string::npos, out.find('\n'));
+}
+
+TEST(JsonWriterTest, prettyMatchesNlohmann) {
+    std::string out;
+    NJamSpell::TJsonWriter writer(out, true);
+    WriteSample(writer);
+    ASSERT_EQ(nlohmann::json::parse(out).dump(4), out);
+}
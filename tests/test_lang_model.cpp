@@ -0,0 +1,389 @@
+#include <gtest/gtest.h>
+
+#include <thread>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+
+#include <jamspell/lang_model.hpp>
+#include <jamspell/lang_model_delta.hpp>
+
+static const std::string ALPHABET_FILE = std::string(TEST_DATA_DIR) + "/alphabet_en.txt";
+static const std::string CORPUS_FILE = std::string(TEST_DATA_DIR) + "/output.txt";
+
+TEST(LangModelTest, concurrentScore) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+
+    std::vector<std::wstring> sentences = {
+        L"she has diabetes mellitus",
+        L"she has dibetes mellitus",
+        L"high blood pressure",
+        L"they like ice cream and pizza",
+        L"coronary artery disease",
+    };
+    std::vector<double> expected;
+    for (auto&& s: sentences) {
+        expected.push_back(model.Score(s));
+    }
+
+    std::atomic<size_t> mismatches(0);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < 8; ++t) {
+        threads.emplace_back([&]() {
+            for (size_t n = 0; n < 200; ++n) {
+                for (size_t i = 0; i < sentences.size(); ++i) {
+                    if (model.Score(sentences[i]) != expected[i]) {
+                        ++mismatches;
+                    }
+                }
+            }
+        });
+    }
+    for (auto&& t: threads) {
+        t.join();
+    }
+    ASSERT_EQ(0u, mismatches.load());
+    ASSERT_GT(expected[0], expected[1]);
+}
+
+TEST(LangModelTest, dumpAndLoadMapped) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    const std::string modelFile = "test_lang_model.bin";
+    ASSERT_TRUE(model.Dump(modelFile));
+
+    NJamSpell::TLangModel loaded;
+    ASSERT_TRUE(loaded.Load(modelFile));
+    std::remove(modelFile.c_str());
+
+    ASSERT_EQ(model.GetWordsCount(), loaded.GetWordsCount());
+    ASSERT_EQ(model.GetCheckSum(), loaded.GetCheckSum());
+    for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+        NJamSpell::TWord w = model.GetWordById(wid);
+        NJamSpell::TWord l = loaded.GetWordById(wid);
+        ASSERT_EQ(std::wstring(w.Ptr, w.Len), std::wstring(l.Ptr, l.Len));
+        ASSERT_EQ(wid, loaded.GetWordIdNoCreate(w));
+        ASSERT_EQ(model.GetWordCount(wid), loaded.GetWordCount(wid));
+    }
+    ASSERT_EQ(model.Score(L"she has diabetes mellitus"), loaded.Score(L"she has diabetes mellitus"));
+    ASSERT_EQ(nullptr, loaded.GetWord(L"diabetesx").Ptr);
+    ASSERT_EQ(nullptr, loaded.GetWord(L"").Ptr);
+}
+
+TEST(LangModelTest, tokenizeAfterLoad) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    const std::string modelFile = "test_lang_model_tokenize.bin";
+    ASSERT_TRUE(model.Dump(modelFile));
+    NJamSpell::TLangModel loaded;
+    ASSERT_TRUE(loaded.Load(modelFile));
+    std::remove(modelFile.c_str());
+
+    const std::wstring text = L"She has DIBETES,mellitus! \u00c9t\u00e9 ok? 42 x";
+    for (const NJamSpell::TLangModel* m: {&model, &loaded}) {
+        NJamSpell::TSentences sentences = m->Tokenize(text);
+        ASSERT_EQ(3u, sentences.size());
+        std::vector<std::wstring> words;
+        for (auto&& s: sentences) {
+            for (auto&& w: s) {
+                ASSERT_TRUE(w.Ptr >= text.data() && w.Ptr + w.Len <= text.data() + text.size());
+                words.push_back(std::wstring(w.Ptr, w.Len));
+            }
+        }
+        std::vector<std::wstring> expected = {L"She", L"has", L"DIBETES", L"mellitus", L"t", L"ok", L"x"};
+        ASSERT_EQ(expected, words);
+    }
+}
+
+TEST(LangModelTest, scoreContextMatchesScore) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+
+    std::wstring text = L"she has high blood pressure and diabetes";
+    NJamSpell::TSentences sentences = model.Tokenize(text);
+    ASSERT_EQ(1u, sentences.size());
+    const NJamSpell::TWords& words = sentences[0];
+
+    std::vector<std::wstring> candidates = {L"blood", L"has", L"pizza", L"unknownword"};
+    for (size_t pos = 0; pos < words.size(); ++pos) {
+        NJamSpell::TScoreContext context = model.PrepareScoreContext(words, pos);
+        for (auto&& c: candidates) {
+            NJamSpell::TWords replaced = words;
+            replaced[pos] = NJamSpell::TWord(c);
+            double expected = model.Score(replaced);
+            double actual = model.Score(context, model.GetWordIdNoCreate(NJamSpell::TWord(c)));
+            ASSERT_NEAR(expected, actual, 1e-9);
+        }
+    }
+}
+
+TEST(LangModelTest, batchScoreMatchesScore) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    const std::string modelFile = "test_lang_model_batch.bin";
+    ASSERT_TRUE(model.Dump(modelFile));
+    NJamSpell::TLangModel loaded;
+    loaded.SetHugePages(true); // falls back to the mapped file if unavailable
+    ASSERT_TRUE(loaded.Load(modelFile));
+    std::remove(modelFile.c_str());
+
+    const std::wstring text = L"she has high blood pressure and diabetes";
+    NJamSpell::TSentences sentences = model.Tokenize(text);
+    const NJamSpell::TWords& words = sentences[0];
+    // more than one prefetched block, with an unknown word in between
+    std::vector<NJamSpell::TWordId> candidates;
+    for (NJamSpell::TWordId wid = 0; wid < 40 && wid < model.GetWordsCount(); ++wid) {
+        candidates.push_back(wid);
+    }
+    candidates.insert(candidates.begin() + 7, model.GetWordIdNoCreate(NJamSpell::TWord(L"unknownword")));
+
+    for (size_t pos = 0; pos < words.size(); ++pos) {
+        NJamSpell::TScoreContext context = model.PrepareScoreContext(words, pos);
+        std::vector<double> scores(candidates.size());
+        std::vector<double> loadedScores(candidates.size());
+        model.Score(context, candidates.data(), candidates.size(), scores.data());
+        loaded.Score(context, candidates.data(), candidates.size(), loadedScores.data());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            ASSERT_EQ(model.Score(context, candidates[i]), scores[i]);
+            ASSERT_EQ(scores[i], loadedScores[i]);
+        }
+    }
+}
+
+TEST(LangModelTest, trainDoesNotDependOnThreads) {
+    NJamSpell::TLangModel single;
+    ASSERT_TRUE(single.Train(CORPUS_FILE, ALPHABET_FILE, 1));
+    NJamSpell::TLangModel parallel;
+    ASSERT_TRUE(parallel.Train(CORPUS_FILE, ALPHABET_FILE, 3));
+
+    ASSERT_EQ(single.GetWordsCount(), parallel.GetWordsCount());
+    for (NJamSpell::TWordId wid = 0; wid < single.GetWordsCount(); ++wid) {
+        ASSERT_EQ(single.GetWordCount(wid), parallel.GetWordCount(wid));
+    }
+    for (auto&& s: {L"she has diabetes mellitus", L"high blood pressure", L"pizza ice cream"}) {
+        ASSERT_EQ(single.Score(s), parallel.Score(s));
+    }
+}
+
+TEST(LangModelTest, partitionedPerfectHash) {
+    NJamSpell::TLangModel single;
+    ASSERT_TRUE(single.Train(CORPUS_FILE, ALPHABET_FILE, 2));
+    NJamSpell::TLangModel partitioned;
+    NJamSpell::TPerfectHashParams params;
+    params.Lambda = 5;
+    params.Alpha = 90;
+    params.Seed = 7;
+    params.Partitions = 5;
+    partitioned.SetPerfectHashParams(params);
+    ASSERT_TRUE(partitioned.Train(CORPUS_FILE, ALPHABET_FILE, 2));
+    const std::string modelFile = "test_lang_model_partitioned.bin";
+    ASSERT_TRUE(partitioned.Dump(modelFile));
+    NJamSpell::TLangModel loaded;
+    ASSERT_TRUE(loaded.Load(modelFile));
+    std::remove(modelFile.c_str());
+
+    ASSERT_EQ(single.GetWordsCount(), loaded.GetWordsCount());
+    for (NJamSpell::TWordId wid = 0; wid < single.GetWordsCount(); ++wid) {
+        ASSERT_EQ(single.GetWordCount(wid), partitioned.GetWordCount(wid));
+        ASSERT_EQ(single.GetWordCount(wid), loaded.GetWordCount(wid));
+    }
+    for (auto&& s: {L"she has diabetes mellitus", L"high blood pressure"}) {
+        ASSERT_EQ(partitioned.Score(s), loaded.Score(s));
+        ASSERT_NEAR(single.Score(s), loaded.Score(s), 1e-9);
+    }
+}
+
+TEST(LangModelTest, trainStreamingMatchesTrain) {
+    // enough distinct n-grams to spill several runs with the smallest buffers
+    const std::string corpusFile = "test_lang_model_corpus.txt";
+    {
+        std::ofstream out(corpusFile);
+        const char* words[] = {"she", "has", "high", "blood", "pressure", "and", "diabetes", "mellitus", "pizza", "cream"};
+        uint32_t seed = 42;
+        for (size_t i = 0; i < 3000; ++i) {
+            for (size_t j = 0; j < 8; ++j) {
+                seed = seed * 1103515245 + 12345;
+                out << words[(seed >> 16) % 10] << ((seed >> 8) % 3 ? " " : "s ");
+            }
+            out << (i % 7 ? ". " : "!\n");
+        }
+    }
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(corpusFile, ALPHABET_FILE));
+    NJamSpell::TLangModel streamed;
+    ASSERT_TRUE(streamed.TrainStreaming(corpusFile, ALPHABET_FILE, corpusFile, 0));
+    std::remove(corpusFile.c_str());
+
+    ASSERT_EQ(model.GetWordsCount(), streamed.GetWordsCount());
+    for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+        NJamSpell::TWord w = model.GetWordById(wid);
+        NJamSpell::TWord s = streamed.GetWordById(wid);
+        ASSERT_EQ(std::wstring(w.Ptr, w.Len), std::wstring(s.Ptr, s.Len));
+        ASSERT_EQ(model.GetWordCount(wid), streamed.GetWordCount(wid));
+    }
+    for (auto&& s: {L"she has high blood pressure", L"pizzas and cream", L"diabetes mellitus bloods"}) {
+        ASSERT_EQ(model.Score(s), streamed.Score(s));
+    }
+}
+
+TEST(LangModelTest, pruneRareGrams) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    NJamSpell::TLangModel pruned;
+    NJamSpell::TPruneParams params;
+    params.MinGram2Count = 2;
+    params.MinGram3Count = 2;
+    pruned.SetPruneParams(params);
+    ASSERT_TRUE(pruned.Train(CORPUS_FILE, ALPHABET_FILE));
+    ASSERT_LT(pruned.GetBucketsMemory(), model.GetBucketsMemory());
+
+    ASSERT_EQ(model.GetWordsCount(), pruned.GetWordsCount());
+    for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+        ASSERT_EQ(model.GetWordCount(wid), pruned.GetWordCount(wid));
+    }
+    std::wstring text = NJamSpell::UTF8ToWide(NJamSpell::LoadFile(CORPUS_FILE));
+    NJamSpell::ToLower(text);
+    std::vector<std::pair<NJamSpell::TPackedCount, NJamSpell::TPackedCount>> counts;
+    NJamSpell::TPackedCount minCount = std::numeric_limits<NJamSpell::TPackedCount>::max();
+    for (const NJamSpell::TWords& sentence: model.Tokenize(text)) {
+        for (size_t i = 0; i + 1 < sentence.size(); ++i) {
+            NJamSpell::TWordId word1 = model.GetWordIdNoCreate(sentence[i]);
+            NJamSpell::TWordId word2 = model.GetWordIdNoCreate(sentence[i + 1]);
+            counts.emplace_back(model.GetGram2HashCount(word1, word2), pruned.GetGram2HashCount(word1, word2));
+            minCount = std::min(minCount, counts.back().first);
+        }
+    }
+    // bigrams seen once are gone, the others keep their counts
+    size_t kept = 0;
+    for (auto&& c: counts) {
+        ASSERT_NE(0, c.first);
+        ASSERT_EQ(c.first == minCount ? 0 : c.first, c.second);
+        kept += c.second != 0;
+    }
+    ASSERT_GT(kept, 0u);
+    ASSERT_LT(kept, counts.size());
+}
+
+TEST(LangModelTest, smallBuckets) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    NJamSpell::TLangModel small;
+    NJamSpell::TBucketFormat format;
+    format.FingerprintBits = 4;
+    ASSERT_FALSE(small.SetBucketFormat(format));
+    format.FingerprintBits = 8;
+    format.CountBits = 8;
+    ASSERT_TRUE(small.SetBucketFormat(format));
+    ASSERT_TRUE(small.Train(CORPUS_FILE, ALPHABET_FILE));
+    const std::string modelFile = "test_lang_model_small.bin";
+    ASSERT_TRUE(small.Dump(modelFile));
+    NJamSpell::TLangModel loaded;
+    ASSERT_TRUE(loaded.Load(modelFile));
+    std::remove(modelFile.c_str());
+
+    ASSERT_EQ(16, model.GetBucketFormat().FingerprintBits);
+    ASSERT_EQ(8, loaded.GetBucketFormat().FingerprintBits);
+    ASSERT_EQ(8, loaded.GetBucketFormat().CountBits);
+    ASSERT_EQ(model.GetBucketsMemory(), 2 * loaded.GetBucketsMemory());
+    for (NJamSpell::TWordId wid = 0; wid < model.GetWordsCount(); ++wid) {
+        double count = model.GetWordCount(wid);
+        ASSERT_NEAR(count, loaded.GetWordCount(wid), 0.05 * count);
+    }
+    for (auto&& s: {L"she has diabetes mellitus", L"high blood pressure"}) {
+        ASSERT_EQ(small.Score(s), loaded.Score(s));
+    }
+    ASSERT_GT(loaded.Score(L"she has diabetes mellitus"), loaded.Score(L"she has dibetes mellitus"));
+    ASSERT_LT(model.EstimateFalsePositiveRate(), 0.001);
+    ASSERT_LT(loaded.EstimateFalsePositiveRate(), 0.01);
+}
+
+TEST(LangModelTest, delta) {
+    NJamSpell::TLangModel model;
+    ASSERT_TRUE(model.Train(CORPUS_FILE, ALPHABET_FILE));
+    const std::string deltaCorpus = "test_lang_model_delta.txt";
+    {
+        std::ofstream out(deltaCorpus);
+        for (size_t i = 0; i < 20; ++i) {
+            out << "she was started on tirzepatide for diabetes. empagliflozin and tirzepatide lower blood sugar.\n";
+        }
+    }
+    NJamSpell::TLangModelDelta delta;
+    ASSERT_TRUE(delta.Train(deltaCorpus, model));
+    const std::string deltaFile = "test_lang_model.delta";
+    ASSERT_TRUE(delta.Dump(deltaFile));
+    ASSERT_GE(delta.WordsCount(), 2u);
+
+    const std::wstring text = L"she was started on tirzepatide and empagliflozin for high blood pressure";
+    NJamSpell::TSentences sentences = model.Tokenize(text);
+    const NJamSpell::TWords& words = sentences[0];
+    std::vector<double> before;
+    for (size_t pos = 0; pos < words.size(); ++pos) {
+        before.push_back(model.Score(model.PrepareScoreContext(words, pos), 0));
+    }
+    const double score = model.Score(text);
+    const NJamSpell::TWordId diabetes = model.GetWordIdNoCreate(NJamSpell::TWord(L"diabetes"));
+    const NJamSpell::TCount diabetesCount = model.GetWordCount(diabetes);
+    ASSERT_EQ(NJamSpell::UNKNOWN_WORD_ID, model.GetWordIdNoCreate(NJamSpell::TWord(L"tirzepatide")));
+
+    const size_t baseWords = model.GetWordsCount();
+    ASSERT_TRUE(model.LoadDelta(deltaFile));
+    ASSERT_FALSE(delta.Train(deltaCorpus, model));
+    NJamSpell::TLangModel other;
+    ASSERT_TRUE(other.Train(deltaCorpus, ALPHABET_FILE));
+    ASSERT_FALSE(other.LoadDelta(deltaFile));
+    ASSERT_TRUE(other.GetDelta() == nullptr);
+    std::remove(deltaFile.c_str());
+
+    ASSERT_EQ(baseWords, model.GetWordsCount());
+    for (auto&& w: {L"tirzepatide", L"empagliflozin"}) {
+        NJamSpell::TWordId wid = model.GetWordIdNoCreate(NJamSpell::TWord(w));
+        ASSERT_GE(wid, baseWords);
+        NJamSpell::TWord word = model.GetWordById(wid);
+        ASSERT_EQ(std::wstring(w), std::wstring(word.Ptr, word.Len));
+        ASSERT_NE(0, model.GetWordCount(wid));
+    }
+    ASSERT_EQ(diabetes, model.GetWordIdNoCreate(NJamSpell::TWord(L"diabetes")));
+    ASSERT_GT(model.GetWordCount(diabetes), diabetesCount);
+    ASSERT_GT(model.Score(text), score);
+    ASSERT_GT(model.Score(L"started on tirzepatide"), model.Score(L"started on tirzepatyde"));
+
+    // the counts are those of a model trained on both corpora
+    const std::string bothCorpora = "test_lang_model_both.txt";
+    {
+        std::ofstream out(bothCorpora);
+        out << NJamSpell::LoadFile(CORPUS_FILE) << "\n" << NJamSpell::LoadFile(deltaCorpus);
+    }
+    NJamSpell::TLangModel both;
+    ASSERT_TRUE(both.Train(bothCorpora, ALPHABET_FILE));
+    std::remove(bothCorpora.c_str());
+    std::remove(deltaCorpus.c_str());
+    for (auto&& w: {L"tirzepatide", L"empagliflozin", L"diabetes", L"she"}) {
+        double count = both.GetWordCount(both.GetWordIdNoCreate(NJamSpell::TWord(w)));
+        ASSERT_NEAR(count, model.GetWordCount(model.GetWordIdNoCreate(NJamSpell::TWord(w))), 0.05 * count);
+    }
+
+    std::vector<NJamSpell::TWordId> candidates;
+    for (NJamSpell::TWordId wid = 0; wid < 40; ++wid) {
+        candidates.push_back(wid);
+    }
+    candidates.push_back(model.GetWordIdNoCreate(NJamSpell::TWord(L"tirzepatide")));
+    candidates.push_back(model.GetWordIdNoCreate(NJamSpell::TWord(L"unknownword")));
+    for (size_t pos = 0; pos < words.size(); ++pos) {
+        NJamSpell::TScoreContext context = model.PrepareScoreContext(words, pos);
+        std::vector<double> scores(candidates.size());
+        model.Score(context, candidates.data(), candidates.size(), scores.data());
+        for (size_t i = 0; i < candidates.size(); ++i) {
+            ASSERT_EQ(model.Score(context, candidates[i]), scores[i]);
+        }
+    }
+
+    model.ClearDelta();
+    ASSERT_EQ(NJamSpell::UNKNOWN_WORD_ID, model.GetWordIdNoCreate(NJamSpell::TWord(L"tirzepatide")));
+    ASSERT_EQ(diabetesCount, model.GetWordCount(diabetes));
+    ASSERT_EQ(score, model.Score(text));
+    for (size_t pos = 0; pos < words.size(); ++pos) {
+        ASSERT_EQ(before[pos], model.Score(model.PrepareScoreContext(words, pos), 0));
+    }
+}
@@ -0,0 +1,36 @@
+#include <gtest/gtest.h>
+
+#include <string>
+
+#include <jamspell/lru_cache.hpp>
+
+TEST(LruCacheTest, evictsLeastRecentlyUsed) {
+    const size_t entryCost = 1000;
+    // a single shard with room for three entries and their bookkeeping
+    NJamSpell::TShardedLruCache<std::string, int> cache(3 * entryCost + entryCost / 2, 1);
+    cache.Put("a", 1, entryCost);
+    cache.Put("b", 2, entryCost);
+    cache.Put("c", 3, entryCost);
+    int value = 0;
+    ASSERT_TRUE(cache.Get("a", value));
+    ASSERT_EQ(1, value);
+    cache.Put("d", 4, entryCost);
+    ASSERT_FALSE(cache.Get("b", value));
+    ASSERT_TRUE(cache.Get("a", value));
+    ASSERT_TRUE(cache.Get("c", value));
+    ASSERT_TRUE(cache.Get("d", value));
+    ASSERT_EQ(4, value);
+
+    NJamSpell::TCacheStats stats = cache.GetStats();
+    ASSERT_EQ(4u, stats.Hits);
+    ASSERT_EQ(1u, stats.Misses);
+    ASSERT_EQ(3u, stats.Entries);
+    ASSERT_LE(stats.Bytes, 3 * entryCost + entryCost / 2);
+
+    cache.Put("huge", 5, 10 * entryCost);
+    ASSERT_FALSE(cache.Get("huge", value));
+
+    cache.Clear();
+    ASSERT_FALSE(cache.Get("a", value));
+    ASSERT_EQ(0u, cache.GetStats().Entries);
+}
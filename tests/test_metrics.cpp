@@ -0,0 +1,54 @@
+#include <gtest/gtest.h>
+
+#include <cstdio>
+
+#include <jamspell/metrics.hpp>
+#include <jamspell/spell_corrector.hpp>
+
+TEST(MetricsTest, histogramIsCumulative) {
+    NJamSpell::THistogram histogram({1, 10, 100});
+    for (uint64_t value: {0, 1, 5, 10, 50, 1000}) {
+        histogram.Observe(value);
+    }
+    std::string out;
+    histogram.Write(out, "test", "stage=\"x\"", 1);
+    ASSERT_NE(std::string::npos, out.find("test_bucket{stage=\"x\",le=\"1\"} 2\n"));
+    ASSERT_NE(std::string::npos, out.find("test_bucket{stage=\"x\",le=\"10\"} 4\n"));
+    ASSERT_NE(std::string::npos, out.find("test_bucket{stage=\"x\",le=\"100\"} 5\n"));
+    ASSERT_NE(std::string::npos, out.find("test_bucket{stage=\"x\",le=\"+Inf\"} 6\n"));
+    ASSERT_NE(std::string::npos, out.find("test_sum{stage=\"x\"} 1066\n"));
+    ASSERT_NE(std::string::npos, out.find("test_count{stage=\"x\"} 6\n"));
+}
+
+TEST(MetricsTest, stagesAreCountedWhileEnabled) {
+    NJamSpell::TSpellCorrector corrector;
+    const std::string modelFile = "test_metrics.bin";
+    ASSERT_TRUE(corrector.TrainLangModel(std::string(TEST_DATA_DIR) + "/output.txt",
+                                         std::string(TEST_DATA_DIR) + "/alphabet_en.txt", modelFile));
+    std::remove(modelFile.c_str());
+    std::remove((modelFile + ".spell").c_str());
+    std::remove((modelFile + ".deletes").c_str());
+
+    NJamSpell::TMetrics& metrics = NJamSpell::GetMetrics();
+    const uint64_t gramProbes = metrics.Counter(NJamSpell::ECounter::GramProbes).Get();
+    const uint64_t bloomProbes = metrics.Counter(NJamSpell::ECounter::BloomProbes).Get();
+
+    corrector.FixFragment(L"she has dibetes");
+    ASSERT_EQ(gramProbes, metrics.Counter(NJamSpell::ECounter::GramProbes).Get());
+
+    NJamSpell::EnableMetrics(true);
+    corrector.GetALLCandidatesScoredJSON("she has dibetes mellitus qqxzvv");
+    NJamSpell::EnableMetrics(false);
+    ASSERT_LT(gramProbes, metrics.Counter(NJamSpell::ECounter::GramProbes).Get());
+    ASSERT_LT(bloomProbes, metrics.Counter(NJamSpell::ECounter::BloomProbes).Get());
+
+    std::string out;
+    NJamSpell::WriteMetrics(out);
+    for (const char* stage: {"tokenize", "edits2", "edits", "score", "json"}) {
+        std::string count = std::string("jamspell_stage_seconds_count{stage=\"") + stage + "\"} ";
+        size_t pos = out.find(count);
+        ASSERT_NE(std::string::npos, pos) << stage;
+        ASSERT_NE('0', out[pos + count.size()]) << stage;
+    }
+    ASSERT_NE(std::string::npos, out.find("# TYPE jamspell_candidates_per_token histogram\n"));
+}
@@ -1,6 +1,9 @@
 #include <gtest/gtest.h>
 
+#include <cstring>
+
 #include <jamspell/perfect_hash.hpp>
+#include <jamspell/thread_pool.hpp>
 #include <contrib/handypack/handypack.hpp>
 
 TEST(PerfetHashTest, basicFlow) {
@@ -44,3 +47,97 @@ TEST(PerfetHashTest, basicFlow) {
     }
     ASSERT_EQ(keys.size(), backetsUsed.size());
 }
+
+TEST(PerfetHashTest, slotsAndHugePages) {
+    NJamSpell::TPerfectHash ph;
+    std::vector<std::string> keys = {
+        "key1",
+        "key2",
+        "key3",
+        "abc",
+        "654321",
+    };
+    ph.Init(keys);
+
+    std::vector<uint32_t> hashes;
+    for (auto&& s: keys) {
+        ASSERT_EQ(ph.Hash(s), ph.HashSlot(s.data(), s.size(), ph.Slot(s.data(), s.size())));
+        hashes.push_back(ph.Hash(s));
+    }
+    // falls back to the current tables if huge pages are unavailable
+    if (ph.CopyToHugePages()) {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            ASSERT_EQ(hashes[i], ph.Hash(keys[i]));
+        }
+    }
+}
+
+TEST(PerfetHashTest, partitioned) {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < 5000; ++i) {
+        keys.push_back("key" + std::to_string(i * 7919));
+    }
+    std::vector<NJamSpell::TPerfectHash::TKeyRef> refs;
+    for (auto&& k: keys) {
+        refs.push_back(NJamSpell::TPerfectHash::TKeyRef(k.data(), k.size()));
+    }
+    NJamSpell::TPerfectHashParams params;
+    params.Partitions = 7;
+    NJamSpell::TThreadPool pool(3);
+    NJamSpell::TPerfectHash ph;
+    ASSERT_TRUE(ph.Init(refs, params, &pool));
+    ASSERT_EQ(7u, ph.PartitionsNumber());
+
+    std::vector<uint32_t> hashes;
+    std::set<uint32_t> backetsUsed;
+    for (auto&& k: keys) {
+        uint32_t bucket = ph.Hash(k);
+        ASSERT_LT(bucket, ph.BucketsNumber());
+        ASSERT_EQ(bucket, ph.HashSlot(k.data(), k.size(), ph.Slot(k.data(), k.size())));
+        backetsUsed.insert(bucket);
+        hashes.push_back(bucket);
+    }
+    ASSERT_EQ(keys.size(), backetsUsed.size());
+
+    std::string serialized;
+    {
+        std::stringbuf buf;
+        std::ostream out(&buf);
+        ph.DumpMapped(out);
+        serialized = buf.str();
+    }
+    // sections are aligned relative to the stream start, keep it aligned too
+    std::vector<uint64_t> aligned(serialized.size() / sizeof(uint64_t) + 1);
+    memcpy(aligned.data(), serialized.data(), serialized.size());
+    NJamSpell::TMemoryStream in((const char*)aligned.data(), serialized.size());
+    NJamSpell::TPerfectHash loaded;
+    ASSERT_TRUE(loaded.LoadMapped(in));
+    ASSERT_EQ(ph.BucketsNumber(), loaded.BucketsNumber());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        ASSERT_EQ(hashes[i], loaded.Hash(keys[i]));
+    }
+}
+
+TEST(PerfetHashTest, integerKeys) {
+    std::vector<uint64_t> keys;
+    for (uint64_t i = 0; i < 5000; ++i) {
+        keys.push_back(i * 0x10000000001ULL + 17);
+    }
+    for (uint32_t partitions: {1u, 5u}) {
+        NJamSpell::TPerfectHashParams params;
+        params.Partitions = partitions;
+        NJamSpell::TThreadPool pool(2);
+        NJamSpell::TPerfectHash ph;
+        ASSERT_TRUE(ph.Init(keys, params, &pool));
+        ASSERT_EQ(partitions, ph.PartitionsNumber());
+
+        std::set<uint32_t> backetsUsed;
+        for (uint64_t k: keys) {
+            uint32_t bucket = ph.Hash(k);
+            ASSERT_LT(bucket, ph.BucketsNumber());
+            ASSERT_EQ(bucket, ph.HashSlot(k, ph.Slot(k)));
+            backetsUsed.insert(bucket);
+        }
+        ASSERT_EQ(keys.size(), backetsUsed.size());
+    }
+}
@@ -0,0 +1,365 @@
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <limits>
+
+#include <jamspell/spell_corrector.hpp>
+#include <contrib/nlohmann/json.hpp>
+
+static const std::string ALPHABET_FILE = std::string(TEST_DATA_DIR) + "/alphabet_en.txt";
+static const std::string CORPUS_FILE = std::string(TEST_DATA_DIR) + "/output.txt";
+static const std::string MODEL_FILE = "test_spell_corrector.bin";
+
+// Trains the model once for all the tests, each of which gets a corrector
+// loaded from it. The files the tests add next to it are removed with it,
+// whether the tests pass or not.
+class SpellCorrectorTest: public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        NJamSpell::TSpellCorrector corrector;
+        Trained = corrector.TrainLangModel(CORPUS_FILE, ALPHABET_FILE, MODEL_FILE);
+    }
+
+    static void TearDownTestCase() {
+        for (auto&& suffix: {"", ".spell", ".deletes", ".dawg", ".delta", ".delta.txt"}) {
+            std::remove((MODEL_FILE + suffix).c_str());
+        }
+    }
+
+    void SetUp() override {
+        ASSERT_TRUE(Trained);
+        ASSERT_TRUE(Corrector.LoadLangModel(MODEL_FILE));
+    }
+
+    static bool Trained;
+    NJamSpell::TSpellCorrector Corrector;
+};
+
+bool SpellCorrectorTest::Trained = false;
+
+TEST_F(SpellCorrectorTest, batchMatchesSingle) {
+    std::vector<std::wstring> texts = {
+        L"She has dibetes mellitus. High blod pressure!",
+        L"",
+        L"they lik ice cream and piza",
+        L"Coronary artery disase",
+    };
+    std::vector<std::string> utf8Texts;
+    for (auto&& t: texts) {
+        utf8Texts.push_back(NJamSpell::WideToUTF8(t));
+    }
+
+    NJamSpell::TThreadPool pool(4);
+    std::vector<std::wstring> fixed = Corrector.FixFragments(texts, pool);
+    std::vector<std::string> candidates = Corrector.GetALLCandidatesScoredJSON(utf8Texts, pool);
+    ASSERT_EQ(texts.size(), fixed.size());
+    ASSERT_EQ(texts.size(), candidates.size());
+    for (size_t i = 0; i < texts.size(); ++i) {
+        ASSERT_EQ(Corrector.FixFragment(texts[i]), fixed[i]);
+        ASSERT_EQ(nlohmann::json::parse(Corrector.GetALLCandidatesScoredJSON(utf8Texts[i])),
+                  nlohmann::json::parse(candidates[i]));
+    }
+    ASSERT_NE(texts[0], fixed[0]);
+}
+
+TEST_F(SpellCorrectorTest, correctionStreamMatchesWhole) {
+    using TOutput = NJamSpell::TCorrectionStream::EOutput;
+    const std::wstring text = L"She has dibetes mellitus. High blod pressure!\nCafé: they lik ice cream and piza?"
+                              L" coronary artery disase";
+    const std::string utf8Text = NJamSpell::WideToUTF8(text);
+    const std::string fixed = NJamSpell::WideToUTF8(Corrector.FixFragment(text));
+    const std::string candidates = Corrector.GetALLCandidatesScoredJSON(utf8Text, false);
+    // pieces of one byte split the two bytes of the accented letter
+    for (size_t pieceSize: {1, 5, 1000}) {
+        NJamSpell::TCorrectionStream fixStream(Corrector, TOutput::Fixed);
+        NJamSpell::TCorrectionStream candidatesStream(Corrector, TOutput::Candidates);
+        std::string fixedOut;
+        std::string candidatesOut;
+        for (size_t i = 0; i < utf8Text.size(); i += pieceSize) {
+            fixedOut += fixStream.Put(utf8Text.substr(i, pieceSize));
+            candidatesOut += candidatesStream.Put(utf8Text.substr(i, pieceSize));
+            if (i == 0 && pieceSize == 1000) {
+                // the last, unfinished sentence is kept
+                ASSERT_EQ(0u, fixed.find(fixedOut));
+                ASSERT_LT(fixedOut.size(), fixed.size());
+            }
+        }
+        fixedOut += fixStream.Finish();
+        candidatesOut += candidatesStream.Finish();
+        ASSERT_EQ(fixed, fixedOut);
+        ASSERT_EQ(candidates, candidatesOut);
+    }
+
+    // sentences longer than that are cut between words
+    NJamSpell::TCorrectionStream bounded(Corrector, TOutput::Fixed, 8);
+    std::string boundedOut = bounded.Put(utf8Text.substr(0, 20));
+    ASSERT_EQ("She has diabetes ", boundedOut);
+    boundedOut += bounded.Put(utf8Text.substr(20));
+    boundedOut += bounded.Finish();
+    ASSERT_EQ(fixed.size(), boundedOut.size());
+
+    NJamSpell::TCorrectionStream empty(Corrector, TOutput::Candidates);
+    ASSERT_EQ(Corrector.GetALLCandidatesScoredJSON("", false), empty.Finish());
+    NJamSpell::TCorrectionStream malformed(Corrector, TOutput::Fixed);
+    ASSERT_EQ("", malformed.Put("abc\xC3"));
+    ASSERT_THROW(malformed.Finish(), std::range_error);
+}
+
+static void ExpectSameCandidates(const NJamSpell::TScoredWords& expected, const NJamSpell::TScoredWords& actual) {
+    ASSERT_EQ(expected.size(), actual.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        ASSERT_EQ(std::wstring(expected[i].Word.Ptr, expected[i].Word.Len),
+                  std::wstring(actual[i].Word.Ptr, actual[i].Word.Len));
+        ASSERT_EQ(expected[i].Score, actual[i].Score);
+    }
+}
+
+TEST_F(SpellCorrectorTest, cachedMatchesUncached) {
+    std::vector<std::wstring> texts = {
+        L"she has dibetes mellitus and high blod pressure",
+        L"dibetes mellitus",
+        L"she has dibetes mellitus and high blod pressure",
+    };
+    std::vector<NJamSpell::TSentences> sentences;
+    for (auto&& t: texts) {
+        sentences.push_back(Corrector.GetLangModel().Tokenize(t));
+    }
+    std::vector<NJamSpell::TScoredWords> expected;
+    for (auto&& s: sentences) {
+        for (size_t j = 0; j < s[0].size(); ++j) {
+            expected.push_back(Corrector.GetCandidatesScoredRaw(s[0], j));
+        }
+    }
+
+    Corrector.SetCacheSize(1 << 20);
+    for (size_t pass = 0; pass < 2; ++pass) {
+        size_t n = 0;
+        for (auto&& s: sentences) {
+            for (size_t j = 0; j < s[0].size(); ++j) {
+                ExpectSameCandidates(expected[n++], Corrector.GetCandidatesScoredRaw(s[0], j));
+            }
+        }
+    }
+    NJamSpell::TSpellCorrector::TCachesStats stats = Corrector.GetCacheStats();
+    ASSERT_GT(stats.Results.Hits, 0u);
+    ASSERT_GT(stats.Candidates.Hits, 0u);
+    ASSERT_GT(stats.Results.Entries, 0u);
+    ASSERT_LE(stats.Results.Bytes + stats.Candidates.Bytes, size_t(1 << 20));
+
+    ASSERT_TRUE(Corrector.LoadLangModel(MODEL_FILE));
+    stats = Corrector.GetCacheStats();
+    ASSERT_EQ(0u, stats.Results.Entries);
+    ASSERT_EQ(0u, stats.Candidates.Hits);
+}
+
+TEST_F(SpellCorrectorTest, latencyBudget) {
+    Corrector.SetCacheSize(1 << 20);
+
+    const std::wstring text = L"she has dibetes mellitus and high blod pressure";
+    const std::string utf8Text = NJamSpell::WideToUTF8(text);
+    const std::wstring fixed = Corrector.FixFragment(text);
+    const std::string candidates = Corrector.GetALLCandidatesScoredJSON(utf8Text);
+    ASSERT_NE(text, fixed);
+
+    NJamSpell::TLatencyBudget ample(1e6);
+    ASSERT_EQ(fixed, Corrector.FixFragment(text, &ample));
+    ASSERT_EQ(candidates, Corrector.GetALLCandidatesScoredJSON(utf8Text, true, &ample));
+    ASSERT_FALSE(ample.Degraded());
+
+    // a spent budget leaves the words as they are, without caching that
+    Corrector.SetCacheSize(1 << 20);
+    NJamSpell::TLatencyBudget spent(0);
+    ASSERT_EQ(text, Corrector.FixFragment(text, &spent));
+    ASSERT_TRUE(spent.Degraded());
+    NJamSpell::TLatencyBudget spentCandidates(0);
+    nlohmann::json empty = nlohmann::json::parse(Corrector.GetALLCandidatesScoredJSON(utf8Text, true, &spentCandidates));
+    ASSERT_TRUE(empty["results"].empty());
+    ASSERT_EQ(0u, Corrector.GetCacheStats().Results.Entries);
+    ASSERT_EQ(fixed, Corrector.FixFragment(text));
+
+    Corrector.SetDecoding(NJamSpell::TSpellCorrector::EDecoding::Beam, 4);
+    NJamSpell::TLatencyBudget spentBeam(0);
+    ASSERT_EQ(text, Corrector.FixFragment(text, &spentBeam));
+    ASSERT_TRUE(spentBeam.Degraded());
+}
+
+TEST_F(SpellCorrectorTest, cacheDoesNotDependOnThreads) {
+    const std::string cacheFile = MODEL_FILE + ".spell";
+
+    ASSERT_TRUE(Corrector.BuildCache(MODEL_FILE, 1));
+    std::string expected = NJamSpell::LoadFile(cacheFile);
+    ASSERT_FALSE(expected.empty());
+    ASSERT_TRUE(Corrector.BuildCache(MODEL_FILE, 3));
+    std::string actual = NJamSpell::LoadFile(cacheFile);
+    ASSERT_TRUE(expected == actual);
+}
+
+static std::vector<std::pair<std::wstring, double>> SortedCandidates(const NJamSpell::TScoredWords& candidates) {
+    std::vector<std::pair<std::wstring, double>> result;
+    for (auto&& c: candidates) {
+        result.push_back(std::make_pair(std::wstring(c.Word.Ptr, c.Word.Len), c.Score));
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+TEST_F(SpellCorrectorTest, deletionIndexMatchesEdits) {
+    using TEngine = NJamSpell::TSpellCorrector::ECandidateEngine;
+    // the words point into the text
+    const std::wstring text = L"she has dibetes melitus and hihg blod presure. coronry artery disase. a xq";
+    NJamSpell::TSentences sentences = Corrector.GetLangModel().Tokenize(text);
+    std::vector<std::vector<std::pair<std::wstring, double>>> expected;
+    for (auto&& s: sentences) {
+        for (size_t j = 0; j < s.size(); ++j) {
+            expected.push_back(SortedCandidates(Corrector.GetCandidatesScoredRaw(s, j)));
+        }
+    }
+    ASSERT_GT(expected[2].size(), 1u);
+
+    NJamSpell::TSpellCorrector loaded;
+    loaded.SetCandidateEngine(TEngine::DeletionIndex);
+    ASSERT_TRUE(Corrector.SetCandidateEngine(TEngine::DeletionIndex));
+    ASSERT_TRUE(loaded.LoadLangModel(MODEL_FILE));
+    ASSERT_TRUE(loaded.GetCandidateEngine() == TEngine::DeletionIndex);
+
+    for (const NJamSpell::TSpellCorrector* c: {&Corrector, &loaded}) {
+        size_t n = 0;
+        for (auto&& s: sentences) {
+            for (size_t j = 0; j < s.size(); ++j) {
+                ASSERT_EQ(expected[n++], SortedCandidates(c->GetCandidatesScoredRaw(s, j)));
+            }
+        }
+    }
+}
+
+TEST_F(SpellCorrectorTest, dawgEngine) {
+    using TEngine = NJamSpell::TSpellCorrector::ECandidateEngine;
+    ASSERT_TRUE(Corrector.SetCandidateEngine(TEngine::Dawg));
+
+    const std::wstring text = L"she has dibetes melitus and hihg blod presure. coronry artery disase. a xq";
+    NJamSpell::TSentences sentences = Corrector.GetLangModel().Tokenize(text);
+    std::vector<std::vector<std::pair<std::wstring, double>>> expected;
+    for (auto&& s: sentences) {
+        for (size_t j = 0; j < s.size(); ++j) {
+            expected.push_back(SortedCandidates(Corrector.GetCandidatesScoredRaw(s, j)));
+        }
+    }
+    auto isDiabetes = [](const std::pair<std::wstring, double>& c) {
+        return c.first == L"diabetes";
+    };
+    ASSERT_TRUE(std::any_of(expected[2].begin(), expected[2].end(), isDiabetes));
+
+    // the automaton built above is loaded from model.bin.dawg
+    NJamSpell::TSpellCorrector loaded;
+    loaded.SetCandidateEngine(TEngine::Dawg);
+    ASSERT_TRUE(loaded.LoadLangModel(MODEL_FILE));
+    ASSERT_TRUE(loaded.GetCandidateEngine() == TEngine::Dawg);
+
+    size_t n = 0;
+    for (auto&& s: sentences) {
+        for (size_t j = 0; j < s.size(); ++j) {
+            ASSERT_EQ(expected[n++], SortedCandidates(loaded.GetCandidatesScoredRaw(s, j)));
+        }
+    }
+    ASSERT_EQ(Corrector.FixFragment(text), loaded.FixFragment(text));
+}
+
+TEST_F(SpellCorrectorTest, knownWordGate) {
+    const std::wstring text = L"she has dibetes mellitus and high blod pressure";
+    const std::wstring fixed = Corrector.FixFragment(text);
+    ASSERT_EQ(0u, Corrector.GetKnownWordStats().Checked);
+
+    // every known word passes, the misspelled ones are still corrected
+    Corrector.SetKnownWordThreshold(1, -std::numeric_limits<double>::infinity());
+    ASSERT_EQ(fixed, Corrector.FixFragment(text));
+    NJamSpell::TSpellCorrector::TKnownWordStats stats = Corrector.GetKnownWordStats();
+    ASSERT_EQ(8u, stats.Checked);
+    ASSERT_EQ(6u, stats.Accepted);
+
+    NJamSpell::TSentences sentences = Corrector.GetLangModel().Tokenize(text);
+    NJamSpell::TScoredWords candidates = Corrector.GetCandidatesScoredRaw(sentences[0], 3);
+    ASSERT_EQ(1u, candidates.size());
+    ASSERT_EQ(L"mellitus", std::wstring(candidates[0].Word.Ptr, candidates[0].Word.Len));
+    ASSERT_GT(Corrector.GetCandidatesScoredRaw(sentences[0], 2).size(), 1u);
+
+    // nothing is likely enough
+    Corrector.SetKnownWordThreshold(1, 0);
+    ASSERT_EQ(fixed, Corrector.FixFragment(text));
+    ASSERT_EQ(0u, Corrector.GetKnownWordStats().Accepted);
+}
+
+TEST_F(SpellCorrectorTest, knownWordGateAtSentenceStart) {
+    const NJamSpell::TLangModel& model = Corrector.GetLangModel();
+    const std::wstring first = L"mellitus and high";
+    const std::wstring third = L"she has mellitus and high";
+    NJamSpell::TSentences firstSentences = model.Tokenize(first);
+    NJamSpell::TSentences thirdSentences = model.Tokenize(third);
+    const NJamSpell::TWords& atFirst = firstSentences[0];
+    const NJamSpell::TWords& atThird = thirdSentences[0];
+
+    // three terms at the start, six from the third word on, on the same scale
+    const double firstLogProb = model.WordContextLogProb(atFirst, 0);
+    const double thirdLogProb = model.WordContextLogProb(atThird, 2);
+    ASSERT_NEAR(firstLogProb, thirdLogProb, 1.0);
+
+    const double below = std::min(firstLogProb, thirdLogProb) - 0.5;
+    const double above = std::max(firstLogProb, thirdLogProb) + 0.5;
+    Corrector.SetKnownWordThreshold(1, below);
+    ASSERT_EQ(1u, Corrector.GetCandidatesScoredRaw(atFirst, 0).size());
+    ASSERT_EQ(1u, Corrector.GetCandidatesScoredRaw(atThird, 2).size());
+    ASSERT_EQ(2u, Corrector.GetKnownWordStats().Accepted);
+
+    Corrector.SetKnownWordThreshold(1, above);
+    Corrector.GetCandidatesScoredRaw(atFirst, 0);
+    Corrector.GetCandidatesScoredRaw(atThird, 2);
+    NJamSpell::TSpellCorrector::TKnownWordStats stats = Corrector.GetKnownWordStats();
+    ASSERT_EQ(2u, stats.Checked);
+    ASSERT_EQ(0u, stats.Accepted);
+}
+
+TEST_F(SpellCorrectorTest, beamDecoding) {
+    using TDecoding = NJamSpell::TSpellCorrector::EDecoding;
+    const std::wstring input = NJamSpell::UTF8ToWide(NJamSpell::LoadFile(std::string(TEST_DATA_DIR) + "/input.txt"));
+    const std::wstring greedy = Corrector.FixFragment(input);
+    ASSERT_NE(input, greedy);
+    NJamSpell::TThreadPool pool(2);
+    for (size_t width: {1, 4, 100}) {
+        Corrector.SetDecoding(TDecoding::Beam, width);
+        ASSERT_TRUE(Corrector.GetDecoding() == TDecoding::Beam);
+        ASSERT_EQ(greedy, Corrector.FixFragment(input)) << width;
+        ASSERT_EQ(greedy, Corrector.FixFragments({input}, pool)[0]) << width;
+    }
+    ASSERT_EQ(L"", Corrector.FixFragment(L""));
+    Corrector.SetDecoding(TDecoding::Greedy);
+    const std::wstring single = Corrector.FixFragment(L"dibetes");
+    Corrector.SetDecoding(TDecoding::Beam);
+    ASSERT_EQ(single, Corrector.FixFragment(L"dibetes"));
+}
+
+TEST_F(SpellCorrectorTest, delta) {
+    using TEngine = NJamSpell::TSpellCorrector::ECandidateEngine;
+    const std::string deltaCorpus = MODEL_FILE + ".delta.txt";
+    {
+        std::ofstream out(deltaCorpus);
+        for (size_t i = 0; i < 20; ++i) {
+            out << "she was started on tirzepatide for diabetes.\n";
+        }
+    }
+    const std::string deltaFile = MODEL_FILE + ".delta";
+    const std::wstring text = L"she was started on tirzepatyde for diabetes. she was started on tirzepatid";
+    const std::wstring expected = L"she was started on tirzepatide for diabetes. she was started on tirzepatide";
+    ASSERT_NE(expected, Corrector.FixFragment(text));
+    ASSERT_TRUE(Corrector.TrainDelta(deltaCorpus, deltaFile));
+    ASSERT_EQ(expected, Corrector.FixFragment(text));
+
+    NJamSpell::TSpellCorrector loaded;
+    ASSERT_FALSE(loaded.LoadDelta(deltaFile));
+    ASSERT_TRUE(loaded.LoadLangModel(MODEL_FILE));
+    ASSERT_TRUE(loaded.LoadDelta(deltaFile));
+    for (TEngine engine: {TEngine::Edits, TEngine::DeletionIndex, TEngine::Dawg}) {
+        ASSERT_TRUE(loaded.SetCandidateEngine(engine));
+        ASSERT_EQ(expected, loaded.FixFragment(text));
+    }
+}
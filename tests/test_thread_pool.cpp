@@ -0,0 +1,43 @@
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <stdexcept>
+
+#include <jamspell/thread_pool.hpp>
+
+TEST(ThreadPoolTest, parallelForVisitsEachIndexOnce) {
+    NJamSpell::TThreadPool pool(4);
+    std::vector<std::atomic<size_t>> visits(1000);
+    for (auto&& v: visits) {
+        v = 0;
+    }
+    NJamSpell::ParallelFor(pool, visits.size(), [&](size_t i) {
+        visits[i] += 1;
+    });
+    for (auto&& v: visits) {
+        ASSERT_EQ(1u, v.load());
+    }
+}
+
+TEST(ThreadPoolTest, nestedParallelFor) {
+    NJamSpell::TThreadPool pool(2, 1);
+    std::atomic<size_t> total(0);
+    NJamSpell::ParallelFor(pool, 8, [&](size_t) {
+        NJamSpell::ParallelFor(pool, 8, [&](size_t) {
+            total += 1;
+        });
+    });
+    ASSERT_EQ(64u, total.load());
+}
+
+TEST(ThreadPoolTest, parallelForRethrows) {
+    NJamSpell::TThreadPool pool(4);
+    std::atomic<size_t> executed(0);
+    ASSERT_THROW(NJamSpell::ParallelFor(pool, 100, [&](size_t i) {
+        executed += 1;
+        if (i == 42) {
+            throw std::runtime_error("failed");
+        }
+    }), std::runtime_error);
+    ASSERT_EQ(100u, executed.load());
+}
@@ -0,0 +1,46 @@
+#include <gtest/gtest.h>
+
+#include <stdexcept>
+
+#include <jamspell/utils.hpp>
+
+TEST(UtilsTest, utf8RoundTrip) {
+    // long enough for the vectorized ASCII path, with multi-byte
+    // characters at and around chunk boundaries
+    std::string text = "she has diabetes mel\xc3\xaf" "tus, caf\xc3\xa9 \xe4\xb8\xad "
+                       "\xf0\x9d\x94\x98nicode and a long plain ASCII tail 0123456789";
+    std::wstring wide = NJamSpell::UTF8ToWide(text);
+    ASSERT_EQ(L'ï', wide[20]);
+    if (sizeof(wchar_t) == 4) {
+        ASSERT_EQ(wchar_t(0x1D518), wide[33]);
+        ASSERT_EQ(L'n', wide[34]);
+    }
+    ASSERT_EQ(text, NJamSpell::WideToUTF8(wide));
+
+    std::string out = "x";
+    NJamSpell::AppendUTF8(wide.data(), wide.size(), out);
+    ASSERT_EQ("x" + text, out);
+    std::wstring buffer = L"previous contents";
+    NJamSpell::UTF8ToWide(text.data(), text.size(), buffer);
+    ASSERT_EQ(wide, buffer);
+
+    ASSERT_TRUE(NJamSpell::UTF8ToWide("").empty());
+    ASSERT_TRUE(NJamSpell::WideToUTF8(L"").empty());
+}
+
+TEST(UtilsTest, utf8RejectsMalformed) {
+    const char* bad[] = {
+        "\xc3",             // truncated
+        "a\x80z",           // stray continuation byte
+        "\xc0\xaf",         // overlong
+        "\xe0\x80\xaf",     // overlong
+        "\xed\xa0\x80",     // surrogate
+        "\xf4\x90\x80\x80", // above U+10FFFF
+        "\xff",
+    };
+    for (const char* s: bad) {
+        ASSERT_THROW(NJamSpell::UTF8ToWide(s), std::range_error) << s;
+    }
+    std::wstring lone(1, wchar_t(0xDC00));
+    ASSERT_EQ("\xef\xbf\xbd", NJamSpell::WideToUTF8(lone));
+}
@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include <cstring>
+#include <sstream>
+
+#include <jamspell/vocabulary.hpp>
+
+TEST(VocabularyTest, addFindAndMap) {
+    NJamSpell::TVocabularyBuilder builder;
+    std::vector<std::wstring> words;
+    for (size_t i = 0; i < 1000; ++i) {
+        words.push_back(L"word" + std::to_wstring(i));
+    }
+    for (size_t i = 0; i < words.size(); ++i) {
+        ASSERT_EQ(i, builder.Add(words[i].data(), words[i].size()));
+    }
+    // known words keep their ids
+    ASSERT_EQ(7u, builder.Add(words[7].data(), words[7].size()));
+    ASSERT_EQ(words.size(), builder.Size());
+
+    NJamSpell::TVocabulary vocabulary;
+    builder.Finish(vocabulary);
+    ASSERT_EQ(0u, builder.Size());
+    ASSERT_EQ(words.size(), vocabulary.Size());
+
+    std::string serialized;
+    {
+        std::stringbuf buf;
+        std::ostream out(&buf);
+        vocabulary.Dump(out);
+        serialized = buf.str();
+    }
+    NJamSpell::TMemoryStream in(&serialized[0], serialized.size());
+    NJamSpell::TVocabulary loaded;
+    ASSERT_TRUE(loaded.LoadMapped(in));
+
+    for (const NJamSpell::TVocabulary* v: {&vocabulary, &loaded}) {
+        for (size_t i = 0; i < words.size(); ++i) {
+            ASSERT_EQ(i, v->Find(words[i].data(), words[i].size()));
+            NJamSpell::TWord word = v->Get(i);
+            ASSERT_EQ(words[i], std::wstring(word.Ptr, word.Len));
+        }
+        std::wstring unknown = L"word1000";
+        ASSERT_EQ(NJamSpell::UNKNOWN_WORD_ID, v->Find(unknown.data(), unknown.size()));
+        ASSERT_EQ(nullptr, v->Get(words.size()).Ptr);
+    }
+    // words in the vocabulary point into the serialized data
+    NJamSpell::TWord mapped = loaded.Get(0);
+    ASSERT_GE((const char*)mapped.Ptr, serialized.data());
+    ASSERT_LT((const char*)mapped.Ptr, serialized.data() + serialized.size());
+}
+
+static bool LoadSections(const std::vector<wchar_t>& chars, const std::vector<uint32_t>& offsets,
+                         const std::vector<NJamSpell::TWordId>& table)
+{
+    std::string serialized;
+    {
+        std::stringbuf buf;
+        std::ostream out(&buf);
+        NJamSpell::DumpSection(out, chars.data(), chars.size() * sizeof(wchar_t));
+        NJamSpell::DumpSection(out, offsets.data(), offsets.size() * sizeof(uint32_t));
+        NJamSpell::DumpSection(out, table.data(), table.size() * sizeof(NJamSpell::TWordId));
+        serialized = buf.str();
+    }
+    // sections are aligned relative to the stream start, keep it aligned too
+    std::vector<uint64_t> aligned(serialized.size() / sizeof(uint64_t) + 1);
+    memcpy(aligned.data(), serialized.data(), serialized.size());
+    NJamSpell::TMemoryStream in((const char*)aligned.data(), serialized.size());
+    NJamSpell::TVocabulary vocabulary;
+    return vocabulary.LoadMapped(in);
+}
+
+TEST(VocabularyTest, rejectCorruptMapped) {
+    const NJamSpell::TWordId none = NJamSpell::UNKNOWN_WORD_ID;
+    const std::vector<wchar_t> chars = {L'a', L'b', L'c'};
+    std::vector<NJamSpell::TWordId> table(16, none);
+    table[3] = 0;
+    table[9] = 1;
+    ASSERT_TRUE(LoadSections(chars, {0, 1, 3}, table));
+
+    ASSERT_FALSE(LoadSections(chars, {1, 1, 3}, table));
+    ASSERT_FALSE(LoadSections(chars, {0, 2, 1, 3}, table));
+    ASSERT_FALSE(LoadSections(chars, {0, 1, 2}, table));
+    table[5] = 2;
+    ASSERT_FALSE(LoadSections(chars, {0, 1, 3}, table));
+    // ids in range, but no free slot left
+    std::vector<NJamSpell::TWordId> full(16, 0);
+    ASSERT_FALSE(LoadSections(chars, {0, 1, 3}, full));
+}
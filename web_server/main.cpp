@@ -1,73 +1,579 @@
 #include "jamspell/spell_corrector.hpp"
+#include "jamspell/json_writer.hpp"
+#include "jamspell/metrics.hpp"
 #include "contrib/httplib/httplib.h"
 #include "contrib/nlohmann/json.hpp"
+#include <atomic>
+#include <chrono>
 #include <cwctype>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#endif
 //#include "contrib/libssl64MT.lib"
 //#include <libcrypto>
 
 #define CPPHTTPLIB_OPENSSL_SUPPORT
 
+// Candidates are pretty-printed unless the request asks for pretty=0.
 std::string GetCandidatesScored(const NJamSpell::TSpellCorrector& corrector,
-                          const std::string& text)
+                                const httplib::Request& req,
+                                const std::string& text,
+                                NJamSpell::TLatencyBudget* budget)
 {
-    return corrector.GetALLCandidatesScoredJSON(text);
+    bool pretty = req.get_param_value("pretty") != "0";
+    return corrector.GetALLCandidatesScoredJSON(text, pretty, budget);
 }
 
 std::string FixText(const NJamSpell::TSpellCorrector& corrector,
-                    const std::string& text)
+                    const std::string& text,
+                    NJamSpell::TLatencyBudget* budget)
 {
     std::wstring input = NJamSpell::UTF8ToWide(text);
-    return NJamSpell::WideToUTF8(corrector.FixFragment(input));
+    return NJamSpell::WideToUTF8(corrector.FixFragment(input, budget));
 }
 
+// Runs process with the latency budget of the request, its budget_ms
+// parameter or else the server default, none when 0. Results that got less
+// effort to meet it carry an X-Degraded: 1 header.
+static void WithBudget(const httplib::Request& req, httplib::Response& resp, double defaultBudgetMs,
+                       const std::function<void(NJamSpell::TLatencyBudget*)>& process)
+{
+    double budgetMs = defaultBudgetMs;
+    if (req.has_param("budget_ms")) {
+        try {
+            budgetMs = std::stod(req.get_param_value("budget_ms"));
+        } catch (const std::exception&) {
+            resp.status = 400;
+            resp.set_content("[error] budget_ms must be a number of milliseconds\n", "text/plain");
+            return;
+        }
+    }
+    NJamSpell::TLatencyBudget budget(budgetMs);
+    process(budgetMs > 0 ? &budget : nullptr);
+    if (budget.Degraded()) {
+        resp.set_header("X-Degraded", "1");
+    }
+}
+
+// Batch bodies are either a JSON array or NDJSON (one JSON value per line).
+// Each document is a string or an object with a "text" (or "body") field.
+struct TBatchRequest {
+    std::vector<std::string> Texts;
+    bool Ndjson = false;
+};
+
+static std::string DocumentText(const nlohmann::json& doc) {
+    if (doc.is_string()) {
+        return doc.get<std::string>();
+    }
+    if (doc.is_object()) {
+        for (const char* field: {"text", "body"}) {
+            auto it = doc.find(field);
+            if (it != doc.end() && it->is_string()) {
+                return it->get<std::string>();
+            }
+        }
+    }
+    throw std::invalid_argument("document must be a string or an object with a \"text\" field");
+}
+
+static TBatchRequest ParseBatchRequest(const std::string& body) {
+    TBatchRequest request;
+    size_t start = body.find_first_not_of(" \t\r\n");
+    if (start != std::string::npos && body[start] == '[') {
+        nlohmann::json docs = nlohmann::json::parse(body);
+        for (auto&& doc: docs) {
+            request.Texts.push_back(DocumentText(doc));
+        }
+        return request;
+    }
+    request.Ndjson = true;
+    std::istringstream lines(body);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) {
+            continue;
+        }
+        request.Texts.push_back(DocumentText(nlohmann::json::parse(line)));
+    }
+    return request;
+}
+
+// Results are already serialized JSON values, in input order.
+static std::string FormatBatchResponse(const std::vector<std::string>& results, bool ndjson) {
+    std::string response;
+    if (ndjson) {
+        for (auto&& r: results) {
+            response += r + "\n";
+        }
+        return response;
+    }
+    response = "[";
+    for (size_t i = 0; i < results.size(); ++i) {
+        if (i > 0) {
+            response += ",";
+        }
+        response += results[i];
+    }
+    response += "]\n";
+    return response;
+}
+
+static void HandleBatch(const httplib::Request& req, httplib::Response& resp,
+                        const std::function<std::vector<std::string>(const std::vector<std::string>&)>& process)
+{
+    TBatchRequest request;
+    try {
+        request = ParseBatchRequest(req.body);
+    } catch (const std::exception& e) {
+        resp.status = 400;
+        resp.set_content(std::string("[error] bad batch request: ") + e.what() + "\n", "text/plain");
+        return;
+    }
+    resp.set_content(FormatBatchResponse(process(request.Texts), request.Ndjson),
+                     request.Ndjson ? "application/x-ndjson" : "application/json");
+}
+
+// Records the latency of the handler and the size of the text it got.
+static httplib::Server::Handler Measured(httplib::Server::Handler handler) {
+    return [handler](const httplib::Request& req, httplib::Response& resp) {
+        auto start = std::chrono::steady_clock::now();
+        handler(req, resp);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        NJamSpell::TMetrics& metrics = NJamSpell::GetMetrics();
+        size_t size = req.body.empty() ? req.get_param_value("text").size() : req.body.size();
+        NJamSpell::ObserveMetric(metrics.RequestBytes, size);
+        NJamSpell::ObserveMetric(metrics.RequestNs,
+            std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    };
+}
+
+// Corrects the body while it is read, answering with a chunked response:
+// each piece of output is sent as soon as its sentences are complete, and
+// the memory held does not grow with the size of the document. A client
+// has to read the response while it sends the body.
+static void HandleStream(httplib::Response& resp, httplib::ContentReader& content,
+                         std::shared_ptr<const NJamSpell::TSpellCorrector> corrector,
+                         NJamSpell::TCorrectionStream::EOutput output, const char* contentType)
+{
+    struct TState {
+        TState(std::shared_ptr<const NJamSpell::TSpellCorrector> corrector, NJamSpell::TCorrectionStream::EOutput output)
+            : Corrector(corrector)
+            , Stream(*Corrector, output)
+            , Start(std::chrono::steady_clock::now())
+        {
+        }
+        std::shared_ptr<const NJamSpell::TSpellCorrector> Corrector; // the stream refers to it
+        NJamSpell::TCorrectionStream Stream;
+        std::chrono::steady_clock::time_point Start;
+        std::string Chunk;
+        bool Finished = false;
+    };
+    std::shared_ptr<TState> state(new TState(corrector, output));
+    resp.set_header("Content-Type", contentType);
+    resp.streamcb = [state, &content](uint64_t) {
+        std::string out;
+        try {
+            while (out.empty() && !state->Finished) {
+                state->Chunk.clear();
+                if (content.read(state->Chunk)) {
+                    out = state->Stream.Put(state->Chunk);
+                    continue;
+                }
+                state->Finished = true;
+                if (content.failed()) {
+                    break;
+                }
+                out = state->Stream.Finish() + "\n";
+                NJamSpell::TMetrics& metrics = NJamSpell::GetMetrics();
+                NJamSpell::ObserveMetric(metrics.RequestBytes, content.bytes_read());
+                NJamSpell::ObserveMetric(metrics.RequestNs, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - state->Start).count());
+            }
+        } catch (const std::exception& e) {
+            // the status is sent already
+            state->Finished = true;
+            out = std::string("\n[error] ") + e.what() + "\n";
+        }
+        return out;
+    };
+}
+
+static void WriteCorrectorMetrics(std::string& out, const NJamSpell::TSpellCorrector& corrector) {
+    NJamSpell::TSpellCorrector::TCachesStats stats = corrector.GetCacheStats();
+    const std::pair<const char*, const NJamSpell::TCacheStats*> caches[] = {
+        {"candidates", &stats.Candidates},
+        {"results", &stats.Results},
+    };
+    out += "# HELP jamspell_cache_requests_total Lookups of the candidates and results caches.\n";
+    out += "# TYPE jamspell_cache_requests_total counter\n";
+    for (auto&& c: caches) {
+        out += std::string("jamspell_cache_requests_total{cache=\"") + c.first + "\",result=\"hit\"} "
+             + std::to_string(c.second->Hits) + "\n";
+        out += std::string("jamspell_cache_requests_total{cache=\"") + c.first + "\",result=\"miss\"} "
+             + std::to_string(c.second->Misses) + "\n";
+    }
+    out += "# HELP jamspell_cache_bytes Memory held by the candidates and results caches.\n";
+    out += "# TYPE jamspell_cache_bytes gauge\n";
+    for (auto&& c: caches) {
+        out += std::string("jamspell_cache_bytes{cache=\"") + c.first + "\"} " + std::to_string(c.second->Bytes) + "\n";
+    }
+    NJamSpell::TSpellCorrector::TKnownWordStats known = corrector.GetKnownWordStats();
+    out += "# HELP jamspell_known_words_total Words checked by the known word gate, and accepted without candidates.\n";
+    out += "# TYPE jamspell_known_words_total counter\n";
+    out += "jamspell_known_words_total{result=\"checked\"} " + std::to_string(known.Checked) + "\n";
+    out += "jamspell_known_words_total{result=\"accepted\"} " + std::to_string(known.Accepted) + "\n";
+}
+
+// Settings applied to every corrector the holder loads.
+struct TCorrectorOptions {
+    size_t CacheMb = 0;
+    bool HugePages = false;
+    NJamSpell::TSpellCorrector::ECandidateEngine Engine = NJamSpell::TSpellCorrector::ECandidateEngine::Edits;
+    NJamSpell::TCount KnownWordMinCount = 0;
+    double KnownWordMinLogProb = -13;
+    size_t BeamWidth = 0; // greedy decoding when 0
+    std::string DeltaFile; // loaded on top of the model unless empty
+};
+
+// Owns the corrector serving requests. Reload() loads the model (and its
+// .spell and .deletes files, and the delta) into a fresh corrector while the
+// current one keeps serving, then swaps the pointer; requests hold on to the
+// corrector they started with, and the old one is freed once the last of
+// them ends. A delta that fails to load, e.g. one left over from the model
+// it was folded into, is skipped rather than failing the reload.
+class TCorrectorHolder {
+public:
+    using TCorrectorPtr = std::shared_ptr<const NJamSpell::TSpellCorrector>;
+
+    TCorrectorHolder(const std::string& modelFile, const TCorrectorOptions& options)
+        : ModelFile(modelFile)
+        , Options(options)
+    {
+    }
+
+    TCorrectorPtr Get() const {
+        return std::atomic_load(&Corrector);
+    }
+
+    enum class EReloadResult {
+        Reloaded,
+        Failed, // the current corrector is kept
+        Busy,   // another reload is running and wait is false
+    };
+
+    EReloadResult Reload(bool wait = true) {
+        std::unique_lock<std::mutex> lock(ReloadMutex, std::defer_lock);
+        if (wait) {
+            lock.lock();
+        } else if (!lock.try_lock()) {
+            return EReloadResult::Busy;
+        }
+        std::shared_ptr<NJamSpell::TSpellCorrector> corrector(new NJamSpell::TSpellCorrector());
+        corrector->SetCacheSize(Options.CacheMb << 20);
+        corrector->SetHugePages(Options.HugePages);
+        corrector->SetCandidateEngine(Options.Engine);
+        corrector->SetKnownWordThreshold(Options.KnownWordMinCount, Options.KnownWordMinLogProb);
+        if (Options.BeamWidth > 0) {
+            corrector->SetDecoding(NJamSpell::TSpellCorrector::EDecoding::Beam, Options.BeamWidth);
+        }
+        if (!corrector->LoadLangModel(ModelFile)) {
+            std::cerr << "[error] failed to load model " << ModelFile << std::endl;
+            return EReloadResult::Failed;
+        }
+        if (!Options.DeltaFile.empty() && !corrector->LoadDelta(Options.DeltaFile)) {
+            std::cerr << "[error] failed to load delta " << Options.DeltaFile << " for " << ModelFile
+                      << ", serving the model without it" << std::endl;
+        }
+        std::atomic_store(&Corrector, TCorrectorPtr(corrector));
+        ++Generation;
+        std::cerr << "[info] serving model " << ModelFile << " (generation " << Generation << ")" << std::endl;
+        return EReloadResult::Reloaded;
+    }
+
+private:
+    const std::string ModelFile;
+    const TCorrectorOptions Options;
+    std::mutex ReloadMutex;
+    TCorrectorPtr Corrector;
+    size_t Generation = 0; // guarded by ReloadMutex
+};
+
+// Without a token only clients on this host may reload; with one, any client
+// sending it in X-Admin-Token may.
+static bool AdminAllowed(const httplib::Request& req, const std::string& adminToken) {
+    if (adminToken.empty()) {
+        std::string addr = req.get_header_value("REMOTE_ADDR");
+        return addr == "::1" || addr.compare(0, 4, "127.") == 0 || addr.compare(0, 11, "::ffff:127.") == 0;
+    }
+    std::string token = req.get_header_value("X-Admin-Token");
+    if (token.size() != adminToken.size()) {
+        return false;
+    }
+    unsigned char diff = 0; // compare in constant time
+    for (size_t i = 0; i < token.size(); ++i) {
+        diff |= token[i] ^ adminToken[i];
+    }
+    return diff == 0;
+}
+
+#ifndef _WIN32
+// SIGHUP is blocked in every thread (call before starting any) and taken by
+// a thread of its own, which reloads the model outside of signal context.
+static void ReloadOnSighup(TCorrectorHolder& holder) {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread([&holder, signals]() {
+        for (;;) {
+            int signal = 0;
+            if (sigwait(&signals, &signal) == 0 && signal == SIGHUP) {
+                std::cerr << "[info] SIGHUP received, reloading model" << std::endl;
+                holder.Reload();
+            }
+        }
+    }).detach();
+}
+#endif
+
 int main(int argc, const char** argv) {
-    if (argc < 4 || argc > 7) {
+    std::vector<std::string> args;
+    size_t threads = CPPHTTPLIB_THREAD_POOL_COUNT;
+    bool queueGiven = false;
+    size_t queue = 0;
+    size_t keepAlive = CPPHTTPLIB_KEEPALIVE_MAX_COUNT;
+    size_t keepAliveIdleMs = CPPHTTPLIB_KEEPALIVE_IDLE_TIMEOUT_MSECOND;
+    TCorrectorOptions options;
+    std::string engine = "edits";
+    std::string logLevel = "info";
+    double budgetMs = 0;
+    std::string adminToken;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--engine" && i + 1 < argc) {
+            engine = argv[++i];
+        } else if (arg == "--log-level" && i + 1 < argc) {
+            logLevel = argv[++i];
+        } else if (arg == "--huge-pages") {
+            options.HugePages = true;
+        } else if (arg == "--known-min-logprob" && i + 1 < argc) {
+            options.KnownWordMinLogProb = std::stod(argv[++i]);
+        } else if (arg == "--budget-ms" && i + 1 < argc) {
+            budgetMs = std::stod(argv[++i]);
+        } else if (arg == "--delta" && i + 1 < argc) {
+            options.DeltaFile = argv[++i];
+        } else if (arg == "--admin-token" && i + 1 < argc) {
+            adminToken = argv[++i];
+        } else if ((arg == "--threads" || arg == "--queue" || arg == "--keep-alive" || arg == "--keep-alive-idle-ms" ||
+                    arg == "--cache-mb" || arg == "--known-min-count" || arg == "--beam") && i + 1 < argc)
+        {
+            size_t value = std::stoul(argv[++i]);
+            if (arg == "--threads") {
+                threads = value;
+            } else if (arg == "--queue") {
+                queueGiven = true;
+                queue = value;
+            } else if (arg == "--keep-alive-idle-ms") {
+                keepAliveIdleMs = value;
+            } else if (arg == "--cache-mb") {
+                options.CacheMb = value;
+            } else if (arg == "--known-min-count") {
+                options.KnownWordMinCount = value;
+            } else if (arg == "--beam") {
+                options.BeamWidth = value;
+            } else {
+                keepAlive = value;
+            }
+        } else {
+            args.push_back(arg);
+        }
+    }
+    if (!queueGiven) {
+        queue = CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD * threads;
+    }
+
+    if (args.size() < 3 || args.size() > 5 || threads == 0 || (engine != "edits" && engine != "index" && engine != "dawg") ||
+        (logLevel != "error" && logLevel != "info" && logLevel != "debug"))
+    {
         std::cerr << "(error) Arg count = " << argc << std::endl;
-        std::cerr << "Usage: " << argv[0] << " model.bin localhost 8080 [sslcertpath] [sslkeypath]\n";
+        std::cerr << "Usage: " << argv[0] << " model.bin localhost 8080 [sslcertpath] [sslkeypath]"
+                  << " [--threads N] [--queue N] [--keep-alive N] [--keep-alive-idle-ms N] [--cache-mb N] [--engine edits|index|dawg] [--huge-pages]"
+                  << " [--known-min-count N] [--known-min-logprob X] [--beam N] [--budget-ms X] [--delta delta.bin]"
+                  << " [--admin-token T] [--log-level error|info|debug]\n";
+        std::cerr << "   --threads     connection worker threads (default " << threads << ")\n";
+        std::cerr << "   --queue       accepted connections waiting for a worker before\n"
+                  << "                 answering 503, 0 for no limit (default "
+                  << CPPHTTPLIB_QUEUED_CONNECTIONS_PER_THREAD << " per thread)\n";
+        std::cerr << "   --keep-alive  requests served per connection, 0 to disable (default "
+                  << CPPHTTPLIB_KEEPALIVE_MAX_COUNT << ")\n";
+        std::cerr << "   --keep-alive-idle-ms\n"
+                  << "                 how long a worker waits for the next request of a connection\n"
+                  << "                 before closing it (default " << CPPHTTPLIB_KEEPALIVE_IDLE_TIMEOUT_MSECOND << ")\n";
+        std::cerr << "   --cache-mb    memory for cached candidates and scores, 0 to disable (default 0)\n";
+        std::cerr << "   --engine      candidate lookup: edits probes every edit, index uses the\n"
+                  << "                 deletion index in model.bin.deletes, dawg walks the automaton\n"
+                  << "                 in model.bin.dawg (default edits)\n";
+        std::cerr << "   --huge-pages  copy the n-gram tables of the model to huge pages instead\n"
+                  << "                 of sharing the mapped file\n";
+        std::cerr << "   --known-min-count, --known-min-logprob\n"
+                  << "                 accept words seen N times whose mean log probability per n-gram\n"
+                  << "                 in context is at least X (default -13) without looking for candidates,\n"
+                  << "                 0 to disable (default 0)\n";
+        std::cerr << "   --beam        fix whole sentences with a beam search keeping N hypotheses per\n"
+                  << "                 word instead of word by word, 0 for word by word (default 0)\n";
+        std::cerr << "   --budget-ms   latency budget of /fix and /candidates requests, their budget_ms\n"
+                  << "                 parameter overrides it: as it runs out words get fewer candidates,\n"
+                  << "                 then no second level ones, then none, and the response is marked\n"
+                  << "                 X-Degraded: 1; 0 for no budget (default 0)\n";
+        std::cerr << "   --delta       n-gram counts trained by main traindelta on top of model.bin, for\n"
+                  << "                 words the model lacks; reloaded with it\n";
+        std::cerr << "   --admin-token POST /admin/reload requires it in an X-Admin-Token header; without\n"
+                  << "                 it only clients on this host (loopback) may reload\n";
+        std::cerr << "   --log-level   debug also logs every candidate considered, which is slow (default info)\n";
+        std::cerr << "   POST /stream/fix and /stream/candidates answer /fix and /candidates (compact)\n"
+                  << "                 with a chunked response, sentence by sentence while the body is read\n";
+        std::cerr << "   GET /metrics reports stage latencies and counters in the Prometheus format\n";
+        std::cerr << "   POST /admin/reload or SIGHUP reloads model.bin (and the delta) without dropping requests\n";
         std::cerr << "   Note: SSL isn't currently working tho\n";
         return 42;
     }
 
-    std::string modelFile = argv[1];
-    std::string hostname = argv[2];
-    int port = std::stoi(argv[3]);
+    std::string modelFile = args[0];
+    std::string hostname = args[1];
+    int port = std::stoi(args[2]);
     std::string sslcert;
     std::string sslkey;
-    if(argc == 6) {
-        sslcert = argv[4];
-        sslkey = argv[5];
+    if(args.size() == 5) {
+        sslcert = args[3];
+        sslkey = args[4];
         std::cerr << "[info] received ssl request (" << sslcert << " | " << sslkey << ")\n";
     }
 
 
-    NJamSpell::TSpellCorrector corrector;
-    if (!corrector.LoadLangModel(modelFile)) {
-        std::cerr << "[error] failed to load model" << std::endl;
+    NJamSpell::SetLogLevel(logLevel == "debug" ? NJamSpell::ELogLevel::Debug
+                           : logLevel == "error" ? NJamSpell::ELogLevel::Error
+                                                 : NJamSpell::ELogLevel::Info);
+    NJamSpell::EnableMetrics(true);
+
+    options.Engine = engine == "index" ? NJamSpell::TSpellCorrector::ECandidateEngine::DeletionIndex
+                   : engine == "dawg" ? NJamSpell::TSpellCorrector::ECandidateEngine::Dawg
+                                      : NJamSpell::TSpellCorrector::ECandidateEngine::Edits;
+    TCorrectorHolder holder(modelFile, options);
+    if (holder.Reload() != TCorrectorHolder::EReloadResult::Reloaded) {
         return 42;
     }
+#ifndef _WIN32
+    ReloadOnSighup(holder);
+#endif
+
+    NJamSpell::TThreadPool pool(std::thread::hardware_concurrency());
 
     //if (argc < 6){ 
         httplib::Server srv; 
     //    }
+    srv.set_thread_pool(threads, queue);
+    srv.set_keep_alive_max_count(keepAlive);
+    srv.set_keep_alive_idle_timeout(keepAliveIdleMs);
     //else { httplib::SSLServer srv(sslcert, sslkey)}
     
-    srv.Get("/fix", [&corrector](const httplib::Request& req, httplib::Response& resp) {
-        resp.set_content(FixText(corrector, req.get_param_value("text")) + "\n", "text/plain");
+    srv.Get("/fix", Measured([&holder, budgetMs](const httplib::Request& req, httplib::Response& resp) {
+        WithBudget(req, resp, budgetMs, [&](NJamSpell::TLatencyBudget* budget) {
+            resp.set_content(FixText(*holder.Get(), req.get_param_value("text"), budget) + "\n", "text/plain");
+        });
+    }));
+
+    srv.Post("/fix", Measured([&holder, budgetMs](const httplib::Request& req, httplib::Response& resp) {
+        WithBudget(req, resp, budgetMs, [&](NJamSpell::TLatencyBudget* budget) {
+            resp.set_content(FixText(*holder.Get(), req.body, budget) + "\n", "text/plain");
+        });
+    }));
+
+    srv.Get("/candidates", Measured([&holder, budgetMs](const httplib::Request& req, httplib::Response& resp) {
+        WithBudget(req, resp, budgetMs, [&](NJamSpell::TLatencyBudget* budget) {
+            resp.set_content(GetCandidatesScored(*holder.Get(), req, req.get_param_value("text"), budget) + "\n",
+                             "text/plain");
+        });
+    }));
+
+    srv.Post("/candidates", Measured([&holder, budgetMs](const httplib::Request& req, httplib::Response& resp) {
+        WithBudget(req, resp, budgetMs, [&](NJamSpell::TLatencyBudget* budget) {
+            resp.set_content(GetCandidatesScored(*holder.Get(), req, req.body, budget) + "\n", "text/plain");
+        });
+    }));
+
+    srv.Post("/stream/fix", [&holder](const httplib::Request&, httplib::Response& resp,
+                                      httplib::ContentReader& content)
+    {
+        HandleStream(resp, content, holder.Get(), NJamSpell::TCorrectionStream::EOutput::Fixed, "text/plain");
     });
 
-    srv.Post("/fix", [&corrector](const httplib::Request& req, httplib::Response& resp) {
-        resp.set_content(FixText(corrector, req.body) + "\n", "text/plain");
+    srv.Post("/stream/candidates", [&holder](const httplib::Request&, httplib::Response& resp,
+                                             httplib::ContentReader& content)
+    {
+        HandleStream(resp, content, holder.Get(), NJamSpell::TCorrectionStream::EOutput::Candidates,
+                     "application/json");
     });
 
-    srv.Get("/candidates", [&corrector](const httplib::Request& req, httplib::Response& resp) {
-        resp.set_content(GetCandidatesScored(corrector, req.get_param_value("text")) + "\n", "text/plain");
+    srv.Post("/batch/candidates", Measured([&holder, &pool](const httplib::Request& req, httplib::Response& resp) {
+        TCorrectorHolder::TCorrectorPtr corrector = holder.Get();
+        HandleBatch(req, resp, [&corrector, &pool](const std::vector<std::string>& texts) {
+            return corrector->GetALLCandidatesScoredJSON(texts, pool);
+        });
+    }));
+
+    srv.Post("/batch/fix", Measured([&holder, &pool](const httplib::Request& req, httplib::Response& resp) {
+        TCorrectorHolder::TCorrectorPtr corrector = holder.Get();
+        HandleBatch(req, resp, [&corrector, &pool](const std::vector<std::string>& texts) {
+            std::vector<std::wstring> inputs;
+            for (auto&& t: texts) {
+                inputs.push_back(NJamSpell::UTF8ToWide(t));
+            }
+            std::vector<std::wstring> fixed = corrector->FixFragments(inputs, pool);
+            std::vector<std::string> results(fixed.size());
+            for (size_t i = 0; i < fixed.size(); ++i) {
+                NJamSpell::TJsonWriter(results[i]).String(fixed[i].data(), fixed[i].size());
+            }
+            return results;
+        });
+    }));
+
+    srv.Get("/metrics", [&holder](const httplib::Request&, httplib::Response& resp) {
+        std::string metrics;
+        NJamSpell::WriteMetrics(metrics);
+        WriteCorrectorMetrics(metrics, *holder.Get());
+        resp.set_content(metrics, "text/plain; version=0.0.4");
     });
 
-    srv.Post("/candidates", [&corrector](const httplib::Request& req, httplib::Response& resp) {
-        resp.set_content(GetCandidatesScored(corrector, req.body) + "\n", "text/plain");
+    // Loads on this worker while the others keep serving the current model.
+    srv.Post("/admin/reload", [&holder, &adminToken](const httplib::Request& req, httplib::Response& resp) {
+        if (!AdminAllowed(req, adminToken)) {
+            resp.status = 403;
+            resp.set_content("[error] reload not allowed\n", "text/plain");
+            return;
+        }
+        switch (holder.Reload(false)) {
+        case TCorrectorHolder::EReloadResult::Reloaded:
+            resp.set_content("reloaded\n", "text/plain");
+            break;
+        case TCorrectorHolder::EReloadResult::Failed:
+            resp.status = 500;
+            resp.set_content("[error] failed to load model, still serving the previous one\n", "text/plain");
+            break;
+        case TCorrectorHolder::EReloadResult::Busy:
+            resp.status = 409;
+            resp.set_content("[error] reload already running\n", "text/plain");
+            break;
+        }
     });
 
-    std::cerr << "[info] starting web server at " << hostname << ":" << port << std::endl;
+    std::cerr << "[info] starting web server at " << hostname << ":" << port
+              << " (" << threads << " threads, queue " << queue << ")" << std::endl;
     srv.listen(hostname.c_str(), port);
     return 0;
 }